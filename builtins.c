@@ -17,6 +17,8 @@
 #define PATH_SEP "\\"
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #define PATH_SEP "/"
 #endif
 
@@ -44,31 +46,67 @@ static void msleep(int ms)
 #endif
 
 static int do_throw_term(query *q, cell *c);
+static int fn_iso_catch_3(query *q);
+static void tbl_unwind(idx_t cp);
+
+// An error is delivered to the innermost catch/3 at once, leaving the
+// query at its recovery goal. Only the first error raised by a goal is
+// thrown, a builtin carrying on after it does not throw again...
 
 void throw_error(query *q, cell *c, const char *err_type, const char *expected)
 {
+	if (q->did_throw || q->error)
+		return;
+
+	int save_quoted = q->quoted;
+	q->quoted = 1;
 	cell tmp = *c;
 	tmp.nbr_cells = 1;
 	tmp.arity = 0;
-	size_t len = write_term_to_buf(q, NULL, 0, &tmp, 1, 0, 0, 0, 0);
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, &tmp, 1, 0, 0, 0, 0);
-	size_t len2 = (len * 2) + strlen(err_type) + strlen(expected) + LEN_STR(q->st.curr_cell) + 20;
+	sink s = {0};
+	write_term_to_sink(q, &s, &tmp, 1, 0, 0, 0, 0);
+	char *dst = s.buf;
+
+	// The goal is the context, unless it is not callable at all and
+	// so has no name to give. Names are bracketed so that operators,
+	// such as +, read back as atoms...
+
+	cell *g = q->st.curr_cell;
+	sink s2 = {0};
+
+	if (is_literal(g)) {
+		cell tmp2 = *g;
+		tmp2.nbr_cells = 1;
+		tmp2.arity = 0;
+		write_term_to_sink(q, &s2, &tmp2, 1, 0, 0, 0, 0);
+	}
+
+	q->quoted = save_quoted;
+
+	const char *ctx = is_literal(g) ? s2.buf : dst;
+	size_t ctx_len = is_literal(g) ? s2.len : s.len;
+	unsigned ctx_arity = is_literal(g) ? g->arity : 0;
+	size_t len2 = (s.len * 2) + strlen(err_type) + strlen(expected) + ctx_len + 40;
 	char *dst2 = malloc(len2+1);
 
 	if (is_var(c)) {
 		err_type = "instantiation_error";
-		snprintf(dst2, len2, "error(%s,%s/%u)", err_type, GET_STR(q->st.curr_cell), q->st.curr_cell->arity);
+		snprintf(dst2, len2, "error(%s,(%s)/%u)", err_type, ctx, ctx_arity);
 	} else
-		snprintf(dst2, len2, "error(%s(%s,%s/%u),%s/%u)", err_type, expected, dst, c->arity, GET_STR(q->st.curr_cell), q->st.curr_cell->arity);
+		snprintf(dst2, len2, "error(%s(%s,(%s)/%u),(%s)/%u)", err_type, expected, dst, c->arity, ctx, ctx_arity);
 
 	parser *p = q->m->p;
+	clear_term(p->t);
+	p->start_term = 1;
 	p->srcptr = dst2;
 	parser_tokenize(p, 0, 0);
 	parser_attach(p, 0);
 	//parser_xref(p, p->t, NULL);
-	do_throw_term(q, p->t->cells);
+	if (do_throw_term(q, p->t->cells))
+		q->did_throw = fn_iso_catch_3(q);
+
 	free(dst2);
+	free(s2.buf);
 	free(dst);
 }
 
@@ -97,20 +135,6 @@ static void unpin_vars(query *q)
 	ch->pins = 0;
 }
 
-static void set_pinned(query *q, int i)
-{
-	idx_t curr_choice = q->cp - 1;
-	choice *ch = q->choices + curr_choice;
-	ch->pins |= 1 << i;
-}
-
-static int is_pinned(query *q, int i)
-{
-	idx_t curr_choice = q->cp - 1;
-	choice *ch = q->choices + curr_choice;
-	return ch->pins & (1 << i) ? 1 : 0;
-}
-
 static void set_params(query *q, idx_t p1, idx_t p2)
 {
 	idx_t curr_choice = q->cp - 1;
@@ -225,113 +249,202 @@ static cell *alloc_tmp_heap(query *q, idx_t nbr_cells)
 static idx_t tmp_heap_used(const query *q) { return q->tmphp; }
 static cell *get_tmp_heap(const query *q, idx_t i) { return q->tmp_heap + i; }
 
-static cell *alloc_heap(query *q, idx_t nbr_cells)
+// The heap is a chain of arenas, newest first. When the current arena
+// fills up a new one is started and nothing already allocated moves,
+// except that the cells from 'keep' onwards (a term still being built)
+// are carried across so the term stays contiguous.
+
+static void new_arena(query *q, idx_t nbr_cells, cell **keep)
 {
-	if (q->st.hp > q->max_heaps)
-		q->max_heaps = q->st.hp;
+	arena *save = q->arenas;
+	idx_t carry = 0;
 
-	if (!q->arenas) {
-		q->arenas = calloc(1, sizeof(arena));
-		q->arenas->heap = calloc(q->h_size, sizeof(cell));
-		q->arenas->h_size = q->h_size;
-		q->arenas->nbr = q->st.anbr++;
+	if (save && keep) {
+		carry = q->st.hp - (*keep - save->heap);
+		q->st.hp -= carry;
 	}
 
-	if ((q->st.hp + nbr_cells) >= q->h_size) {
-		arena *a = calloc(1, sizeof(arena));
-		a->next = q->arenas;
-		idx_t save_size = q->h_size;
-		q->h_size += q->h_size / 2;
-		a->heap = calloc(q->h_size, sizeof(cell));
-		copy_cells(a->heap, q->arenas->heap, save_size);
-		a->h_size = q->h_size;
-		a->nbr = q->st.anbr++;
-		q->arenas = a;
+	// Size arenas in proportion to the heap in use so there are only
+	// ever a logarithmic number of them.
+
+	idx_t h_size = q->h_size;
+
+	if (save && (((save->base + q->st.hp) / 2) > h_size))
+		h_size = (save->base + q->st.hp) / 2;
+
+	while ((carry + nbr_cells) >= h_size)
+		h_size += h_size / 2;
+
+	arena *a = calloc(1, sizeof(arena));
+	a->heap = calloc(h_size, sizeof(cell));
+	a->h_size = h_size;
+
+	if (save) {
+		save->hp = q->st.hp;
+		a->base = save->base + save->hp;
+		a->nbr = ++q->st.anbr;
+	} else
+		a->nbr = q->st.anbr;
+
+	if (carry) {
+		copy_cells(a->heap, *keep, carry);
+		*keep = a->heap;
 	}
 
+	a->next = save;
+	q->arenas = a;
+	q->st.hp = a->hp = carry;
+
+	if (a->base > q->gc_next)
+		q->gc = 1;
+}
+
+static cell *alloc_heap_keep(query *q, idx_t nbr_cells, cell **keep)
+{
+	if (!q->arenas || ((q->st.hp + nbr_cells) >= q->arenas->h_size))
+		new_arena(q, nbr_cells, keep);
+
 	cell *c = q->arenas->heap + q->st.hp;
 	memset(c, 0, sizeof(cell)*nbr_cells);
 	q->st.hp += nbr_cells;
 	q->arenas->hp = q->st.hp;
+
+	if ((q->arenas->base + q->st.hp) > q->max_heaps)
+		q->max_heaps = q->arenas->base + q->st.hp;
+
 	return c;
 }
 
+static cell *alloc_heap(query *q, idx_t nbr_cells)
+{
+	return alloc_heap_keep(q, nbr_cells, NULL);
+}
+
+// Make sure the next nbr_cells allocations are contiguous. Needed
+// when a term is assembled from several allocations.
+
+static void reserve_heap(query *q, idx_t nbr_cells)
+{
+	if (!q->arenas || ((q->st.hp + nbr_cells) >= q->arenas->h_size))
+		new_arena(q, nbr_cells, NULL);
+}
+
 static idx_t heap_used(const query *q) { return q->st.hp; }
 static cell *get_heap(const query *q, idx_t i) { return q->arenas->heap + i; }
 
-static cell *alloc_string(query *q, char *s, int take)
+static cell *alloc_stringn(query *q, const char *s, size_t n)
 {
 	cell *tmp = alloc_heap(q, 1);
 	tmp->val_type = TYPE_STRING;
 	tmp->nbr_cells = 1;
-	tmp->val_str = take ? s : strdup(s);
+	tmp->val_str = alloc_strbuf(s, n);
+
+	// Big strings count towards the next collection too...
+
+	q->str_bytes += n;
+
+	if (q->str_bytes > ((uint64_t)q->gc_next * sizeof(cell)))
+		q->gc = 1;
+
+	return tmp;
+}
+
+static cell *alloc_string(query *q, char *s, int take)
+{
+	cell *tmp = alloc_stringn(q, s, strlen(s));
+	if (take) free(s);
 	return tmp;
 }
 
+static cell *alloc_collector(collector *qs, cell *c)
+{
+	if (!qs->queue)
+		qs->queue = calloc(qs->q_size, sizeof(cell));
+
+	while ((qs->qp+c->nbr_cells) >= qs->q_size) {
+		qs->q_size += qs->q_size / 2;
+		qs->queue = realloc(qs->queue, sizeof(cell)*qs->q_size);
+	}
+
+	cell *dst = qs->queue + qs->qp;
+	copy_cells(dst, c, c->nbr_cells);
+	qs->qp += c->nbr_cells;
+	return dst;
+}
+
 static void init_queue(query* q)
 {
-	free(q->queue[0]);
-	q->queue[0] = NULL;
-	q->qp[0] = 0;
+	q->qs[0].qp = 0;
 }
 
-static idx_t queue_used(const query *q) { return q->qp[0]; }
-static cell *get_queue(query *q) { return q->queue[0]; }
+static idx_t queue_used(const query *q) { return q->qs[0].qp; }
+static cell *get_queue(query *q) { return q->qs[0].queue; }
 
 static cell *pop_queue(query *q)
 {
-	if (!q->qp[0])
+	if (!q->qs[0].qp)
 		return NULL;
 
-	cell *c = q->queue[0] + q->popp;
+	cell *c = q->qs[0].queue + q->popp;
 	q->popp += c->nbr_cells;
 
-	if (q->popp == q->qp[0])
-		q->popp = q->qp[0] = 0;
+	if (q->popp == q->qs[0].qp)
+		q->popp = q->qs[0].qp = 0;
 
 	return c;
 }
 
 static cell *alloc_queue(query *q, cell *c)
 {
-	if (!q->queue[0])
-		q->queue[0] = calloc(q->q_size[0], sizeof(cell));
+	return alloc_collector(q->qs, c);
+}
+
+// Solution collectors nest as deep as findall/bagof/setof do. Buffers
+// stay with their depth and are reused by the next collector there.
+
+static void push_queuen(query *q)
+{
+	if (++q->qnbr == q->nbr_queues) {
+		idx_t save_queues = q->nbr_queues;
+		q->nbr_queues += q->nbr_queues / 2;
+		q->qs = realloc(q->qs, sizeof(collector)*q->nbr_queues);
+		memset(q->qs+save_queues, 0, sizeof(collector)*(q->nbr_queues-save_queues));
 
-	while ((q->qp[0]+c->nbr_cells) >= q->q_size[0]) {
-		q->q_size[0] += q->q_size[0] / 2;
-		q->queue[0] = realloc(q->queue[0], sizeof(cell)*q->q_size[0]);
+		for (idx_t i = save_queues; i < q->nbr_queues; i++)
+			q->qs[i].q_size = q->qs[save_queues-1].q_size;
 	}
 
-	cell *dst = q->queue[0] + q->qp[0];
-	copy_cells(dst, c, c->nbr_cells);
-	q->qp[0] += c->nbr_cells;
-	return dst;
+	q->qs[q->qnbr].qp = 0;
+	q->qs[q->qnbr].tmpq_nbr = 0;
 }
 
 static void init_queuen(query* q)
 {
-	free(q->queue[q->qnbr]);
-	q->queue[q->qnbr] = NULL;
-	q->qp[q->qnbr] = 0;
+	q->qs[q->qnbr].qp = 0;
 }
 
-static idx_t queuen_used(const query *q) { return q->qp[q->qnbr]; }
-static cell *get_queuen(query *q) { return q->queue[q->qnbr]; }
+static idx_t queuen_used(const query *q) { return q->qs[q->qnbr].qp; }
+static cell *get_queuen(query *q) { return q->qs[q->qnbr].queue; }
 
 static cell *alloc_queuen(query *q, int qnbr, cell *c)
 {
-	if (!q->queue[qnbr])
-		q->queue[qnbr] = calloc(q->q_size[qnbr], sizeof(cell));
+	return alloc_collector(q->qs+qnbr, c);
+}
+
+// Bagof/setof keep a copy of the solutions to pick groups from on
+// each retry, while the queue itself collects the current group.
+
+static void copy_queuen(query *q)
+{
+	collector *qs = q->qs + q->qnbr;
 
-	while ((q->qp[qnbr]+c->nbr_cells) >= q->q_size[qnbr]) {
-		q->q_size[qnbr] += q->q_size[qnbr] / 2;
-		q->queue[qnbr] = realloc(q->queue[qnbr], sizeof(cell)*q->q_size[qnbr]);
+	if (qs->tmpq_size < qs->qp) {
+		qs->tmpq_size = qs->qp;
+		qs->tmpq = realloc(qs->tmpq, sizeof(cell)*qs->tmpq_size);
 	}
 
-	cell *dst = q->queue[qnbr] + q->qp[qnbr];
-	copy_cells(dst, c, c->nbr_cells);
-	q->qp[qnbr] += c->nbr_cells;
-	return dst;
+	copy_cells(qs->tmpq, qs->queue, qs->qp);
+	qs->tmpq_nbr = qs->qp;
 }
 
 static cell *alloc_list(query *q, const cell *c)
@@ -347,26 +460,22 @@ static cell *alloc_list(query *q, const cell *c)
 
 static cell *append_list(query *q, cell *l, const cell *c)
 {
-	idx_t save = l - q->arenas->heap;
-	cell *tmp = alloc_heap(q, 1+c->nbr_cells);
+	cell *tmp = alloc_heap_keep(q, 1+c->nbr_cells, &l);
 	tmp->val_type = TYPE_LITERAL;
 	tmp->nbr_cells = 1 + c->nbr_cells;
 	tmp->val_offset = g_dot_s;
 	tmp->arity = 2;
 	copy_cells(tmp+1, c, c->nbr_cells);
-	l = q->arenas->heap + save;
 	l->nbr_cells += tmp->nbr_cells;
 	return l;
 }
 
 static cell *end_list(query *q, cell *l)
 {
-	idx_t save = l - q->arenas->heap;
-	cell *tmp = alloc_heap(q, 1);
+	cell *tmp = alloc_heap_keep(q, 1, &l);
 	tmp->val_type = TYPE_LITERAL;
 	tmp->nbr_cells = 1;
 	tmp->val_offset = g_nil_s;
-	l = q->arenas->heap + save;
 	l->nbr_cells += tmp->nbr_cells;
 	return l;
 }
@@ -390,11 +499,30 @@ static cell make_stringn(query *q, const char *s, size_t n)
 	if (n < MAX_SMALL_STRING) {
 		make_smalln(&tmp, s, n);
 	} else
-		tmp = *alloc_string(q, strndup(s, n), 1);
+		tmp = *alloc_stringn(q, s, n);
 
 	return tmp;
 }
 
+// The tail of a big string shares its buffer rather than being
+// copied, anything else is a new string...
+
+static cell make_slice(query *q, cell *p1, size_t offset, size_t n)
+{
+	if ((n < MAX_SMALL_STRING) || !is_bigstring(p1) || ((offset+n) != LEN_STR(p1)))
+		return make_stringn(q, GET_STR(p1)+offset, n);
+
+	cell *tmp = alloc_heap(q, 1);
+	tmp->val_type = TYPE_STRING;
+	tmp->nbr_cells = 1;
+	tmp->flags = FLAG_SLICE;
+	tmp->val_str = p1->val_str + offset;
+	tmp->val_off = (p1->flags&FLAG_SLICE ? p1->val_off : 0) + offset;
+	tmp->val_nchars = 0;
+	retain_string(p1);
+	return *tmp;
+}
+
 static cell take_string(query *q, char *s)
 {
 	cell tmp;
@@ -408,18 +536,16 @@ static cell take_string(query *q, char *s)
 	return tmp;
 }
 
-static cell take_blob(query *q, const char *s, size_t n)
+static cell take_blob(query *q, char *s, size_t n)
 {
 	cell tmp;
 
-	if (n < MAX_SMALL_STRING) {
+	if (n < MAX_SMALL_STRING)
 		make_smalln(&tmp, s, n);
-		return tmp;
-	}
+	else
+		tmp = *alloc_stringn(q, s, n);
 
-	tmp = *alloc_string(q, strndup(s, n), 1);
-	tmp.flags |= FLAG_SLICE;
-	tmp.nbytes = n;
+	free(s);
 	return tmp;
 }
 
@@ -453,15 +579,49 @@ ssize_t stream_getline(char **lineptr, size_t *len, stream *str)
 		return getline(lineptr, len, str->fp);
 }
 
-static void deep_clone_term2_on_tmp(query *q, cell *p1, idx_t p1_ctx)
+// Variables from different frames may have the same slot number, a
+// copy that is to have its own variables numbers them afresh...
+
+typedef struct {
+	idx_t ctx[MAX_ARITY];
+	uint8_t slot_nbr[MAX_ARITY];
+	unsigned nbr_vars;
+} var_map;
+
+static unsigned map_var(var_map *vm, unsigned slot_nbr, idx_t ctx)
+{
+	if (vm->nbr_vars > MAX_ARITY)
+		return 0;
+
+	for (unsigned i = 0; i < vm->nbr_vars; i++) {
+		if ((vm->slot_nbr[i] == slot_nbr) && (vm->ctx[i] == ctx))
+			return i;
+	}
+
+	if (vm->nbr_vars == MAX_ARITY) {
+		vm->nbr_vars++;
+		return 0;
+	}
+
+	vm->slot_nbr[vm->nbr_vars] = slot_nbr;
+	vm->ctx[vm->nbr_vars] = ctx;
+	return vm->nbr_vars++;
+}
+
+static void deep_clone_term2_on_tmp(query *q, cell *p1, idx_t p1_ctx, var_map *vm)
 {
 	idx_t save_idx = tmp_heap_used(q);
 	cell *tmp = alloc_tmp_heap(q, 1);
 	copy_cells(tmp, p1, 1);
 
+	if (vm && is_var(tmp))
+		tmp->slot_nbr = map_var(vm, tmp->slot_nbr, p1_ctx);
+
 	if (!is_structure(p1)) {
-		if (is_bigstring(p1))
-			tmp->val_str = strdup(p1->val_str);
+		if (is_bigstring(p1)) {
+			retain_string(p1);
+			tmp->flags &= ~FLAG_CONST;
+		}
 
 		return;
 	}
@@ -472,9 +632,9 @@ static void deep_clone_term2_on_tmp(query *q, cell *p1, idx_t p1_ctx)
 	for (idx_t i = 1; i < nbr_cells;) {
 		if (is_var(p1)) {
 			cell *c = deref_var(q, p1, p1_ctx);
-			deep_clone_term2_on_tmp(q, c, q->latest_ctx);
+			deep_clone_term2_on_tmp(q, c, q->latest_ctx, vm);
 		} else
-			deep_clone_term2_on_tmp(q, p1, p1_ctx);
+			deep_clone_term2_on_tmp(q, p1, p1_ctx, vm);
 
 		i += p1->nbr_cells;
 		p1 += p1->nbr_cells;
@@ -484,7 +644,7 @@ static void deep_clone_term2_on_tmp(query *q, cell *p1, idx_t p1_ctx)
 	tmp->nbr_cells = tmp_heap_used(q) - save_idx;
 }
 
-static cell *deep_clone_term_on_tmp(query *q, cell *p1, idx_t p1_ctx)
+static cell *deep_copy_term_on_tmp(query *q, cell *p1, idx_t p1_ctx, var_map *vm)
 {
 	init_tmp_heap(q);
 	idx_t save_idx = tmp_heap_used(q);
@@ -494,52 +654,33 @@ static cell *deep_clone_term_on_tmp(query *q, cell *p1, idx_t p1_ctx)
 		p1_ctx = q->latest_ctx;
 	}
 
-	deep_clone_term2_on_tmp(q, p1, p1_ctx);
+	deep_clone_term2_on_tmp(q, p1, p1_ctx, vm);
 	return get_tmp_heap(q, save_idx);
 }
 
-static void deep_clone_term2_on_heap(query *q, cell *p1, idx_t p1_ctx)
+static cell *deep_clone_term_on_tmp(query *q, cell *p1, idx_t p1_ctx)
 {
-	idx_t save_idx = heap_used(q);
-	cell *tmp = alloc_heap(q, 1);
-	copy_cells(tmp, p1, 1);
-
-	if (!is_structure(p1)) {
-		if (is_bigstring(p1))
-			tmp->val_str = strdup(p1->val_str);
-
-		return;
-	}
-
-	idx_t nbr_cells = p1->nbr_cells;
-	p1++;
+	return deep_copy_term_on_tmp(q, p1, p1_ctx, NULL);
+}
 
-	for (idx_t i = 1; i < nbr_cells;) {
-		if (is_var(p1)) {
-			cell *c = deref_var(q, p1, p1_ctx);
-			deep_clone_term2_on_heap(q, c, q->latest_ctx);
-		} else
-			deep_clone_term2_on_heap(q, p1, p1_ctx);
+// A tmp clone holds a reference to each big string in it, which
+// passes to the heap when the cells are copied there. Cells that are
+// dropped instead let go of theirs here...
 
-		i += p1->nbr_cells;
-		p1 += p1->nbr_cells;
+static void release_tmp_cells(cell *c, idx_t nbr_cells)
+{
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		if (is_bigstring(c) && !is_const(c))
+			release_string(c);
 	}
-
-	tmp = get_heap(q, save_idx);
-	tmp->nbr_cells = heap_used(q) - save_idx;
 }
 
 cell *deep_clone_term_on_heap(query *q, cell *p1, idx_t p1_ctx)
 {
-	idx_t save_idx = heap_used(q);
-
-	if (is_var(p1)) {
-		p1 = deref_var(q, p1, p1_ctx);
-		p1_ctx = q->latest_ctx;
-	}
-
-	deep_clone_term2_on_heap(q, p1, p1_ctx);
-	return get_heap(q, save_idx);
+	cell *tmp = deep_clone_term_on_tmp(q, p1, p1_ctx);
+	cell *c = alloc_heap(q, tmp->nbr_cells);
+	copy_cells(c, tmp, tmp->nbr_cells);
+	return c;
 }
 
 cell *clone_term(query *q, int prefix, cell *p1, idx_t p1_ctx, idx_t suffix)
@@ -806,7 +947,6 @@ static int fn_iso_atom_chars_2(query *q)
 
 			if (!is_list(tail)) {
 				throw_error(q, tail, "type_error", "list");
-				q->error = 1;
 				return 0;
 			}
 
@@ -834,7 +974,7 @@ static int fn_iso_atom_chars_2(query *q)
 		tmp.flags |= FLAG_SMALL_STRING;
 		strcpy(tmp.val_chars, tmpbuf);
 	} else
-		tmp.val_str = strdup(tmpbuf);
+		tmp.val_str = alloc_strbuf(tmpbuf, nbytes);
 
 	src += nbytes;
 	cell *l = alloc_list(q, &tmp);
@@ -993,7 +1133,7 @@ static int fn_iso_number_chars_2(query *q)
 		tmp.flags |= FLAG_SMALL_STRING;
 		strcpy(tmp.val_chars, src);
 	} else
-		tmp.val_str = strdup(src);
+		tmp.val_str = alloc_strbuf(src, nbytes);
 
 	cell *l = alloc_list(q, &tmp);
 
@@ -1076,97 +1216,200 @@ static int fn_iso_number_codes_2(query *q)
 	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
 }
 
-static int fn_iso_sub_atom_5(query *q)
+// Character/byte offset conversions, direct for ASCII atoms...
+
+static size_t offset_utf8(const char *src, size_t n, int ascii)
+{
+	if (ascii)
+		return n;
+
+	const char *s = src;
+
+	while (n-- && *s)
+		s += len_char_utf8(s);
+
+	return s - src;
+}
+
+static size_t count_utf8(const char *src, const char *end, int ascii)
+{
+	if (ascii)
+		return end - src;
+
+	size_t cnt = 0;
+
+	while (src < end) {
+		src += len_char_utf8(src);
+		cnt++;
+	}
+
+	return cnt;
+}
+
+// Sub is known: search for it rather than enumerate...
+
+static int do_sub_atom_5(query *q)
 {
 	GET_FIRST_ARG(p1,atom);
 	GET_NEXT_ARG(p2,integer_or_var);
 	GET_NEXT_ARG(p3,integer_or_var);
 	GET_NEXT_ARG(p4,integer_or_var);
-	GET_NEXT_ARG(p5,atom_or_var);
-	int before = 0, len = 0;
+	GET_NEXT_ARG(p5,atom);
+	const char *src = GET_STR(p1), *sub = GET_STR(p5);
+	size_t len = atom_nchars(p1), nbytes = LEN_STR(p1);
+	size_t sub_len = atom_nchars(p5), sub_nbytes = LEN_STR(p5);
+	int ascii = len == nbytes;
+	size_t before, offset;
+
+	if ((!is_var(p3) && (p3->val_int != (int_t)sub_len)) || (sub_len > len))
+		return 0;
 
-	if (!q->retry) {
-		make_choice(q);
+	if (!is_var(p2) || !is_var(p4)) {
+		int_t n = !is_var(p2) ? p2->val_int : (int_t)(len - sub_len) - p4->val_int;
 
-		if (!is_var(p2))
-			before = p2->val_int;
+		if ((n < 0) || (n > (int_t)(len - sub_len)))
+			return 0;
 
-		if (!is_var(p3)) {
-			len = p3->val_int;
-			set_pinned(q, 3);
-		}
-	} else {
-		idx_t v1, v2;
-		get_params(q, &v1, &v2);
-		before = v1;
-		len = v2;
+		offset = offset_utf8(src, n, ascii);
 
-		if (is_pinned(q, 3)) {
-			len = p3->val_int;
-			before++;
+		// Fewer characters can still be more bytes...
+
+		if (((offset + sub_nbytes) > nbytes) || memcmp(src+offset, sub, sub_nbytes))
+			return 0;
+
+		before = n;
+	} else {
+		if (!q->retry) {
+			const char *s = memmem(src, nbytes, sub, sub_nbytes);
 
-			if ((before+len) > LEN_STR(p1)) {
-				drop_choice(q);
+			if (!s)
 				return 0;
-			}
+
+			offset = s - src;
+			before = count_utf8(src, s, ascii);
+			make_choice(q);
+		} else {
+			idx_t v1, v2;
+			get_params(q, &v1, &v2);
+			before = v1;
+			offset = v2;
+		}
+
+		// Find the next match now so the last one leaves no choice
+
+		const char *s = NULL;
+
+		if (offset < nbytes) {
+			size_t next = offset + len_char_utf8(src+offset);
+			s = memmem(src+next, nbytes-next, sub, sub_nbytes);
 		}
-	}
 
-	if (len > (LEN_STR(p1)-before)) {
-		before++;
-		len = 0;
+		if (s) {
+			set_params(q, before+count_utf8(src+offset, s, ascii), s - src);
+			make_choice(q);
+		} else
+			drop_choice(q);
 	}
 
-	if (before > LEN_STR(p1)) {
-		drop_choice(q);
+	cell tmp;
+	make_int(&tmp, before);
+
+	if (!unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
 		return 0;
-	}
 
-	int any = 0;
+	make_int(&tmp, sub_len);
 
-	for (int i = before; i <= LEN_STR(p1); i++) {
-		for (int j = len; j <= LEN_STR(p1); j++) {
-			cell tmp;
-			any = 1;
+	if (!unify(q, p3, p3_ctx, &tmp, q->st.curr_frame))
+		return 0;
 
-			set_params(q, i, j+1);
-			make_choice(q);
-			make_int(&tmp, i);
+	make_int(&tmp, len-before-sub_len);
+	return unify(q, p4, p4_ctx, &tmp, q->st.curr_frame);
+}
 
-			if (!unify(q, p2, p2_ctx, &tmp, q->st.curr_frame)) {
-				drop_choice(q);
-				continue;
-			}
+static int fn_iso_sub_atom_5(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,integer_or_var);
+	GET_NEXT_ARG(p3,integer_or_var);
+	GET_NEXT_ARG(p4,integer_or_var);
+	GET_NEXT_ARG(p5,atom_or_var);
 
-			make_int(&tmp, j);
+	if (!is_var(p5))
+		return do_sub_atom_5(q);
 
-			if (!unify(q, p3, p3_ctx, &tmp, q->st.curr_frame)) {
-				drop_choice(q);
-				continue;
-			}
+	size_t len = atom_nchars(p1);
+	int ascii = len == LEN_STR(p1);
+	idx_t before = 0, n = 0;
 
-			make_int(&tmp, LEN_STR(p1)-i-j);
+	if (!q->retry) {
+		if (!is_var(p2)) {
+			if ((p2->val_int < 0) || (p2->val_int > (int_t)len))
+				return 0;
 
-			if (!unify(q, p4, p4_ctx, &tmp, q->st.curr_frame)) {
-				drop_choice(q);
-				continue;
-			}
+			before = p2->val_int;
+		}
+
+		make_choice(q);
+	} else
+		get_params(q, &before, &n);
 
-			const char *src = GET_STR(p1) + i;
-			tmp = make_stringn(q, src, j);
+	// Length is fixed when given directly or by After, and
+	// once it doesn't fit it won't for any later Before...
 
-			if (!unify(q, p5, p5_ctx, &tmp, q->st.curr_frame)) {
-				drop_choice(q);
-				continue;
-			}
+	int fixed = !is_var(p3) || !is_var(p4), last;
 
-			any++;
-			return 1;
+	if (fixed) {
+		int_t want = !is_var(p3) ? p3->val_int : (int_t)(len - before) - p4->val_int;
+
+		if ((before > len) || (want < 0) || (want > (int_t)(len - before))) {
+			drop_choice(q);
+			return 0;
+		}
+
+		n = want;
+		last = !is_var(p2) || (before == len)
+			|| (!is_var(p3) ? (before+n) == len : (len-before) == (size_t)p4->val_int);
+	} else {
+		if (n > (len - before)) {
+			before++;
+			n = 0;
+		}
+
+		if (before > len) {
+			drop_choice(q);
+			return 0;
 		}
+
+		last = (n == (len - before)) && (!is_var(p2) || (before == len));
 	}
 
-	drop_choice(q);
-	return 0;
+	if (last)
+		drop_choice(q);
+	else {
+		set_params(q, fixed ? before+1 : before, fixed ? 0 : n+1);
+		make_choice(q);
+	}
+
+	cell tmp;
+	make_int(&tmp, before);
+
+	if (!unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+		return 0;
+
+	make_int(&tmp, n);
+
+	if (!unify(q, p3, p3_ctx, &tmp, q->st.curr_frame))
+		return 0;
+
+	make_int(&tmp, len-before-n);
+
+	if (!unify(q, p4, p4_ctx, &tmp, q->st.curr_frame))
+		return 0;
+
+	const char *src = GET_STR(p1);
+	size_t offset = offset_utf8(src, before, ascii);
+	tmp = make_slice(q, p1, offset, offset_utf8(src+offset, n, ascii));
+	return unify(q, p5, p5_ctx, &tmp, q->st.curr_frame);
 }
 
 // NOTE: this just handles the mode(-,-,+) case...
@@ -1181,7 +1424,10 @@ static int do_atom_concat_3(query *q)
 		make_literal(&tmp, g_empty_s);
 		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
 		set_var(q, p2, p2_ctx, p3, q->st.curr_frame);
-		make_choice(q);
+
+		if (LEN_STR(p3))
+			make_choice(q);
+
 		return 1;
 	}
 
@@ -1189,22 +1435,15 @@ static int do_atom_concat_3(query *q)
 	GET_NEXT_ARG(p2,any);
 	GET_NEXT_ARG(p3,atom);
 	const char *src = GET_STR(p3);
-	size_t len = LEN_STR(p1) + len_char_utf8(src);
-	char *dst1 = strndup(src, len);
-	char *dst2 = strdup(src+len);
-	int done = 0;
-
-	if (!*dst2)
-		done = 1;
-
+	size_t len = LEN_STR(p1) + len_char_utf8(src+LEN_STR(p1));
 	GET_RAW_ARG(1,p1_raw);
 	GET_RAW_ARG(2,p2_raw);
-	cell tmp = take_string(q, dst1);
+	cell tmp = make_stringn(q, src, len);
 	reset_value(q, p1_raw, p1_raw_ctx, &tmp, q->st.curr_frame);
-	tmp = take_string(q, dst2);
+	tmp = make_slice(q, p3, len, LEN_STR(p3)-len);
 	reset_value(q, p2_raw, p2_raw_ctx, &tmp, q->st.curr_frame);
 
-	if (!done)
+	if (len < LEN_STR(p3))
 		make_choice(q);
 
 	return 1;
@@ -1235,24 +1474,24 @@ static int fn_iso_atom_concat_3(query *q)
 
 		const char *src1, *src2;
 		size_t len1, len2;
-		char tmpbuf1[256], tmpbuf2[256];
+		sink s1 = {0}, s2 = {0};
 
 		if (is_atom(p1)) {
 			src1 = GET_STR(p1);
 			len1 = LEN_STR(p1);
 		} else {
-			write_term_to_buf(q, tmpbuf1, sizeof(tmpbuf1), p1, 1, 0, 0, 0, 0);
-			len1 = strlen(tmpbuf1);
-			src1 = tmpbuf1;
+			write_term_to_sink(q, &s1, p1, 1, 0, 0, 0, 0);
+			len1 = s1.len;
+			src1 = s1.buf;
 		}
 
 		if (is_atom(p2)) {
 			src2 = GET_STR(p2);
 			len2 = LEN_STR(p2);
 		} else {
-			write_term_to_buf(q, tmpbuf2, sizeof(tmpbuf2), p2, 1, 0, 0, 0, 0);
-			len2 = strlen(tmpbuf2);
-			src2 = tmpbuf2;
+			write_term_to_sink(q, &s2, p2, 1, 0, 0, 0, 0);
+			len2 = s2.len;
+			src2 = s2.buf;
 		}
 
 		size_t nbytes = len1 + len2;
@@ -1260,6 +1499,8 @@ static int fn_iso_atom_concat_3(query *q)
 		memcpy(dst, src1, len1);
 		memcpy(dst+len1, src2, len2);
 		dst[nbytes] = '\0';
+		free(s1.buf);
+		free(s2.buf);
 		cell tmp = take_blob(q, dst, nbytes);
 		set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
 		return 1;
@@ -1299,7 +1540,7 @@ static int fn_iso_atom_length_2(query *q)
 	GET_FIRST_ARG(p1,atom);
 	GET_NEXT_ARG(p2,integer_or_var);
 	cell tmp;
-	make_int(&tmp, strlen_utf8(GET_STR(p1)));
+	make_int(&tmp, atom_nchars(p1));
 	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 }
 
@@ -1380,14 +1621,18 @@ static int fn_iso_current_output_1(query *q)
 static int fn_iso_set_input_1(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
-	q->current_input = get_stream(q, pstr);
+	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
+	q->current_input = n;
 	return 1;
 }
 
 static int fn_iso_set_output_1(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
-	q->current_output = get_stream(q, pstr);
+	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
+	q->current_output = n;
 	return 1;
 }
 
@@ -1396,6 +1641,7 @@ static int fn_iso_stream_property_2(query *q)
 	GET_FIRST_ARG(pstr,stream);
 	GET_NEXT_ARG(p1,structure);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 
 	if (p1->arity != 1) {
@@ -1434,6 +1680,7 @@ static int fn_iso_set_stream_position_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,integer);
 	return !fseeko(str->fp, p1->val_int, SEEK_SET);
@@ -1532,6 +1779,7 @@ static int fn_iso_close_1(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 
 	if (str->p)
@@ -1565,6 +1813,7 @@ static int fn_iso_at_end_of_stream_1(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	return feof(str->fp);
 }
@@ -1581,6 +1830,7 @@ static int fn_iso_flush_output_1(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	fflush(str->fp);
 	return !ferror(str->fp);
@@ -1599,6 +1849,7 @@ static int fn_iso_nl_1(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	fputc('\n', str->fp);
 	fflush(str->fp);
@@ -1709,6 +1960,7 @@ static int fn_iso_read_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 	return do_read_term(q, str, p1, p1_ctx, NULL, 0, NULL);
@@ -1727,6 +1979,7 @@ static int fn_iso_read_term_3(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 	GET_NEXT_ARG(p2,list_or_nil);
@@ -1746,6 +1999,7 @@ static int fn_iso_write_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 	write_term(q, str->fp, p1, 1, q->m->dq, 0, 200, 0);
@@ -1768,6 +2022,7 @@ static int fn_iso_writeq_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 	int save = q->quoted;
@@ -1790,6 +2045,7 @@ static int fn_iso_write_canonical_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 	write_canonical(q, str->fp, p1, 1, q->m->dq, 0);
@@ -1855,6 +2111,7 @@ static int fn_iso_write_term_3(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
@@ -1899,6 +2156,7 @@ static int fn_iso_put_char_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,atom);
 	const char *src = GET_STR(p1);
@@ -1925,6 +2183,7 @@ static int fn_iso_put_code_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,integer);
 	int ch = (int)p1->val_int;
@@ -1951,6 +2210,7 @@ static int fn_iso_put_byte_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,atom);
 	const char *src = GET_STR(p1);
@@ -1997,6 +2257,7 @@ static int fn_iso_get_char_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,atom_or_var);
 
@@ -2053,6 +2314,7 @@ static int fn_iso_get_code_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,integer_or_var);
 
@@ -2100,6 +2362,7 @@ static int fn_iso_get_byte_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,atom_or_var);
 
@@ -2146,6 +2409,7 @@ static int fn_iso_peek_char_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 
@@ -2182,6 +2446,7 @@ static int fn_iso_peek_code_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 	int ch = str->ungetch ? str->ungetch : getc_utf8(str->fp);
@@ -2207,6 +2472,7 @@ static int fn_iso_peek_byte_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,any);
 	int ch = str->ungetch ? str->ungetch : getc(str->fp);
@@ -2216,14 +2482,22 @@ static int fn_iso_peek_byte_2(query *q)
 	return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
 }
 
+// Once an error has been thrown the query is at the recovery goal of
+// its catch, so the rest of the expression is not evaluated...
+
 static void do_calc(query *q, cell *c)
 {
+	if (q->did_throw)
+		return;
+
 	cell *save = q->st.curr_cell;
 	q->st.curr_cell = c;
 	q->calc = 1;
 	c->fn(q);
 	q->calc = 0;
-	q->st.curr_cell = save;
+
+	if (!q->did_throw)
+		q->st.curr_cell = save;
 }
 
 static int_t gcd(int_t num, int_t remainder)
@@ -2255,7 +2529,21 @@ void do_reduce(cell *n)
 }
 
 #define reduce(c) if ((c)->val_den != 1) do_reduce(c)
-#define calc(q,c) !(c->flags&FLAG_BUILTIN) ? *c : (do_calc(q, c), q->accum)
+// An atom or compound that is not an arithmetic function can't be
+// evaluated...
+
+static cell calc(query *q, cell *c)
+{
+	if (c->flags&FLAG_BUILTIN) {
+		do_calc(q, c);
+		return q->accum;
+	}
+
+	if (is_literal(c))
+		throw_error(q, c, "type_error", "evaluable");
+
+	return *c;
+}
 
 static int fn_iso_is_2(query *q)
 {
@@ -2265,7 +2553,7 @@ static int fn_iso_is_2(query *q)
 	cell p2 = calc(q, p2_tmp);
 	p2.nbr_cells = 1;
 
-	if (q->error)
+	if (q->error || q->did_throw)
 		return 0;
 
 	if (is_var(p1) && is_rational(&p2)) {
@@ -3259,7 +3547,7 @@ static int compare(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
 
 	if (p1->arity == 0) {
 		if (is_atom(p1) && is_atom(p2))
-			return strcmp(GET_STR(p1), GET_STR(p2));
+			return atom_cmp(p1, p2);
 
 		if (is_rational(p1) && is_rational(p2)) {
 			cell tmp1 = *p1, tmp2 = *p2;
@@ -3561,7 +3849,7 @@ static int fn_iso_univ_2(query *q)
 		size_t nbr_cells = p2->nbr_cells;
 		cell *tmp = malloc(sizeof(cell)*nbr_cells);
 		size_t idx = 0;
-		make_literal(tmp+idx++, head->val_offset);
+		make_literal(tmp+idx++, is_string(head) ? find_in_pool(GET_STR(head)) : head->val_offset);
 
 		while (tail) {
 			tail = GET_VALUE(q, tail, p2_ctx);
@@ -3761,8 +4049,25 @@ static int fn_iso_copy_term_2(query *q)
 {
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
-	cell *tmp1 = deep_clone_term_on_tmp(q, p1, p1_ctx);
-	cell *tmp = copy_term(q, 0, tmp1, p1_ctx, 0);
+	var_map vm;
+	vm.nbr_vars = 0;
+	cell *tmp1 = deep_copy_term_on_tmp(q, p1, p1_ctx, &vm);
+	frame *g = GET_FRAME(q->st.curr_frame);
+
+	if ((vm.nbr_vars + g->nbr_vars) > MAX_ARITY) {
+		throw_error(q, p1, "resource_error", "too many vars");
+		return 0;
+	}
+
+	cell *tmp = alloc_heap(q, tmp1->nbr_cells);
+	copy_cells(tmp, tmp1, tmp1->nbr_cells);
+	unsigned slot_nbr = vm.nbr_vars ? create_vars(q, vm.nbr_vars) : 0;
+
+	for (idx_t i = 0; i < tmp->nbr_cells; i++) {
+		if (is_var(tmp+i))
+			tmp[i].slot_nbr += slot_nbr;
+	}
+
 	return unify(q, p2, p2_ctx, tmp, q->st.curr_frame);
 }
 
@@ -3922,53 +4227,132 @@ static int fn_iso_clause_2(query *q)
 	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 }
 
-enum log_type { LOG_ASSERTA=1, LOG_ASSERTZ=2, LOG_ERASE=3 };
+// Persistent predicates are logged to <module>.db. After a header
+// (magic, version and cell size, as for precompiled files) each record
+// is a length and CRC-32 followed by that many bytes of payload: an op
+// ('A' asserta, 'Z' assertz or 'E' erase), the clause's uuid and, for
+// the asserts, any atom definitions and the term itself encoded as in
+// precompiled files. A reset ('R') starts the atom numbering again. A
+// short or corrupt record can only be the tail of a write cut off by a
+// crash, so loading stops there and drops it.
+// With the persist_sync flag set to N the log is flushed and synced to
+// disk every N records, otherwise that is left to stdio and the OS.
+
+#define LOG_MAGIC "TPLW"
+#define LOG_VERSION 1
+#define LOG_HEADER_SIZE 8
+
+enum log_type { LOG_ASSERTA='A', LOG_ASSERTZ='Z', LOG_ERASE='E', LOG_RESET='R' };
+
+static uint32_t log_crc(const char *src, size_t len)
+{
+	static uint32_t s_table[256];
+
+	if (!s_table[1]) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (int j = 0; j < 8; j++)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+
+			s_table[i] = c;
+		}
+	}
+
+	uint32_t crc = 0xFFFFFFFF;
+
+	while (len--)
+		crc = s_table[(crc ^ (uint8_t)*src++) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+static int log_valid(const char *src, size_t len)
+{
+	uint16_t version, cell_size;
+
+	if ((len < LOG_HEADER_SIZE) || memcmp(src, LOG_MAGIC, 4))
+		return 0;
+
+	memcpy(&version, src+4, sizeof(version));
+	memcpy(&cell_size, src+6, sizeof(cell_size));
+	return (version == LOG_VERSION) && (cell_size == sizeof(cell));
+}
+
+static int log_header(FILE *fp)
+{
+	uint16_t version = LOG_VERSION, cell_size = sizeof(cell);
+	fwrite(LOG_MAGIC, 1, 4, fp);
+	fwrite(&version, sizeof(version), 1, fp);
+	return fwrite(&cell_size, sizeof(cell_size), 1, fp) == 1;
+}
+
+static void log_encode(qlf_out *o, clause *r, enum log_type l)
+{
+	uint32_t hdr[2] = {0};
+	uuid u = {0};
+	char op = l;
+	o->len = 0;
+	qlf_put(o, hdr, sizeof(hdr));
+	qlf_put(o, &op, 1);
+	qlf_put(o, r ? &r->u : &u, sizeof(uuid));
+
+	if ((l == LOG_ASSERTA) || (l == LOG_ASSERTZ))
+		qlf_write_term(o, &r->t);
+
+	hdr[0] = o->len - sizeof(hdr);
+	hdr[1] = log_crc(o->buf+sizeof(hdr), hdr[0]);
+	memcpy(o->buf, hdr, sizeof(hdr));
+}
+
+static int log_record(qlf_out *o, FILE *fp, clause *r, enum log_type l)
+{
+	log_encode(o, r, l);
+	return fwrite(o->buf, 1, o->len, fp) == o->len;
+}
+
+static void db_sync(module *m)
+{
+	fflush(m->fp);
+	fsync(fileno(m->fp));
+	m->log_pending = 0;
+}
+
+static void db_compact_check(module *m);
+static void tbl_changed(query *q, cell *c);
+static void tbl_rule_changed(module *m, rule *h);
 
 static void db_log(query *q, clause *r, enum log_type l)
 {
 	static int s_quiet = 5;
-	int save = q->quoted;
-	q->quoted = 2;
-
-	switch(l) {
-		case LOG_ASSERTA:
-		{
-			size_t len = write_term_to_buf(q, NULL, 0, r->t.cells, 1, 0, 0, 0, 0);
-			char *dst = malloc(len+1);
-			write_term_to_buf(q, dst, len+1, r->t.cells, 1, 0, 0, 0, 0);
-			char tmpbuf2[80];
-			uuid_to_string(&r->u, tmpbuf2, sizeof(tmpbuf2));
-			fprintf(q->m->fp, "a_(%s,'%s').\n", dst, tmpbuf2);
-			free(dst);
-			break;
-		}
-		case LOG_ASSERTZ:
-		{
-			size_t len = write_term_to_buf(q, NULL, 0, r->t.cells, 1, 0, 0, 0, 0);
-			char *dst = malloc(len+1);
-			write_term_to_buf(q, dst, len+1, r->t.cells, 1, 0, 0, 0, 0);
-			char tmpbuf2[80];
-			uuid_to_string(&r->u, tmpbuf2, sizeof(tmpbuf2));
-			fprintf(q->m->fp, "z_(%s,'%s').\n", dst, tmpbuf2);
-			free(dst);
-			break;
-		}
-		case LOG_ERASE:
-		{
-			char tmpbuf[256], tmpbuf2[80];
-			uuid_to_string(&r->u, tmpbuf2, sizeof(tmpbuf2));
-			int len = snprintf(tmpbuf, sizeof(tmpbuf), "e_('%s').\n", tmpbuf2);
-
-			if (fwrite(tmpbuf, len, 1, q->m->fp) <= 0) {
-				if (s_quiet-- > 0)
-					fprintf(stderr, "Error: db_log write error '%s'\n", strerror(errno));
-			}
+	module *m = q->m;
 
-			break;
-		}
+	if (!m->fp)
+		return;
+
+	if (!log_record(&m->log, m->fp, r, l)) {
+		if (s_quiet-- > 0)
+			fprintf(stderr, "Error: db_log write error '%s'\n", strerror(errno));
 	}
 
-	q->quoted = save;
+	m->compact.size += m->log.len;
+	m->compact.records++;
+	m->compact.erased += l == LOG_ERASE;
+
+	// While a snapshot is being written records also go to a
+	// backlog, numbering atoms afresh, to be appended to it...
+
+	if (m->compact.pid) {
+		log_encode(&m->compact.dict, r, l);
+		qlf_put(&m->compact.backlog, m->compact.dict.buf, m->compact.dict.len);
+		m->compact.backlog_records++;
+		m->compact.backlog_erased += l == LOG_ERASE;
+	}
+
+	if (m->flag.persist_sync && (++m->log_pending >= (unsigned)m->flag.persist_sync))
+		db_sync(m);
+
+	db_compact_check(m);
 }
 
 static int fn_iso_retract_1(query *q)
@@ -3984,6 +4368,7 @@ static int fn_iso_retract_1(query *q)
 	if (!q->m->loading && r->t.persist)
 		db_log(q, r, LOG_ERASE);
 
+	tbl_changed(q, get_head(r->t.cells));
 	return 1;
 }
 
@@ -3999,6 +4384,9 @@ static int abolish_from_db(query *q, cell *c)
 {
 	rule *h = find_match(q->m, c);
 
+	if (h && (h->flags&FLAG_RULE_TABLED))
+		h = h->impl;
+
 	if (h) {
 		if (!(h->flags&FLAG_RULE_DYNAMIC)) {
 			fprintf(stderr, "Error: not dynamic '%s/%u'\n", GET_STR(c), c->arity);
@@ -4012,6 +4400,7 @@ static int abolish_from_db(query *q, cell *c)
 				db_log(q, r, LOG_ERASE);
 		}
 
+		tbl_rule_changed(q->m, h);
 		h->flags = 0;
 	}
 
@@ -4076,6 +4465,7 @@ static int fn_iso_asserta_1(query *q)
 	if (!q->m->loading && r->t.persist)
 		db_log(q, r, LOG_ASSERTA);
 
+	tbl_changed(q, get_head(r->t.cells));
 	return 1;
 }
 
@@ -4100,6 +4490,7 @@ static int fn_iso_assertz_1(query *q)
 	if (!q->m->loading && r->t.persist)
 		db_log(q, r, LOG_ASSERTZ);
 
+	tbl_changed(q, get_head(r->t.cells));
 	return 1;
 }
 
@@ -4114,6 +4505,7 @@ int call_me(query *q, cell *p1, idx_t p1_ctx)
 
 	if (p1_ctx != q->st.curr_frame) {
 		tmp = copy_term(q, 1, p1, p1_ctx, 1);
+		if (!tmp) return 0;
 		unify(q, p1, p1_ctx, tmp+1, q->st.curr_frame);
 	} else
 		tmp = clone_term(q, 1, p1, p1_ctx, 1);
@@ -4127,6 +4519,14 @@ int call_me(query *q, cell *p1, idx_t p1_ctx)
 static int fn_iso_call_n(query *q)
 {
 	GET_FIRST_ARG(p1,callable);
+	cell tmpf;
+
+	if (is_string(p1)) {
+		make_literal(&tmpf, find_in_pool(GET_STR(p1)));
+		p1 = &tmpf;
+	}
+
+	reserve_heap(q, 2+p1->nbr_cells+q->st.curr_cell->nbr_cells);
 	idx_t save_pos = heap_used(q);
 	clone_term(q, 1, p1, p1_ctx, 0);
 	idx_t nbr_cells = 1 + p1->nbr_cells;
@@ -4284,9 +4684,11 @@ static int do_throw_term(query *q, cell *c)
 			continue;
 
 		q->exception = NULL;
+		tbl_unwind(q->cp);
 		return 1;
 	}
 
+	tbl_unwind(0);
 	fprintf(stderr, "Error: uncaught exception... ");
 	write_term(q, stderr, c, 1, q->m->dq, 0, 999, 0);
 	fprintf(stderr, "\n");
@@ -4416,6 +4818,21 @@ static int fn_iso_current_prolog_flag_2(query *q)
 		else
 			make_literal(&tmp, find_in_pool("compatibility"));
 
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	} else if (!strcmp(GET_STR(p1), "persist_sync")) {
+		cell tmp;
+		make_int(&tmp, q->m->flag.persist_sync);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	} else if (!strcmp(GET_STR(p1), "persist_compact_size")) {
+		cell tmp;
+		make_int(&tmp, q->m->flag.persist_compact_size);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	} else if (!strcmp(GET_STR(p1), "persist_compact_ratio")) {
+		cell tmp;
+		make_int(&tmp, q->m->flag.persist_compact_ratio);
 		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 		return 1;
 	} else if (!strcmp(GET_STR(p1), "version_git")) {
@@ -4469,6 +4886,26 @@ static int fn_iso_set_prolog_flag_2(query *q)
 		return 0;
 	}
 
+	int *flag = !strcmp(GET_STR(p1), "persist_sync") ? &q->m->flag.persist_sync :
+		!strcmp(GET_STR(p1), "persist_compact_size") ? &q->m->flag.persist_compact_size :
+		!strcmp(GET_STR(p1), "persist_compact_ratio") ? &q->m->flag.persist_compact_ratio :
+		NULL;
+
+	if (flag) {
+		if (!is_integer(p2)) {
+			throw_error(q, p2, "type_error", "integer");
+			return 0;
+		}
+
+		if ((p2->val_int < 0) || (p2->val_int > INT_MAX)) {
+			throw_error(q, p2, "domain_error", "flag_value");
+			return 0;
+		}
+
+		*flag = p2->val_int;
+		return 1;
+	}
+
 	if (!is_atom(p2)) {
 		throw_error(q, p2, "type_error", "atom");
 		return 0;
@@ -4510,110 +4947,211 @@ static int fn_iso_set_prolog_flag_2(query *q)
 	return 1;
 }
 
-#ifdef __FreeBSD__
-static int nodecmp(void *thunk, const void *ptr1, const void *ptr2)
-#else
-static int nodecmp(const void *ptr1, const void *ptr2, void *thunk)
-#endif
+// Standard order of terms: Var < Number < Atom < Compound...
+
+static int term_rank(const cell *c)
+{
+	if (is_var(c))
+		return 0;
+	else if (is_number(c))
+		return 1;
+	else if (is_atom(c))
+		return 2;
+	else if (is_structure(c))
+		return 3;
+	else
+		return 4;
+}
+
+static int num_cmp(const cell *p1, const cell *p2)
 {
-	const cell *p1 = *(const cell**)ptr1;
-	const cell *p2 = *(const cell**)ptr2;
-	int keysort = (int)(long)thunk;
+	if (is_rational(p1) && is_rational(p2)) {
+		if ((p1->val_den == 1) && (p2->val_den == 1))
+			return p1->val_int < p2->val_int ? -1 : p1->val_int > p2->val_int ? 1 : 0;
 
-	if (is_rational(p1)) {
-		if (is_rational(p2)) {
-			cell tmp1 = *p1, tmp2 = *p2;
-			tmp1.val_num *= tmp2.val_den;
-			tmp2.val_num *= tmp1.val_den;
-			if (tmp1.val_int < tmp2.val_int)
-				return -1;
-			else if (tmp1.val_int > tmp2.val_int)
-				return 1;
-			else
-				return 0;
-		} else if (is_real(p2)) {
-			if (((double)p1->val_num/p1->val_den) < p2->val_real)
-				return -1;
-			else if (((double)p1->val_num/p1->val_den) > p2->val_real)
-				return 1;
-			else
-				return 0;
-		} else if (is_atom(p2))
-			return -1;
-		else if (is_var(p2))
-			return 1;
+		int_t n1, n2;
+
+		if (!__builtin_mul_overflow(p1->val_num, p2->val_den, &n1) &&
+			!__builtin_mul_overflow(p2->val_num, p1->val_den, &n2))
+			return n1 < n2 ? -1 : n1 > n2 ? 1 : 0;
+
+		long double d1 = (long double)p1->val_num / p1->val_den;
+		long double d2 = (long double)p2->val_num / p2->val_den;
+		return d1 < d2 ? -1 : d1 > d2 ? 1 : 0;
 	}
-	else if (is_real(p1)) {
-		if (is_rational(p2)) {
-			if (p1->val_real < ((double)p2->val_num/p2->val_den))
-				return -1;
-			else if (p1->val_real > ((double)p2->val_num/p2->val_den))
-				return 1;
-			else
-				return 0;
-		} else if (is_real(p2)) {
-			if (p1->val_real < p2->val_real)
-				return -1;
-			else if (p1->val_real > p2->val_real)
-				return 1;
-			else
-				return 0;
-		} else if (is_atom(p2))
-			return -1;
-		else if (is_var(p2))
-			return 1;
-	} else if (is_atom(p1)) {
-		if (is_atom(p2))
-			return strcmp(GET_STR(p1), GET_STR(p2));
-		else if (is_structure(p2))
-			return -1;
-		else
-			return 1;
-	} else if (is_var(p1)) {
-		if (is_var(p2))
+
+	double d1 = is_real(p1) ? p1->val_real : (double)p1->val_num / p1->val_den;
+	double d2 = is_real(p2) ? p2->val_real : (double)p2->val_num / p2->val_den;
+
+	if (d1 < d2)
+		return -1;
+	else if (d1 > d2)
+		return 1;
+
+	// Compare equal by value, so a float precedes an integer
+
+	if (is_real(p1) && !is_real(p2))
+		return -1;
+	else if (!is_real(p1) && is_real(p2))
+		return 1;
+
+	return 0;
+}
+
+static int term_cmp(const cell *p1, const cell *p2)
+{
+	for (;;) {
+		int r1 = term_rank(p1), r2 = term_rank(p2);
+
+		if (r1 != r2)
+			return r1 < r2 ? -1 : 1;
+
+		if (r1 == 0)
 			return p1->slot_nbr < p2->slot_nbr ? -1 : p1->slot_nbr > p2->slot_nbr ? 1 : 0;
-		else
-			return -1;
-	} else if (is_structure(p1)) {
-		if (is_structure(p2)) {
-			if (p1->arity < p2->arity)
-				return -1;
+		else if (r1 == 1)
+			return num_cmp(p1, p2);
+		else if (r1 == 2)
+			return atom_cmp(p1, p2);
+		else if (r1 != 3)
+			return 0;
+
+		if (p1->arity != p2->arity)
+			return p1->arity < p2->arity ? -1 : 1;
+
+		int i = atom_cmp(p1, p2);
+
+		if (i != 0)
+			return i;
+
+		unsigned arity = p1->arity;
+		p1++; p2++;
 
-			if (p1->arity > p2->arity)
-				return 1;
+		// The last argument is compared iteratively so that
+		// long lists don't recurse...
 
-			int i = strcmp(GET_STR(p1), GET_STR(p2));
+		while (--arity) {
+			int i = term_cmp(p1, p2);
 
 			if (i != 0)
 				return i;
 
-			int arity = !keysort ? p1->arity : 1;
-			p1++; p2++;
+			p1 += p1->nbr_cells;
+			p2 += p2->nbr_cells;
+		}
+	}
+}
 
-			while (arity--) {
-#ifdef __FreeBSD__
-				int i = nodecmp(NULL, &p1, &p2);
-#else
-				int i = nodecmp(&p1, &p2, NULL);
-#endif
+typedef struct {
+	cell *c, *key;
+	uint64_t prefix;
+} sort_item;
 
-				if (i != 0)
-					return i;
+// The first 8 bytes of an atom packed big-endian compare the same
+// way as strcmp() on those bytes, so most atom keys are ordered
+// without touching the string itself.
 
-				p1 += p1->nbr_cells;
-				p2 += p2->nbr_cells;
-			}
+static uint64_t atom_prefix(const cell *c)
+{
+	const unsigned char *src = (const unsigned char*)GET_STR(c);
+	uint64_t v = 0;
+
+	for (int i = 0; i < 8; i++) {
+		v <<= 8;
+
+		if (*src)
+			v |= *src++;
+	}
+
+	return v;
+}
+
+static int item_cmp(const sort_item *i1, const sort_item *i2)
+{
+	if (i1->prefix && i2->prefix) {
+		if (i1->prefix != i2->prefix)
+			return i1->prefix < i2->prefix ? -1 : 1;
 
+		if (!(i1->prefix & 0xFF))
 			return 0;
-		} else
-			return 1;
-	} else
-		return 0;
+	} else if (is_integer(i1->key) && is_integer(i2->key))
+		return i1->key->val_int < i2->key->val_int ? -1 : i1->key->val_int > i2->key->val_int ? 1 : 0;
 
-	return 0;
+	return term_cmp(i1->key, i2->key);
+}
+
+// Stable natural merge sort: ascending runs are taken as found,
+// strictly descending ones are reversed, then adjacent runs are
+// merged pairwise until one is left.
+
+static sort_item *merge_sort(sort_item *base, sort_item *tmp, size_t *runs, size_t cnt, int dir)
+{
+	size_t nbr_runs = 0;
+
+	for (size_t i = 0; i < cnt;) {
+		size_t j = i + 1;
+		runs[nbr_runs++] = i;
+
+		if ((j < cnt) && ((item_cmp(base+j-1, base+j)*dir) > 0)) {
+			while ((j < cnt) && ((item_cmp(base+j-1, base+j)*dir) > 0))
+				j++;
+
+			for (size_t lo = i, hi = j - 1; lo < hi; lo++, hi--) {
+				sort_item save = base[lo];
+				base[lo] = base[hi];
+				base[hi] = save;
+			}
+		} else {
+			while ((j < cnt) && ((item_cmp(base+j-1, base+j)*dir) <= 0))
+				j++;
+		}
+
+		i = j;
+	}
+
+	runs[nbr_runs] = cnt;
+
+	while (nbr_runs > 1) {
+		size_t n = 0, r = 0;
+
+		for (; (r + 1) < nbr_runs; r += 2) {
+			size_t i = runs[r], mid = runs[r+1], j = mid, hi = runs[r+2], k = i;
+
+			while ((i < mid) && (j < hi)) {
+				if ((item_cmp(base+i, base+j)*dir) <= 0)
+					tmp[k++] = base[i++];
+				else
+					tmp[k++] = base[j++];
+			}
+
+			while (i < mid)
+				tmp[k++] = base[i++];
+
+			while (j < hi)
+				tmp[k++] = base[j++];
+
+			runs[n++] = runs[r];
+		}
+
+		if (r < nbr_runs) {
+			memcpy(tmp+runs[r], base+runs[r], sizeof(sort_item)*(cnt-runs[r]));
+			runs[n++] = runs[r];
+		}
+
+		runs[n] = cnt;
+		nbr_runs = n;
+		sort_item *save = base;
+		base = tmp;
+		tmp = save;
+	}
+
+	return base;
 }
 
-static cell *nodesort(query *q, cell *p1, idx_t p1_ctx, int dedup, int keysort)
+// Sort on the whole term (arg=0) or on its arg'th argument,
+// optionally descending (dir=-1) and dropping elements whose
+// key is equal to the one before. Returns NULL on error.
+
+static cell *nodesort(query *q, cell *p1, idx_t p1_ctx, unsigned arg, int dir, int dedup, int pairs)
 {
 	cell *p = deep_clone_term_on_tmp(q, p1, p1_ctx);
 	size_t cnt = 0;
@@ -4626,50 +5164,82 @@ static cell *nodesort(query *q, cell *p1, idx_t p1_ctx, int dedup, int keysort)
 		cnt++;
 	}
 
-	cell **base = malloc(sizeof(cell*)*cnt);
+	sort_item *base = malloc((sizeof(sort_item)*2*cnt) + (sizeof(size_t)*(cnt+1)));
 	size_t idx = 0;
 	l = p;
 
 	while (is_list(l)) {
 		cell *head = l + 1;
 		cell *tail = head + head->nbr_cells;
-		base[idx++] = head;
+		cell *key = head;
+
+		if (arg) {
+			if (is_var(head) || !is_structure(head) || (head->arity < arg)
+				|| (pairs && ((head->arity != 2) || strcmp(GET_STR(head), "-")))) {
+				free(base);
+				throw_error(q, head, "type_error", pairs ? "pair" : "compound");
+				release_tmp_cells(p, p->nbr_cells);
+				return NULL;
+			}
+
+			key = head + 1;
+
+			for (unsigned i = 1; i < arg; i++)
+				key += key->nbr_cells;
+		}
+
+		base[idx].c = head;
+		base[idx].key = key;
+		base[idx].prefix = is_atom(key) ? atom_prefix(key) : 0;
+		idx++;
 		l = tail;
 	}
 
-#ifdef __FreeBSD__
-	qsort_r(base, cnt, sizeof(cell*), (void*)(long)keysort, nodecmp);
-#else
-	qsort_r(base, cnt, sizeof(cell*), nodecmp, (void*)(long)keysort);
-#endif
-	l = NULL;
+	sort_item *items = merge_sort(base, base+cnt, (size_t*)(base+2*cnt), cnt, dir);
+	idx_t nbr_cells = 1;
+
+	// Deduplication compares against the element before, which
+	// is equal to the last kept one...
 
 	for (size_t i = 0; i < cnt; i++) {
-		if (i > 0) {
-#ifdef __FreeBSD__
-			if (dedup && !nodecmp((void*)(long)keysort, &base[i], &base[i-1]))
-#else
-			if (dedup && !nodecmp(&base[i], &base[i-1], (void*)(long)keysort))
-#endif
-				continue;
+		if (dedup && i && !item_cmp(items+i, items+i-1)) {
+			release_tmp_cells(items[i].c, items[i].c->nbr_cells);
+			items[i].c = NULL;
+			continue;
 		}
 
-		if (i == 0)
-			l = alloc_list(q, base[i]);
-		else
-			l = append_list(q, l, base[i]);
+		nbr_cells += 1 + items[i].c->nbr_cells;
 	}
 
-	l = end_list(q, l);
+	cell *tmp = alloc_heap(q, nbr_cells);
+	idx_t n = 0;
+
+	for (size_t i = 0; i < cnt; i++) {
+		const cell *c = items[i].c;
+
+		if (!c)
+			continue;
+
+		tmp[n].val_type = TYPE_LITERAL;
+		tmp[n].nbr_cells = nbr_cells - n;
+		tmp[n].val_offset = g_dot_s;
+		tmp[n].arity = 2;
+		copy_cells(tmp+n+1, c, c->nbr_cells);
+		n += 1 + c->nbr_cells;
+	}
+
+	tmp[n].val_type = TYPE_LITERAL;
+	tmp[n].nbr_cells = 1;
+	tmp[n].val_offset = g_nil_s;
 	free(base);
-	return l;
+	return tmp;
 }
 
 static int fn_iso_sort_2(query *q)
 {
 	GET_FIRST_ARG(p1,list_or_nil);
 	GET_NEXT_ARG(p2,list_or_nil_or_var);
-	cell *l = nodesort(q, p1, p1_ctx, 1, 0);
+	cell *l = nodesort(q, p1, p1_ctx, 0, 1, 1, 0);
 	return unify(q, l, p1_ctx, p2, p2_ctx);
 }
 
@@ -4677,7 +5247,8 @@ static int fn_iso_keysort_2(query *q)
 {
 	GET_FIRST_ARG(p1,list_or_nil);
 	GET_NEXT_ARG(p2,list_or_nil_or_var);
-	cell *l = nodesort(q, p1, p1_ctx, 0, 1);
+	cell *l = nodesort(q, p1, p1_ctx, 1, 1, 0, 1);
+	if (!l) return 0;
 	return unify(q, l, p1_ctx, p2, p2_ctx);
 }
 
@@ -4691,6 +5262,7 @@ static cell *convert_to_list(query *q, cell *c, idx_t nbr_cells)
 		return c;
 	}
 
+	reserve_heap(q, (nbr_cells*2)+1);
 	cell *l = alloc_list(q, c);
 	nbr_cells -= c->nbr_cells;
 	c += c->nbr_cells;
@@ -4774,15 +5346,13 @@ static int fn_iso_findall_3(query *q)
 	}
 
 	cell *tmp = clone_term(q, 1, p2, p2_ctx, 3+p1->nbr_cells);
-	q->qnbr++;
+	push_queuen(q);
 	idx_t nbr_cells = 1 + p2->nbr_cells;
 	make_structure(tmp+nbr_cells++, g_sys_queue_s, fn_sys_queue_2, 2, 1+p1->nbr_cells);
 	make_int(tmp+nbr_cells++, q->qnbr);
 	copy_cells(tmp+nbr_cells, p1, p1->nbr_cells);
 	nbr_cells += p1->nbr_cells;
 	make_structure(tmp+nbr_cells, g_fail_s, fn_iso_fail_0, 0, 0);
-	q->tmpq[q->qnbr] = NULL;
-	init_queuen(q);
 	make_choice(q);
 	q->st.curr_cell = tmp;
 	return 1;
@@ -4836,66 +5406,185 @@ static cell *get_existentials(const query *q, cell *p2, idx_t *xs)
 	return p2;
 }
 
-static int fn_iso_bagof_3(query *q)
+// A solution's witness is what the free variables of the goal were
+// bound to. Hashing it lets each group be found by following a chain
+// of solutions instead of rescanning the whole queue.
+
+static uint32_t hash_solution(const cell *c, uint32_t h)
 {
-	GET_FIRST_ARG(p1,structure_or_var);
-	GET_NEXT_ARG(p2,callable);
-	GET_NEXT_ARG(p3,any);
-	idx_t xs_vars = 0;
-	p2 = get_existentials(q, p2, &xs_vars);
+	idx_t nbr_cells = c->nbr_cells;
 
-	// First time thru generate all solutions
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		uint32_t v = c->val_type + (c->arity << 8);
+
+		if (is_literal(c) || is_string(c))
+			v ^= atom_hash((cell*)c);
+		else if (is_rational(c))
+			v ^= (uint32_t)c->val_int ^ (uint32_t)(c->val_int >> 32);
+		else if (is_real(c)) {
+			uint64_t bits;
+			memcpy(&bits, &c->val_real, sizeof(bits));
+			v ^= (uint32_t)bits ^ (uint32_t)(bits >> 32);
+		}
 
-	if (!q->retry) {
-		cell *tmp = clone_term(q, 1, p2, p2_ctx, 3+p2->nbr_cells);
-		q->qnbr++;
-		idx_t nbr_cells = 1 + p2->nbr_cells;
-		make_structure(tmp+nbr_cells++, g_sys_queue_s, fn_sys_queue_2, 2, 1+p2->nbr_cells);
-		make_int(tmp+nbr_cells++, q->qnbr);
-		copy_cells(tmp+nbr_cells, p2, p2->nbr_cells);
-		nbr_cells += p2->nbr_cells;
-		make_structure(tmp+nbr_cells, g_fail_s, fn_iso_fail_0, 0, 0);
-		free(q->tmpq[q->qnbr]);
-		q->tmpq[q->qnbr] = NULL;
-		init_queuen(q);
-		make_choice(q);
-		q->st.curr_cell = tmp;
-		return 1;
+		h = (h * 31) + v;
 	}
 
-	if (!queuen_used(q) && !q->tmpq[q->qnbr]) {
-		q->qnbr--;
-		return 0;
-	}
+	return h;
+}
 
-	// Take a copy
+static uint32_t hash_witness(query *q, cell *p, idx_t p_ctx, const cell *c, uint32_t mask, uint32_t h)
+{
+	p = GET_VALUE(q, p, p_ctx);
+	p_ctx = q->latest_ctx;
 
-	if (!q->tmpq[q->qnbr]) {
-		idx_t nbr_cells = queuen_used(q);
-		q->tmpq[q->qnbr] = malloc(sizeof(cell)*nbr_cells);
-		copy_cells(q->tmpq[q->qnbr], get_queuen(q), nbr_cells);
-		q->tmpq_size[q->qnbr] = nbr_cells;
-	}
+	if (is_var(p)) {
+		if ((p_ctx == q->st.curr_frame) && (p->slot_nbr < 32) && (mask & (1U << p->slot_nbr)))
+			h = hash_solution(c, h);
 
-	init_queuen(q);
-	make_choice(q);
-	uint32_t p1_vars = get_vars(q, p1, p1_ctx);
-	uint32_t p2_vars = get_vars(q, p2, p2_ctx);
-	uint32_t mask = (p1_vars^p2_vars) & ~xs_vars;
-	pin_vars(q, mask);
-	cell *c_end = q->tmpq[q->qnbr]+q->tmpq_size[q->qnbr];
+		return h;
+	}
 
-	for (cell *c = q->tmpq[q->qnbr]; c < c_end; c += c->nbr_cells) {
-		if (c->flags & FLAG_DELETED)
-			continue;
+	if (!is_structure(p) || !is_structure(c))
+		return h;
 
-		if (unify(q, p2, p2_ctx, c, q->st.curr_frame)) {
-			c->flags |= FLAG_DELETED;
-			cell *c1 = deep_clone_term_on_tmp(q, p1, q->st.curr_frame);
-			alloc_queuen(q, q->qnbr, c1);
-		}
+	unsigned arity = p->arity;
+	p++; c++;
 
-		undo_me(q);
+	while (arity--) {
+		h = hash_witness(q, p, p_ctx, c, mask, h);
+		p += p->nbr_cells;
+		c += c->nbr_cells;
+	}
+
+	return h;
+}
+
+static void bind_witness(query *q, cell *p, idx_t p_ctx, cell *c, uint32_t mask)
+{
+	p = GET_VALUE(q, p, p_ctx);
+	p_ctx = q->latest_ctx;
+
+	if (is_var(p)) {
+		if ((p_ctx == q->st.curr_frame) && (p->slot_nbr < 32) && (mask & (1U << p->slot_nbr))) {
+			cell *tmp = deep_clone_term_on_heap(q, c, q->st.curr_frame);
+			unify(q, p, p_ctx, tmp, q->st.curr_frame);
+		}
+
+		return;
+	}
+
+	if (!is_structure(p) || !is_structure(c))
+		return;
+
+	unsigned arity = p->arity;
+	p++; c++;
+
+	while (arity--) {
+		bind_witness(q, p, p_ctx, c, mask);
+		p += p->nbr_cells;
+		c += c->nbr_cells;
+	}
+}
+
+static void group_queuen(query *q, cell *p2, idx_t p2_ctx, uint32_t mask)
+{
+	collector *qs = q->qs + q->qnbr;
+	idx_t nbr_sols = 0;
+	const cell *c_end = qs->tmpq + qs->tmpq_nbr;
+
+	for (cell *c = qs->tmpq; c < c_end; c += c->nbr_cells)
+		nbr_sols++;
+
+	if (qs->sols_size < nbr_sols) {
+		qs->sols_size = nbr_sols;
+		qs->sols = realloc(qs->sols, sizeof(solution)*qs->sols_size);
+	}
+
+	idx_t nbr_heads = 1;
+
+	while (nbr_heads < nbr_sols)
+		nbr_heads *= 2;
+
+	if (qs->heads_size < nbr_heads) {
+		qs->heads_size = nbr_heads;
+		qs->heads = realloc(qs->heads, sizeof(idx_t)*qs->heads_size);
+	}
+
+	idx_t *heads = qs->heads;
+
+	for (idx_t i = 0; i < nbr_heads; i++)
+		heads[i] = nbr_sols;
+
+	idx_t i = 0;
+
+	for (cell *c = qs->tmpq; c < c_end; c += c->nbr_cells, i++) {
+		solution *s = qs->sols + i;
+		s->offset = c - qs->tmpq;
+		s->hash = hash_witness(q, p2, p2_ctx, c, mask, 0);
+	}
+
+	// Chain each solution to the next one in the same bucket, in order
+
+	while (i--) {
+		solution *s = qs->sols + i;
+		idx_t *head = heads + (s->hash & (nbr_heads-1));
+		s->next = *head;
+		*head = i;
+	}
+
+	qs->nbr_sols = nbr_sols;
+	qs->next_sol = 0;
+}
+
+// On each redo the first unused solution fixes the witness and only
+// the solutions chained after it are tried against it.
+
+static int collect_group(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, uint32_t xs_vars)
+{
+	if (!queuen_used(q) && !q->qs[q->qnbr].tmpq_nbr) {
+		q->qnbr--;
+		return 0;
+	}
+
+	uint32_t p1_vars = get_vars(q, p1, p1_ctx);
+	uint32_t p2_vars = get_vars(q, p2, p2_ctx);
+	uint32_t mask = (p1_vars^p2_vars) & ~xs_vars;
+
+	// Take a copy
+
+	if (!q->qs[q->qnbr].tmpq_nbr) {
+		copy_queuen(q);
+		group_queuen(q, p2, p2_ctx, mask);
+	}
+
+	init_queuen(q);
+	make_choice(q);
+	pin_vars(q, mask);
+	collector *qs = q->qs + q->qnbr;
+	const solution *first = NULL;
+
+	while (!queuen_used(q) && (qs->next_sol < qs->nbr_sols)) {
+		first = qs->sols + qs->next_sol++;
+
+		if (qs->tmpq[first->offset].flags & FLAG_DELETED)
+			continue;
+
+		for (const solution *s = first; ; s = qs->sols + s->next) {
+			cell *c = qs->tmpq + s->offset;
+
+			if (!(c->flags & FLAG_DELETED) && (s->hash == first->hash)
+				&& unify(q, p2, p2_ctx, c, q->st.curr_frame)) {
+				c->flags |= FLAG_DELETED;
+				cell *c1 = deep_clone_term_on_tmp(q, p1, p1_ctx);
+				alloc_queuen(q, q->qnbr, c1);
+			}
+
+			undo_me(q);
+
+			if (s->next == qs->nbr_sols)
+				break;
+		}
 	}
 
 	unpin_vars(q);
@@ -4903,22 +5592,19 @@ static int fn_iso_bagof_3(query *q)
 	if (!queuen_used(q)) {
 		drop_choice(q);
 		init_queuen(q);
-		free(q->tmpq[q->qnbr]);
-		q->tmpq[q->qnbr] = NULL;
+		qs->tmpq_nbr = 0;
 		q->qnbr--;
 		return 0;
 	}
 
-	do_sys_listn(q, p3, p3_ctx);
-
+	bind_witness(q, p2, p2_ctx, qs->tmpq+first->offset, mask);
 	idx_t curr_choice = q->cp - 1;
 	choice *ch = q->choices + curr_choice;
 	ch->qnbr = q->qnbr;
-
 	return 1;
 }
 
-static int fn_iso_setof_3(query *q)
+static int fn_iso_bagof_3(query *q)
 {
 	GET_FIRST_ARG(p1,structure_or_var);
 	GET_NEXT_ARG(p2,callable);
@@ -4926,72 +5612,59 @@ static int fn_iso_setof_3(query *q)
 	idx_t xs_vars = 0;
 	p2 = get_existentials(q, p2, &xs_vars);
 
-	// First time thru: generate all solutions
+	// First time thru generate all solutions
 
 	if (!q->retry) {
 		cell *tmp = clone_term(q, 1, p2, p2_ctx, 3+p2->nbr_cells);
-		q->qnbr++;
+		push_queuen(q);
 		idx_t nbr_cells = 1 + p2->nbr_cells;
 		make_structure(tmp+nbr_cells++, g_sys_queue_s, fn_sys_queue_2, 2, 1+p2->nbr_cells);
 		make_int(tmp+nbr_cells++, q->qnbr);
 		copy_cells(tmp+nbr_cells, p2, p2->nbr_cells);
 		nbr_cells += p2->nbr_cells;
 		make_structure(tmp+nbr_cells, g_fail_s, fn_iso_fail_0, 0, 0);
-		q->tmpq[q->qnbr] = NULL;
-		init_queuen(q);
 		make_choice(q);
 		q->st.curr_cell = tmp;
 		return 1;
 	}
 
-	if (!queuen_used(q) && !q->tmpq[q->qnbr]) {
-		q->qnbr--;
+	if (!collect_group(q, p1, q->st.curr_frame, p2, p2_ctx, xs_vars))
 		return 0;
-	}
-
-	// Take a copy
 
-	if (!q->tmpq[q->qnbr]) {
-		idx_t nbr_cells = queuen_used(q);
-		q->tmpq[q->qnbr] = malloc(sizeof(cell)*nbr_cells);
-		copy_cells(q->tmpq[q->qnbr], get_queuen(q), nbr_cells);
-		q->tmpq_size[q->qnbr] = nbr_cells;
-	}
-
-	init_queuen(q);
-	make_choice(q);
-	uint32_t p1_vars = get_vars(q, p1, p1_ctx);
-	uint32_t p2_vars = get_vars(q, p2, p2_ctx);
-	uint32_t mask = (p1_vars^p2_vars) & ~xs_vars;
-	pin_vars(q, mask);
-	cell *c_end = q->tmpq[q->qnbr]+q->tmpq_size[q->qnbr];
+	do_sys_listn(q, p3, p3_ctx);
+	return 1;
+}
 
-	for (cell *c = q->tmpq[q->qnbr]; c < c_end; c += c->nbr_cells) {
-		if (c->flags & FLAG_DELETED)
-			continue;
+static int fn_iso_setof_3(query *q)
+{
+	GET_FIRST_ARG(p1,structure_or_var);
+	GET_NEXT_ARG(p2,callable);
+	GET_NEXT_ARG(p3,any);
+	idx_t xs_vars = 0;
+	p2 = get_existentials(q, p2, &xs_vars);
 
-		if (unify(q, p2, p2_ctx, c, q->st.curr_frame)) {
-			c->flags |= FLAG_DELETED;
-			cell *c1 = deep_clone_term_on_tmp(q, p1, p1_ctx);
-			alloc_queuen(q, q->qnbr, c1);
-		}
+	// First time thru: generate all solutions
 
-		undo_me(q);
+	if (!q->retry) {
+		cell *tmp = clone_term(q, 1, p2, p2_ctx, 3+p2->nbr_cells);
+		push_queuen(q);
+		idx_t nbr_cells = 1 + p2->nbr_cells;
+		make_structure(tmp+nbr_cells++, g_sys_queue_s, fn_sys_queue_2, 2, 1+p2->nbr_cells);
+		make_int(tmp+nbr_cells++, q->qnbr);
+		copy_cells(tmp+nbr_cells, p2, p2->nbr_cells);
+		nbr_cells += p2->nbr_cells;
+		make_structure(tmp+nbr_cells, g_fail_s, fn_iso_fail_0, 0, 0);
+		make_choice(q);
+		q->st.curr_cell = tmp;
+		return 1;
 	}
 
-	unpin_vars(q);
-
-	if (!queuen_used(q)) {
-		drop_choice(q);
-		init_queuen(q);
-		free(q->tmpq[q->qnbr]);
-		q->tmpq[q->qnbr] = NULL;
-		q->qnbr--;
+	if (!collect_group(q, p1, p1_ctx, p2, p2_ctx, xs_vars))
 		return 0;
-	}
 
 	cell *l = convert_to_list(q, get_queuen(q), queuen_used(q));
-	l = nodesort(q, l, q->st.curr_frame, 1, 0);
+	init_queuen(q);
+	l = nodesort(q, l, q->st.curr_frame, 0, 1, 1, 0);
 	return unify(q, p3, p3_ctx, l, q->st.curr_frame);
 }
 
@@ -5006,6 +5679,7 @@ static int fn_erase_1(query *q)
 	if (!q->m->loading && r->t.persist)
 		db_log(q, r, LOG_ERASE);
 
+	tbl_changed(q, get_head(r->t.cells));
 	return 1;
 }
 
@@ -5087,6 +5761,7 @@ static int do_asserta_2(query *q)
 	if (!q->m->loading && r->t.persist)
 		db_log(q, r, LOG_ASSERTA);
 
+	tbl_changed(q, get_head(r->t.cells));
 	return 1;
 }
 
@@ -5137,6 +5812,7 @@ static int do_assertz_2(query *q)
 	if (!q->m->loading && r->t.persist)
 		db_log(q, r, LOG_ASSERTZ);
 
+	tbl_changed(q, get_head(r->t.cells));
 	return 1;
 }
 
@@ -5303,6 +5979,45 @@ static int fn_get_time_1(query *q)
 	return 1;
 }
 
+static int fn_statistics_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,integer_or_var);
+	const char *key = GET_STR(p1);
+	cell tmp;
+
+	if (!strcmp(key, "atoms"))
+		make_int(&tmp, g_pool_count);
+	else if (!strcmp(key, "atom_space"))
+		make_int(&tmp, g_pool_offset);
+	else if (!strcmp(key, "atom_lookups"))
+		make_int(&tmp, g_pool_lookups);
+	else if (!strcmp(key, "atom_probes"))
+		make_int(&tmp, g_pool_probes);
+	else if (!strcmp(key, "atom_max_probe"))
+		make_int(&tmp, g_pool_max_probe);
+	else if (!strcmp(key, "heap"))
+		make_int(&tmp, q->arenas ? q->arenas->base + q->st.hp : 0);
+	else if (!strcmp(key, "gc_count"))
+		make_int(&tmp, q->tot_gcs);
+	else if (!strcmp(key, "gc_time"))
+		make_int(&tmp, q->gc_time / 1000);
+	else if (!strcmp(key, "gc_freed"))
+		make_int(&tmp, q->gc_freed);
+	else if (!strcmp(key, "frames"))
+		make_int(&tmp, q->st.fp);
+	else if (!strcmp(key, "max_frames"))
+		make_int(&tmp, q->max_frames);
+	else if (!strcmp(key, "max_slots"))
+		make_int(&tmp, q->max_slots);
+	else {
+		throw_error(q, p1, "domain_error", "statistics_key");
+		return 0;
+	}
+
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
 static int fn_writeln_1(query *q)
 {
 	GET_FIRST_ARG(p1,any);
@@ -5369,6 +6084,7 @@ static int fn_forall_2(query *q)
 	GET_NEXT_ARG(p2,callable);
 	GET_NEXT_ARG(p3,any);
 
+	reserve_heap(q, 2+p1->nbr_cells+p2->nbr_cells);
 	cell *tmp = clone_term(q, 1, p1, p1_ctx, 0);
 	clone_term(q, 0, p2, p2_ctx, 1);
 	idx_t nbr_cells = 1 + p1->nbr_cells + p2->nbr_cells;
@@ -5671,6 +6387,7 @@ static int fn_accept_2(query *q)
 	GET_FIRST_ARG(pstr,stream);
 	GET_NEXT_ARG(p1,var);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 
 	int fd = net_accept(str);
@@ -5883,6 +6600,7 @@ static int fn_getline_2(query *q)
 	GET_FIRST_ARG(pstr,stream);
 	GET_NEXT_ARG(p1,any);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	char *line = NULL;
 	size_t len = 0;
@@ -5923,6 +6641,7 @@ static int fn_bread_3(query *q)
 	GET_NEXT_ARG(p1,integer_or_var);
 	GET_NEXT_ARG(p2,var);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	size_t len;
 
@@ -6009,6 +6728,7 @@ static int fn_bwrite_2(query *q)
 	GET_FIRST_ARG(pstr,stream);
 	GET_NEXT_ARG(p1,atom);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	const char *src = GET_STR(p1);
 	size_t len = LEN_STR(p1);
@@ -6053,18 +6773,18 @@ static int fn_term_to_atom_2(query *q)
 	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,any);
 
+	sink s = {0};
+	q->latest_ctx = p1_ctx;
+	write_term_to_sink(q, &s, p1, 1, q->m->dq, 0, 999, 0);
+	char *dst = s.buf;
+	idx_t offset;
+
 	if (is_number(p1)) {
-		char tmpbuf[256], *dst = tmpbuf;
-		write_term_to_buf(q, dst, sizeof(tmpbuf), p1, 1, q->m->dq, 0, 999, 0);
 		cell tmp = make_string(q, dst);
+		free(dst);
 		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 	}
 
-	size_t len = write_term_to_buf(q, NULL, 0, p1, 1, q->m->dq, 0, 999, 0);
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, p1, 1, q->m->dq, 0, 999, 0);
-	idx_t offset;
-
 	if (is_in_pool(dst, &offset)) {
 		cell tmp;
 		make_literal(&tmp, offset);
@@ -6082,18 +6802,18 @@ static int fn_write_term_to_atom_3(query *q)
 	GET_NEXT_ARG(p1,any);
 	GET_NEXT_ARG(p3,any);
 
+	sink s = {0};
+	q->latest_ctx = p1_ctx;
+	write_term_to_sink(q, &s, p1, 1, q->m->dq, 0, 999, 0);
+	char *dst = s.buf;
+	idx_t offset;
+
 	if (is_number(p1)) {
-		char tmpbuf[256], *dst = tmpbuf;
-		write_term_to_buf(q, dst, sizeof(tmpbuf), p1, 1, q->m->dq, 0, 999, 0);
 		cell tmp = make_string(q, dst);
+		free(dst);
 		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 	}
 
-	size_t len = write_term_to_buf(q, NULL, 0, p1, 1, q->m->dq, 0, 999, 0);
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, p1, 1, q->m->dq, 0, 999, 0);
-	idx_t offset;
-
 	if (is_in_pool(dst, &offset)) {
 		cell tmp;
 		make_literal(&tmp, offset);
@@ -6253,13 +6973,13 @@ static int fn_spawn_n(query *q)
 
 	while (args++ <= q->st.curr_cell->arity) {
 		GET_NEXT_ARG(p2,any);
-		cell *tmp2 = alloc_heap(q, p2->nbr_cells);
+		cell *tmp2 = alloc_heap_keep(q, p2->nbr_cells, &tmp);
 		copy_cells(tmp2, p2, p2->nbr_cells);
 		cell *c = tmp2;
 
 		for (idx_t i = 0; i < p2->nbr_cells; i++, c++) {
 			if (is_bigstring(c))
-				c->val_str = strdup(c->val_str);
+				retain_string(c);
 		}
 
 		n += p2->nbr_cells;
@@ -6306,21 +7026,6 @@ static int fn_send_1(query *q)
 	GET_FIRST_ARG(p1,nonvar);
 	query *dstq = q->parent ? q->parent : q;
 	cell *c = deep_clone_term_on_tmp(q, p1, p1_ctx);
-
-	for (idx_t i = 0; i < c->nbr_cells; i++) {
-		cell *c2 = c + i;
-
-		if (is_string(c2) && !(c2->flags&FLAG_SMALL_STRING)) {
-			if ((c2->flags&FLAG_SLICE)) {
-				size_t nbytes = c2->nbytes;
-				char *tmp = malloc(nbytes + 1);
-				memcpy(tmp, c2->val_str, nbytes+1);
-				c2->val_str = tmp;
-			} else
-				c2->val_str = strdup(c2->val_str);
-		}
-	}
-
 	alloc_queue(dstq, c);
 	q->yielded = 1;
 	return 1;
@@ -6400,10 +7105,43 @@ static int fn_msort_2(query *q)
 {
 	GET_FIRST_ARG(p1,list_or_nil);
 	GET_NEXT_ARG(p2,list_or_nil_or_var);
-	cell *l = nodesort(q, p1, p1_ctx, 0, 0);
+	cell *l = nodesort(q, p1, p1_ctx, 0, 1, 0, 0);
 	return unify(q, l, p1_ctx, p2, p2_ctx);
 }
 
+static int fn_sort_4(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,atom);
+	GET_NEXT_ARG(p3,list_or_nil);
+	GET_NEXT_ARG(p4,list_or_nil_or_var);
+
+	if (p1->val_int < 0) {
+		throw_error(q, p1, "domain_error", "not_less_than_zero");
+		return 0;
+	}
+
+	const char *src = GET_STR(p2);
+	int dir, dedup;
+
+	if (!strcmp(src, "@<")) {
+		dir = 1; dedup = 1;
+	} else if (!strcmp(src, "@=<")) {
+		dir = 1; dedup = 0;
+	} else if (!strcmp(src, "@>")) {
+		dir = -1; dedup = 1;
+	} else if (!strcmp(src, "@>=")) {
+		dir = -1; dedup = 0;
+	} else {
+		throw_error(q, p2, "domain_error", "order");
+		return 0;
+	}
+
+	cell *l = nodesort(q, p3, p3_ctx, p1->val_int, dir, dedup, 0);
+	if (!l) return 0;
+	return unify(q, l, p3_ctx, p4, p4_ctx);
+}
+
 static int fn_consult_1(query *q)
 {
 	GET_FIRST_ARG(p1,atom);
@@ -6633,22 +7371,22 @@ static int do_format(query *q, cell *str, idx_t str_ctx, cell* p1, cell* p2, idx
 
 			len = format_integer(dst, c->val_int, 3, ',', noargval?2:argval);
 		} else {
-			if (canonical)
-				len = write_canonical_to_buf(q, NULL, 0, c, 1, q->m->dq, 0);
-			else
-				len = write_term_to_buf(q, NULL, 0, c, 1, q->m->dq, 0, 999, 0);
-
-			while (nbytes < len) {
-				size_t save = dst - tmpbuf;
-				tmpbuf = realloc(tmpbuf, bufsiz*=2);
-				dst = tmpbuf + save;
-				nbytes = bufsiz - save;
-			}
+			size_t save = dst - tmpbuf;
+			sink s = {0};
+			s.buf = tmpbuf;
+			s.len = save;
+			s.size = bufsiz;
 
 			if (canonical)
-				len = write_canonical_to_buf(q, dst, nbytes, c, 1, q->m->dq, 0);
+				write_canonical_to_sink(q, &s, c, 1, q->m->dq, 0);
 			else
-				len = write_term_to_buf(q, dst, nbytes, c, 1, q->m->dq, 0, 999, 0);
+				write_term_to_sink(q, &s, c, 1, q->m->dq, 0, 999, 0);
+
+			tmpbuf = s.buf;
+			bufsiz = s.size;
+			dst = tmpbuf + save;
+			nbytes = bufsiz - save;
+			len = s.len - save;
 		}
 
 		dst += len;
@@ -7068,6 +7806,7 @@ static int fn_edin_skip_2(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,integer);
 
@@ -7126,6 +7865,7 @@ static int fn_edin_tab_2(query *q)
 	}
 
 	int n = get_stream(q, pstr);
+	if (n < 0) return 0;
 	stream *str = &g_streams[n];
 
 	for (int i = 0; i < p1.val_int; i++)
@@ -7187,73 +7927,1026 @@ static int fn_edin_telling_1(query *q)
 	return 1;
 }
 
-static idx_t do_jenkins_one_at_a_time_hash(const char *key)
+// Structural term hashing: the cells are walked in order mixing in a
+// Prolog type tag, atom names and arities and numeric values. Atoms
+// are hashed by their text, not by how they are stored, so the value
+// is the same from run to run and for pool and string atoms alike.
+// Variables make the term unhashable unless 'variant' is set, when
+// they are numbered in order of first occurrence...
+
+enum { HASH_VAR=1, HASH_INT, HASH_FLOAT, HASH_ATOM, HASH_COMPOUND };
+
+typedef struct {
+	uint64_t h;
+	struct { idx_t ctx; unsigned slot_nbr; } *vars;
+	unsigned nbr_vars, max_vars;
+	int max_depth, variant;
+} term_hasher;
+
+static uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+	h ^= v;
+	h *= 0x9E3779B97F4A7C15ULL;
+	return h ^ (h >> 29);
+}
+
+static uint64_t hash_bytes(uint64_t h, const char *src, size_t len)
 {
-	idx_t hash = 0;
+	uint64_t h2 = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		h2 ^= (uint8_t)*src++;
+		h2 *= 0x100000001b3ULL;
+	}
+
+	return hash_mix(h, h2);
+}
+
+static int do_term_hash(query *q, term_hasher *th, cell *c, idx_t c_ctx, int depth)
+{
+	for (;;) {
+		if ((th->max_depth >= 0) && (depth > th->max_depth))
+			return 1;
+
+		c = GET_VALUE(q, c, c_ctx);
+		c_ctx = q->latest_ctx;
+
+		if (is_var(c)) {
+			if (!th->variant)
+				return 0;
+
+			unsigned i;
+
+			for (i = 0; i < th->nbr_vars; i++) {
+				if ((th->vars[i].ctx == c_ctx) && (th->vars[i].slot_nbr == c->slot_nbr))
+					break;
+			}
+
+			if (i == th->nbr_vars) {
+				if (th->nbr_vars == th->max_vars)
+					th->vars = realloc(th->vars, sizeof(*th->vars)*(th->max_vars = th->max_vars ? th->max_vars*2 : 16));
 
-	while (*key != 0) {
-		hash += *key++;
-		hash += (hash << 10);
-		hash ^= (hash >> 6);
+				th->vars[i].ctx = c_ctx;
+				th->vars[i].slot_nbr = c->slot_nbr;
+				th->nbr_vars++;
+			}
+
+			th->h = hash_mix(th->h, ((uint64_t)i << 8) | HASH_VAR);
+			return 1;
+		}
+
+		if (is_rational(c)) {
+			th->h = hash_mix(th->h, HASH_INT);
+			th->h = hash_mix(th->h, (uint64_t)c->val_num);
+#if USE_INT128
+			th->h = hash_mix(th->h, (uint64_t)(c->val_num >> 64));
+#endif
+			if (c->val_den != 1)
+				th->h = hash_mix(th->h, (uint64_t)c->val_den);
+
+			return 1;
+		}
+
+		if (is_real(c)) {
+			uint64_t v;
+			memcpy(&v, &c->val_real, sizeof(v));
+			th->h = hash_mix(th->h, HASH_FLOAT);
+			th->h = hash_mix(th->h, v);
+			return 1;
+		}
+
+		th->h = hash_mix(th->h, ((uint64_t)c->arity << 8) | (c->arity ? HASH_COMPOUND : HASH_ATOM));
+		th->h = hash_bytes(th->h, GET_STR(c), LEN_STR(c));
+
+		if (!is_structure(c))
+			return 1;
+
+		unsigned arity = c->arity;
+
+		for (c++; arity > 1; arity--, c += c->nbr_cells) {
+			if (!do_term_hash(q, th, c, c_ctx, depth+1))
+				return 0;
+		}
+
+		depth++;
 	}
+}
 
-	hash += (hash << 3);
-	hash ^= (hash >> 11);
-	hash += (hash << 15);
-	return hash;
+static int term_hash(query *q, cell *c, idx_t c_ctx, int max_depth, int variant, uint64_t *h)
+{
+	term_hasher th = {0};
+	th.h = 0x84222325cbf29ce4ULL;
+	th.max_depth = max_depth;
+	th.variant = variant;
+	int ok = do_term_hash(q, &th, c, c_ctx, 1);
+	free(th.vars);
+	*h = th.h ^ (th.h >> 32);
+	return ok;
 }
 
 static int fn_term_hash_2(query *q)
 {
-	GET_FIRST_ARG(p1,nonvar);
+	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,integer_or_var);
-	size_t len = write_term_to_buf(q, NULL, 0, p1, 1, q->m->dq, 0, 999, 0);
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, p1, 1, q->m->dq, 0, 999, 0);
+	uint64_t h;
+
+	if (!term_hash(q, p1, p1_ctx, -1, 0, &h))
+		return 1;
+
 	cell tmp;
-	make_int(&tmp, do_jenkins_one_at_a_time_hash(dst));
-	int ok = unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
-	free(dst);
-	return ok;
+	make_int(&tmp, h & INT64_MAX);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 }
 
-static int fn_atom_number_2(query *q)
+static int fn_term_hash_4(query *q)
 {
-	GET_FIRST_ARG(p1,atom_or_var);
-	GET_NEXT_ARG(p2,integer_or_var);
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,integer);
+	GET_NEXT_ARG(p3,integer);
+	GET_NEXT_ARG(p4,integer_or_var);
 
-	if (is_var(p1) && is_var(p2)) {
-		throw_error(q, p1, "instantiation_error", "not sufficiently instantiated");
+	// A depth of -1 hashes the whole term, 0 none of it...
+
+	if (p2->val_int < -1) {
+		throw_error(q, p2, "domain_error", "not_less_than_minus_one");
 		return 0;
 	}
 
-	if (is_var(p1)) {
-		char tmpbuf[256];
-		sprintf(tmpbuf, "%lld", (long long)p2->val_int);
-		cell tmp = make_string(q, tmpbuf);
-		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
-		return 1;
+	if (p3->val_int <= 0) {
+		throw_error(q, p3, "domain_error", "positive_integer");
+		return 0;
 	}
 
-	int_t p1_val = strtoll(GET_STR(p1), NULL, 10);
+	uint64_t h;
+	int max_depth = p2->val_int > INT_MAX ? INT_MAX : (int)p2->val_int;
 
-	if (is_var(p2)) {
-		cell tmp;
-		make_int(&tmp, p1_val);
-		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	if (!term_hash(q, p1, p1_ctx, max_depth, 0, &h))
 		return 1;
-	}
 
-	return p1_val == p2->val_int;
+	cell tmp;
+	make_int(&tmp, (h & INT64_MAX) % (uint64_t)p3->val_int);
+	return unify(q, p4, p4_ctx, &tmp, q->st.curr_frame);
 }
 
-static int fn_atom_hex_2(query *q)
+static int fn_variant_hash_2(query *q)
 {
-	GET_FIRST_ARG(p1,atom_or_var);
+	GET_FIRST_ARG(p1,any);
 	GET_NEXT_ARG(p2,integer_or_var);
+	uint64_t h;
+	term_hash(q, p1, p1_ctx, -1, 1, &h);
+	cell tmp;
+	make_int(&tmp, h & INT64_MAX);
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
 
-	if (is_var(p1) && is_var(p2)) {
-		throw_error(q, p1, "instantiation_error", "atom");
+// Tabling: the wrapper of a tabled predicate p/N (see parse.c) calls
+// '$tbl_call'(Goal,Impl). Each call variant has a table of answers
+// that is filled by running the clauses (Impl) to exhaustion. A call
+// to a variant whose table is still being filled consumes the answers
+// found so far and makes every table above it on the stack depend on
+// it. The oldest table of such a group (the leader) repeats rounds of
+// evaluation until one adds no new answer, then completes the whole
+// group. Completed tables are kept across queries until abolished
+// or, for incremental ones, an incremental dynamic predicate changes.
+// Calls are keyed on the module as well as the goal, and atoms are
+// compared by their text however they are stored.
+
+enum { TBL_FRESH, TBL_EVAL, TBL_INCOMPLETE, TBL_COMPLETE };
+
+typedef struct {
+	cell *cells;
+	uint64_t h;
+} tbl_term;
+
+typedef struct table_ table;
+
+struct table_ {
+	table *next;
+	module *m;
+	tbl_term key, *answers;
+	uint32_t *slots;
+	uint64_t id, mark, stamp, dep_stamp;
+	idx_t nbr_answers, max_answers, nbr_slots, cp;
+	unsigned sp, dep, pending_mark;
+	int status, incremental, pending;
+};
+
+typedef struct {
+	cell *cells;
+	idx_t len, size;
+	struct { idx_t ctx; unsigned slot_nbr; } vars[MAX_ARITY];
+	unsigned nbr_vars;
+	int error;
+} tbl_buf;
+
+static struct {
+	table **ids, **buckets, **stack, **pending;
+	unsigned *free_ids, nbr_ids, nbr_free, nbr_buckets, count;
+	unsigned sp, max_sp, nbr_pending, max_pending, incremental;
+	uint64_t gen, changes, stamp;
+	tbl_buf buf;
+} g_tbl;
+
+static void tbl_put(tbl_buf *b, const cell *c)
+{
+	if (b->len == b->size) {
+		b->size = b->size ? b->size * 2 : 256;
+		b->cells = realloc(b->cells, sizeof(cell)*b->size);
+	}
+
+	b->cells[b->len++] = *c;
+}
+
+// Copies a term out of the frames, numbering its variables from 0 in
+// order of first occurrence. The last argument is looped on so long
+// lists don't recurse...
+
+static void tbl_flatten(query *q, tbl_buf *b, cell *c, idx_t c_ctx)
+{
+	idx_t start = b->len;
+
+	for (;;) {
+		c = GET_VALUE(q, c, c_ctx);
+		c_ctx = q->latest_ctx;
+		tbl_put(b, c);
+		cell *dst = b->cells + b->len - 1;
+
+		if (is_var(c)) {
+			unsigned n;
+
+			for (n = 0; n < b->nbr_vars; n++) {
+				if ((b->vars[n].ctx == c_ctx) && (b->vars[n].slot_nbr == c->slot_nbr))
+					break;
+			}
+
+			if (n == b->nbr_vars) {
+				if (n == MAX_ARITY) {
+					b->error = 1;
+					n = 0;
+				} else {
+					b->vars[n].ctx = c_ctx;
+					b->vars[n].slot_nbr = c->slot_nbr;
+					b->nbr_vars++;
+				}
+			}
+
+			dst->slot_nbr = n;
+			dst->flags = 0;
+			break;
+		}
+
+		if (is_bigstring(c)) {
+			retain_string(c);
+			dst->flags &= ~FLAG_CONST;
+		}
+
+		if (!is_structure(c))
+			break;
+
+		unsigned arity = c->arity;
+
+		for (c++; arity > 1; arity--, c += c->nbr_cells)
+			tbl_flatten(q, b, c, c_ctx);
+	}
+
+	// Structures along the last argument all end here...
+
+	for (idx_t i = start; is_structure(b->cells+i);) {
+		cell *s = b->cells + i++;
+		s->nbr_cells = b->len - (s - b->cells);
+
+		for (unsigned arity = s->arity; arity > 1; arity--)
+			i += b->cells[i].nbr_cells;
+	}
+}
+
+static void tbl_release(cell *c, idx_t nbr_cells)
+{
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		if (is_bigstring(c))
+			release_string(c);
+	}
+}
+
+static unsigned tbl_tag(const cell *c)
+{
+	if (is_var(c))
+		return HASH_VAR;
+	else if (is_rational(c))
+		return HASH_INT;
+	else if (is_real(c))
+		return HASH_FLOAT;
+	else
+		return c->arity ? HASH_COMPOUND : HASH_ATOM;
+}
+
+static uint64_t tbl_hash(cell *c, idx_t nbr_cells)
+{
+	uint64_t h = 0x84222325cbf29ce4ULL;
+
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		h = hash_mix(h, ((uint64_t)c->arity << 8) | tbl_tag(c));
+
+		if (is_var(c))
+			h = hash_mix(h, c->slot_nbr);
+		else if (is_rational(c)) {
+			h = hash_mix(h, (uint64_t)c->val_num);
+#if USE_INT128
+			h = hash_mix(h, (uint64_t)(c->val_num >> 64));
+#endif
+			h = hash_mix(h, (uint64_t)c->val_den);
+		} else if (is_real(c)) {
+			uint64_t v;
+			memcpy(&v, &c->val_real, sizeof(v));
+			h = hash_mix(h, v);
+		} else
+			h = hash_bytes(h, GET_STR(c), LEN_STR(c));
+	}
+
+	return h;
+}
+
+static int tbl_equal(const tbl_term *t1, cell *c2, idx_t nbr_cells, uint64_t h)
+{
+	cell *c1 = t1->cells;
+
+	if ((t1->h != h) || (c1->nbr_cells != nbr_cells))
+		return 0;
+
+	for (idx_t i = 0; i < nbr_cells; i++, c1++, c2++) {
+		if ((tbl_tag(c1) != tbl_tag(c2)) || (c1->arity != c2->arity))
+			return 0;
+
+		if (is_var(c1)) {
+			if (c1->slot_nbr != c2->slot_nbr)
+				return 0;
+		} else if (is_rational(c1)) {
+			if ((c1->val_num != c2->val_num) || (c1->val_den != c2->val_den))
+				return 0;
+		} else if (is_real(c1)) {
+			if (memcmp(&c1->val_real, &c2->val_real, sizeof(c1->val_real)))
+				return 0;
+		} else if (is_literal(c1) && is_literal(c2)) {
+			if (c1->val_offset != c2->val_offset)
+				return 0;
+		} else if ((LEN_STR(c1) != LEN_STR(c2)) || memcmp(GET_STR(c1), GET_STR(c2), LEN_STR(c1)))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Flattens into the scratch buffer, returning the number of cells or
+// zero if the term has too many variables...
+
+static idx_t tbl_scratch(query *q, cell *c, idx_t c_ctx, uint64_t *h)
+{
+	tbl_buf *b = &g_tbl.buf;
+	b->len = b->nbr_vars = 0;
+	b->error = 0;
+	tbl_flatten(q, b, c, c_ctx);
+
+	if (b->error) {
+		tbl_release(b->cells, b->len);
+		return 0;
+	}
+
+	*h = tbl_hash(b->cells, b->len);
+	return b->len;
+}
+
+static cell *tbl_keep(idx_t nbr_cells)
+{
+	cell *c = malloc(sizeof(cell)*nbr_cells);
+	copy_cells(c, g_tbl.buf.cells, nbr_cells);
+	return c;
+}
+
+static table *tbl_get(int_t id)
+{
+	uint64_t slot = (uint64_t)id & 0xFFFFFFFF;
+
+	if (slot >= g_tbl.nbr_ids)
+		return NULL;
+
+	table *t = g_tbl.ids[slot];
+	return t && (t->id == (uint64_t)id) ? t : NULL;
+}
+
+static void tbl_clear(table *t)
+{
+	for (idx_t i = 0; i < t->nbr_answers; i++) {
+		tbl_release(t->answers[i].cells, t->answers[i].cells->nbr_cells);
+		free(t->answers[i].cells);
+	}
+
+	if (t->slots)
+		memset(t->slots, 0, sizeof(uint32_t)*t->nbr_slots);
+
+	t->nbr_answers = 0;
+	t->status = TBL_FRESH;
+	t->pending = 0;
+}
+
+static void tbl_free(table *t)
+{
+	table **link = &g_tbl.buckets[t->key.h & (g_tbl.nbr_buckets-1)];
+
+	while (*link != t)
+		link = &(*link)->next;
+
+	*link = t->next;
+	tbl_clear(t);
+	unsigned slot = t->id & 0xFFFFFFFF;
+	g_tbl.ids[slot] = NULL;
+	g_tbl.free_ids[g_tbl.nbr_free++] = slot;
+	g_tbl.count--;
+	g_tbl.incremental -= t->incremental;
+	tbl_release(t->key.cells, t->key.cells->nbr_cells);
+	free(t->key.cells);
+	free(t->answers);
+	free(t->slots);
+	free(t);
+}
+
+static table *tbl_find(query *q, cell *c, idx_t c_ctx)
+{
+	uint64_t h;
+	idx_t nbr_cells = tbl_scratch(q, c, c_ctx, &h);
+
+	if (!nbr_cells)
+		return NULL;
+
+	h = hash_bytes(h, q->m->name, strlen(q->m->name));
+
+	if (g_tbl.nbr_buckets) {
+		for (table *t = g_tbl.buckets[h & (g_tbl.nbr_buckets-1)]; t; t = t->next) {
+			if ((t->m == q->m) && tbl_equal(&t->key, g_tbl.buf.cells, nbr_cells, h)) {
+				tbl_release(g_tbl.buf.cells, nbr_cells);
+				return t;
+			}
+		}
+	}
+
+	if (g_tbl.count >= g_tbl.nbr_buckets) {
+		unsigned nbr_buckets = g_tbl.nbr_buckets ? g_tbl.nbr_buckets * 2 : 256;
+		table **buckets = calloc(nbr_buckets, sizeof(table*));
+
+		for (unsigned i = 0; i < g_tbl.nbr_buckets; i++) {
+			for (table *t = g_tbl.buckets[i], *next; t; t = next) {
+				next = t->next;
+				t->next = buckets[t->key.h & (nbr_buckets-1)];
+				buckets[t->key.h & (nbr_buckets-1)] = t;
+			}
+		}
+
+		free(g_tbl.buckets);
+		g_tbl.buckets = buckets;
+		g_tbl.nbr_buckets = nbr_buckets;
+	}
+
+	if (!g_tbl.nbr_free) {
+		unsigned nbr_ids = g_tbl.nbr_ids ? g_tbl.nbr_ids * 2 : 256;
+		g_tbl.ids = realloc(g_tbl.ids, sizeof(table*)*nbr_ids);
+		g_tbl.free_ids = realloc(g_tbl.free_ids, sizeof(unsigned)*nbr_ids);
+
+		for (unsigned i = nbr_ids; i > g_tbl.nbr_ids; i--) {
+			g_tbl.ids[i-1] = NULL;
+			g_tbl.free_ids[g_tbl.nbr_free++] = i - 1;
+		}
+
+		g_tbl.nbr_ids = nbr_ids;
+	}
+
+	table *t = calloc(1, sizeof(table));
+	unsigned slot = g_tbl.free_ids[--g_tbl.nbr_free];
+	t->id = (++g_tbl.gen & 0x7FFFFFFF) << 32 | slot;
+	t->m = q->m;
+	t->key.cells = tbl_keep(nbr_cells);
+	t->key.h = h;
+	rule *r = find_match(q->m, t->key.cells);
+	t->incremental = r && (r->flags&FLAG_RULE_INCREMENTAL) ? 1 : 0;
+	g_tbl.incremental += t->incremental;
+	g_tbl.ids[slot] = t;
+	t->next = g_tbl.buckets[h & (g_tbl.nbr_buckets-1)];
+	g_tbl.buckets[h & (g_tbl.nbr_buckets-1)] = t;
+	g_tbl.count++;
+	return t;
+}
+
+static int tbl_add(query *q, table *t, cell *c, idx_t c_ctx)
+{
+	uint64_t h;
+	idx_t nbr_cells = tbl_scratch(q, c, c_ctx, &h);
+
+	if (!nbr_cells)
+		return 0;
+
+	if ((t->nbr_answers * 2) >= t->nbr_slots) {
+		t->nbr_slots = t->nbr_slots ? t->nbr_slots * 2 : 16;
+		free(t->slots);
+		t->slots = calloc(t->nbr_slots, sizeof(uint32_t));
+
+		for (idx_t i = 0; i < t->nbr_answers; i++) {
+			idx_t j = t->answers[i].h & (t->nbr_slots-1);
+
+			while (t->slots[j])
+				j = (j + 1) & (t->nbr_slots-1);
+
+			t->slots[j] = i + 1;
+		}
+	}
+
+	idx_t j = h & (t->nbr_slots-1);
+
+	while (t->slots[j]) {
+		if (tbl_equal(&t->answers[t->slots[j]-1], g_tbl.buf.cells, nbr_cells, h)) {
+			tbl_release(g_tbl.buf.cells, nbr_cells);
+			return 1;
+		}
+
+		j = (j + 1) & (t->nbr_slots-1);
+	}
+
+	if (t->nbr_answers == t->max_answers) {
+		t->max_answers = t->max_answers ? t->max_answers * 2 : 16;
+		t->answers = realloc(t->answers, sizeof(tbl_term)*t->max_answers);
+	}
+
+	t->answers[t->nbr_answers].cells = tbl_keep(nbr_cells);
+	t->answers[t->nbr_answers].h = h;
+	t->slots[j] = ++t->nbr_answers;
+	g_tbl.changes++;
+	return 1;
+}
+
+// Called when a table is consumed while incomplete: it and every
+// table above it on the stack now depend on the one at 'sp'.
+
+static void tbl_depend(unsigned sp)
+{
+	for (unsigned i = sp; i < g_tbl.sp; i++) {
+		if (g_tbl.stack[i]->dep > sp)
+			g_tbl.stack[i]->dep = sp;
+	}
+}
+
+static void tbl_complete(table *t)
+{
+	for (unsigned i = t->pending_mark; i < g_tbl.nbr_pending; i++) {
+		g_tbl.pending[i]->status = TBL_COMPLETE;
+		g_tbl.pending[i]->pending = 0;
+	}
+
+	g_tbl.nbr_pending = t->pending_mark;
+	t->status = TBL_COMPLETE;
+	g_tbl.sp--;
+}
+
+static void tbl_invalidate(void)
+{
+	for (unsigned i = 0; i < g_tbl.nbr_ids; i++) {
+		table *t = g_tbl.ids[i];
+
+		if (t && t->incremental && ((t->status == TBL_COMPLETE) || (t->status == TBL_FRESH)))
+			tbl_free(t);
+	}
+}
+
+// The tables of a tabled predicate are dropped when its own clauses
+// change...
+
+static void tbl_drop(module *m, rule *h)
+{
+	for (unsigned i = 0; i < g_tbl.nbr_ids; i++) {
+		table *t = g_tbl.ids[i];
+
+		if (!t || (t->m != m) || (t->key.cells->val_offset != h->val_offset)
+			|| (t->key.cells->arity != h->arity))
+			continue;
+
+		if ((t->status == TBL_COMPLETE) || (t->status == TBL_FRESH))
+			tbl_free(t);
+	}
+}
+
+static void tbl_rule_changed(module *m, rule *h)
+{
+	if (!g_tbl.count)
+		return;
+
+	if (h->owner) {
+		h = h->owner;
+		tbl_drop(m, h);
+	}
+
+	if (g_tbl.incremental && (h->flags&FLAG_RULE_INCREMENTAL))
+		tbl_invalidate();
+}
+
+static void tbl_changed(query *q, cell *c)
+{
+	if (!g_tbl.count)
+		return;
+
+	rule *h = find_match(q->m, c);
+
+	if (h)
+		tbl_rule_changed(q->m, h);
+}
+
+void destroy_tables(void)
+{
+	for (unsigned i = 0; i < g_tbl.nbr_ids; i++) {
+		if (g_tbl.ids[i])
+			tbl_free(g_tbl.ids[i]);
+	}
+
+	free(g_tbl.ids);
+	free(g_tbl.free_ids);
+	free(g_tbl.buckets);
+	free(g_tbl.stack);
+	free(g_tbl.pending);
+	free(g_tbl.buf.cells);
+	memset(&g_tbl, 0, sizeof(g_tbl));
+}
+
+static int fn_sys_tbl_variant_3(query *q)
+{
+	GET_FIRST_ARG(p1,callable);
+	GET_NEXT_ARG(p2,var);
+	GET_NEXT_ARG(p3,var);
+	table *t = tbl_find(q, p1, p1_ctx);
+
+	if (!t) {
+		throw_error(q, p1, "resource_error", "too many vars");
+		return 0;
+	}
+
+	int fresh = 0;
+
+	if (t->status == TBL_FRESH)
+		fresh = 1;
+	else if (t->status == TBL_EVAL) {
+		if ((t->sp < g_tbl.sp) && (g_tbl.stack[t->sp] == t))
+			tbl_depend(t->sp);
+		else {
+			tbl_clear(t);
+			fresh = 1;
+		}
+	} else if (t->status == TBL_INCOMPLETE) {
+		// Consumed as is until its leader starts another round...
+
+		if ((t->dep < g_tbl.sp) && (g_tbl.stack[t->dep]->stamp == t->dep_stamp))
+			tbl_depend(t->dep);
+		else
+			fresh = 1;
+	}
+
+	cell tmp;
+	make_int(&tmp, t->id);
+	set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	make_literal(&tmp, fresh ? g_true_s : find_in_pool("false"));
+	set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
+
+static int fn_sys_tbl_start_1(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	table *t = tbl_get(p1->val_int);
+
+	if (!t)
+		return 1;
+
+	if (g_tbl.sp == g_tbl.max_sp) {
+		g_tbl.max_sp = g_tbl.max_sp ? g_tbl.max_sp * 2 : 64;
+		g_tbl.stack = realloc(g_tbl.stack, sizeof(table*)*g_tbl.max_sp);
+	}
+
+	t->sp = g_tbl.sp;
+	g_tbl.stack[g_tbl.sp++] = t;
+	t->status = TBL_EVAL;
+	t->dep = UINT_MAX;
+	t->mark = g_tbl.changes;
+	t->stamp = ++g_tbl.stamp;
+	t->pending_mark = g_tbl.nbr_pending;
+	t->cp = q->cp;
+	return 1;
+}
+
+static int fn_sys_tbl_add_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,any);
+	table *t = tbl_get(p1->val_int);
+
+	if (!t)
+		return 1;
+
+	if (!tbl_add(q, t, p2, p2_ctx)) {
+		throw_error(q, p2, "resource_error", "too many vars");
+		return 0;
+	}
+
+	return 1;
+}
+
+// Succeeds when the table is done with, fails if another round is
+// needed...
+
+static int fn_sys_tbl_done_1(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	table *t = tbl_get(p1->val_int);
+
+	if (!t || (t->status != TBL_EVAL))
+		return 1;
+
+	if (t->dep < t->sp) {
+		t->status = TBL_INCOMPLETE;
+		t->dep_stamp = g_tbl.stack[t->dep]->stamp;
+		g_tbl.sp--;
+
+		if (g_tbl.stack[g_tbl.sp-1]->dep > t->dep)
+			g_tbl.stack[g_tbl.sp-1]->dep = t->dep;
+
+		if (!t->pending) {
+			if (g_tbl.nbr_pending == g_tbl.max_pending) {
+				g_tbl.max_pending = g_tbl.max_pending ? g_tbl.max_pending * 2 : 64;
+				g_tbl.pending = realloc(g_tbl.pending, sizeof(table*)*g_tbl.max_pending);
+			}
+
+			g_tbl.pending[g_tbl.nbr_pending++] = t;
+			t->pending = 1;
+		}
+
+		return 1;
+	}
+
+	if ((t->dep == t->sp) && (t->mark != g_tbl.changes)) {
+		t->mark = g_tbl.changes;
+		t->stamp = ++g_tbl.stamp;
+		return 0;
+	}
+
+	tbl_complete(t);
+	return 1;
+}
+
+// Evaluations started since choice 'cp' are abandoned when an
+// exception is caught there, their tables go back to being fresh...
+
+static void tbl_unwind(idx_t cp)
+{
+	unsigned sp = g_tbl.sp;
+
+	while (sp && (g_tbl.stack[sp-1]->cp > cp))
+		sp--;
+
+	if (sp == g_tbl.sp)
+		return;
+
+	table *t = g_tbl.stack[sp];
+
+	for (unsigned i = t->pending_mark; i < g_tbl.nbr_pending; i++)
+		tbl_clear(g_tbl.pending[i]);
+
+	for (unsigned i = sp; i < g_tbl.sp; i++)
+		tbl_clear(g_tbl.stack[i]);
+
+	g_tbl.nbr_pending = t->pending_mark;
+	g_tbl.sp = sp;
+}
+
+static int fn_sys_tbl_answer_3(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,any);
+	GET_NEXT_ARG(p3,integer_or_var);
+	table *t = tbl_get(p1->val_int);
+	idx_t i = q->retry ? p3->val_int + 1 : 0;
+
+	if (!t || (i >= t->nbr_answers))
+		return 0;
+
+	cell tmp;
+	make_int(&tmp, i);
+
+	if (q->retry) {
+		GET_RAW_ARG(3,p3_raw);
+		reset_value(q, p3_raw, p3_raw_ctx, &tmp, q->st.curr_frame);
+	} else
+		set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+
+	// While incomplete more answers may yet be added...
+
+	if ((t->status != TBL_COMPLETE) || ((i + 1) < t->nbr_answers))
+		make_choice(q);
+
+	cell *c = copy_term(q, 0, t->answers[i].cells, 0, 0);
+
+	if (!c)
+		return 0;
+
+	for (idx_t j = 0; j < c->nbr_cells; j++) {
+		if (is_bigstring(c+j))
+			retain_string(c+j);
+	}
+
+	return unify(q, p2, p2_ctx, c, q->st.curr_frame);
+}
+
+static int fn_abolish_all_tables_0(query *q)
+{
+	for (unsigned i = 0; i < g_tbl.nbr_ids; i++) {
+		table *t = g_tbl.ids[i];
+
+		if (t && ((t->status == TBL_COMPLETE) || (t->status == TBL_FRESH)))
+			tbl_free(t);
+	}
+
+	return 1;
+}
+
+// Global variables: nb_setval/2 and b_setval/2 store a copy of the
+// value in the module, nb_getval/2 and b_getval/2 copy it back. Only
+// the b_setval/2 assignments are undone on backtracking.
+
+static int gvar_compkey(const void *ptr1, const void *ptr2)
+{
+	return strcmp(ptr1, ptr2);
+}
+
+void free_gvar_value(cell *c)
+{
+	if (!c)
+		return;
+
+	tbl_release(c, c->nbr_cells);
+	free(c);
+}
+
+static int gvar_free(void *p, const void *k, const void *v)
+{
+	const gvar *g = v;
+	free_gvar_value(g->val);
+	free((void*)k);
+	free((void*)v);
+	return 1;
+}
+
+void destroy_gvars(module *m)
+{
+	if (!m->gvars)
+		return;
+
+	sl_iterate(m->gvars, gvar_free, NULL);
+	sl_destroy(m->gvars);
+	m->gvars = NULL;
+}
+
+static gvar *gvar_find(module *m, cell *c, int create)
+{
+	const char *key = GET_STR(c);
+	const void *v;
+
+	if (m->gvars && sl_get(m->gvars, key, &v))
+		return (gvar*)v;
+
+	if (!create)
+		return NULL;
+
+	if (!m->gvars)
+		m->gvars = sl_create(gvar_compkey);
+
+	gvar *g = calloc(1, sizeof(gvar));
+	sl_set(m->gvars, strdup(key), g);
+	return g;
+}
+
+static int gvar_set(query *q, int backtrack)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,any);
+	tbl_buf *b = &g_tbl.buf;
+	b->len = b->nbr_vars = 0;
+	b->error = 0;
+	tbl_flatten(q, b, p2, p2_ctx);
+
+	if (b->error) {
+		tbl_release(b->cells, b->len);
+		throw_error(q, p2, "resource_error", "too many vars");
+		return 0;
+	}
+
+	gvar *g = gvar_find(q->m, p1, 1);
+
+	// The old value is kept if there is a choice to go back to,
+	// else its cells are reused when the size is the same...
+
+	if (backtrack && q->cp) {
+		trail_gvar(q, g);
+		g->val = NULL;
+	}
+
+	if (g->val && (g->val->nbr_cells == b->len)) {
+		tbl_release(g->val, b->len);
+		copy_cells(g->val, b->cells, b->len);
+	} else {
+		free_gvar_value(g->val);
+		g->val = tbl_keep(b->len);
+	}
+
+	return 1;
+}
+
+static int gvar_get(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,any);
+	gvar *g = gvar_find(q->m, p1, 0);
+
+	// A key first set by b_setval/2 has no value once that is undone...
+
+	if (!g || !g->val) {
+		throw_error(q, p1, "existence_error", "variable");
+		return 0;
+	}
+
+	cell *c = g->val;
+
+	if (!is_structure(c) && !is_var(c) && !is_bigstring(c))
+		return unify(q, p2, p2_ctx, c, q->st.curr_frame);
+
+	if (!(c = copy_term(q, 0, c, 0, 0)))
+		return 0;
+
+	for (idx_t i = 0; i < c->nbr_cells; i++) {
+		if (is_bigstring(c+i))
+			retain_string(c+i);
+	}
+
+	return unify(q, p2, p2_ctx, c, q->st.curr_frame);
+}
+
+static int fn_nb_setval_2(query *q)
+{
+	return gvar_set(q, 0);
+}
+
+static int fn_b_setval_2(query *q)
+{
+	return gvar_set(q, 1);
+}
+
+static int fn_nb_getval_2(query *q)
+{
+	return gvar_get(q);
+}
+
+static int fn_b_getval_2(query *q)
+{
+	return gvar_get(q);
+}
+
+static int fn_atom_number_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_var);
+	GET_NEXT_ARG(p2,integer_or_var);
+
+	if (is_var(p1) && is_var(p2)) {
+		throw_error(q, p1, "instantiation_error", "not sufficiently instantiated");
+		return 0;
+	}
+
+	if (is_var(p1)) {
+		char tmpbuf[256];
+		sprintf(tmpbuf, "%lld", (long long)p2->val_int);
+		cell tmp = make_string(q, tmpbuf);
+		set_var(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	}
+
+	int_t p1_val = strtoll(GET_STR(p1), NULL, 10);
+
+	if (is_var(p2)) {
+		cell tmp;
+		make_int(&tmp, p1_val);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return 1;
+	}
+
+	return p1_val == p2->val_int;
+}
+
+static int fn_atom_hex_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_var);
+	GET_NEXT_ARG(p2,integer_or_var);
+
+	if (is_var(p1) && is_var(p2)) {
+		throw_error(q, p1, "instantiation_error", "atom");
 		return 0;
 	}
 
@@ -7614,21 +9307,60 @@ static int fn_replace_4(query *q)
 		}
 	}
 
-	*dst = '\0';
-	cell tmp = make_string(q, dstbuf);
-	free(dstbuf);
-	set_var(q, p4, p4_ctx, &tmp, q->st.curr_frame);
-	return 1;
+	*dst = '\0';
+	cell tmp = make_string(q, dstbuf);
+	free(dstbuf);
+	set_var(q, p4, p4_ctx, &tmp, q->st.curr_frame);
+	return 1;
+}
+
+static int do_indexed(query *q, rule *h, cell *p2, idx_t p2_ctx)
+{
+	cell *l = NULL;
+	cell tmp;
+
+	for (unsigned n = 0; n < h->arity; n++) {
+		int ok;
+
+		if (!n)
+			ok = h->jit || (h->index && !(h->flags&FLAG_RULE_VARKEY));
+		else
+			ok = h->arg_index && (n < MAX_ARG_INDEX) && h->arg_index[n] && !(h->arg_noindex & (1ULL << n));
+
+		if (!ok)
+			continue;
+
+		make_int(&tmp, n+1);
+
+		if (!l)
+			l = alloc_list(q, &tmp);
+		else
+			l = append_list(q, l, &tmp);
+	}
+
+	if (!l)
+		return 0;
+
+	l = end_list(q, l);
+	cell *c = GET_VALUE(q, p2+1, p2_ctx);
+	return unify(q, c, q->latest_ctx, l, q->st.curr_frame);
 }
 
 static int fn_predicate_property_2(query *q)
 {
 	GET_FIRST_ARG(p1,callable);
-	GET_NEXT_ARG(p2,atom_or_var)
+	GET_NEXT_ARG(p2,callable_or_var)
 	cell tmp;
 
 	rule *h = find_functor(q->m, GET_STR(p1), p1->arity);
 
+	if (is_structure(p2)) {
+		if (h && (p2->arity == 1) && !strcmp(GET_STR(p2), "indexed"))
+			return do_indexed(q, h, p2, p2_ctx);
+
+		return 0;
+	}
+
 	if (check_builtin(q->m, GET_STR(p1), p1->arity)) {
 		make_literal(&tmp, find_in_pool("built_in"));
 		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
@@ -7659,6 +9391,18 @@ static int fn_predicate_property_2(query *q)
 			return 1;
 	}
 
+	if (h && (h->flags&FLAG_RULE_TABLED)) {
+		make_literal(&tmp, find_in_pool("tabled"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
+	if (h && (h->flags&FLAG_RULE_INCREMENTAL)) {
+		make_literal(&tmp, find_in_pool("incremental"));
+		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
+			return 1;
+	}
+
 	if (h && (h->flags&FLAG_RULE_PUBLIC)) {
 		make_literal(&tmp, find_in_pool("public"));
 		if (unify(q, p2, p2_ctx, &tmp, q->st.curr_frame))
@@ -7830,20 +9574,21 @@ static int fn_findall_4(query *q)
 	}
 
 	cell *tmp = clone_term(q, 1, p2, p2_ctx, 3+p1->nbr_cells);
-	q->qnbr++;
+	push_queuen(q);
 	idx_t nbr_cells = 1 + p2->nbr_cells;
 	make_structure(tmp+nbr_cells++, g_sys_queue_s, fn_sys_queue_2, 2, 1+p1->nbr_cells);
 	make_int(tmp+nbr_cells++, q->qnbr);
 	copy_cells(tmp+nbr_cells, p1, p1->nbr_cells);
 	nbr_cells += p1->nbr_cells;
 	make_structure(tmp+nbr_cells, g_fail_s, fn_iso_fail_0, 0, 0);
-	q->tmpq[q->qnbr] = NULL;
-	init_queuen(q);
 	make_choice(q);
 	q->st.curr_cell = tmp;
 	return 1;
 }
 
+// Logs written before the binary format are text, one a_/z_/e_ call
+// per line...
+
 static void restore_db(module *m, FILE *fp)
 {
 	parser *p = create_parser(m);
@@ -7869,29 +9614,403 @@ static void restore_db(module *m, FILE *fp)
 	destroy_parser(p);
 }
 
+// Returns the length of the valid part of the log. Atoms defined in
+// a record that is then rejected are forgotten, so in->nbr_atoms is
+// the number defined by that part...
+
+static size_t replay_db(module *m, const char *src, size_t len, qlf_in *in)
+{
+	parser *p = create_parser(m);
+	const char *start = src, *end = src + len;
+	size_t good = LOG_HEADER_SIZE;
+	src += LOG_HEADER_SIZE;
+	m->loading = 1;
+
+	while (src < end) {
+		uint32_t hdr[2];
+
+		if (!qlf_read(&src, end, hdr, sizeof(hdr)) ||
+			((size_t)(end - src) < hdr[0]) ||
+			(log_crc(src, hdr[0]) != hdr[1]))
+			break;
+
+		const char *rec = src, *rec_end = src + hdr[0];
+		size_t nbr_atoms = in->nbr_atoms;
+		char op;
+		uuid u;
+		src = rec_end;
+
+		if (!qlf_read(&rec, rec_end, &op, 1) || !qlf_read(&rec, rec_end, &u, sizeof(u)))
+			break;
+
+		if (op == LOG_RESET) {
+			in->nbr_atoms = 0;
+			good = src - start;
+			continue;
+		}
+
+		m->compact.records++;
+
+		if (op == LOG_ERASE) {
+			erase_from_db(m, &u);
+			m->compact.erased++;
+			good = src - start;
+			continue;
+		}
+
+		int ok = (op == LOG_ASSERTA) || (op == LOG_ASSERTZ);
+
+		while (ok && (rec < rec_end) && (*rec == 'a')) {
+			rec++;
+			ok = qlf_read_atom(p, in, &rec, rec_end);
+		}
+
+		if (!ok || (rec == rec_end) || (*rec++ != 't') || !qlf_read_term(p, in, &rec, rec_end)) {
+			in->nbr_atoms = nbr_atoms;
+			m->compact.records--;
+			clear_term(p->t);
+			break;
+		}
+
+		parser_xref(p, p->t, NULL);
+		clause *r = op == LOG_ASSERTA ? asserta_to_db(m, p->t, 0) : assertz_to_db(m, p->t, 0);
+		clear_term(p->t);
+
+		// Kept in the log even if this program doesn't declare it...
+
+		if (r) {
+			r->u = u;
+			r->t.persist = 1;
+		}
+
+		good = src - start;
+	}
+
+	m->loading = 0;
+	destroy_parser(p);
+	return good;
+}
+
+static void db_filenames(module *m, char *filename, char *tmpname, size_t size)
+{
+	snprintf(filename, size, "%s.db", m->name);
+	snprintf(tmpname, size, "%s.TMP", m->name);
+}
+
+// Write the live persistent clauses to a fresh log, numbering atoms
+// from scratch...
+
+static int write_snapshot(module *m, const char *tmpname, qlf_out *o, unsigned *nbr)
+{
+	FILE *fp = fopen(tmpname, "wb");
+
+	if (!fp)
+		return 0;
+
+	int ok = log_header(fp);
+	*nbr = 0;
+
+	for (rule *h = m->head; h && ok; h = h->next) {
+		for (clause *r = h->head; r && ok; r = r->next) {
+			if (r->t.deleted || !r->t.persist)
+				continue;
+
+			ok = log_record(o, fp, r, LOG_ASSERTZ);
+			(*nbr)++;
+		}
+	}
+
+	if (fflush(fp) || fsync(fileno(fp)))
+		ok = 0;
+
+	if (fclose(fp))
+		ok = 0;
+
+	return ok;
+}
+
+// Snapshot in the foreground and swap it in. On success its atom
+// numbering replaces the module's for records appended later...
+
+static int db_snapshot(module *m, const char *filename, const char *tmpname)
+{
+	qlf_out o = {0};
+	unsigned nbr;
+
+	if (!write_snapshot(m, tmpname, &o, &nbr) || rename(tmpname, filename)) {
+		qlf_clear(&o);
+		remove(tmpname);
+		return 0;
+	}
+
+	qlf_clear(&m->log);
+	m->log = o;
+	m->compact.records = nbr;
+	m->compact.erased = 0;
+	return 1;
+}
+
+static void db_open(module *m, const char *filename)
+{
+	m->fp = fopen(filename, "ab");
+
+	if (!m->fp) {
+		fprintf(stderr, "Error: can't open '%s'\n", filename);
+		return;
+	}
+
+	fseek(m->fp, 0, SEEK_END);
+
+	if (!ftell(m->fp))
+		log_header(m->fp);
+
+	m->compact.size = m->compact.base = ftell(m->fp);
+	m->log_pending = 0;
+}
+
+// The log is compacted when it has grown by persist_compact_size
+// bytes since it was loaded or last compacted, or once past a minimum
+// size when persist_compact_ratio percent of its records are dead
+// (an erase and the assert it undoes). A child process writes the
+// snapshot of the database as it was at the fork while this one goes
+// on logging, also into a backlog. When the child reports success the
+// backlog is appended to the snapshot after a reset record and the
+// result renamed over the log. Until then the old log is complete, and
+// loading discards a leftover snapshot...
+
+#define LOG_COMPACT_MIN (64*1024)
+
+static int db_compact_due(module *m)
+{
+	if (m->flag.persist_compact_size &&
+		((m->compact.size - m->compact.base) >= (size_t)m->flag.persist_compact_size))
+		return 1;
+
+	if (m->flag.persist_compact_ratio && (m->compact.size >= LOG_COMPACT_MIN) &&
+		((uint64_t)m->compact.erased * 200 >= (uint64_t)m->compact.records * m->flag.persist_compact_ratio))
+		return 1;
+
+	return 0;
+}
+
+static void db_compact_reset(module *m)
+{
+	qlf_clear(&m->compact.dict);
+	m->compact.backlog.len = 0;
+	m->compact.backlog_records = m->compact.backlog_erased = 0;
+	m->compact.pid = 0;
+}
+
+static void db_compact_finish(module *m)
+{
+	char filename[1024], tmpname[1024];
+	db_filenames(m, filename, tmpname, sizeof(filename));
+	fflush(m->fp);
+	FILE *fp = fopen(tmpname, "ab");
+	int ok = fp != NULL;
+
+	if (ok) {
+		qlf_out o = {0};
+		ok = log_record(&o, fp, NULL, LOG_RESET);
+		qlf_clear(&o);
+
+		if (fwrite(m->compact.backlog.buf, 1, m->compact.backlog.len, fp) != m->compact.backlog.len)
+			ok = 0;
+
+		if (fflush(fp) || fsync(fileno(fp)))
+			ok = 0;
+
+		if (fclose(fp))
+			ok = 0;
+	}
+
+	if (!ok || rename(tmpname, filename)) {
+		fprintf(stderr, "Error: can't compact '%s'\n", filename);
+		remove(tmpname);
+		m->compact.base = m->compact.size;
+		db_compact_reset(m);
+		return;
+	}
+
+	unsigned live = m->compact.live;
+	fclose(m->fp);
+	db_open(m, filename);
+	qlf_clear(&m->log);
+	m->log = m->compact.dict;
+	memset(&m->compact.dict, 0, sizeof(qlf_out));
+	m->compact.records = live + m->compact.backlog_records;
+	m->compact.erased = m->compact.backlog_erased;
+	db_compact_reset(m);
+}
+
+#ifndef _WIN32
+static void db_compact_start(module *m)
+{
+	char filename[1024], tmpname[1024];
+	db_filenames(m, filename, tmpname, sizeof(filename));
+	int fds[2];
+
+	if (pipe(fds))
+		return;
+
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		m->compact.base = m->compact.size;
+		return;
+	}
+
+	// The child has a copy of the database and must not flush any
+	// of the parent's buffered streams, hence _exit()...
+
+	if (!pid) {
+		qlf_out o = {0};
+		unsigned nbr;
+		close(fds[0]);
+		char ok = write_snapshot(m, tmpname, &o, &nbr);
+
+		if (!ok || (write(fds[1], &ok, 1) != 1))
+			remove(tmpname);
+
+		_exit(0);
+	}
+
+	close(fds[1]);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	m->compact.fd = fds[0];
+	m->compact.pid = pid;
+	m->compact.live = m->compact.records > 2*m->compact.erased ? m->compact.records - 2*m->compact.erased : 0;
+}
+
+// The child writes a byte once its snapshot is safely on disk, so
+// end of file without one means it failed...
+
+static void db_compact_wait(module *m, int block)
+{
+	char ok = 0;
+
+	if (block)
+		fcntl(m->compact.fd, F_SETFL, 0);
+
+	ssize_t n = read(m->compact.fd, &ok, 1);
+
+	if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+		return;
+
+	close(m->compact.fd);
+	waitpid(m->compact.pid, NULL, 0);
+
+	if ((n == 1) && ok)
+		db_compact_finish(m);
+	else {
+		char filename[1024], tmpname[1024];
+		db_filenames(m, filename, tmpname, sizeof(filename));
+		remove(tmpname);
+		m->compact.base = m->compact.size;
+		db_compact_reset(m);
+	}
+}
+#endif
+
+static void db_compact_check(module *m)
+{
+#ifndef _WIN32
+	if (m->compact.pid)
+		db_compact_wait(m, 0);
+	else if (db_compact_due(m))
+		db_compact_start(m);
+#endif
+}
+
+// Closing waits for a snapshot in progress, so the next start has
+// only the live clauses to replay...
+
+static void db_compact_join(module *m)
+{
+#ifndef _WIN32
+	if (m->compact.pid)
+		db_compact_wait(m, 1);
+#endif
+}
+
+void db_close(module *m)
+{
+	db_compact_join(m);
+
+	if (m->fp) {
+		if (m->flag.persist_sync)
+			db_sync(m);
+
+		fclose(m->fp);
+		m->fp = NULL;
+	}
+
+	qlf_clear(&m->log);
+	qlf_clear(&m->compact.backlog);
+}
+
 void do_db_load(module *m)
 {
 	if (!m->use_persist)
 		return;
 
-	char filename[1024];
-	snprintf(filename, sizeof(filename), "%s.db", m->name);
-	char filename2[1024];
-	snprintf(filename2, sizeof(filename2), "%s.TMP", m->name);
+	char filename[1024], filename2[1024];
+	db_filenames(m, filename, filename2, sizeof(filename));
 	struct stat st;
 
+	// A snapshot left beside the log was never swapped in, so the
+	// log is still complete...
+
 	if (!stat(filename2, &st) && !stat(filename, &st))
 		remove(filename2);
 	else if (!stat(filename2, &st))
 		rename(filename2, filename);
 
-	if (!stat(filename, &st)) {
-		FILE *fp = fopen(filename, "rb");
-		restore_db(m, fp);
-		fclose(fp);
+	db_close(m);
+	m->compact.records = m->compact.erased = 0;
+	FILE *fp;
+
+	if (!stat(filename, &st) && st.st_size && ((fp = fopen(filename, "rb")) != NULL)) {
+		char *src = malloc(st.st_size);
+		if (!src) abort();
+		size_t len = fread(src, 1, st.st_size, fp);
+
+		if (log_valid(src, len)) {
+			qlf_in in = {0};
+			size_t good = replay_db(m, src, len, &in);
+			qlf_seed(&m->log, &in);
+			free(in.atoms);
+			fclose(fp);
+
+			if (good < len) {
+				fprintf(stderr, "Error: dropped %u bytes at the end of '%s'\n", (unsigned)(len - good), filename);
+
+				if (truncate(filename, good))
+					fprintf(stderr, "Error: can't truncate '%s'\n", filename);
+			}
+		} else if ((len < LOG_HEADER_SIZE) && !memcmp(src, LOG_MAGIC, len < 4 ? len : 4)) {
+			fclose(fp);
+
+			if (truncate(filename, 0))
+				fprintf(stderr, "Error: can't truncate '%s'\n", filename);
+		} else {
+			rewind(fp);
+			restore_db(m, fp);
+			fclose(fp);
+
+			if (!db_snapshot(m, filename, filename2))
+				fprintf(stderr, "Error: can't convert '%s'\n", filename);
+		}
+
+		free(src);
 	}
 
-	m->fp = fopen(filename, "ab");
+	db_open(m, filename);
+
+	if (m->fp)
+		db_compact_check(m);
 }
 
 static int fn_db_load_0(query *q)
@@ -7902,19 +10021,23 @@ static int fn_db_load_0(query *q)
 
 static int fn_db_save_0(query *q)
 {
-	fsync(fileno(q->m->fp));
-	fclose(q->m->fp);
-	char filename[1024];
-	snprintf(filename, sizeof(filename), "%s.db", q->m->name);
-	char filename2[1024];
-	snprintf(filename2, sizeof(filename2), "%s.TMP", q->m->name);
-	FILE *fp = fopen(filename2, "wb");
-	save_db(stdout, q, q->m->dq);
-	fclose(fp);
-	remove(filename);
-	rename(filename2, filename);
-	q->m->fp = fopen(filename, "ab");
-	return 0;
+	module *m = q->m;
+
+	if (!m->fp)
+		return 0;
+
+	char filename[1024], filename2[1024];
+	db_filenames(m, filename, filename2, sizeof(filename));
+	db_compact_join(m);
+	fclose(m->fp);
+	m->fp = NULL;
+	int ok = db_snapshot(m, filename, filename2);
+
+	if (!ok)
+		fprintf(stderr, "Error: can't write '%s'\n", filename2);
+
+	db_open(m, filename);
+	return ok;
 }
 
 static int fn_module_1(query *q)
@@ -8150,6 +10273,7 @@ static const struct builtins g_other_funcs[] =
 	{"now", 0, fn_now_0, NULL},
 	{"now", 1, fn_now_1, "now(-integer)"},
 	{"get_time", 1, fn_get_time_1, "-var"},
+	{"statistics", 2, fn_statistics_2, "+atom,-integer"},
 	{"random", 1, fn_random_1, "?integer"},
 	{"rand", 1, fn_rand_1, "?integer"},
 	{"rand", 0, fn_rand_0, NULL},
@@ -8167,10 +10291,23 @@ static const struct builtins g_other_funcs[] =
 	{"split", 3, fn_split_3, "+atom,+atom,?list"},
 	{"split", 4, fn_split_4, "+atom,+atom,?left,?right"},
 	{"msort", 2, fn_msort_2, "+list,-list"},
+	{"sort", 4, fn_sort_4, "+integer,+atom,+list,-list"},
 	{"is_list", 1, fn_is_list_1, "+term"},
 	{"list", 1, fn_is_list_1, "+term"},
 	{"forall", 2, fn_forall_2, "+term,+term"},
 	{"term_hash", 2, fn_term_hash_2, "+term,?integer"},
+	{"term_hash", 4, fn_term_hash_4, "+term,+integer,+integer,?integer"},
+	{"variant_hash", 2, fn_variant_hash_2, "+term,?integer"},
+	{"abolish_all_tables", 0, fn_abolish_all_tables_0, NULL},
+	{"nb_setval", 2, fn_nb_setval_2, "+atom,+term"},
+	{"b_setval", 2, fn_b_setval_2, "+atom,+term"},
+	{"nb_getval", 2, fn_nb_getval_2, "+atom,-term"},
+	{"b_getval", 2, fn_b_getval_2, "+atom,-term"},
+	{"$tbl_variant", 3, fn_sys_tbl_variant_3, "+callable,-integer,-atom"},
+	{"$tbl_start", 1, fn_sys_tbl_start_1, "+integer"},
+	{"$tbl_add", 2, fn_sys_tbl_add_2, "+integer,+term"},
+	{"$tbl_done", 1, fn_sys_tbl_done_1, "+integer"},
+	{"$tbl_answer", 3, fn_sys_tbl_answer_3, "+integer,?term,?integer"},
 	{"rename_file", 2, fn_rename_file_2, "+atom,+atom"},
 	{"delete_file", 1, fn_delete_file_1, "+atom"},
 	{"exists_file", 1, fn_exists_file_1, "+atom"},
@@ -8239,40 +10376,123 @@ static const struct builtins g_other_funcs[] =
 	{0}
 };
 
-int check_builtin(module *m, const char *name, unsigned arity)
+// Builtins are looked up through a (name offset, arity) hash built
+// once when the atom pool is created. Where a name/arity appears in
+// both tables the ISO entry is the one kept.
+
+typedef struct {
+	const struct builtins *ptr;
+	idx_t offset;
+	int iso;
+} builtin_slot;
+
+static builtin_slot *g_bi_hash = NULL;
+static idx_t g_bi_hash_size = 0;
+
+static const builtin_slot *find_builtin_offset(module *m, idx_t offset, unsigned arity)
 {
-	for (const struct builtins *ptr = g_iso_funcs; ptr->name; ptr++) {
-		if ((ptr->arity == arity) && !strcmp(ptr->name, name))
-			return 1;
-	}
+	if (!g_bi_hash)
+		return NULL;
 
-	if (m->iso_only)
-		return 0;
+	idx_t mask = g_bi_hash_size - 1;
+	idx_t i = functor_hash(offset, arity) & mask;
+	const builtin_slot *e;
 
-	for (const struct builtins *ptr = g_other_funcs; ptr->name; ptr++) {
-		if ((ptr->arity == arity) && !strcmp(ptr->name, name))
-			return 1;
+	while ((e = g_bi_hash+i)->ptr) {
+		if ((e->offset == offset) && (e->ptr->arity == arity))
+			return (m->iso_only && !e->iso) ? NULL : e;
+
+		i = (i + 1) & mask;
 	}
 
-	return 0;
+	return NULL;
 }
 
-void *get_builtin(module *m, const char *name, unsigned arity)
+static const builtin_slot *find_builtin(module *m, const char *name, unsigned arity)
 {
-	for (const struct builtins *ptr = g_iso_funcs; ptr->name; ptr++) {
-		if ((ptr->arity == arity) && !strcmp(ptr->name, name))
-			return ptr->fn;
-	}
+	idx_t offset;
 
-	if (m->iso_only)
+	if (!g_bi_hash || !is_in_pool(name, &offset))
 		return NULL;
 
-	for (const struct builtins *ptr = g_other_funcs; ptr->name; ptr++) {
-		if ((ptr->arity == arity) && !strcmp(ptr->name, name))
-			return ptr->fn;
+	return find_builtin_offset(m, offset, arity);
+}
+
+static void add_builtins(const struct builtins *ptr, int iso)
+{
+	idx_t mask = g_bi_hash_size - 1;
+
+	for (; ptr->name; ptr++) {
+		idx_t offset = find_in_pool(ptr->name);
+		idx_t i = functor_hash(offset, ptr->arity) & mask;
+		builtin_slot *e;
+
+		while ((e = g_bi_hash+i)->ptr) {
+			if ((e->offset == offset) && (e->ptr->arity == ptr->arity))
+				break;
+
+			i = (i + 1) & mask;
+		}
+
+		if (e->ptr)
+			continue;
+
+		e->ptr = ptr;
+		e->offset = offset;
+		e->iso = iso;
 	}
+}
 
-	return NULL;
+void load_builtins(void)
+{
+	if (g_bi_hash)
+		return;
+
+	idx_t cnt = 0;
+
+	for (const struct builtins *ptr = g_iso_funcs; ptr->name; ptr++)
+		cnt++;
+
+	for (const struct builtins *ptr = g_other_funcs; ptr->name; ptr++)
+		cnt++;
+
+	g_bi_hash_size = 1;
+
+	while (g_bi_hash_size < (cnt * 2))
+		g_bi_hash_size *= 2;
+
+	g_bi_hash = calloc(g_bi_hash_size, sizeof(builtin_slot));
+	if (!g_bi_hash) abort();
+	add_builtins(g_iso_funcs, 1);
+	add_builtins(g_other_funcs, 0);
+}
+
+void destroy_builtins(void)
+{
+	free(g_bi_hash);
+	g_bi_hash = NULL;
+	g_bi_hash_size = 0;
+}
+
+int check_builtin(module *m, const char *name, unsigned arity)
+{
+	return find_builtin(m, name, arity) != NULL;
+}
+
+void *get_builtin(module *m, const char *name, unsigned arity)
+{
+	const builtin_slot *e = find_builtin(m, name, arity);
+	return e ? e->ptr->fn : NULL;
+}
+
+// For a literal cell, returns if it names a builtin and sets its
+// function (which can be NULL)...
+
+int xref_builtin(module *m, cell *c)
+{
+	const builtin_slot *e = find_builtin_offset(m, c->val_offset, c->arity);
+	c->fn = e ? e->ptr->fn : NULL;
+	return e != NULL;
 }
 
 void load_keywords(module *m)
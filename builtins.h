@@ -15,6 +15,7 @@ extern int do_yield_0(query *q);
 
 #define is_atomic(c) (is_atom(c) || is_number(c))
 #define is_callable(c) (is_literal(c) || is_string(c))
+#define is_callable_or_var(c) (is_callable(c) || is_var(c))
 #define is_list_or_nil(c) (is_list(c) || is_nil(c))
 #define is_list_or_nil_or_var(c) (is_list_or_nil(c) || is_var(c))
 #define is_list_or_var(c) (is_list(c) || is_var(c))
@@ -0,0 +1,554 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "internal.h"
+
+// Heap garbage collection.
+//
+// Only the part of the heap allocated since the most recent choice
+// point is collected: everything older may be restored to by
+// backtracking and must stay where it is. In a deterministic loop
+// there are no choice points so the whole heap is eligible.
+//
+// Marking starts from the frames older than that choice point, the
+// active frame chain, the current goal and any pending exception.
+// Newer frames are only kept if a live variable refers to them, and
+// the same goes for global frames made since the choice point. Live
+// cells are marked in per-arena bitmaps, data terms as their whole
+// extent and goal sequences up to and through their END cell (whose
+// return address is followed in turn).
+//
+// Live runs of cells are then slid down, in order, towards the start
+// of the collectable region so terms stay contiguous, and every
+// pointer into the region is relocated. Arenas left empty are freed.
+// The global frames kept are likewise slid down over those that were
+// not, and slots referring to them renumbered.
+
+typedef struct {
+	arena *a;
+	uint64_t *bits;
+	idx_t from, first_move, nbr_moves;
+} gc_arena;
+
+typedef struct {
+	cell *src, *dst;
+	idx_t nbr_cells;
+} gc_move;
+
+typedef struct {
+	query *q;
+	gc_arena *arenas;
+	uint8_t *frames;
+	idx_t *gframes;
+	idx_t *fstack;
+	cell **cstack;
+	const char **strs;
+	gc_move *moves;
+	idx_t nbr_arenas, bfp, bgfp, bgsp, gfp, fsp, fsize, csp, csize;
+	idx_t nbr_strs, strs_size, nbr_moves, moves_size;
+} gc_state;
+
+#define GC_BIT(ga,i) ((ga)->bits[(i)/64] & (1ULL << ((i)%64)))
+
+static gc_arena *gc_find(const gc_state *gs, const cell *c)
+{
+	for (idx_t i = 0; i < gs->nbr_arenas; i++) {
+		gc_arena *ga = gs->arenas + i;
+
+		if ((c >= (ga->a->heap + ga->from)) && (c < (ga->a->heap + ga->a->hp)))
+			return ga;
+	}
+
+	return NULL;
+}
+
+static void gc_string(gc_state *gs, const cell *c)
+{
+	if (!is_bigstring(c))
+		return;
+
+	if (gs->nbr_strs == gs->strs_size) {
+		gs->strs_size = gs->strs_size ? gs->strs_size * 2 : 256;
+		gs->strs = realloc(gs->strs, sizeof(char*)*gs->strs_size);
+		if (!gs->strs) abort();
+	}
+
+	gs->strs[gs->nbr_strs++] = c->val_str;
+}
+
+static void gc_frame(gc_state *gs, idx_t f)
+{
+	if (is_global_ctx(f)) {
+		idx_t i = f & ~CTX_GLOBAL;
+
+		if ((i < gs->bgfp) || (i >= gs->q->st.gfp) || gs->gframes[i-gs->bgfp])
+			return;
+
+		gs->gframes[i-gs->bgfp] = 1;
+	} else {
+		if ((f < gs->bfp) || (f >= gs->q->st.fp) || gs->frames[f-gs->bfp])
+			return;
+
+		gs->frames[f-gs->bfp] = 1;
+	}
+
+	if (gs->fsp == gs->fsize) {
+		gs->fsize = gs->fsize ? gs->fsize * 2 : 256;
+		gs->fstack = realloc(gs->fstack, sizeof(idx_t)*gs->fsize);
+		if (!gs->fstack) abort();
+	}
+
+	gs->fstack[gs->fsp++] = f;
+}
+
+static void gc_control(gc_state *gs, cell *c)
+{
+	if (!c)
+		return;
+
+	if (gs->csp == gs->csize) {
+		gs->csize = gs->csize ? gs->csize * 2 : 256;
+		gs->cstack = realloc(gs->cstack, sizeof(cell*)*gs->csize);
+		if (!gs->cstack) abort();
+	}
+
+	gs->cstack[gs->csp++] = c;
+}
+
+static int gc_mark(gc_arena *ga, cell *c, idx_t nbr_cells)
+{
+	idx_t i = c - ga->a->heap, last = i + nbr_cells - 1;
+
+	if (last >= ga->a->hp)
+		last = ga->a->hp - 1;
+
+	if (GC_BIT(ga, i) && GC_BIT(ga, last))
+		return 0;
+
+	for (; i <= last; i++)
+		ga->bits[i/64] |= 1ULL << (i%64);
+
+	return 1;
+}
+
+static void gc_data(gc_state *gs, cell *c, idx_t c_ctx)
+{
+	gc_arena *ga = gc_find(gs, c);
+	idx_t nbr_cells = c->nbr_cells ? c->nbr_cells : 1;
+
+	if (ga && !gc_mark(ga, c, nbr_cells))
+		return;
+
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		if (is_var(c))
+			gc_frame(gs, c_ctx);
+		else if (ga)
+			gc_string(gs, c);
+	}
+}
+
+static void gc_goals(gc_state *gs, cell *c)
+{
+	gc_arena *ga;
+
+	while ((ga = gc_find(gs, c)) != NULL) {
+		idx_t nbr_cells = c->nbr_cells ? c->nbr_cells : 1;
+
+		if (is_end(c)) {
+			if (!GC_BIT(ga, c - ga->a->heap)) {
+				gc_mark(ga, c, 1);
+				gc_control(gs, c->val_cell);
+			}
+
+			return;
+		}
+
+		if (gc_mark(ga, c, nbr_cells)) {
+			for (idx_t i = 0; i < nbr_cells; i++)
+				gc_string(gs, c+i);
+		}
+
+		c += nbr_cells;
+	}
+}
+
+static void gc_slots(gc_state *gs, idx_t f)
+{
+	query *q = gs->q;
+	frame *g = GET_FRAME(f);
+
+	for (unsigned i = 0; i < g->nbr_vars; i++) {
+		slot *e = GET_SLOT(g, i);
+		cell *c = &e->c;
+
+		if (is_var(c))
+			gc_frame(gs, e->ctx);
+		else if (is_indirect(c))
+			gc_data(gs, c->val_cell, e->ctx);
+		else
+			gc_string(gs, c);
+	}
+}
+
+static void gc_mark_all(gc_state *gs)
+{
+	query *q = gs->q;
+
+	for (idx_t f = 0; f < gs->bfp; f++)
+		gc_slots(gs, f);
+
+	for (idx_t i = 0; i < gs->bgfp; i++)
+		gc_slots(gs, i | CTX_GLOBAL);
+
+	for (idx_t f = q->st.curr_frame;;) {
+		frame *g = GET_FRAME(f);
+		gc_frame(gs, f);
+		gc_control(gs, g->curr_cell);
+
+		if (!f || (g->prev_frame == f))
+			break;
+
+		f = g->prev_frame;
+	}
+
+	gc_control(gs, q->st.curr_cell);
+
+	if (q->exception)
+		gc_data(gs, q->exception, q->st.curr_frame);
+
+	while (gs->fsp || gs->csp) {
+		if (gs->fsp)
+			gc_slots(gs, gs->fstack[--gs->fsp]);
+		else
+			gc_goals(gs, gs->cstack[--gs->csp]);
+	}
+}
+
+static int gc_strcmp(const void *ptr1, const void *ptr2)
+{
+	const char *s1 = *(const char**)ptr1, *s2 = *(const char**)ptr2;
+	return s1 < s2 ? -1 : s1 > s2 ? 1 : 0;
+}
+
+static int gc_is_live_string(const gc_state *gs, const char *s)
+{
+	return bsearch(&s, gs->strs, gs->nbr_strs, sizeof(char*), gc_strcmp) != NULL;
+}
+
+static void gc_add_move(gc_state *gs, cell *src, cell *dst, idx_t nbr_cells)
+{
+	if (gs->nbr_moves == gs->moves_size) {
+		gs->moves_size = gs->moves_size ? gs->moves_size * 2 : 256;
+		gs->moves = realloc(gs->moves, sizeof(gc_move)*gs->moves_size);
+		if (!gs->moves) abort();
+	}
+
+	gc_move *m = gs->moves + gs->nbr_moves++;
+	m->src = src;
+	m->dst = dst;
+	m->nbr_cells = nbr_cells;
+}
+
+static cell *gc_reloc(const gc_state *gs, cell *c)
+{
+	if (!c)
+		return c;
+
+	for (idx_t i = 0; i < gs->nbr_arenas; i++) {
+		const gc_arena *ga = gs->arenas + i;
+
+		if ((c < ga->a->heap) || (c >= (ga->a->heap + ga->a->h_size)))
+			continue;
+
+		idx_t lo = ga->first_move, hi = ga->first_move + ga->nbr_moves;
+
+		while (lo < hi) {
+			idx_t mid = (lo + hi) / 2;
+			const gc_move *m = gs->moves + mid;
+
+			if (c < m->src)
+				hi = mid;
+			else if (c >= (m->src + m->nbr_cells))
+				lo = mid + 1;
+			else
+				return m->dst + (c - m->src);
+		}
+
+		break;
+	}
+
+	return c;
+}
+
+// An arena is done with once the destination moves past it. Cells
+// above its new fill are moved or dead copies, so empty them...
+
+static void gc_fill_arena(arena *a, idx_t hp)
+{
+	for (idx_t j = hp; j < a->hp; j++)
+		a->heap[j].val_type = TYPE_EMPTY;
+
+	a->hp = hp;
+}
+
+// Slide the global frames kept down over the others, noting where
+// each one went (plus one, so a dead frame is still zero)...
+
+static void gc_gframes(gc_state *gs)
+{
+	query *q = gs->q;
+	idx_t n = gs->bgfp, sp = gs->bgsp;
+	gs->gfp = q->st.gfp;
+
+	for (idx_t i = gs->bgfp; i < q->st.gfp; i++) {
+		if (!gs->gframes[i-gs->bgfp])
+			continue;
+
+		frame *g = q->gframes + i;
+
+		if (g->env != sp)
+			memmove(q->gslots+sp, q->gslots+g->env, sizeof(slot)*g->nbr_vars);
+
+		g->env = sp;
+		sp += g->nbr_vars;
+		q->gframes[n] = *g;
+		gs->gframes[i-gs->bgfp] = ++n;
+	}
+
+	q->st.gfp = n;
+	q->st.gsp = sp;
+}
+
+static idx_t gc_ctx(const gc_state *gs, idx_t ctx)
+{
+	if (!is_global_ctx(ctx))
+		return ctx;
+
+	idx_t i = ctx & ~CTX_GLOBAL;
+
+	if ((i < gs->bgfp) || (i >= gs->gfp))
+		return ctx;
+
+	// A dead frame keeps its number, which no choice will unwind...
+
+	if (!gs->gframes[i-gs->bgfp])
+		return ctx;
+
+	return (gs->gframes[i-gs->bgfp]-1) | CTX_GLOBAL;
+}
+
+// Only a variable or structure's context means anything, the others
+// may be left over from before...
+
+static void gc_reloc_slot(const gc_state *gs, slot *e)
+{
+	if (is_indirect(&e->c))
+		e->c.val_cell = gc_reloc(gs, e->c.val_cell);
+	else if (!is_var(&e->c))
+		return;
+
+	e->ctx = gc_ctx(gs, e->ctx);
+}
+
+// Free unreachable strings, then slide live runs down.
+
+static void gc_compact(gc_state *gs)
+{
+	qsort(gs->strs, gs->nbr_strs, sizeof(char*), gc_strcmp);
+	idx_t d = 0, doff = gs->arenas[0].from;
+
+	for (idx_t i = 0; i < gs->nbr_arenas; i++) {
+		gc_arena *ga = gs->arenas + i;
+		arena *a = ga->a;
+
+		for (idx_t j = ga->from; j < a->hp; j++) {
+			cell *c = a->heap + j;
+
+			if (GC_BIT(ga, j))
+				continue;
+
+			// A slot may hold a copy of a string whose heap cell is
+			// otherwise dead, so that cell keeps the reference...
+
+			if (is_bigstring(c) && !is_const(c)) {
+				if (gc_is_live_string(gs, c->val_str)) {
+					gc_mark(ga, c, 1);
+					continue;
+				}
+
+				release_string(c);
+			}
+
+			c->val_type = TYPE_EMPTY;
+		}
+	}
+
+	for (idx_t i = 0; i < gs->nbr_arenas; i++) {
+		gc_arena *ga = gs->arenas + i;
+		arena *a = ga->a;
+		ga->first_move = gs->nbr_moves;
+
+		for (idx_t j = ga->from; j < a->hp;) {
+			if (!GC_BIT(ga, j)) {
+				j++;
+				continue;
+			}
+
+			idx_t start = j;
+
+			while ((j < a->hp) && GC_BIT(ga, j))
+				j++;
+
+			idx_t nbr_cells = j - start;
+
+			while ((doff + nbr_cells) > gs->arenas[d].a->h_size) {
+				gc_fill_arena(gs->arenas[d].a, doff);
+				d++;
+				doff = 0;
+			}
+
+			cell *dst = gs->arenas[d].a->heap + doff;
+
+			if (dst != (a->heap + start))
+				memmove(dst, a->heap+start, sizeof(cell)*nbr_cells);
+
+			gc_add_move(gs, a->heap+start, dst, nbr_cells);
+			doff += nbr_cells;
+		}
+
+		ga->nbr_moves = gs->nbr_moves - ga->first_move;
+	}
+
+	query *q = gs->q;
+	gc_gframes(gs);
+
+	for (idx_t f = 0; f < q->st.fp; f++) {
+		frame *g = GET_FRAME(f);
+
+		// Unreachable frames can't be resumed or dereferenced through
+		// but they may become older than a later choice point, so
+		// don't leave them pointing at reclaimed cells.
+
+		if ((f >= gs->bfp) && !gs->frames[f-gs->bfp]) {
+			for (unsigned i = 0; i < g->nbr_vars; i++) {
+				slot *e = GET_SLOT(g, i);
+				e->c.val_type = TYPE_EMPTY;
+			}
+
+			continue;
+		}
+
+		g->curr_cell = gc_reloc(gs, g->curr_cell);
+
+		for (unsigned i = 0; i < g->nbr_vars; i++)
+			gc_reloc_slot(gs, GET_SLOT(g, i));
+	}
+
+	for (idx_t i = 0; i < q->st.gsp; i++)
+		gc_reloc_slot(gs, q->gslots+i);
+
+	for (idx_t i = 0; i < q->st.tp; i++)
+		q->trails[i].ctx = gc_ctx(gs, q->trails[i].ctx);
+
+	q->latest_ctx = gc_ctx(gs, q->latest_ctx);
+
+	q->st.curr_cell = gc_reloc(gs, q->st.curr_cell);
+	q->exception = gc_reloc(gs, q->exception);
+
+	for (idx_t i = 0; i < gs->nbr_moves; i++) {
+		gc_move *m = gs->moves + i;
+		cell *c = m->dst;
+
+		for (idx_t j = 0; j < m->nbr_cells; j++, c++) {
+			if (is_end(c) || is_indirect(c))
+				c->val_cell = gc_reloc(gs, c->val_cell);
+		}
+	}
+
+	// Arenas past the last one written to are now empty...
+
+	for (idx_t i = gs->nbr_arenas-1; i > d; i--) {
+		arena *a = gs->arenas[i].a;
+		q->arenas = a->next;
+		free(a->heap);
+		free(a);
+	}
+
+	gc_fill_arena(gs->arenas[d].a, doff);
+
+	for (idx_t i = 1; i <= d; i++) {
+		arena *a = gs->arenas[i].a;
+		a->base = gs->arenas[i-1].a->base + gs->arenas[i-1].a->hp;
+	}
+
+	arena *a = gs->arenas[d].a;
+	q->arenas = a;
+	q->st.hp = a->hp;
+	q->st.anbr = a->nbr;
+}
+
+void gc_heap(query *q)
+{
+	q->gc = 0;
+	q->str_bytes = 0;
+
+	if (!q->arenas || q->m->tasks || q->is_subquery)
+		return;
+
+	uint64_t started = gettimeofday_usec();
+	gc_state gs = {0};
+	gs.q = q;
+	idx_t banbr = 0, bhp = 0;
+
+	if (q->cp) {
+		const choice *ch = q->choices + q->cp - 1;
+		gs.bfp = ch->st.fp;
+		gs.bgfp = ch->st.gfp;
+		gs.bgsp = ch->st.gsp;
+		banbr = ch->st.anbr;
+		bhp = ch->st.hp;
+	}
+
+	q->arenas->hp = q->st.hp;
+	idx_t before = q->arenas->base + q->st.hp;
+
+	for (arena *a = q->arenas; a && (!q->cp || (a->nbr >= banbr)); a = a->next)
+		gs.nbr_arenas++;
+
+	gs.arenas = calloc(gs.nbr_arenas, sizeof(gc_arena));
+	idx_t i = gs.nbr_arenas;
+
+	for (arena *a = q->arenas; i; a = a->next) {
+		gc_arena *ga = gs.arenas + --i;
+		ga->a = a;
+		ga->from = q->cp && (a->nbr == banbr) ? bhp : 0;
+		ga->bits = calloc((a->h_size/64)+1, sizeof(uint64_t));
+	}
+
+	if (q->st.fp > gs.bfp)
+		gs.frames = calloc(q->st.fp-gs.bfp, 1);
+
+	if (q->st.gfp > gs.bgfp)
+		gs.gframes = calloc(q->st.gfp-gs.bgfp, sizeof(idx_t));
+
+	gc_mark_all(&gs);
+	gc_compact(&gs);
+
+	for (idx_t i = 0; i < gs.nbr_arenas; i++)
+		free(gs.arenas[i].bits);
+
+	free(gs.arenas);
+	free(gs.frames);
+	free(gs.gframes);
+	free(gs.fstack);
+	free(gs.cstack);
+	free(gs.strs);
+	free(gs.moves);
+
+	idx_t after = q->arenas->base + q->st.hp;
+	q->gc_next = after * 2 > q->gc_next ? after * 2 : q->gc_next;
+	q->gc_freed += before - after;
+	q->tot_gcs++;
+	q->gc_time += gettimeofday_usec() - started;
+}
@@ -28,15 +28,23 @@ typedef uint32_t idx_t;
 #define MAX_ARITY UCHAR_MAX
 #define MAX_SMALL_STRING (sizeof(int_t)*2)
 #define MAX_USER_OPS 100
-#define MAX_QUEUES 16
 #define MAX_STREAMS 64
+#define MAX_ARG_INDEX 64
+#define MIN_ARG_INDEX 8
+#define PURGE_MIN 1024
 #define STREAM_BUFLEN 1024
 
-#define GET_STR(c) ((c)->val_type != TYPE_STRING ? g_pool+((c)->val_offset) : (c)->flags&FLAG_SMALL_STRING ? (c)->val_chars : (c)->val_str)
-#define LEN_STR(c) ((c->flags&FLAG_BINARY) ? c->nbytes : strlen(GET_STR(c)))
+#define GET_STR(c) ((c)->val_type != TYPE_STRING ? GET_POOL()+((c)->val_offset) : (c)->flags&FLAG_SMALL_STRING ? (c)->val_chars : (c)->val_str)
+#define LEN_STR(c) atom_nbytes(c)
 
-#define GET_FRAME(i) q->frames+(i)
-#define GET_SLOT(g,i) (i) < g->nbr_slots ? q->slots+g->env+(i) : q->slots+g->overflow+((i)-g->nbr_slots)
+// A context with CTX_GLOBAL set is a global frame (see runtime.c),
+// one that is kept until backtracking rather than popped on exit.
+
+#define CTX_GLOBAL ((idx_t)1 << 31)
+#define is_global_ctx(ctx) ((ctx) & CTX_GLOBAL)
+
+#define GET_FRAME(i) (is_global_ctx(i) ? q->gframes+((i)&~CTX_GLOBAL) : q->frames+(i))
+#define GET_SLOT(g,i) (g)->global ? q->gslots+(g)->env+(i) : (i) < g->nbr_slots ? q->slots+g->env+(i) : q->slots+g->overflow+((i)-g->nbr_slots)
 
 #define GET_VALUE(q,c,c_ctx) !is_var(c) ? (q->latest_ctx = c_ctx, c) : deref_var(q, c, c_ctx)
 
@@ -118,7 +126,7 @@ struct cell_ {
 			union {
 				rule *match;				// rules
 				int (*fn)(query*);			// builtins
-				size_t nbytes;              // slice size
+				struct { uint32_t val_nchars, val_off; };	// slice length in chars (0 until counted) and offset
 				uint16_t precedence;		// ops parsing
 				uint8_t slot_nbr;			// vars
 				int_t val_den;				// rational denominator
@@ -138,6 +146,18 @@ struct cell_ {
 	};
 };
 
+// Big strings are immutable reference counted buffers, the cell points
+// at the text. A slice (FLAG_SLICE) is the tail of another string's
+// buffer, val_off bytes in, so it is still nul-terminated. Like pool
+// atoms the buffer keeps its lengths and hash ahead of the text, the
+// hash and character count once 'hashed' is set.
+
+typedef struct {
+	uint32_t refcnt, nbytes, nchars, hash;
+	uint8_t hashed;
+	char cstr[];
+} strbuf;
+
 typedef struct {
 	idx_t nbr_cells, cidx;
 	uint8_t nbr_vars, first_cut, cut_only, deleted, persist;
@@ -160,14 +180,32 @@ enum {
 	FLAG_RULE_PUBLIC=1<<1,
 	FLAG_RULE_DYNAMIC=1<<2,
 	FLAG_RULE_PERSIST=1<<3,
-	FLAG_RULE_VOLATILE=1<<4
+	FLAG_RULE_VOLATILE=1<<4,
+	FLAG_RULE_VARKEY=1<<5,
+	FLAG_RULE_TABLED=1<<6,
+	FLAG_RULE_INCREMENTAL=1<<7
+};
+
+typedef struct cindex_ cindex;
+
+// First-argument index on static predicates. Bucket 'i' is the clause
+// list clauses[start[i]..start[i+1]) in clause order, holding clauses
+// whose key hashes to 'i' plus those with a variable first argument.
+
+struct cindex_ {
+	cindex *next;
+	clause **clauses;
+	idx_t *start;
+	idx_t nbr_buckets;
 };
 
 struct rule_ {
-	rule *next;
+	rule *next, *impl, *owner;
 	clause *head, *tail;
-	skiplist *index;
-	idx_t val_offset;
+	skiplist *index, **arg_index;
+	cindex *jit;
+	uint64_t arg_noindex;
+	idx_t val_offset, nbr_deleted;
 	uint8_t arity, flags;
 };
 
@@ -186,9 +224,22 @@ struct op_table {
 
 typedef struct {
 	idx_t ctx;
-	uint8_t slot_nbr;
+	uint8_t slot_nbr, gvar;
 } trail;
 
+// A global variable (see b_setval/2) holds a copy of its value off
+// the heap. A backtrackable assignment saves the old one on the query's
+// undo stack, with a trail entry to restore it on backtracking.
+
+typedef struct {
+	cell *val;
+} gvar;
+
+typedef struct {
+	gvar *v;
+	cell *val;
+} gvar_undo;
+
 typedef struct {
 	cell c;
 	idx_t ctx;
@@ -198,7 +249,7 @@ typedef struct {
 	cell *curr_cell;
 	module *m;
 	idx_t prev_frame, env, overflow;
-	uint8_t any_choices, nbr_vars, nbr_slots;
+	uint8_t any_choices, any_refs, nbr_vars, nbr_slots, global;
 } frame;
 
 typedef struct {
@@ -214,54 +265,95 @@ typedef struct {
 
 typedef struct {
 	cell *curr_cell;
-	clause *curr_clause;
+	clause *curr_clause, **bucket, **bucket_end;
 	sliter *iter;
-	idx_t curr_frame, fp, hp, tp, sp, anbr;
+	idx_t curr_frame, fp, hp, tp, sp, anbr, gfp, gsp;
 } qstate;
 
 typedef struct {
 	qstate st;
 	uint32_t pins;
-	idx_t v1, v2;
-	uint8_t nbr_vars, inner_cut, any_choices, catchme, qnbr;
+	idx_t v1, v2, qnbr;
+	uint8_t nbr_vars, inner_cut, any_choices, catchme;
 } choice;
 
+typedef struct {
+	idx_t offset, next;
+	uint32_t hash;
+} solution;
+
+typedef struct {
+	cell *queue, *tmpq;
+	solution *sols;
+	idx_t *heads;
+	idx_t qp, q_size, tmpq_nbr, tmpq_size;
+	idx_t nbr_sols, sols_size, next_sol, heads_size;
+} collector;
+
 typedef struct arena_ arena;
 
 struct arena_ {
 	arena *next;
 	cell *heap;
-	idx_t hp, h_size;
+	idx_t hp, h_size, base;
 	unsigned nbr;
 };
 
 struct query_ {
-	query *prev, *next, *parent;
+	query *prev, *next, *parent, *live_prev, *live_next;
 	module *m;
-	frame *frames;
-	slot *slots;
+	frame *frames, *gframes;
+	slot *slots, *gslots;
 	choice *choices;
 	trail *trails;
-	cell *last_arg, *tmpq[MAX_QUEUES], *exception;
-	cell *tmp_heap, *queue[MAX_QUEUES];
+	gvar_undo *undo;
+	cell *last_arg, *exception, *tmp_heap;
+	collector *qs;
 	arena *arenas;
 	cell accum;
 	qstate st;
 	int64_t time_started, tmo;
 	uint64_t tot_goals, tot_retries, tot_matches, tot_tcos, step, qid;
+	uint64_t tot_gcs, gc_time, gc_freed, str_bytes;
 	uint64_t nv_mask;
 	int halt, halt_code, status, error, trace, calc, qnbr, yielded;
-	int retry, resume, no_tco, current_input, current_output;
+	int retry, resume, current_input, current_output, gc;
 	int max_depth, quoted, nl, fullstop, ignore_ops, character_escapes;
-	int is_subquery;
+	int is_subquery, did_throw;
 	idx_t cp, tmphp, nv_start;
-	idx_t latest_ctx, popp, qp[MAX_QUEUES];
+	idx_t latest_ctx, popp, nbr_queues;
 	idx_t nbr_frames, nbr_slots, nbr_trails, nbr_choices;
+	idx_t nbr_gframes, nbr_gslots;
 	idx_t max_choices, max_frames, max_slots, max_trails, max_heaps;
-	idx_t tot_heaps, tot_heapsize, tmpq_size[MAX_QUEUES];
-	idx_t h_size, tmph_size, q_size[MAX_QUEUES], anbr;
+	idx_t tot_heaps, tot_heapsize, nbr_undo, max_undo;
+	idx_t h_size, tmph_size, anbr, gc_next;
 };
 
+// Binary term encoding, used for precompiled files and the log of
+// persistent predicates (see parse.c)
+
+typedef struct {
+	char *buf;
+	uint32_t *atoms;
+	size_t len, size, atoms_size, nbr_atoms;
+} qlf_out;
+
+typedef struct {
+	idx_t *atoms;
+	size_t nbr_atoms, max_atoms;
+} qlf_in;
+
+// Output of the term writer (see print.c): a growable buffer, or if
+// 'fp' is set a fixed one that is flushed to the file as it fills
+
+typedef struct {
+	char *buf, *closers;
+	FILE *fp;
+	size_t len, size, nbr_closers, max_closers;
+	unsigned nesting;
+	int error;
+} sink;
+
 struct parser_ {
 	struct {
 		char var_pool[MAX_VAR_POOL_SIZE];
@@ -269,14 +361,15 @@ struct parser_ {
 		const char *var_name[MAX_ARITY];
 	} vartab;
 
-	FILE *fp;
+	FILE *fp, *qlf;
 	module *m;
 	term *t;
 	char *token, *save_line, *srcptr;
+	qlf_out qlf_buf, *deps;
 	size_t token_size, n_line;
 	int start_term, end_of_term, line_nbr, comment, error;
-	int directive, consulting, one_shot, dq_consing, depth;
-	int quoted, is_var, is_op, skip, command, in_dcg, dcg_passthru;
+	int directive, consulting, one_shot, dq_consing, depth, worker;
+	int quoted, is_var, is_op, skip, command, in_dcg, dcg_passthru, scan;
 	unsigned val_type;
 };
 
@@ -285,8 +378,22 @@ struct module_ {
 	query *tasks;
 	char *name, *filename;
 	rule *head, *tail;
+	rule **fn_hash;
+	cindex *retired;
+	skiplist *gvars;
+	clause *dead;
+	idx_t fn_hash_size, nbr_rules, nbr_retracted, purge_at;
 	parser *p;
 	FILE *fp;
+	qlf_out log;
+
+	struct {
+		qlf_out dict, backlog;
+		size_t size, base;
+		unsigned records, erased, live, backlog_records, backlog_erased;
+		int pid, fd;
+	} compact;
+
 	struct op_table ops[MAX_USER_OPS+1];
     const char *keywords[1000];
 
@@ -294,10 +401,12 @@ struct module_ {
 		int double_quote_codes, double_quote_chars, double_quote_atom;
 		int character_escapes;
 		int rational_syntax_natural, prefer_rationals;
+		int persist_sync, persist_compact_size, persist_compact_ratio;
 	} flag;
 
 	int prebuilt, dq, halt, halt_code, status, trace, quiet, dirty;
-	int user_ops, opt, stats, iso_only, use_persist, loading;
+	int user_ops, opt, stats, iso_only, use_persist, loading, threads, purge;
+	unsigned log_pending;
 };
 
 extern idx_t g_empty_s, g_dot_s, g_cut_s, g_nil_s, g_true_s, g_fail_s;
@@ -305,8 +414,28 @@ extern idx_t g_anon_s, g_clause_s, g_eof_s, g_lt_s;
 extern idx_t g_gt_s, g_eq_s, g_sys_elapsed_s, g_sys_queue_s;
 extern stream g_streams[MAX_STREAMS];
 extern module *g_modules;
+extern int g_purge;
 extern char *g_pool;
 
+// Consult workers read the pool while another thread may replace it
+// with a grown copy (see pool_grow), so the pointer is loaded with
+// acquire ordering to pair with the release store there...
+
+#ifndef _WIN32
+#define GET_POOL() __atomic_load_n(&g_pool, __ATOMIC_ACQUIRE)
+#else
+#define GET_POOL() g_pool
+#endif
+extern idx_t g_pool_offset, g_pool_count, g_pool_max_probe;
+extern uint64_t g_pool_lookups, g_pool_probes;
+
+// Every pool string is preceded by its (aligned) 32-bit length in
+// characters, length in bytes and hash
+
+#define POOL_NCHARS(off) (((const uint32_t*)(GET_POOL()+(off)))[-3])
+#define POOL_LEN(off) (((const uint32_t*)(GET_POOL()+(off)))[-2])
+#define POOL_HASH(off) (((const uint32_t*)(GET_POOL()+(off)))[-1])
+
 #define copy_cells(dst,src,nbr_cells) memcpy(dst, src, sizeof(cell)*(nbr_cells))
 
 int is_in_pool(const char *name, idx_t *offset);
@@ -316,7 +445,15 @@ void reset_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx);
 int unify(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx);
 int module_load_fp(module *m, FILE *fp);
 int module_load_file(module *m, const char *filename);
+int module_compile_file(module *m, const char *filename);
 int module_save_file(module *m, const char *filename);
+void qlf_put(qlf_out *o, const void *src, size_t len);
+void qlf_clear(qlf_out *o);
+void qlf_seed(qlf_out *o, const qlf_in *in);
+void qlf_write_term(qlf_out *o, term *t);
+int qlf_read(const char **src, const char *end, void *dst, size_t len);
+int qlf_read_atom(parser *p, qlf_in *in, const char **src, const char *end);
+int qlf_read_term(parser *p, const qlf_in *in, const char **src, const char *end);
 int deconsult(const char *filename);
 module *create_module(const char *name);
 void destroy_module(module *m);
@@ -325,16 +462,37 @@ clause *asserta_to_db(module *m, term *t, int consulting);
 clause *assertz_to_db(module *m, term *t, int consulting);
 clause *retract_from_db(module *m, clause *r);
 clause *erase_from_db(module *m, uuid *ref);
+void purge_retracted(void);
 clause *find_in_db(module *m, uuid *ref);
 int get_op(module *m, const char *name, unsigned *val_type, int *userop, int hint_prefix);
 void write_canonical(query *q, FILE *fp, cell *c, int running, int dq, int depth);
-size_t write_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, int running, int dq, int depth);
+void write_canonical_to_sink(query *q, sink *s, cell *c, int running, int dq, int depth);
 void write_term(query *q, FILE *fp, cell *c, int running, int dq, int cons, int max_depth, int depth);
-size_t write_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, int running, int dq, int cons, int max_depth, int depth);
+void write_term_to_sink(query *q, sink *s, cell *c, int running, int dq, int cons, int max_depth, int depth);
 void make_choice(query *q);
 void cut_me(query *q, int inner_cut);
 int check_builtin(module *m, const char *name, unsigned arity);
 void *get_builtin(module *m, const char *name, unsigned arity);
+int xref_builtin(module *m, cell *c);
+void load_builtins(void);
+void destroy_builtins(void);
+void destroy_tables(void);
+void destroy_gvars(module *m);
+void trail_gvar(query *q, gvar *v);
+void forget_gvars(query *q);
+void free_gvar_value(cell *c);
+idx_t functor_hash(idx_t offset, unsigned arity);
+uint32_t index_key(cell *c);
+int compkey(const void *ptr1, const void *ptr2);
+uint32_t atom_hash(cell *c);
+size_t atom_nbytes(cell *c);
+char *alloc_strbuf(const char *s, size_t n);
+void retain_string(const cell *c);
+void release_string(const cell *c);
+size_t atom_nchars(cell *c);
+int atom_eq(cell *p1, cell *p2);
+int atom_cmp(const cell *p1, const cell *p2);
+skiplist *get_arg_index(rule *h, unsigned n);
 void query_execute(query *q, term *t);
 cell *get_head(cell *c);
 cell *get_body(cell *c);
@@ -369,5 +527,7 @@ char *uuid_to_string(const uuid *u, char *buf, size_t buflen);
 int uuid_from_string(const char *s, uuid *u);
 void uuid_gen(uuid *u);
 uint64_t gettimeofday_usec(void);
+void gc_heap(query *q);
 void clear_term(term *t);
 void do_db_load(module *m);
+void db_close(module *m);
@@ -15,11 +15,24 @@ extern uint8_t _binary_library_http_pro_end[];
 extern uint8_t _binary_library_auth_pro_start[];
 extern uint8_t _binary_library_auth_pro_end[];
 
+// The precompiled libraries are absent from the bootstrap binary
+// that compiles them, hence weak...
+
+#define QLF(name) \
+extern uint8_t _binary_library_##name##_qlf_start[] __attribute__((weak)); \
+extern uint8_t _binary_library_##name##_qlf_end[] __attribute__((weak));
+
+QLF(lists)
+QLF(dict)
+QLF(apply)
+QLF(http)
+QLF(auth)
+
 library g_libs[] = {
-     {"lists", _binary_library_lists_pro_start, _binary_library_lists_pro_end},
-     {"dict", _binary_library_dict_pro_start, _binary_library_dict_pro_end},
-     {"apply", _binary_library_apply_pro_start, _binary_library_apply_pro_end},
-     {"http", _binary_library_http_pro_start, _binary_library_http_pro_end},
-     {"auth", _binary_library_auth_pro_start, _binary_library_auth_pro_end},
+     {"lists", _binary_library_lists_pro_start, _binary_library_lists_pro_end, _binary_library_lists_qlf_start, _binary_library_lists_qlf_end},
+     {"dict", _binary_library_dict_pro_start, _binary_library_dict_pro_end, _binary_library_dict_qlf_start, _binary_library_dict_qlf_end},
+     {"apply", _binary_library_apply_pro_start, _binary_library_apply_pro_end, _binary_library_apply_qlf_start, _binary_library_apply_qlf_end},
+     {"http", _binary_library_http_pro_start, _binary_library_http_pro_end, _binary_library_http_qlf_start, _binary_library_http_qlf_end},
+     {"auth", _binary_library_auth_pro_start, _binary_library_auth_pro_end, _binary_library_auth_qlf_start, _binary_library_auth_qlf_end},
      {0}
 };
@@ -6,6 +6,8 @@ typedef struct {
     const char *name;
     const uint8_t *start;
     const uint8_t *end;
+    const uint8_t *qlf_start;
+    const uint8_t *qlf_end;
 } library;
 
 extern library g_libs[];
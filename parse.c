@@ -1,10 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <time.h>
 #include <ctype.h>
 #include <float.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <sys/errno.h>
 
 #ifdef _WIN32
@@ -12,6 +14,8 @@
 #define isatty _isatty
 #else
 #include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #endif
 
 #include "internal.h"
@@ -22,9 +26,13 @@
 
 static const unsigned INITIAL_TOKEN_SIZE = 100;
 static const unsigned INITIAL_POOL_SIZE = 4000;
+static const unsigned INITIAL_POOL_HASH = 1024;
+static const unsigned INITIAL_FN_HASH = 64;
 static const unsigned INITIAL_NBR_CELLS = 100;
 static const unsigned INITIAL_NBR_HEAP = 8000;
 static const unsigned INITIAL_NBR_QUEUE = 1000;
+static const unsigned INITIAL_NBR_QUEUES = 16;
+static const unsigned INITIAL_GC_HEAP = 1000000;
 
 static const unsigned INITIAL_NBR_GOALS = 1000;
 static const unsigned INITIAL_NBR_SLOTS = 1000;
@@ -41,12 +49,36 @@ idx_t g_empty_s, g_dot_s, g_cut_s, g_nil_s, g_true_s, g_fail_s;
 idx_t g_anon_s, g_clause_s, g_eof_s, g_lt_s, g_gt_s, g_eq_s;
 idx_t g_sys_elapsed_s, g_sys_queue_s;
 
-static idx_t g_pool_offset = 0, g_pool_size = 0;
+typedef struct {
+	idx_t offset;							// pool offset + 1, 0 if empty
+	uint32_t hash;
+} pool_slot;
+
+static pool_slot *g_pool_hash = NULL;
+static idx_t g_pool_size = 0, g_pool_hash_size = 0;
+idx_t g_pool_offset = 0, g_pool_count = 0, g_pool_max_probe = 0;
+uint64_t g_pool_lookups = 0, g_pool_probes = 0;
 static int g_tpl_count = 0;
 
+#ifndef _WIN32
+// While consult workers are running the pool is shared: lookups and
+// insertions are serialized and a grown pool is copied rather than
+// reallocated, so strings other threads are reading stay put until
+// the last worker is done.
+
+static pthread_mutex_t g_pool_guard = PTHREAD_MUTEX_INITIALIZER;
+static char **g_pool_retired = NULL;
+static unsigned g_pool_shared = 0, g_pool_nbr_retired = 0;
+#endif
+
 int g_ac = 0, g_avc = 1;
 char **g_av = NULL;
 
+// Every query that exists, running or suspended, so that retracted
+// clauses are only reclaimed once none of them can still see them.
+
+static query *g_queries = NULL;
+
 static struct op_table g_ops[] =
 {
 	{":-", OP_XFX, 1200},
@@ -64,11 +96,13 @@ static struct op_table g_ops[] =
 	{"dynamic", OP_FX, 1150},
 	{"persist", OP_FX, 1150},
 	{"volatile", OP_FX, 1150},
+	{"table", OP_FX, 1150},
 	{"initialization", OP_FX, 1150},
 	{"set_prolog_flag", OP_FX, 1150},
 	{"module", OP_FX, 1150},
 	{"use_module", OP_FX, 1150},
 	{"ensure_loaded", OP_FX, 1150},
+	{"as", OP_XFX, 1105},
 
 	{"\\+", OP_FY, 900},
 	{"is", OP_XFX, 700},
@@ -119,44 +153,327 @@ static struct op_table g_ops[] =
 	{0}
 };
 
-int is_in_pool(const char *name, idx_t *val)
+// The pool is indexed by an open-addressed hash table of offsets so
+// that interning is O(1). Offsets into the pool never change, only the
+// index is rebuilt when it fills up.
+
+static uint32_t pool_hash(const char *name)
 {
-	idx_t offset = 0;
+	uint32_t hash = 2166136261U;
 
-	while (offset < g_pool_offset) {
-		if (!strcmp(g_pool+offset, name)) {
-			if (val)
-				*val = offset;
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619U;
+	}
 
-			return 1;
-		}
+	return hash;
+}
+
+static void pool_rehash(void)
+{
+	idx_t save_size = g_pool_hash_size;
+	pool_slot *save = g_pool_hash;
+	g_pool_hash_size = save_size ? save_size * 2 : INITIAL_POOL_HASH;
+	g_pool_hash = calloc(g_pool_hash_size, sizeof(pool_slot));
+	if (!g_pool_hash) abort();
+	idx_t mask = g_pool_hash_size - 1;
+
+	for (idx_t i = 0; i < save_size; i++) {
+		pool_slot *e = save + i;
+
+		if (!e->offset)
+			continue;
+
+		idx_t j = e->hash & mask;
 
-		offset += strlen(g_pool+offset) + 1;
+		while (g_pool_hash[j].offset)
+			j = (j + 1) & mask;
+
+		g_pool_hash[j] = *e;
 	}
 
-	return 0;
+	free(save);
 }
 
-idx_t find_in_pool(const char *name)
+static pool_slot *pool_lookup(const char *name, uint32_t hash)
 {
-	idx_t offset;
+	idx_t mask = g_pool_hash_size - 1;
+	idx_t i = hash & mask, probes = 1;
+	g_pool_lookups++;
 
-	if (is_in_pool(name, &offset))
-		return offset;
+	for (;;) {
+		pool_slot *e = g_pool_hash + i;
 
-	offset = g_pool_offset;
-	size_t len = strlen(name);
+		if (!e->offset || ((e->hash == hash) && !strcmp(g_pool+e->offset-1, name)))
+			break;
+
+		i = (i + 1) & mask;
+		probes++;
+	}
+
+	g_pool_probes += probes;
+
+	if (probes > g_pool_max_probe)
+		g_pool_max_probe = probes;
+
+	return g_pool_hash + i;
+}
+
+static int pool_find(const char *name, idx_t *val)
+{
+	if (!g_pool_hash_size)
+		return 0;
+
+	pool_slot *e = pool_lookup(name, pool_hash(name));
+
+	if (!e->offset)
+		return 0;
+
+	if (val)
+		*val = e->offset - 1;
+
+	return 1;
+}
 
-	if ((offset+len+1) >= g_pool_size) {
-		g_pool = realloc(g_pool, g_pool_size*=2);
-		if (!g_pool) abort();
+static void pool_grow(void)
+{
+#ifndef _WIN32
+	if (g_pool_shared) {
+		char *pool = malloc(g_pool_size*2);
+		if (!pool) abort();
+		memcpy(pool, g_pool, g_pool_offset);
+		g_pool_retired = realloc(g_pool_retired, sizeof(char*)*(g_pool_nbr_retired+1));
+		if (!g_pool_retired) abort();
+		g_pool_retired[g_pool_nbr_retired++] = g_pool;
+		__atomic_store_n(&g_pool, pool, __ATOMIC_RELEASE);
+		g_pool_size *= 2;
+		return;
 	}
+#endif
+
+	g_pool = realloc(g_pool, g_pool_size*=2);
+	if (!g_pool) abort();
+}
+
+static idx_t pool_insert(const char *name)
+{
+	if ((g_pool_count+1) >= (g_pool_hash_size / 2))
+		pool_rehash();
 
+	uint32_t hash = pool_hash(name);
+	pool_slot *e = pool_lookup(name, hash);
+
+	if (e->offset)
+		return e->offset - 1;
+
+	idx_t offset = (g_pool_offset + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+	offset += sizeof(uint32_t) * 3;
+	size_t len = strlen(name);
+
+	while ((offset+len+1) >= g_pool_size)
+		pool_grow();
+
+	((uint32_t*)(g_pool+offset))[-3] = strlen_utf8(name);
+	((uint32_t*)(g_pool+offset))[-2] = len;
+	((uint32_t*)(g_pool+offset))[-1] = hash;
 	strcpy(g_pool+offset, name);
-	g_pool_offset += len + 1;
+	g_pool_offset = offset + len + 1;
+	g_pool_count++;
+	e->offset = offset + 1;
+	e->hash = hash;
 	return offset;
 }
 
+int is_in_pool(const char *name, idx_t *val)
+{
+#ifndef _WIN32
+	if (g_pool_shared) {
+		pthread_mutex_lock(&g_pool_guard);
+		int found = pool_find(name, val);
+		pthread_mutex_unlock(&g_pool_guard);
+		return found;
+	}
+#endif
+
+	return pool_find(name, val);
+}
+
+idx_t find_in_pool(const char *name)
+{
+#ifndef _WIN32
+	if (g_pool_shared) {
+		pthread_mutex_lock(&g_pool_guard);
+		idx_t offset = pool_insert(name);
+		pthread_mutex_unlock(&g_pool_guard);
+		return offset;
+	}
+#endif
+
+	return pool_insert(name);
+}
+
+#ifndef _WIN32
+static void pool_share(int on)
+{
+	pthread_mutex_lock(&g_pool_guard);
+
+	if (on)
+		g_pool_shared++;
+	else if (!--g_pool_shared) {
+		for (unsigned i = 0; i < g_pool_nbr_retired; i++)
+			free(g_pool_retired[i]);
+
+		free(g_pool_retired);
+		g_pool_retired = NULL;
+		g_pool_nbr_retired = 0;
+	}
+
+	pthread_mutex_unlock(&g_pool_guard);
+}
+#endif
+
+// Atoms are either pool literals or string cells. Literals carry their
+// hash and lengths in the pool. A big string buffer carries them in its
+// header, filled in the first time they are needed, and a slice counts
+// its own characters once. So mismatches are mostly rejected without
+// touching the bytes and lengths don't need a scan each time.
+
+static strbuf *get_strbuf(const cell *c)
+{
+	const char *src = c->val_str;
+
+	if (c->flags&FLAG_SLICE)
+		src -= c->val_off;
+
+	return (strbuf*)(src - offsetof(strbuf, cstr));
+}
+
+static void hash_strbuf(strbuf *b)
+{
+	const unsigned char *src = (const unsigned char*)b->cstr;
+	uint32_t hash = 2166136261U, nchars = 0;
+
+	while (*src) {
+		if ((*src < 0x80) || (*src > 0xBF))
+			nchars++;
+
+		hash ^= *src++;
+		hash *= 16777619U;
+	}
+
+	b->hash = hash;
+	b->nchars = nchars;
+	b->hashed = 1;
+}
+
+uint32_t atom_hash(cell *c)
+{
+	if (!is_string(c))
+		return POOL_HASH(c->val_offset);
+
+	if (is_smallstring(c))
+		return pool_hash(c->val_chars);
+
+	if (c->flags&FLAG_SLICE)
+		return pool_hash(c->val_str);
+
+	strbuf *b = get_strbuf(c);
+
+	if (!b->hashed)
+		hash_strbuf(b);
+
+	return b->hash;
+}
+
+// Only atoms and variables have their name in the pool, other cells
+// such as numbers have no text...
+
+size_t atom_nbytes(cell *c)
+{
+	if (is_literal(c) || is_var(c))
+		return POOL_LEN(c->val_offset);
+
+	if (!is_string(c))
+		return 0;
+
+	if (is_smallstring(c))
+		return strlen(c->val_chars);
+
+	return get_strbuf(c)->nbytes - (c->flags&FLAG_SLICE ? c->val_off : 0);
+}
+
+// Length in characters. Small strings are at most MAX_SMALL_STRING
+// bytes so they are just counted...
+
+size_t atom_nchars(cell *c)
+{
+	if (!is_string(c))
+		return POOL_NCHARS(c->val_offset);
+
+	if (is_smallstring(c))
+		return strlen_utf8(c->val_chars);
+
+	strbuf *b = get_strbuf(c);
+
+	if (!b->hashed)
+		hash_strbuf(b);
+
+	if (!(c->flags&FLAG_SLICE))
+		return b->nchars;
+
+	if (!c->val_nchars)
+		c->val_nchars = b->nchars == b->nbytes ? b->nbytes - c->val_off : strlen_utf8(c->val_str);
+
+	return c->val_nchars;
+}
+
+char *alloc_strbuf(const char *s, size_t n)
+{
+	strbuf *b = malloc(sizeof(strbuf)+n+1);
+	if (!b) abort();
+	b->refcnt = 1;
+	b->nbytes = n;
+	b->hashed = 0;
+	memcpy(b->cstr, s, n);
+	b->cstr[n] = '\0';
+	return b->cstr;
+}
+
+void retain_string(const cell *c)
+{
+	get_strbuf(c)->refcnt++;
+}
+
+void release_string(const cell *c)
+{
+	strbuf *b = get_strbuf(c);
+
+	if (!--b->refcnt)
+		free(b);
+}
+
+int atom_eq(cell *p1, cell *p2)
+{
+	if (is_literal(p1) && is_literal(p2))
+		return p1->val_offset == p2->val_offset;
+
+	if (is_smallstring(p1) || is_smallstring(p2))
+		return !strcmp(GET_STR(p1), GET_STR(p2));
+
+	if ((atom_hash(p1) != atom_hash(p2)) || (LEN_STR(p1) != LEN_STR(p2)))
+		return 0;
+
+	return !strcmp(GET_STR(p1), GET_STR(p2));
+}
+
+int atom_cmp(const cell *p1, const cell *p2)
+{
+	if (is_literal(p1) && is_literal(p2) && (p1->val_offset == p2->val_offset))
+		return 0;
+
+	return strcmp(GET_STR(p1), GET_STR(p2));
+}
+
 int get_op(module *m, const char *name, unsigned *val_type, int *userop, int hint_prefix)
 {
 	for (const struct op_table *ptr = m->ops; ptr->name; ptr++) {
@@ -190,11 +507,9 @@ int get_op(module *m, const char *name, unsigned *val_type, int *userop, int hin
 static int set_op(module *m, const char *name, unsigned val_type, unsigned precedence)
 {
 	struct op_table *ptr = m->ops;
-	name = g_pool + find_in_pool(name);
 
 	for (; ptr->name; ptr++) {
 		if (!strcmp(ptr->name, name)) {
-			ptr->name = name;
 			ptr->val_type = val_type;
 			ptr->precedence = precedence;
 			return 1;
@@ -205,13 +520,15 @@ static int set_op(module *m, const char *name, unsigned val_type, unsigned prece
 		return 0;
 
 	m->user_ops--;
-	ptr->name = name;
+	ptr->name = strdup(name);
 	ptr->val_type = val_type;
 	ptr->precedence = precedence;
 	return 1;
 }
 
 module *g_modules = NULL;
+int g_purge = 0;
+static int g_opt = 0;
 
 module *find_module(const char *name)
 {
@@ -251,24 +568,77 @@ cell *get_body(cell *c)
 	return c;
 }
 
-rule *find_match(module *m, cell *c)
+// Rules are also indexed by an open-addressed (functor,arity) hash
+// table. Rules are only ever freed with their module so there is no
+// need for tombstones.
+
+idx_t functor_hash(idx_t offset, unsigned arity)
 {
-	for (rule *h = m->head; h; h = h->next) {
-		if ((h->val_offset == c->val_offset) && (h->arity == c->arity))
+	uint32_t hash = offset * 2654435761U;
+	hash ^= arity * 40503U;
+	return hash ^ (hash >> 16);
+}
+
+static rule *find_rule(module *m, idx_t offset, unsigned arity)
+{
+	if (!m->fn_hash_size)
+		return NULL;
+
+	idx_t mask = m->fn_hash_size - 1;
+	idx_t i = functor_hash(offset, arity) & mask;
+	rule *h;
+
+	while ((h = m->fn_hash[i]) != NULL) {
+		if ((h->val_offset == offset) && (h->arity == arity))
 			return h;
+
+		i = (i + 1) & mask;
 	}
 
 	return NULL;
 }
 
-rule *find_functor(module *m, const char *name, unsigned arity)
+static void add_rule(module *m, rule *h)
 {
-	for (rule *h = m->head; h; h = h->next) {
-		if (!strcmp(g_pool+h->val_offset, name) && (h->arity == arity))
-			return h;
+	if ((m->nbr_rules+1) >= (m->fn_hash_size / 2)) {
+		rule **save = m->fn_hash;
+		idx_t save_size = m->fn_hash_size;
+		m->fn_hash_size = save_size ? save_size * 2 : INITIAL_FN_HASH;
+		m->fn_hash = calloc(m->fn_hash_size, sizeof(rule*));
+		if (!m->fn_hash) abort();
+		m->nbr_rules = 0;
+
+		for (idx_t i = 0; i < save_size; i++) {
+			if (save[i])
+				add_rule(m, save[i]);
+		}
+
+		free(save);
 	}
 
-	return NULL;
+	idx_t mask = m->fn_hash_size - 1;
+	idx_t i = functor_hash(h->val_offset, h->arity) & mask;
+
+	while (m->fn_hash[i])
+		i = (i + 1) & mask;
+
+	m->fn_hash[i] = h;
+	m->nbr_rules++;
+}
+
+rule *find_match(module *m, cell *c)
+{
+	return find_rule(m, c->val_offset, c->arity);
+}
+
+rule *find_functor(module *m, const char *name, unsigned arity)
+{
+	idx_t offset;
+
+	if (!is_in_pool(name, &offset))
+		return NULL;
+
+	return find_rule(m, offset, arity);
 }
 
 uint64_t gettimeofday_usec(void)
@@ -364,148 +734,314 @@ static rule *create_rule(module *m, cell *c)
 
 	h->val_offset = c->val_offset;
 	h->arity = c->arity;
+	add_rule(m, h);
 	return h;
 }
 
-static int compkey(const void *ptr1, const void *ptr2)
+uint32_t index_key(cell *c)
 {
-	const cell *p1 = (const cell*)ptr1;
-	const cell *p2 = (const cell*)ptr2;
-
-	if (is_integer(p1)) {
-		if (is_integer(p2)) {
-			if (p1->val_int < p2->val_int)
-				return -1;
-			else if (p1->val_int > p2->val_int)
-				return 1;
-			else
-				return 0;
-		} else if (is_var(p2))
-			return 0;
-	} else if (is_real(p1)) {
-		if (is_real(p2)) {
-			if (p1->val_real < p2->val_real)
-				return -1;
-			else if (p1->val_real > p2->val_real)
-				return 1;
-			else
-				return 0;
-		} else if (is_var(p2))
-			return 0;
-	} else if (is_atom(p1)) {
-		if (is_atom(p2))
-			return strcmp(GET_STR(p1), GET_STR(p2));
-		else if (is_var(p2))
-			return 0;
-	} else if (is_structure(p1)) {
-		if (is_structure(p2)) {
-			if (p1->arity < p2->arity)
-				return -1;
-
-			if (p1->arity > p2->arity)
-				return 1;
+	if (is_structure(c))
+		return POOL_HASH(c->val_offset) ^ (c->arity * 2654435761U);
 
-			int i = strcmp(GET_STR(p1), GET_STR(p2));
+	if (is_atom(c))
+		return atom_hash(c);
 
-			if (i != 0)
-				return i;
+	uint64_t v = 0;
 
-			int arity = p1->arity;
-			p1++; p2++;
+	if (is_rational(c))
+		v = (uint64_t)c->val_num ^ ((uint64_t)c->val_den << 32);
+	else if (is_real(c) && (c->val_real != 0.0))
+		memcpy(&v, &c->val_real, sizeof(v));
 
-			while (arity--) {
-				int i = compkey(p1, p2);
+	v ^= v >> 32;
+	return (uint32_t)v * 2654435761U;
+}
 
-				if (i != 0)
-					return i;
+static void free_index(cindex *idx)
+{
+	free(idx->clauses);
+	free(idx->start);
+	free(idx);
+}
 
-				p1 += p1->nbr_cells;
-				p2 += p2->nbr_cells;
-			}
+// A retired index may still be referenced by choice points of the
+// running query so it is only freed once back at the top level.
 
-			return 0;
-		} else if (is_var(p2))
-			return 0;
-	} else if (is_var(p1))
-		return 0;
-	else
-		return 0;
+static void retire_index(module *m, rule *h)
+{
+	if (!h->jit)
+		return;
 
-	return 0;
+	h->jit->next = m->retired;
+	m->retired = h->jit;
+	h->jit = NULL;
 }
 
-clause *asserta_to_db(module *m, term *t, int consulting)
+static void index_rule(module *m, rule *h)
 {
-	cell *c = get_head(t->cells);
+	if (h->jit || h->index || !h->arity)
+		return;
 
-	if (!c) {
-		fprintf(stderr, "Error: not a fact or clause\n");
-		return NULL;
-	}
+	idx_t nbr_clauses = 0, nbr_vars = 0;
 
-	rule *h = find_match(m, c);
+	for (clause *r = h->head; r; r = r->next) {
+		if (r->t.deleted)
+			continue;
 
-	if (h && !consulting) {
-		if (!(h->flags&FLAG_RULE_DYNAMIC)) {
-			fprintf(stderr, "Error: not a fact or clause\n");
-			return NULL;
-		}
+		cell *c = get_head(r->t.cells) + 1;
+		nbr_clauses++;
+
+		if (is_var(c))
+			nbr_vars++;
 	}
 
-	if (!h) {
-		h = create_rule(m, c);
+	idx_t nbr_keyed = nbr_clauses - nbr_vars;
 
-		if (!consulting) {
-			h->flags |= FLAG_RULE_DYNAMIC;
-			h->index = sl_create(compkey);
-		}
-	}
+	if ((nbr_clauses < 2) || !nbr_keyed)
+		return;
 
+	idx_t nbr_buckets = 2;
 
-	if (m->prebuilt)
-		h->flags |= FLAG_RULE_PREBUILT;
+	while (nbr_buckets < (nbr_keyed * 2))
+		nbr_buckets *= 2;
 
-	int nbr_cells = t->cidx;
-	clause *r = calloc(sizeof(clause)+(sizeof(cell)*nbr_cells), 1);
-	memcpy(&r->t, t, sizeof(term));
-	copy_cells(r->t.cells, t->cells, nbr_cells);
-	r->t.nbr_cells = nbr_cells;
-	r->m = m;
-	r->next = h->head;
-	h->head = r;
+	// Catch-all clauses are repeated in every bucket...
 
-	if (!h->tail)
-		h->tail = r;
+	if ((nbr_vars * nbr_buckets) > (nbr_clauses * 4))
+		return;
 
-	if ((h->flags&FLAG_RULE_DYNAMIC) && (c->arity > 0)) {
-		cell *c = get_head(r->t.cells);
-		sl_set(h->index, c, r);
-	}
+	cindex *idx = calloc(1, sizeof(cindex));
+	idx->nbr_buckets = nbr_buckets;
+	idx->start = calloc(nbr_buckets+1, sizeof(idx_t));
+	idx_t mask = nbr_buckets - 1;
 
-	t->cidx = 0;
-	uuid_gen(&r->u);
+	for (clause *r = h->head; r; r = r->next) {
+		cell *c = get_head(r->t.cells) + 1;
 
-	if (h->flags&FLAG_RULE_PERSIST)
-		r->t.persist = 1;
+		if (!r->t.deleted && !is_var(c))
+			idx->start[(index_key(c) & mask) + 1]++;
+	}
 
-	return r;
-}
+	for (idx_t i = 0; i < nbr_buckets; i++)
+		idx->start[i+1] += idx->start[i] + nbr_vars;
 
-clause *assertz_to_db(module *m, term *t, int consulting)
-{
-	cell *c = get_head(t->cells);
+	idx->clauses = malloc(sizeof(clause*)*idx->start[nbr_buckets]);
+	idx_t *pos = malloc(sizeof(idx_t)*nbr_buckets);
+	memcpy(pos, idx->start, sizeof(idx_t)*nbr_buckets);
 
-	if (!c) {
-		fprintf(stderr, "Error: no fact or clause head\n");
-		return NULL;
-	}
+	for (clause *r = h->head; r; r = r->next) {
+		cell *c = get_head(r->t.cells) + 1;
 
-	rule *h = find_match(m, c);
+		if (r->t.deleted)
+			continue;
 
-	if (h && !consulting) {
-		if (!(h->flags&FLAG_RULE_DYNAMIC)) {
-			fprintf(stderr, "Error: not a fact or clause\n");
-			return NULL;
+		if (is_var(c)) {
+			for (idx_t i = 0; i < nbr_buckets; i++)
+				idx->clauses[pos[i]++] = r;
+		} else {
+			idx_t i = index_key(c) & mask;
+			idx->clauses[pos[i]++] = r;
+		}
+	}
+
+	free(pos);
+	h->jit = idx;
+}
+
+// Dynamic predicates are indexed on their first argument. Keys are
+// ordered by type then value, comparing only the principal functor of
+// a compound (unification sorts out the rest).
+
+static int key_type(const cell *c)
+{
+	if (is_var(c))
+		return 0;
+	else if (is_rational(c))
+		return 1;
+	else if (is_real(c))
+		return 2;
+	else if (is_atom(c))
+		return 3;
+	else
+		return 4;
+}
+
+int compkey(const void *ptr1, const void *ptr2)
+{
+	const cell *p1 = (const cell*)ptr1;
+	const cell *p2 = (const cell*)ptr2;
+	int t1 = key_type(p1), t2 = key_type(p2);
+
+	if (t1 != t2)
+		return t1 < t2 ? -1 : 1;
+
+	if (is_rational(p1)) {
+		if (p1->val_den != p2->val_den)
+			return p1->val_den < p2->val_den ? -1 : 1;
+
+		if (p1->val_num < p2->val_num)
+			return -1;
+		else if (p1->val_num > p2->val_num)
+			return 1;
+		else
+			return 0;
+	} else if (is_real(p1)) {
+		if (p1->val_real < p2->val_real)
+			return -1;
+		else if (p1->val_real > p2->val_real)
+			return 1;
+		else
+			return 0;
+	} else if (is_atom(p1))
+		return atom_cmp(p1, p2);
+	else if (is_structure(p1)) {
+		if (p1->arity < p2->arity)
+			return -1;
+
+		if (p1->arity > p2->arity)
+			return 1;
+
+		return atom_cmp(p1, p2);
+	}
+
+	return 0;
+}
+
+static cell *get_arg(cell *c, unsigned n)
+{
+	c++;
+
+	while (n--)
+		c += c->nbr_cells;
+
+	return c;
+}
+
+// A clause with a variable in the indexed argument can match any key,
+// so once there is one that index is no use for lookups. It may still
+// have live iterators so is only freed on the next purge.
+
+static void index_clause(rule *h, clause *r, int append)
+{
+	cell *head = get_head(r->t.cells);
+	cell *c = head + 1;
+
+	if (is_var(c))
+		h->flags |= FLAG_RULE_VARKEY;
+
+	if (append)
+		sl_app(h->index, c, r);
+	else
+		sl_set(h->index, c, r);
+
+	if (!h->arg_index)
+		return;
+
+	for (unsigned n = 1; (n < h->arity) && (n < MAX_ARG_INDEX); n++) {
+		if (!h->arg_index[n] || (h->arg_noindex & (1ULL << n)))
+			continue;
+
+		c = get_arg(head, n);
+
+		if (is_var(c))
+			h->arg_noindex |= 1ULL << n;
+		else if (append)
+			sl_app(h->arg_index[n], c, r);
+		else
+			sl_set(h->arg_index[n], c, r);
+	}
+}
+
+static void drop_arg_indexes(rule *h)
+{
+	if (!h->arg_index)
+		return;
+
+	for (unsigned n = 1; (n < h->arity) && (n < MAX_ARG_INDEX); n++) {
+		if (h->arg_index[n])
+			sl_destroy(h->arg_index[n]);
+	}
+
+	free(h->arg_index);
+	h->arg_index = NULL;
+	h->arg_noindex = 0;
+}
+
+static void reindex_rule(rule *h)
+{
+	drop_arg_indexes(h);
+
+	if (h->index)
+		sl_destroy(h->index);
+
+	h->index = sl_create(compkey);
+	h->flags &= ~FLAG_RULE_VARKEY;
+
+	if (!h->arity)
+		return;
+
+	for (clause *r = h->head; r; r = r->next) {
+		if (!r->t.deleted)
+			index_clause(h, r, 1);
+	}
+}
+
+// Build an index on argument 'n' (from 0) of a dynamic predicate the
+// first time a call needs one. It is then kept up to date by asserts.
+
+skiplist *get_arg_index(rule *h, unsigned n)
+{
+	if ((n >= MAX_ARG_INDEX) || (h->arg_noindex & (1ULL << n)))
+		return NULL;
+
+	if (h->arg_index && h->arg_index[n])
+		return h->arg_index[n];
+
+	if (sl_count(h->index) < MIN_ARG_INDEX)
+		return NULL;
+
+	for (clause *r = h->head; r; r = r->next) {
+		if (!r->t.deleted && is_var(get_arg(get_head(r->t.cells), n))) {
+			h->arg_noindex |= 1ULL << n;
+			return NULL;
+		}
+	}
+
+	if (!h->arg_index)
+		h->arg_index = calloc(MAX_ARG_INDEX, sizeof(skiplist*));
+
+	skiplist *l = h->arg_index[n] = sl_create(compkey);
+
+	for (clause *r = h->head; r; r = r->next) {
+		if (!r->t.deleted)
+			sl_app(l, get_arg(get_head(r->t.cells), n), r);
+	}
+
+	return l;
+}
+
+clause *asserta_to_db(module *m, term *t, int consulting)
+{
+	cell *c = get_head(t->cells);
+
+	if (!c) {
+		fprintf(stderr, "Error: not a fact or clause\n");
+		return NULL;
+	}
+
+	rule *h = find_match(m, c);
+
+	// Clauses of a tabled predicate go to its implementation...
+
+	if (h && (h->flags&FLAG_RULE_TABLED)) {
+		h = h->impl;
+		c->val_offset = h->val_offset;
+	}
+
+	if (h && !consulting) {
+		if (!(h->flags&FLAG_RULE_DYNAMIC)) {
+			fprintf(stderr, "Error: not a fact or clause\n");
+			return NULL;
 		}
 	}
 
@@ -518,6 +1054,9 @@ clause *assertz_to_db(module *m, term *t, int consulting)
 		}
 	}
 
+
+	retire_index(m, h);
+
 	if (m->prebuilt)
 		h->flags |= FLAG_RULE_PREBUILT;
 
@@ -527,6 +1066,44 @@ clause *assertz_to_db(module *m, term *t, int consulting)
 	copy_cells(r->t.cells, t->cells, nbr_cells);
 	r->t.nbr_cells = nbr_cells;
 	r->m = m;
+	r->next = h->head;
+	h->head = r;
+
+	if (!h->tail)
+		h->tail = r;
+
+	if ((h->flags&FLAG_RULE_DYNAMIC) && (c->arity > 0))
+		index_clause(h, r, 0);
+
+	t->cidx = 0;
+	uuid_gen(&r->u);
+
+	if (h->flags&FLAG_RULE_PERSIST)
+		r->t.persist = 1;
+
+	return r;
+}
+
+// Takes over the cells of t...
+
+static clause *make_clause(module *m, term *t)
+{
+	int nbr_cells = t->cidx;
+	clause *r = calloc(sizeof(clause)+(sizeof(cell)*nbr_cells), 1);
+	memcpy(&r->t, t, sizeof(term));
+	copy_cells(r->t.cells, t->cells, nbr_cells);
+	r->t.nbr_cells = nbr_cells;
+	r->m = m;
+	t->cidx = 0;
+	return r;
+}
+
+static void link_clause(module *m, rule *h, clause *r)
+{
+	retire_index(m, h);
+
+	if (m->prebuilt)
+		h->flags |= FLAG_RULE_PREBUILT;
 
 	if (h->tail)
 		h->tail->next = r;
@@ -536,24 +1113,74 @@ clause *assertz_to_db(module *m, term *t, int consulting)
 	if (!h->head)
 		h->head = r;
 
-	if ((h->flags&FLAG_RULE_DYNAMIC) && (c->arity > 0)) {
-		cell *c = get_head(r->t.cells);
-		sl_app(h->index, c, r);
-	}
+	if ((h->flags&FLAG_RULE_DYNAMIC) && (h->arity > 0))
+		index_clause(h, r, 1);
 
-	t->cidx = 0;
 	uuid_gen(&r->u);
 
 	if (h->flags&FLAG_RULE_PERSIST)
 		r->t.persist = 1;
+}
 
+static clause *append_to_rule(module *m, rule *h, term *t)
+{
+	clause *r = make_clause(m, t);
+	link_clause(m, h, r);
 	return r;
 }
 
+clause *assertz_to_db(module *m, term *t, int consulting)
+{
+	cell *c = get_head(t->cells);
+
+	if (!c) {
+		fprintf(stderr, "Error: no fact or clause head\n");
+		return NULL;
+	}
+
+	rule *h = find_match(m, c);
+
+	// Clauses of a tabled predicate go to its implementation...
+
+	if (h && (h->flags&FLAG_RULE_TABLED)) {
+		h = h->impl;
+		c->val_offset = h->val_offset;
+	}
+
+	if (h && !consulting) {
+		if (!(h->flags&FLAG_RULE_DYNAMIC)) {
+			fprintf(stderr, "Error: not a fact or clause\n");
+			return NULL;
+		}
+	}
+
+	if (!h) {
+		h = create_rule(m, c);
+
+		if (!consulting) {
+			h->flags |= FLAG_RULE_DYNAMIC;
+			h->index = sl_create(compkey);
+		}
+	}
+
+	return append_to_rule(m, h, t);
+}
+
 clause *retract_from_db(module *m, clause *r)
 {
+	if (r->t.deleted)
+		return r;
+
 	r->t.deleted = 1;
 	m->dirty = 1;
+	rule *h = find_match(m, get_head(r->t.cells));
+
+	if (h)
+		h->nbr_deleted++;
+
+	if (++m->nbr_retracted >= m->purge_at)
+		m->purge = g_purge = 1;
+
 	return r;
 }
 
@@ -576,11 +1203,10 @@ clause *erase_from_db(module *m, uuid *ref)
 {
 	clause *r = find_in_db(m, ref);
 	if (!r) return 0;
-	r->t.deleted = 1;
-	return r;
+	return retract_from_db(m, r);
 }
 
-static void set_dynamic_in_db(module *m, const char *name, idx_t arity)
+static rule *set_dynamic_in_db(module *m, const char *name, idx_t arity)
 {
 	cell tmp;
 	tmp.val_type = TYPE_LITERAL;
@@ -588,8 +1214,14 @@ static void set_dynamic_in_db(module *m, const char *name, idx_t arity)
 	tmp.arity = arity;
 	rule *h = find_match(m, &tmp);
 	if (!h) h = create_rule(m, &tmp);
+	if (h->flags&FLAG_RULE_TABLED) h = h->impl;
 	h->flags |= FLAG_RULE_DYNAMIC;
-	h->index = sl_create(compkey);
+	retire_index(m, h);
+
+	if (!h->index)
+		reindex_rule(h);
+
+	return h;
 }
 
 static void set_persist_in_db(module *m, const char *name, idx_t arity)
@@ -601,7 +1233,11 @@ static void set_persist_in_db(module *m, const char *name, idx_t arity)
 	rule *h = find_match(m, &tmp);
 	if (!h) h = create_rule(m, &tmp);
 	h->flags |= FLAG_RULE_DYNAMIC | FLAG_RULE_PERSIST;
-	h->index = sl_create(compkey);
+	retire_index(m, h);
+
+	if (!h->index)
+		reindex_rule(h);
+
 	m->use_persist = 1;
 }
 
@@ -616,13 +1252,119 @@ static void set_volatile_in_db(module *m, const char *name, unsigned arity)
 	h->flags |= FLAG_RULE_VOLATILE;
 }
 
+static cell *make_cell(parser *p);
+static cell *make_literal(parser *p, idx_t offset);
+
+// Appends name(A0,...,An) to the term being built...
+
+static void make_tbl_goal(parser *p, idx_t offset, unsigned arity)
+{
+	cell *c = make_literal(p, offset);
+	c->arity = arity;
+	c->nbr_cells += arity;
+
+	for (unsigned i = 0; i < arity; i++) {
+		char v[20];
+		sprintf(v, "A%u", i);
+		c = make_literal(p, find_in_pool(v));
+		c->val_type = TYPE_VAR;
+	}
+}
+
+// A tabled predicate keeps its clauses under the name '$tbl_<name>'
+// and is itself a single clause passing each call to the table:
+//
+//	name(A0,...) :- '$tbl_call'(name(A0,...),'$tbl_name'(A0,...)).
+
+static void set_table_in_db(module *m, const char *name, unsigned arity, int incremental)
+{
+	cell tmp;
+	tmp.val_type = TYPE_LITERAL;
+	tmp.val_offset = find_in_pool(name);
+	tmp.arity = arity;
+	rule *h = find_match(m, &tmp);
+	if (!h) h = create_rule(m, &tmp);
+
+	if (incremental)
+		h->flags |= FLAG_RULE_INCREMENTAL;
+
+	if (h->flags&FLAG_RULE_TABLED)
+		return;
+
+	size_t len = strlen(name);
+	char *impl_name = malloc(len+8);
+	sprintf(impl_name, "$tbl_%s", name);
+	tmp.val_offset = find_in_pool(impl_name);
+	free(impl_name);
+	rule *impl = find_match(m, &tmp);
+	if (!impl) impl = create_rule(m, &tmp);
+
+	// Clauses already loaded move across...
+
+	if (h->head) {
+		for (clause *r = h->head; r; r = r->next)
+			get_head(r->t.cells)->val_offset = impl->val_offset;
+
+		if (impl->tail)
+			impl->tail->next = h->head;
+		else
+			impl->head = h->head;
+
+		impl->tail = h->tail;
+		h->head = h->tail = NULL;
+		retire_index(m, h);
+		retire_index(m, impl);
+
+		if (h->index)
+			reindex_rule(h);
+	}
+
+	if (h->flags&FLAG_RULE_DYNAMIC) {
+		impl->flags |= FLAG_RULE_DYNAMIC;
+		reindex_rule(impl);
+	}
+
+	parser *p = create_parser(m);
+	p->consulting = 1;
+	cell *c = make_literal(p, g_clause_s);
+	c->arity = 2;
+	make_tbl_goal(p, h->val_offset, arity);
+	c = make_literal(p, find_in_pool("$tbl_call"));
+	c->arity = 2;
+	make_tbl_goal(p, h->val_offset, arity);
+	make_tbl_goal(p, impl->val_offset, arity);
+	p->t->cells[2+arity].nbr_cells = p->t->cidx - (2+arity);
+	p->t->cells[0].nbr_cells = p->t->cidx;
+	parser_assign_vars(p);
+	assertz_to_db(m, p->t, 1);
+	destroy_parser(p);
+	h->impl = impl;
+	impl->owner = h;
+	h->flags |= FLAG_RULE_TABLED;
+}
+
+static int is_incremental(cell *c)
+{
+	for (idx_t i = 0; i < c->nbr_cells; i++, c++) {
+		if (is_structure(c) && (c->arity == 2) && !strcmp(GET_STR(c), "as")) {
+			cell *c2 = c + 1;
+			c2 += c2->nbr_cells;
+
+			if (is_atom(c2) && !strcmp(GET_STR(c2), "incremental"))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
 void clear_term(term *t)
 {
 	for (idx_t i = 0; i < t->cidx; i++) {
 		cell *c = t->cells + i;
 
 		if (is_bigstring(c) && !is_const(c))
-			free(c->val_str);
+			release_string(c);
 
 		c->val_type = TYPE_EMPTY;
 	}
@@ -681,13 +1423,23 @@ query *create_query(module *m, int small)
 	q->trails = calloc(q->nbr_trails, sizeof(trail));
 	q->h_size = small ? INITIAL_NBR_HEAP/10 : INITIAL_NBR_HEAP;
 	q->tmph_size = small ? INITIAL_NBR_CELLS/10 : INITIAL_NBR_CELLS;
+	q->gc_next = INITIAL_GC_HEAP;
 	q->current_input = 0;
 	q->current_output = 1;
 	q->accum.val_den = 1;
 
-	for (int i = 0; i < MAX_QUEUES; i++)
-		q->q_size[i] = small ? INITIAL_NBR_QUEUE/10 : INITIAL_NBR_QUEUE;
+	q->nbr_queues = INITIAL_NBR_QUEUES;
+	q->qs = calloc(q->nbr_queues, sizeof(collector));
+
+	for (idx_t i = 0; i < q->nbr_queues; i++)
+		q->qs[i].q_size = small ? INITIAL_NBR_QUEUE/10 : INITIAL_NBR_QUEUE;
+
+	q->live_next = g_queries;
 
+	if (g_queries)
+		g_queries->live_prev = q;
+
+	g_queries = q;
 	return q;
 }
 
@@ -723,15 +1475,25 @@ query *create_subquery(query *q, cell *curr_cell)
 
 void destroy_query(query *q)
 {
+	if (q->live_prev)
+		q->live_prev->live_next = q->live_next;
+	else
+		g_queries = q->live_next;
+
+	if (q->live_next)
+		q->live_next->live_prev = q->live_prev;
+
+	forget_gvars(q);
+	free(q->undo);
 	free(q->trails);
 	free(q->choices);
 
 	for (arena *a = q->arenas; a;) {
-		for (idx_t i = 0; (i < a->hp) && (a == q->arenas); i++) {
+		for (idx_t i = 0; i < a->hp; i++) {
 			cell *c = &a->heap[i];
 
 			if (is_bigstring(c) && !is_const(c))
-				free(c->val_str);
+				release_string(c);
 			else if (is_integer(c) && ((c)->flags&FLAG_STREAM)) {
 				stream *str = &g_streams[c->val_int];
 
@@ -752,11 +1514,19 @@ void destroy_query(query *q)
 		free(save);
 	}
 
-	for (int i = 0; i < MAX_QUEUES; i++)
-		free(q->queue[i]);
+	for (idx_t i = 0; i < q->nbr_queues; i++) {
+		free(q->qs[i].queue);
+		free(q->qs[i].tmpq);
+		free(q->qs[i].sols);
+		free(q->qs[i].heads);
+	}
+
+	free(q->qs);
 
 	free(q->frames);
 	free(q->slots);
+	free(q->gframes);
+	free(q->gslots);
 	free(q->tmp_heap);
 	free(q);
 }
@@ -800,16 +1570,124 @@ static void consultall(parser *p, cell *l)
 }
 
 static module *module_load_text(module *m, const char *src);
+static module *module_load_lib(module *m, const library *lib);
+static void qlf_write_parsed(parser *p);
+static FILE *open_source(const char *filename, char *path, size_t size);
+static void qlf_put_uint(qlf_out *o, uint_t v);
+static int qlf_read_len(const char **src, const char *end, size_t *len);
 
-static void directives(parser *p, term *t)
+// A precompiled file records the size and a hash of the contents of
+// its source and of each file the source loads, so it is only used
+// while they are exactly as compiled, whatever their times...
+
+typedef struct {
+	uint64_t size, hash;
+} qlf_stamp;
+
+static int qlf_stamp_file(FILE *fp, qlf_stamp *s)
 {
-	p->skip = 0;
+	char tmpbuf[1024*64];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t n;
+	s->size = 0;
+	rewind(fp);
+
+	while ((n = fread(tmpbuf, 1, sizeof(tmpbuf), fp)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			h ^= (uint8_t)tmpbuf[i];
+			h *= 0x100000001b3ULL;
+		}
 
-	if (!is_literal(t->cells))
-		return;
+		s->size += n;
+	}
 
-	if (is_list(t->cells) && p->command) {
-		consultall(p, t->cells);
+	s->hash = h;
+	int ok = !ferror(fp);
+	rewind(fp);
+	return ok;
+}
+
+// A file loaded by one being compiled is read for the operators and
+// flags it sets, as loading it would, without being compiled itself.
+// Its path and stamp are recorded so the precompiled file is only used
+// while it is unchanged...
+
+static void qlf_depend(parser *p, const char *filename)
+{
+	char path[1024];
+	FILE *fp = open_source(filename, path, sizeof(path));
+
+	if (!fp) {
+		fprintf(stderr, "Error: file '%s[.pro|.pl]' does not exist\n", filename);
+		p->error = 1;
+		return;
+	}
+
+	const char *src = p->deps->buf, *end = src + p->deps->len;
+	size_t len = strlen(path), n;
+
+	while ((src++ < end) && qlf_read_len(&src, end, &n)) {
+		if ((n == len) && !memcmp(src, path, len)) {
+			fclose(fp);
+			return;
+		}
+
+		src += n + sizeof(qlf_stamp);
+	}
+
+	qlf_stamp stamp;
+
+	if (!qlf_stamp_file(fp, &stamp)) {
+		fprintf(stderr, "Error: can't read '%s'\n", path);
+		p->error = 1;
+		fclose(fp);
+		return;
+	}
+
+	qlf_put(p->deps, "d", 1);
+	qlf_put_uint(p->deps, len);
+	qlf_put(p->deps, path, len);
+	qlf_put(p->deps, &stamp, sizeof(stamp));
+	char hdr[4];
+
+	if ((fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr)) && !memcmp(hdr, "TPLQ", 4)) {
+		fprintf(stderr, "Error: '%s' is precompiled, its source is needed\n", path);
+		p->error = 1;
+		fclose(fp);
+		return;
+	}
+
+	rewind(fp);
+	parser *p2 = create_parser(p->m);
+	p2->deps = p->deps;
+	p2->scan = p->scan ? p->scan : 1;
+	p2->fp = fp;
+
+	do {
+		if (getline(&p2->save_line, &p2->n_line, p2->fp) == -1)
+			break;
+
+		p2->srcptr = p2->save_line;
+	}
+	 while (parser_tokenize(p2, 0, 0));
+
+	if (p2->error)
+		p->error = 1;
+
+	free(p2->save_line);
+	destroy_parser(p2);
+	fclose(fp);
+}
+
+static void directives(parser *p, term *t)
+{
+	p->skip = 0;
+
+	if (p->worker || !is_literal(t->cells))
+		return;
+
+	if (is_list(t->cells) && p->command) {
+		consultall(p, t->cells);
 		p->skip = 1;
 		return;
 	}
@@ -824,6 +1702,35 @@ static void directives(parser *p, term *t)
 
 	const char *dirname = GET_STR(c);
 
+	if (p->qlf || p->scan) {
+		cell *p1 = c + 1;
+
+		if ((!strcmp(dirname, "ensure_loaded") || !strcmp(dirname, "consult")
+			|| !strcmp(dirname, "include") || !strcmp(dirname, "use_module"))
+			&& (c->arity == 1)) {
+			if (is_list(p1)) {
+				while (is_list(p1)) {
+					if (is_literal(p1+1) && !p1[1].arity)
+						qlf_depend(p, GET_STR(p1+1));
+
+					p1 = p1 + 1;
+					p1 += p1->nbr_cells;
+				}
+			} else if (is_literal(p1) && !p1->arity)
+				qlf_depend(p, GET_STR(p1));
+
+			return;
+		}
+
+		// What a module file sets after its declaration is its own...
+
+		if (!strcmp(dirname, "module") && (c->arity == 2) && p->scan)
+			p->scan = 2;
+
+		if ((p->scan == 2) || (strcmp(dirname, "op") && strcmp(dirname, "set_prolog_flag")))
+			return;
+	}
+
 	if (!strcmp(dirname, "initialization"))
 		return;
 
@@ -894,9 +1801,7 @@ static void directives(parser *p, term *t)
 				if (strcmp(lib->name, name))
 					continue;
 
-				char *src = strndup((const char*)lib->start, (lib->end-lib->start));
-				m = module_load_text(p->m, src);
-				free(src);
+				m = module_load_lib(p->m, lib);
 
 				if (m != p->m)
 					do_db_load(m);
@@ -921,6 +1826,31 @@ static void directives(parser *p, term *t)
 
 	if (!strcmp(dirname, "dynamic") && (c->arity >= 1)) {
 		cell *p1 = c + 1;
+		int incremental = is_incremental(p1);
+
+		while (!is_end(p1)) {
+			if (!is_literal(p1)) return;
+			if (is_literal(p1) && !strcmp(GET_STR(p1), "/") && (p1->arity == 2)) {
+				cell *c_name = p1 + 1;
+				if (!is_literal(c_name)) return;
+				cell *c_arity = p1 + 2;
+				if (!is_integer(c_arity)) return;
+				rule *h = set_dynamic_in_db(p->m, GET_STR(c_name), c_arity->val_int);
+
+				if (incremental)
+					h->flags |= FLAG_RULE_INCREMENTAL;
+
+				p1 += p1->nbr_cells;
+			} else
+				p1 += 1;
+		}
+
+		return;
+	}
+
+	if (!strcmp(dirname, "table") && (c->arity >= 1)) {
+		cell *p1 = c + 1;
+		int incremental = is_incremental(p1);
 
 		while (!is_end(p1)) {
 			if (!is_literal(p1)) return;
@@ -929,7 +1859,7 @@ static void directives(parser *p, term *t)
 				if (!is_literal(c_name)) return;
 				cell *c_arity = p1 + 2;
 				if (!is_integer(c_arity)) return;
-				set_dynamic_in_db(p->m, GET_STR(c_name), c_arity->val_int);
+				set_table_in_db(p->m, GET_STR(c_name), c_arity->val_int, incremental);
 				p1 += p1->nbr_cells;
 			} else
 				p1 += 1;
@@ -979,6 +1909,23 @@ static void directives(parser *p, term *t)
 	if (!strcmp(dirname, "set_prolog_flag") && (c->arity == 2)) {
 		cell *p1 = c + 1, *p2 = c + 2;
 		if (!is_literal(p1)) return;
+
+		int *flag = !strcmp(GET_STR(p1), "persist_sync") ? &p->m->flag.persist_sync :
+			!strcmp(GET_STR(p1), "persist_compact_size") ? &p->m->flag.persist_compact_size :
+			!strcmp(GET_STR(p1), "persist_compact_ratio") ? &p->m->flag.persist_compact_ratio :
+			NULL;
+
+		if (flag) {
+			if (!is_integer(p2) || (p2->val_int < 0) || (p2->val_int > INT_MAX)) {
+				fprintf(stderr, "Error: unknown value\n");
+				p->error = 1;
+				return;
+			}
+
+			*flag = p2->val_int;
+			return;
+		}
+
 		if (!is_literal(p2)) return;
 
 		if (!strcmp(GET_STR(p1), "double_quotes")) {
@@ -1069,12 +2016,7 @@ int parser_xref(parser *p, term *t, rule *parent)
 		const char *functor = GET_STR(c);
 		module *m = p->m;
 
-		if ((c->fn = get_builtin(m, functor, c->arity)) != NULL) {
-			c->flags |= FLAG_BUILTIN;
-			continue;
-		}
-
-		if (check_builtin(m, functor, c->arity)) {
+		if (xref_builtin(m, c)) {
 			c->flags |= FLAG_BUILTIN;
 			continue;
 		}
@@ -1130,6 +2072,8 @@ static void parser_xref_db(parser *p)
 	for (rule *h = p->m->head; h; h = h->next) {
 		for (clause *r = h->head; r; r = r->next)
 			parser_xref(p, &r->t, h);
+
+		index_rule(p->m, h);
 	}
 }
 
@@ -1179,7 +2123,9 @@ static idx_t get_varno(parser *p, const char *src)
 	size_t len = strlen(src);
 
 	if ((offset+len+1) >= MAX_VAR_POOL_SIZE) {
-		fprintf(stderr, "Error: var pool exhausted\n");
+		if (!p->worker)
+			fprintf(stderr, "Error: var pool exhausted\n");
+
 		p->error = 1;
 		return 0;
 	}
@@ -1206,7 +2152,9 @@ void parser_assign_vars(parser *p)
 		c->slot_nbr = get_varno(p, GET_STR(c));
 
 		if (c->slot_nbr == MAX_ARITY) {
-			fprintf(stderr, "Error: max vars per term reached\n");
+			if (!p->worker)
+				fprintf(stderr, "Error: max vars per term reached\n");
+
 			p->error = 1;
 			return;
 		}
@@ -1220,8 +2168,10 @@ void parser_assign_vars(parser *p)
 	}
 
 	for (idx_t i = 0; i < t->nbr_vars; i++) {
-		if (p->consulting && (p->vartab.var_used[i] == 1) && (*p->vartab.var_name[i] != '_')) {
-			if (!p->m->quiet)
+		if (p->consulting && !p->m->quiet && (p->vartab.var_used[i] == 1) && (*p->vartab.var_name[i] != '_')) {
+			if (p->worker)
+				p->error = 1;
+			else
 				fprintf(stderr, "Warning: singleton: %s, line %d\n", p->vartab.var_name[i], (int)p->line_nbr);
 		}
 	}
@@ -1232,7 +2182,7 @@ void parser_assign_vars(parser *p)
 	c->nbr_cells = 1;
 
 	check_first_cut(p);
-	directives(p, t);
+	directives(p, p->t);
 }
 
 static int attach_ops(parser *p, idx_t start_idx)
@@ -1706,7 +2656,7 @@ static int get_hex(const char **srcptr, int n)
 const char *g_escapes = "\e\a\f\b\t\v\r\n";
 const char *g_anti_escapes = "eafbtvrn";
 
-static int get_escape(const char **_src, int *error)
+static int get_escape(parser *p, const char **_src)
 {
 	const char *src = *_src;
 	int ch = *src++;
@@ -1731,9 +2681,11 @@ static int get_escape(const char **_src, int *error)
 		}
 
 		if (!unicode && (*src++ != '\\')) {
-			fprintf(stderr, "Error: closing \\ missing\n");
+			if (!p->worker)
+				fprintf(stderr, "Error: closing \\ missing\n");
+
 			*_src = src;
-			*error = 1;
+			p->error = 1;
 			return 0;
 		}
 	}
@@ -1770,10 +2722,12 @@ static int get_token(parser *p, int last_op)
 		int ch = get_char_utf8(&src);
 
 		if ((ch == '\\') && p->m->flag.character_escapes) {
-			ch = get_escape(&src, &p->error);
+			ch = get_escape(p, &src);
 
 			if (p->error) {
-				fprintf(stderr, "Error: illegal character escape, line %d\n", p->line_nbr);
+				if (!p->worker)
+					fprintf(stderr, "Error: illegal character escape, line %d\n", p->line_nbr);
+
 				p->error = 1;
 				return 0;
 			}
@@ -1837,8 +2791,12 @@ static int get_token(parser *p, int last_op)
 		return 0;
 	}
 
-	if (*src == '%')
+	if (*src == '%') {
+		if (p->fp)
+			p->line_nbr++;
+
 		return 0;
+	}
 
 	do {
 		if (!p->comment && (src[0] == '/') && (src[1] == '*')) {
@@ -1943,7 +2901,7 @@ static int get_token(parser *p, int last_op)
 
 				if ((ch == '\\') && p->m->flag.character_escapes) {
 					int ch2 = *src;
-					ch = get_escape(&src, &p->error);
+					ch = get_escape(p, &src);
 
 					if (!p->error) {
 						if (ch2 == '\n') {
@@ -1951,7 +2909,9 @@ static int get_token(parser *p, int last_op)
 							break;
 						}
 					} else {
-						fprintf(stderr, "Error: illegal character escape, line %d\n", p->line_nbr);
+						if (!p->worker)
+							fprintf(stderr, "Error: illegal character escape, line %d\n", p->line_nbr);
+
 						p->error = 1;
 						return 0;
 					}
@@ -2069,6 +3029,11 @@ static int get_token(parser *p, int last_op)
 
 		if (strchr(s_delims, ch) || isalnum_utf8(ch) || (ch == '_'))
 			break;
+
+		// An end token can be followed by a comment...
+
+		if ((ch == '%') && !strcmp(p->token, "."))
+			break;
 	}
 
 	p->srcptr = (char*)src;
@@ -2094,7 +3059,12 @@ int parser_tokenize(parser *p, int args, int consing)
 				parser_dcg_rewrite(p);
 				parser_assign_vars(p);
 
-				if (p->consulting && !p->skip)
+				if ((p->qlf || p->scan) && !p->error) {
+					if (p->qlf)
+						qlf_write_parsed(p);
+
+					clear_term(p->t);
+				} else if (p->consulting && !p->skip && !p->worker)
 					if (!assertz_to_db(p->m, p->t, 1)) {
 						printf("Error: '%s', line nbr %d\n", p->token, p->line_nbr);
 						p->error = 1;
@@ -2186,7 +3156,9 @@ int parser_tokenize(parser *p, int args, int consing)
 			arity++;
 
 			if (arity > MAX_ARITY) {
-				fprintf(stderr, "Error: max arity reached, line %d: %s\n", p->line_nbr, p->srcptr);
+				if (!p->worker)
+					fprintf(stderr, "Error: max arity reached, line %d: %s\n", p->line_nbr, p->srcptr);
+
 				p->error = 1;
 				break;
 			}
@@ -2200,268 +3172,1950 @@ int parser_tokenize(parser *p, int args, int consing)
 			continue;
 		}
 
-		if (!p->quoted && p->start_term &&
-			(!strcmp(p->token, ",") || !strcmp(p->token, "]") || !strcmp(p->token, ")") || !strcmp(p->token, "}"))) {
-			fprintf(stderr, "Error: start of term expected, line %d: %s\n", p->line_nbr, p->srcptr);
-			p->error = 1;
-			break;
-		}
+		if (!p->quoted && p->start_term &&
+			(!strcmp(p->token, ",") || !strcmp(p->token, "]") || !strcmp(p->token, ")") || !strcmp(p->token, "}"))) {
+			if (!p->worker)
+				fprintf(stderr, "Error: start of term expected, line %d: %s\n", p->line_nbr, p->srcptr);
+
+			p->error = 1;
+			break;
+		}
+
+		if (!p->quoted && (!strcmp(p->token, ")") || !strcmp(p->token, "]") || !strcmp(p->token, "}"))) {
+			parser_attach(p, begin_idx);
+			return arity;
+		}
+
+		if (p->is_var && (*p->srcptr == '(')) {
+			if (!p->worker)
+				fprintf(stderr, "Error: syntax error, line %d: %s\n", p->line_nbr, p->srcptr);
+
+			p->error = 1;
+			break;
+		}
+
+		unsigned optype = 0;
+		int userop = 0;
+		int precedence = get_op(p->m, p->token, &optype, &userop, last_op);
+
+		if (p->quoted && !userop) {
+			optype = 0;
+			precedence = 0;
+		}
+
+		if (precedence && ((*p->srcptr == ',') || (*p->srcptr == ')'))) {
+			optype = 0;
+			precedence = 0;
+		}
+
+		// Operators in canonical form..
+
+		if (last_op && precedence && (*p->srcptr == '(')) {
+			p->val_type = TYPE_LITERAL;
+			optype = 0;
+			precedence = 0;
+			p->quoted = 0;
+		}
+
+		last_op = strcmp(p->token, ")") && precedence;
+		int func = (p->val_type == TYPE_LITERAL) && !optype && (*p->srcptr == '(');
+
+		if (func) {
+			is_func = 1;
+			p->is_op = 0;
+			save_idx = p->t->cidx;
+		}
+
+#if 0
+		if (p->is_op && !precedence) {
+			fprintf(stderr, "Error: syntax error or operator expected, line %d: %s, %s\n", p->line_nbr, p->token, p->srcptr);
+			p->error = 1;
+			break;
+		}
+#endif
+
+		p->start_term = 0;
+		cell *c = make_cell(p);
+		memset(c, 0, sizeof(cell));
+		c->nbr_cells = 1;
+		c->val_type = p->val_type;
+		c->flags = (uint16_t)optype;
+		c->precedence = precedence;
+
+		if (p->dcg_passthru)
+			c->flags |= FLAG_PASSTHRU;
+
+		if (p->val_type == TYPE_INT) {
+			const char *src = p->token;
+			parse_number(p, &src, &c->val_num, &c->val_den);
+
+			if (strstr(p->token, "0o"))
+				c->flags |= FLAG_OCTAL;
+			else if (strstr(p->token, "0x"))
+				c->flags |= FLAG_HEX;
+			else if (strstr(p->token, "0b"))
+				c->flags |= FLAG_BINARY;
+		}
+		else if (p->val_type == TYPE_FLOAT)
+			c->val_real = atof(p->token);
+		else if (!p->quoted || func || p->is_op || p->is_var || check_builtin(p->m, p->token, 0)) {
+			if (func && !strcmp(p->token, "."))
+				c->precedence = 0;
+
+			if (p->is_var)
+				c->val_type = TYPE_VAR;
+
+			c->val_offset = find_in_pool(p->token);
+		} else {
+			c->val_type = TYPE_STRING;
+
+			if (strlen(p->token) < MAX_SMALL_STRING) {
+				c->flags |= FLAG_SMALL_STRING;
+				strcpy(c->val_chars, p->token);
+			} else
+				c->val_str = alloc_strbuf(p->token, strlen(p->token));
+		}
+	}
+
+	p->depth--;
+	return !p->error;
+}
+
+static void free_dead(module *m)
+{
+	while (m->dead) {
+		clause *r = m->dead;
+		m->dead = r->next;
+		clear_term(&r->t);
+		free(r);
+	}
+}
+
+static void module_purge(module *m)
+{
+	if (!m->dirty)
+		return;
+
+	free_dead(m);
+
+	for (rule *h = m->head; h != NULL; h = h->next) {
+		int indexed = h->jit != NULL, purged = 0;
+		clause *last = NULL;
+		h->nbr_deleted = 0;
+
+		for (clause *r = h->head; r != NULL;) {
+			if (!r->t.deleted) {
+				last = r;
+				r = r->next;
+				continue;
+			}
+
+			retire_index(m, h);
+			purged = 1;
+
+			if (h->head == r)
+				h->head = r->next;
+
+			if (h->tail == r)
+				h->tail = last;
+
+			if (last)
+				last->next = r->next;
+
+			clause *next = r->next;
+			clear_term(&r->t);
+			free(r);
+			r = next;
+		}
+
+		if (indexed && !h->jit)
+			index_rule(m, h);
+
+		if (purged && h->index)
+			reindex_rule(h);
+	}
+
+	m->dirty = m->purge = 0;
+	m->nbr_retracted = 0;
+	m->purge_at = PURGE_MIN;
+}
+
+// Retracted clauses are left in place, to be skipped, until the query
+// ends. A long running goal that retracts a lot purges them as it goes
+// (see run_query). The roots are the choices, frames, slots, heap and
+// solution queues of every live query, suspended ones included.
+
+typedef struct {
+	const char *s;
+	idx_t owner;
+} purge_str;
+
+typedef struct {
+	clause **dead, **pinned;
+	uint8_t *live;
+	purge_str *strs;
+	idx_t nbr_dead, nbr_pinned, nbr_strs, strs_size, scanned;
+} purge_state;
+
+static int ptr_cmp(const void *ptr1, const void *ptr2)
+{
+	const char *p1 = *(const char**)ptr1, *p2 = *(const char**)ptr2;
+	return p1 < p2 ? -1 : p1 > p2 ? 1 : 0;
+}
+
+static int is_pinned(const purge_state *ps, const clause *r)
+{
+	return bsearch(&r, ps->pinned, ps->nbr_pinned, sizeof(clause*), ptr_cmp) != NULL;
+}
+
+// The dead clauses are sorted by address, so a pointer into one is
+// after its start and before the start of the next...
+
+static void purge_ptr(purge_state *ps, const void *ptr)
+{
+	const char *p = ptr;
+	idx_t lo = 0, hi = ps->nbr_dead;
+
+	if (!p)
+		return;
+
+	while (lo < hi) {
+		idx_t mid = (lo + hi) / 2;
+
+		if ((const char*)ps->dead[mid] <= p)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return;
+
+	const clause *r = ps->dead[lo-1];
+
+	if (p < (const char*)(r->t.cells + r->t.nbr_cells))
+		ps->live[lo-1] = 1;
+}
+
+static void purge_cells(purge_state *ps, const cell *c, idx_t nbr_cells)
+{
+	ps->scanned += nbr_cells;
+
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		if (is_indirect(c) || is_end(c))
+			purge_ptr(ps, c->val_cell);
+		else if (ps->nbr_strs && is_bigstring(c)) {
+			purge_str key = {c->val_str, 0};
+			const purge_str *found = bsearch(&key, ps->strs, ps->nbr_strs, sizeof(purge_str), ptr_cmp);
+
+			if (found)
+				ps->live[found->owner] = 1;
+		}
+	}
+}
+
+static void purge_scan(purge_state *ps, query *q)
+{
+	idx_t max_fp = q->st.fp, max_sp = q->st.sp;
+
+	for (idx_t i = 0; i < q->cp; i++) {
+		const choice *ch = q->choices + i;
+		purge_ptr(ps, ch->st.curr_cell);
+
+		if (ch->st.fp > max_fp)
+			max_fp = ch->st.fp;
+
+		if (ch->st.sp > max_sp)
+			max_sp = ch->st.sp;
+	}
+
+	for (idx_t f = 0; (f < max_fp) && (f < q->nbr_frames); f++)
+		purge_ptr(ps, q->frames[f].curr_cell);
+
+	for (idx_t i = 0; (i < max_sp) && (i < q->nbr_slots); i++)
+		purge_cells(ps, &q->slots[i].c, 1);
+
+	for (idx_t i = 0; i < q->st.gsp; i++)
+		purge_cells(ps, &q->gslots[i].c, 1);
+
+	purge_ptr(ps, q->st.curr_cell);
+	purge_ptr(ps, q->last_arg);
+	purge_ptr(ps, q->exception);
+	purge_cells(ps, &q->accum, 1);
+
+	for (arena *a = q->arenas; a; a = a->next) {
+		idx_t hp = (a == q->arenas) && (q->st.hp > a->hp) ? q->st.hp : a->hp;
+		purge_cells(ps, a->heap, hp);
+	}
+
+	if (q->tmp_heap)
+		purge_cells(ps, q->tmp_heap, q->tmphp);
+
+	for (idx_t i = 0; i < q->nbr_queues; i++) {
+		const collector *qs = q->qs + i;
+
+		if (qs->queue)
+			purge_cells(ps, qs->queue, qs->qp);
+
+		if (qs->tmpq)
+			purge_cells(ps, qs->tmpq, qs->tmpq_nbr);
+	}
+}
+
+// Unlinks the retracted clauses of h that no choice is positioned on,
+// onto the module's dead list...
+
+static void purge_rule(module *m, rule *h, const purge_state *ps)
+{
+	clause *last = NULL;
+	int purged = 0;
+
+	for (clause *r = h->head; r != NULL;) {
+		if (!r->t.deleted || is_pinned(ps, r)) {
+			last = r;
+			r = r->next;
+			continue;
+		}
+
+		if (h->head == r)
+			h->head = r->next;
+
+		if (h->tail == r)
+			h->tail = last;
+
+		if (last)
+			last->next = r->next;
+
+		clause *next = r->next;
+		r->next = m->dead;
+		m->dead = r;
+		h->nbr_deleted--;
+		purged = 1;
+		r = next;
+	}
+
+	if (purged && h->index)
+		reindex_rule(h);
+}
+
+static int is_iterating(const rule *h)
+{
+	if (h->index && sl_iterators(h->index))
+		return 1;
+
+	for (unsigned n = 1; h->arg_index && (n < h->arity) && (n < MAX_ARG_INDEX); n++) {
+		if (h->arg_index[n] && sl_iterators(h->arg_index[n]))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void purge_module(module *m)
+{
+	purge_state ps = {0};
+	idx_t nbr_pinned = 0;
+
+	for (query *q = g_queries; q; q = q->live_next)
+		nbr_pinned += q->cp + 1;
+
+	ps.pinned = malloc(sizeof(clause*)*(nbr_pinned+1));
+	if (!ps.pinned) abort();
+
+	for (query *q = g_queries; q; q = q->live_next) {
+		for (idx_t i = 0; i < q->cp; i++) {
+			if (q->choices[i].st.curr_clause)
+				ps.pinned[ps.nbr_pinned++] = q->choices[i].st.curr_clause;
+		}
+
+		if (q->st.curr_clause)
+			ps.pinned[ps.nbr_pinned++] = q->st.curr_clause;
+	}
+
+	qsort(ps.pinned, ps.nbr_pinned, sizeof(clause*), ptr_cmp);
+	idx_t remaining = 0;
+
+	// Static rules have a fixed index that iterations may be in, and
+	// with a skiplist only rebuild it once enough of it is dead...
+
+	for (rule *h = m->head; h != NULL; h = h->next) {
+		if (!h->nbr_deleted)
+			continue;
+
+		if (!h->jit && !is_iterating(h) &&
+			(!h->index || ((h->nbr_deleted * 8) >= sl_count(h->index))))
+			purge_rule(m, h, &ps);
+
+		remaining += h->nbr_deleted;
+	}
+
+	free(ps.pinned);
+
+	for (clause *r = m->dead; r; r = r->next)
+		ps.nbr_dead++;
+
+	ps.dead = malloc(sizeof(clause*)*(ps.nbr_dead+1));
+	ps.live = calloc(ps.nbr_dead+1, 1);
+	if (!ps.dead || !ps.live) abort();
+	idx_t i = 0;
+
+	for (clause *r = m->dead; r; r = r->next)
+		ps.dead[i++] = r;
+
+	qsort(ps.dead, ps.nbr_dead, sizeof(clause*), ptr_cmp);
+
+	// Big strings in the dead clauses may be shared, uncounted, by
+	// copies of their cells...
+
+	for (i = 0; i < ps.nbr_dead; i++) {
+		const clause *r = ps.dead[i];
+
+		for (idx_t j = 0; j < r->t.nbr_cells; j++) {
+			const cell *c = r->t.cells + j;
+
+			if (!is_bigstring(c))
+				continue;
+
+			if (ps.nbr_strs == ps.strs_size) {
+				ps.strs_size = ps.strs_size ? ps.strs_size * 2 : 256;
+				ps.strs = realloc(ps.strs, sizeof(purge_str)*ps.strs_size);
+				if (!ps.strs) abort();
+			}
+
+			ps.strs[ps.nbr_strs].s = c->val_str;
+			ps.strs[ps.nbr_strs++].owner = i;
+		}
+	}
+
+	if (ps.nbr_strs)
+		qsort(ps.strs, ps.nbr_strs, sizeof(purge_str), ptr_cmp);
+
+	for (query *q = g_queries; q && ps.nbr_dead; q = q->live_next)
+		purge_scan(&ps, q);
+
+	m->dead = NULL;
+
+	for (i = 0; i < ps.nbr_dead; i++) {
+		clause *r = ps.dead[i];
+
+		if (ps.live[i]) {
+			r->next = m->dead;
+			m->dead = r;
+			remaining++;
+			continue;
+		}
+
+		clear_term(&r->t);
+		free(r);
+	}
+
+	m->nbr_retracted = remaining;
+	idx_t slack = remaining > (ps.scanned / 16) ? remaining : ps.scanned / 16;
+	m->purge_at = remaining + (slack > PURGE_MIN ? slack : PURGE_MIN);
+	free(ps.dead);
+	free(ps.live);
+	free(ps.strs);
+}
+
+void purge_retracted(void)
+{
+	g_purge = 0;
+
+	for (module *m = g_modules; m; m = m->next) {
+		if (!m->purge)
+			continue;
+
+		m->purge = 0;
+		purge_module(m);
+	}
+}
+
+static int parser_run(parser *p, const char *src, int dump)
+{
+	p->srcptr = (char*)src;
+
+	if (!parser_tokenize(p, 0, 0))
+		return 0;
+
+	if (p->skip) {
+		p->m->status = 1;
+		return 1;
+	}
+
+	if (!parser_attach(p, 0))
+		return 0;
+
+	if (p->command) {
+		parser_dcg_rewrite(p);
+		parser_assign_vars(p);
+	}
+
+	if (!parser_xref(p, p->t, NULL))
+		return 0;
+
+	query *q = create_query(p->m, 0);
+	query_execute(q, p->t);
+
+	if (q->halt)
+		q->error = 0;
+	else if (dump)
+		dump_vars(q, p);
+
+	p->m->halt = q->halt;
+	p->m->halt_code = q->halt_code;
+	p->m->status = q->status;
+
+	if (!p->m->quiet && !p->directive && dump && q->m->stats) {
+		fprintf(stderr,
+			"Goals %llu, Matches %llu, Max frames %u, Max slots %u, Max choices %u, Max trails: %u, Heap: %u, Backtracks %llu, TCOs:%llu\n",
+			(unsigned long long)q->tot_goals, (unsigned long long)q->tot_matches,
+			q->max_frames, q->max_slots, q->max_choices, q->max_trails, q->max_heaps,
+			(unsigned long long)q->tot_retries, (unsigned long long)q->tot_tcos);
+	}
+
+	int ok = !q->error;
+	destroy_query(q);
+	module_purge(p->m);
+
+	if (!p->directive) {
+		while (p->m->retired) {
+			cindex *save = p->m->retired;
+			p->m->retired = save->next;
+			free_index(save);
+		}
+	}
+
+	return ok;
+}
+
+static int module_load_done(parser *p, module **mp)
+{
+	free(p->save_line);
+
+	if (!p->error && !p->end_of_term && p->t->cidx) {
+		fprintf(stderr, "Error: incomplete statement\n");
+		p->error = 1;
+	}
+
+	if (!p->error) {
+		parser_xref_db(p);
+		int save = p->m->quiet;
+		p->m->quiet = 1;
+		p->directive = 1;
+
+		if (parser_run(p, "initialization(G), call(G)", 0))
+			p->m->halt = 1;
+		else
+			p->m->halt = 0;
+
+		p->directive = 0;
+		p->m->quiet = save;
+	}
+
+	int ok = !p->error;
+	int halt = p->m->halt;
+
+	if (mp)
+		*mp = p->m;
+
+	destroy_parser(p);
+	return ok && !halt;
+}
+
+static module *module_load_text(module *m, const char *src)
+{
+	parser *p = create_parser(m);
+	p->consulting = 1;
+	p->srcptr = (char*)src;
+	parser_tokenize(p, 0, 0);
+	module_load_done(p, &m);
+	return m;
+}
+
+int module_load_fp(module *m, FILE *fp)
+{
+	parser *p = create_parser(m);
+	p->consulting = 1;
+	p->fp = fp;
+	int ok;
+
+	do {
+		if (getline(&p->save_line, &p->n_line, p->fp) == -1)
+			break;
+
+		p->srcptr = p->save_line;
+		ok = parser_tokenize(p, 0, 0);
+	}
+	 while (ok);
+
+	return module_load_done(p, NULL);
+}
+
+static const char *copy_token(parser *p, const char *src, const char *end)
+{
+	size_t len = end - src;
+
+	if (len >= p->token_size)
+		return NULL;
+
+	memcpy(p->token, src, len);
+	p->token[len] = '\0';
+	return p->token;
+}
+
+#ifndef _WIN32
+
+// Bulk loading of a memory mapped file. Simple ground facts, that is
+// name(Arg, ...). on one line where each argument is an atom, a quoted
+// atom without escapes or a decimal integer, are built straight into
+// cells, bypassing the tokenizer. Anything else is handed to the full
+// parser one statement at a time.
+
+static const char *skip_layout(const char *src, const char *end, int *line_nbr)
+{
+	while (src < end) {
+		if (*src == '\n') {
+			(*line_nbr)++;
+			src++;
+		} else if (isspace((uint8_t)*src))
+			src++;
+		else if (*src == '%') {
+			while ((src < end) && (*src != '\n'))
+				src++;
+		} else
+			break;
+	}
+
+	return src;
+}
+
+static const char *bulk_term(parser *p, const char *src, const char *end)
+{
+	const char *s = src;
+
+	if (!islower((uint8_t)*s))
+		return NULL;
+
+	while ((s < end) && (isalnum((uint8_t)*s) || (*s == '_')))
+		s++;
+
+	if ((s == end) || (*s != '(') || !copy_token(p, src, s))
+		return NULL;
+
+	p->t->cidx = 0;
+	cell *c = make_cell(p);
+	memset(c, 0, sizeof(cell));
+	c->val_type = TYPE_LITERAL;
+	c->val_offset = find_in_pool(p->token);
+	unsigned arity = 0;
+	s++;
+
+	for (;;) {
+		while ((s < end) && ((*s == ' ') || (*s == '\t')))
+			s++;
+
+		if ((s == end) || (arity == MAX_ARITY))
+			break;
+
+		c = make_cell(p);
+		memset(c, 0, sizeof(cell));
+		c->nbr_cells = 1;
+		src = s;
+
+		if (islower((uint8_t)*s)) {
+			while ((s < end) && (isalnum((uint8_t)*s) || (*s == '_')))
+				s++;
+
+			if (!copy_token(p, src, s))
+				break;
+
+			c->val_type = TYPE_LITERAL;
+			c->val_offset = find_in_pool(p->token);
+		} else if (*s == '\'') {
+			src = ++s;
+
+			while ((s < end) && (*s != '\'') && (*s != '\\') && (*s != '\n'))
+				s++;
+
+			if ((s == end) || (*s != '\'') || !copy_token(p, src, s++))
+				break;
+
+			// Quoted operators are read as plain atoms, leave them
+			// to the parser...
+
+			if (get_op(p->m, p->token, NULL, NULL, 0))
+				break;
+
+			if (check_builtin(p->m, p->token, 0)) {
+				c->val_type = TYPE_LITERAL;
+				c->val_offset = find_in_pool(p->token);
+			} else {
+				size_t len = strlen(p->token);
+				c->val_type = TYPE_STRING;
+
+				if (len < MAX_SMALL_STRING) {
+					c->flags |= FLAG_SMALL_STRING;
+					memcpy(c->val_chars, p->token, len+1);
+				} else
+					c->val_str = alloc_strbuf(p->token, len);
+			}
+		} else if (isdigit((uint8_t)*s) || ((*s == '-') && ((s+1) < end) && isdigit((uint8_t)s[1]))) {
+			int neg = *s == '-';
+			int_t v = 0;
+			src = s += neg;
+
+			while ((s < end) && isdigit((uint8_t)*s) && ((s - src) < 18))
+				v = (v * 10) + (*s++ - '0');
+
+			if (((s < end) && isdigit((uint8_t)*s)) || ((*src == '0') && ((s - src) > 1)))
+				break;
+
+			c->val_type = TYPE_INT;
+			c->val_num = neg ? -v : v;
+			c->val_den = 1;
+		} else
+			break;
+
+		arity++;
+
+		if ((s < end) && (*s == ','))
+			s++;
+		else if ((s < end) && (*s == ')') && ((s+1) < end) && (s[1] == '.')) {
+			s += 2;
+
+			if ((s < end) && !isspace((uint8_t)*s) && (*s != '%'))
+				break;
+
+			c = p->t->cells;
+			c->arity = arity;
+			c->nbr_cells = p->t->cidx;
+			c = make_cell(p);
+			memset(c, 0, sizeof(cell));
+			c->val_type = TYPE_END;
+			c->nbr_cells = 1;
+			p->t->nbr_vars = p->t->first_cut = p->t->cut_only = 0;
+			return s;
+		} else
+			break;
+	}
+
+	clear_term(p->t);
+	return NULL;
+}
+
+// The rule for head c, trying the one the last clause went to first
+
+static rule *head_rule(module *m, cell *c, rule *last)
+{
+	if (last && (last->val_offset == c->val_offset) && (last->arity == c->arity))
+		return last;
+
+	rule *h = find_match(m, c);
+
+	if (h && (h->flags&FLAG_RULE_TABLED)) {
+		h = h->impl;
+		c->val_offset = h->val_offset;
+	}
+
+	return h ? h : create_rule(m, c);
+}
+
+static const char *bulk_fact(parser *p, const char *src, const char *end, rule **last)
+{
+	const char *s = bulk_term(p, src, end);
+
+	if (!s)
+		return NULL;
+
+	*last = head_rule(p->m, p->t->cells, *last);
+	append_to_rule(p->m, *last, p->t);
+	return s;
+}
+
+static size_t parser_load_stmt(parser *p, const char *src, const char *end)
+{
+	size_t len = end - src;
+	p->fp = fmemopen((void*)src, len, "r");
+
+	if (!p->fp) {
+		p->error = 1;
+		return 0;
+	}
+
+	p->one_shot = 1;
+	p->end_of_term = 0;
+
+	do {
+		if (getline(&p->save_line, &p->n_line, p->fp) == -1)
+			break;
+
+		p->srcptr = p->save_line;
+
+		if (!parser_tokenize(p, 0, 0))
+			break;
+	}
+	 while (!p->end_of_term);
+
+	if (p->end_of_term)
+		len = ftell(p->fp) - strlen(p->srcptr);
+
+	fclose(p->fp);
+	p->fp = NULL;
+	return len;
+}
+
+// Hand back pages already consumed so the mapping doesn't add the
+// whole file to the peak footprint...
+
+static void release_pages(const char **done, const char *upto)
+{
+	if ((size_t)(upto - *done) < (16*1024*1024))
+		return;
+
+	size_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+	upto = *done + ((upto - *done) & ~page_mask);
+	madvise((void*)*done, upto - *done, MADV_DONTNEED);
+	*done = upto;
+}
+
+static void load_serial(parser *p, const char *src, const char *end)
+{
+	const char *done = src;
+	rule *h = NULL;
+	size_t len;
+
+	while (!p->error && ((src = skip_layout(src, end, &p->line_nbr)) < end)) {
+		release_pages(&done, src);
+		const char *s = bulk_fact(p, src, end, &h);
+
+		if (s) {
+			src = s;
+			continue;
+		}
+
+		if (!(len = parser_load_stmt(p, src, end)))
+			break;
+
+		src += len;
+		h = NULL;
+	}
+}
+
+// Parallel consult. The text is split into statements at their full
+// stop and handed out in batches to worker threads, each tokenizing
+// into a private term and making a clause of it. The loading thread
+// links the clauses in order while the workers get on with the next
+// batch. A batch stops short of a directive, which is run once the
+// workers are idle, so operators and flags take effect just as when
+// loading sequentially. Workers never report anything: a statement
+// with a diagnostic, or that the tokenizer doesn't end where it was
+// split, is re-read by the loading thread, which reads on until it is
+// back at a point where the text was split. Should that not be in the
+// batch, or a directive be read on the way, the rest of the text is
+// loaded sequentially.
+
+#define LOAD_BATCH 4096
+#define LOAD_SLICE 32
+#define LOAD_PARALLEL_MIN (1024*1024)
+#define LOAD_MAX_THREADS 8
+
+typedef struct {
+	const char *src;
+	clause *r;
+	size_t len;
+	int line_nbr, directive;
+} load_stmt;
+
+typedef struct {
+	load_stmt stmts[LOAD_BATCH];
+	const char *end;
+	size_t nbr_stmts, next, done;
+	int line_nbr, serial;
+} load_batch;
+
+typedef struct {
+	module *m;
+	load_batch *batch;
+	pthread_mutex_t guard;
+	pthread_cond_t ready, finished;
+	unsigned generation;
+	int stop;
+} load_ctx;
+
+// A full stop ending a run of symbol chars is part of that atom...
+
+static int is_symbol_char(int ch)
+{
+	return (ch > ' ') && (ch < 0x80) && !isalnum(ch) && !strchr("(){}[]_,`'\"!", ch);
+}
+
+// Finds the end of the statement at src, a full stop followed by
+// layout or a comment, outside of quotes and comments. Returns NULL if
+// there is none.
+
+static const char *split_stmt(const char *src, const char *end, int *line_nbr)
+{
+	const char *s = src;
+	int lines = 0;
+
+	while (s < end) {
+		int ch = *s++;
+
+		if (ch == '\n')
+			lines++;
+		else if (ch == '%') {
+			while ((s < end) && (*s != '\n'))
+				s++;
+		} else if ((ch == '/') && (s < end) && (*s == '*')) {
+			const char *body = ++s;
+
+			while ((s < end) && !((*s == '/') && (s > body) && (s[-1] == '*'))) {
+				if (*s++ == '\n')
+					lines++;
+			}
+
+			if (s++ == end)
+				return NULL;
+		} else if ((ch == '\'') && ((s-2) >= src) && (s[-2] == '0') &&
+			(((s-2) == src) || (!isalnum((uint8_t)s[-3]) && (s[-3] != '_')))) {
+			if ((s < end) && (*s == '\\'))
+				s += 2;
+			else if (((s+1) < end) && (s[0] == '\'') && (s[1] == '\''))
+				s += 2;
+			else
+				s++;
+		} else if ((ch == '\'') || (ch == '"') || (ch == '`')) {
+			for (;;) {
+				if (s >= end)
+					return NULL;
+
+				int c = *s++;
+
+				if (c == '\n')
+					lines++;
+				else if ((c == '\\') && (s < end)) {
+					if (*s++ == '\n')
+						lines++;
+				} else if (c == ch) {
+					if ((s < end) && (*s == ch))
+						s++;
+					else
+						break;
+				}
+			}
+		} else if ((ch == '.') && ((s == end) || isspace(*s) || (*s == '%'))) {
+			if (((s-2) >= src) && is_symbol_char((uint8_t)s[-2]))
+				continue;
+
+			*line_nbr += lines;
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+static int is_directive(const char *src, const char *end)
+{
+	return ((*src == ':') || (*src == '?')) && ((src+1) < end) && (src[1] == '-');
+}
+
+// Directives, and anything that can't be split, are left to the
+// loading thread. The batch ends there with serial set.
+
+static void split_batch(load_batch *b, const char *src, const char *end, int line_nbr)
+{
+	b->nbr_stmts = 0;
+	b->serial = 0;
+
+	while ((b->nbr_stmts < LOAD_BATCH) && ((src = skip_layout(src, end, &line_nbr)) < end)) {
+		if (is_directive(src, end)) {
+			b->serial = 1;
+			break;
+		}
+
+		load_stmt *s = b->stmts + b->nbr_stmts;
+		s->line_nbr = line_nbr;
+		const char *e = split_stmt(src, end, &line_nbr);
+
+		if (!e) {
+			b->serial = 1;
+			break;
+		}
+
+		s->src = src;
+		s->len = e - src;
+		s->r = NULL;
+		s->directive = 0;
+		b->nbr_stmts++;
+		src = e;
+	}
+
+	b->end = src;
+	b->line_nbr = line_nbr;
+}
+
+static parser *create_worker(module *m)
+{
+	parser *p = create_parser(m);
+	p->consulting = p->worker = p->one_shot = 1;
+	return p;
+}
+
+static void destroy_worker(parser *p)
+{
+	free(p->save_line);
+	destroy_parser(p);
+}
+
+static void load_parse(parser **pp, load_stmt *s)
+{
+	parser *p = *pp;
+	const char *end = s->src + s->len, *e;
+
+	if ((e = bulk_term(p, s->src, end)) == end) {
+		s->r = make_clause(p->m, p->t);
+		return;
+	}
+
+	if (e)
+		clear_term(p->t);
+
+	if (p->n_line <= s->len) {
+		p->save_line = realloc(p->save_line, p->n_line=s->len+1);
+		if (!p->save_line) abort();
+	}
+
+	memcpy(p->save_line, s->src, s->len);
+	p->save_line[s->len] = '\0';
+	p->srcptr = p->save_line;
+	p->line_nbr = s->line_nbr;
+	p->end_of_term = 0;
+	parser_tokenize(p, 0, 0);
+	cell *c = p->t->cells;
+
+	if (p->t->cidx && is_literal(c) && (c->arity == 1) && !strcmp(GET_STR(c), ":-"))
+		s->directive = 1;
+
+	if (p->error || !p->end_of_term || *p->srcptr || s->directive || !p->t->cidx || !get_head(c)) {
+		// Start afresh, the parser may have stopped mid-term...
+
+		*pp = create_worker(p->m);
+		destroy_worker(p);
+		return;
+	}
+
+	s->r = make_clause(p->m, p->t);
+}
+
+static void *load_worker(void *arg)
+{
+	load_ctx *ctx = arg;
+	parser *p = create_worker(ctx->m);
+	unsigned generation = 0;
+	pthread_mutex_lock(&ctx->guard);
+
+	for (;;) {
+		while (!ctx->stop && (ctx->generation == generation))
+			pthread_cond_wait(&ctx->ready, &ctx->guard);
+
+		if (ctx->stop)
+			break;
+
+		// The batch is only rewritten once all of it is done and
+		// the generation moves on...
+
+		load_batch *b = ctx->batch;
+		size_t nbr_stmts = b->nbr_stmts;
+		generation = ctx->generation;
+		p->m = ctx->m;
+
+		while ((ctx->generation == generation) && (b->next < nbr_stmts)) {
+			size_t i = b->next, n = nbr_stmts - i;
+
+			if (n > LOAD_SLICE)
+				n = LOAD_SLICE;
+
+			b->next += n;
+			pthread_mutex_unlock(&ctx->guard);
+
+			for (size_t j = i; j < (i+n); j++)
+				load_parse(&p, b->stmts+j);
+
+			pthread_mutex_lock(&ctx->guard);
+
+			if ((b->done += n) == nbr_stmts)
+				pthread_cond_signal(&ctx->finished);
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->guard);
+	destroy_worker(p);
+	return NULL;
+}
+
+static void load_start(load_ctx *ctx, load_batch *b, module *m)
+{
+	pthread_mutex_lock(&ctx->guard);
+	b->next = b->done = 0;
+	ctx->batch = b;
+	ctx->m = m;
+	ctx->generation++;
+	pthread_cond_broadcast(&ctx->ready);
+	pthread_mutex_unlock(&ctx->guard);
+}
+
+static void load_wait(load_ctx *ctx, load_batch *b)
+{
+	pthread_mutex_lock(&ctx->guard);
+
+	while (b->done < b->nbr_stmts)
+		pthread_cond_wait(&ctx->finished, &ctx->guard);
+
+	pthread_mutex_unlock(&ctx->guard);
+}
+
+static void load_discard(load_batch *b, size_t from, size_t to)
+{
+	for (size_t i = from; i < to; i++) {
+		clause *r = b->stmts[i].r;
+
+		if (r) {
+			clear_term(&r->t);
+			free(r);
+		}
+	}
+}
+
+// Links the clauses of batch b in order. A statement re-read here
+// that didn't end where it was split is followed by others read here
+// until the text is back at a split point, the clauses made of those
+// passed over being dropped. Returns where to carry on from if that
+// point is not in the batch, or a statement re-read was a directive,
+// having dropped the rest of the batch and the one read ahead (next,
+// if any). Else returns NULL.
+
+static const char *load_commit(parser *p, load_ctx *ctx, load_batch *b, load_batch *next, const char *end)
+{
+	rule *h = NULL;
+
+	for (size_t i = 0; i < b->nbr_stmts; i++) {
+		load_stmt *s = b->stmts + i;
+
+		if (s->r) {
+			h = head_rule(p->m, get_head(s->r->t.cells), h);
+			link_clause(p->m, h, s->r);
+			continue;
+		}
+
+		if (next)
+			load_wait(ctx, next);
+
+		p->line_nbr = s->line_nbr;
+		const char *src = s->src + parser_load_stmt(p, s->src, end);
+		size_t j = i + 1;
+		h = NULL;
+
+		while (!p->error && !s->directive) {
+			while ((j < b->nbr_stmts) && (b->stmts[j].src < src))
+				j++;
+
+			const char *split = j < b->nbr_stmts ? b->stmts[j].src : b->end;
+			src = skip_layout(src, end, &p->line_nbr);
+
+			if ((src == split) || (src == end) || is_directive(src, end))
+				break;
+
+			size_t len = parser_load_stmt(p, src, end);
+
+			if (!len)
+				break;
+
+			src += len;
+		}
+
+		if (p->error || s->directive || (src != (j < b->nbr_stmts ? b->stmts[j].src : b->end))) {
+			load_discard(b, i+1, b->nbr_stmts);
+
+			if (next)
+				load_discard(next, 0, next->nbr_stmts);
+
+			return src;
+		}
+
+		load_discard(b, i+1, j);
+		i = j - 1;
+	}
+
+	p->line_nbr = b->line_nbr;
+	return NULL;
+}
+
+static void load_parallel(parser *p, const char *src, const char *end, unsigned nbr_workers)
+{
+	load_ctx ctx = {0};
+	pthread_mutex_init(&ctx.guard, NULL);
+	pthread_cond_init(&ctx.ready, NULL);
+	pthread_cond_init(&ctx.finished, NULL);
+	pthread_t *workers = calloc(nbr_workers, sizeof(pthread_t));
+	load_batch *b = calloc(1, sizeof(load_batch));
+	load_batch *next = calloc(1, sizeof(load_batch));
+	if (!workers || !b || !next) abort();
+	const char *done = src;
+	unsigned started = 0;
+	pool_share(1);
+	ctx.m = p->m;
+
+	while ((started < nbr_workers) && !pthread_create(workers+started, NULL, load_worker, &ctx))
+		started++;
+
+	if (!started)
+		load_serial(p, src, end);
+	else {
+		split_batch(b, src, end, p->line_nbr);
+		load_start(&ctx, b, p->m);
+	}
+
+	while (started && !p->error) {
+		int ahead = !b->serial && (b->end < end);
+
+		if (ahead)
+			split_batch(next, b->end, end, b->line_nbr);
+
+		load_wait(&ctx, b);
+
+		if (ahead)
+			load_start(&ctx, next, p->m);
+
+		const char *resync = load_commit(p, &ctx, b, ahead ? next : NULL, end);
+
+		if (p->error)
+			break;
+
+		if (ahead && !resync) {
+			load_batch *tmp = b;
+			b = next;
+			next = tmp;
+			release_pages(&done, next->end);
+			continue;
+		}
+
+		// The tokenizer couldn't be brought back in step with the
+		// split text, so the rest of it is read here...
+
+		if (resync) {
+			load_serial(p, resync, end);
+			break;
+		}
+
+		if (b->serial) {
+			size_t len = parser_load_stmt(p, b->end, end);
+
+			if (!len || p->error)
+				break;
+
+			src = b->end + len;
+		} else
+			break;
+
+		if ((src = skip_layout(src, end, &p->line_nbr)) == end)
+			break;
+
+		// A late worker may still be looking at the last batch
+		// started, so split into the other one...
+
+		if (ctx.batch == b) {
+			load_batch *tmp = b;
+			b = next;
+			next = tmp;
+		}
+
+		release_pages(&done, src);
+		split_batch(b, src, end, p->line_nbr);
+		load_start(&ctx, b, p->m);
+	}
+
+	pthread_mutex_lock(&ctx.guard);
+	ctx.stop = 1;
+	pthread_cond_broadcast(&ctx.ready);
+	pthread_mutex_unlock(&ctx.guard);
+
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	pool_share(0);
+	pthread_cond_destroy(&ctx.finished);
+	pthread_cond_destroy(&ctx.ready);
+	pthread_mutex_destroy(&ctx.guard);
+	free(workers);
+	free(next);
+	free(b);
+}
+
+// Large files are loaded in parallel unless the thread count is set
+
+static unsigned load_threads(module *m, size_t len)
+{
+	if (m->threads)
+		return m->threads;
+
+	if (len < LOAD_PARALLEL_MIN)
+		return 1;
+
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n > LOAD_MAX_THREADS ? LOAD_MAX_THREADS : n;
+}
+
+static int module_load_mem(module *m, const char *src, size_t len)
+{
+	parser *p = create_parser(m);
+	p->consulting = 1;
+	unsigned nbr_threads = load_threads(m, len);
+
+	if (nbr_threads > 1)
+		load_parallel(p, src, src+len, nbr_threads-1);
+	else
+		load_serial(p, src, src+len);
+
+	return module_load_done(p, NULL);
+}
+
+#endif
+
+// Precompiled (.qlf) files hold the terms of a source file as read,
+// that is after operator attachment, DCG rewriting and variable
+// numbering. Loading replays them through directives() and into the
+// database, skipping the tokenizer. Records are an atom ('a', length
+// and bytes) the first time it is seen, numbered in order, or a term
+// ('t', header and cells), all after the stamp of the source and the
+// files the source loads ('d', length, path and stamp) which are
+// checked before it is used. A cell is its type, arity, flags and size
+// followed by what its type needs: an atom number, slot, value or the
+// text of a string. Counts and integers are varints. The header is
+// native endian, so a file from another architecture is rejected and
+// the source loaded instead. Persistent predicate logs use the same
+// encoding for their terms.
+
+#define QLF_MAGIC "TPLQ"
+#define QLF_VERSION 4
+#define QLF_HEADER_SIZE 8
+
+static int qlf_valid(const char *src, size_t len)
+{
+	uint16_t version, cell_size;
+
+	if ((len < QLF_HEADER_SIZE) || memcmp(src, QLF_MAGIC, 4))
+		return 0;
+
+	memcpy(&version, src+4, sizeof(version));
+	memcpy(&cell_size, src+6, sizeof(cell_size));
+	return (version == QLF_VERSION) && (cell_size == sizeof(cell));
+}
+
+static void qlf_filename(char *dst, size_t size, const char *filename)
+{
+	snprintf(dst, size, "%s", filename);
+	char *ext = strrchr(dst, '.');
+
+	if (ext && (!strcmp(ext, ".pro") || !strcmp(ext, ".pl")))
+		*ext = '\0';
+
+	size_t len = strlen(dst);
+	snprintf(dst+len, size-len, ".qlf");
+}
+
+void qlf_put(qlf_out *o, const void *src, size_t len)
+{
+	if ((o->len + len) > o->size) {
+		o->size = (o->len + len) * 2;
+		o->buf = realloc(o->buf, o->size);
+		if (!o->buf) abort();
+	}
+
+	memcpy(o->buf+o->len, src, len);
+	o->len += len;
+}
+
+void qlf_clear(qlf_out *o)
+{
+	free(o->buf);
+	free(o->atoms);
+	memset(o, 0, sizeof(qlf_out));
+}
+
+static uint32_t *qlf_slot(qlf_out *o, idx_t offset)
+{
+	size_t slot = offset / sizeof(uint32_t);
+
+	if (slot >= o->atoms_size) {
+		size_t size = (slot + 1) * 2;
+		o->atoms = realloc(o->atoms, sizeof(uint32_t)*size);
+		if (!o->atoms) abort();
+		memset(o->atoms+o->atoms_size, 0, sizeof(uint32_t)*(size-o->atoms_size));
+		o->atoms_size = size;
+	}
+
+	return o->atoms + slot;
+}
+
+static void qlf_put_uint(qlf_out *o, uint_t v)
+{
+	uint8_t tmpbuf[24], *dst = tmpbuf;
+
+	while (v >= 0x80) {
+		*dst++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+
+	*dst++ = (uint8_t)v;
+	qlf_put(o, tmpbuf, dst-tmpbuf);
+}
+
+static void qlf_put_int(qlf_out *o, int_t v)
+{
+	qlf_put_uint(o, ((uint_t)v << 1) ^ (uint_t)(v < 0 ? -1 : 0));
+}
+
+static uint32_t qlf_atom(qlf_out *o, idx_t offset)
+{
+	uint32_t *slot = qlf_slot(o, offset);
+
+	if (!*slot) {
+		uint32_t len = POOL_LEN(offset);
+		qlf_put(o, "a", 1);
+		qlf_put_uint(o, len);
+		qlf_put(o, g_pool+offset, len);
+		*slot = ++o->nbr_atoms;
+	}
+
+	return *slot - 1;
+}
+
+// Carry on the numbering of atoms already read back from a file,
+// so records appended to it can refer to the earlier definitions...
+
+void qlf_seed(qlf_out *o, const qlf_in *in)
+{
+	for (size_t i = 0; i < in->nbr_atoms; i++)
+		*qlf_slot(o, in->atoms[i]) = i + 1;
+
+	o->nbr_atoms = in->nbr_atoms;
+}
+
+void qlf_write_term(qlf_out *o, term *t)
+{
+	for (idx_t i = 0; i < t->cidx; i++) {
+		cell *c = t->cells + i;
+
+		if (is_literal(c) || is_var(c))
+			qlf_atom(o, c->val_offset);
+	}
+
+	uint8_t hdr[3] = {t->nbr_vars, t->first_cut, t->cut_only};
+	qlf_put(o, "t", 1);
+	qlf_put_uint(o, t->cidx);
+	qlf_put(o, hdr, sizeof(hdr));
+
+	for (idx_t i = 0; i < t->cidx; i++) {
+		cell *c = t->cells + i;
+		uint8_t type[2] = {c->val_type, c->arity};
+		unsigned flags = c->flags;
+
+		// Rule and builtin pointers only mean something in this
+		// process, they are looked up again when read back...
+
+		if (is_literal(c))
+			flags &= ~(FLAG_BUILTIN|FLAG_TAIL|FLAG_TAILREC);
+		else if (is_string(c))
+			flags &= ~(FLAG_SLICE|FLAG_CONST);
+		else if (is_integer(c))
+			flags &= ~FLAG_STREAM;
+
+		qlf_put(o, type, sizeof(type));
+		qlf_put_uint(o, flags);
+		qlf_put_uint(o, c->nbr_cells);
+
+		if (is_literal(c))
+			qlf_put_uint(o, qlf_atom(o, c->val_offset));
+		else if (is_var(c)) {
+			qlf_put_uint(o, qlf_atom(o, c->val_offset));
+			qlf_put_uint(o, c->slot_nbr);
+		} else if (is_rational(c)) {
+			qlf_put_int(o, c->val_num);
+			qlf_put_int(o, c->val_den);
+		} else if (is_real(c))
+			qlf_put(o, &c->val_real, sizeof(c->val_real));
+		else if (is_string(c)) {
+			uint32_t len = LEN_STR(c);
+			qlf_put_uint(o, len);
+			qlf_put(o, GET_STR(c), len);
+		}
+	}
+}
+
+static void qlf_write_parsed(parser *p)
+{
+	qlf_write_term(&p->qlf_buf, p->t);
+}
+
+int qlf_read(const char **src, const char *end, void *dst, size_t len)
+{
+	if ((size_t)(end - *src) < len)
+		return 0;
+
+	memcpy(dst, *src, len);
+	*src += len;
+	return 1;
+}
+
+static int qlf_read_uint(const char **src, const char *end, uint_t *v)
+{
+	*v = 0;
+
+	for (unsigned shift = 0; (*src < end) && (shift < sizeof(uint_t)*8); shift += 7) {
+		uint8_t ch = *(*src)++;
+		*v |= (uint_t)(ch & 0x7F) << shift;
+
+		if (!(ch & 0x80))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int qlf_read_int(const char **src, const char *end, int_t *v)
+{
+	uint_t u;
+
+	if (!qlf_read_uint(src, end, &u))
+		return 0;
+
+	*v = (int_t)(u >> 1) ^ -(int_t)(u & 1);
+	return 1;
+}
+
+static int qlf_read_len(const char **src, const char *end, size_t *len)
+{
+	uint_t v;
+
+	if (!qlf_read_uint(src, end, &v) || ((uint_t)(end - *src) < v))
+		return 0;
+
+	*len = v;
+	return 1;
+}
+
+int qlf_read_atom(parser *p, qlf_in *in, const char **src, const char *end)
+{
+	size_t n;
+
+	if (!qlf_read_len(src, end, &n) || !copy_token(p, *src, *src+n))
+		return 0;
+
+	if (in->nbr_atoms == in->max_atoms) {
+		in->max_atoms = in->max_atoms ? in->max_atoms * 2 : 1024;
+		in->atoms = realloc(in->atoms, sizeof(idx_t)*in->max_atoms);
+		if (!in->atoms) abort();
+	}
+
+	in->atoms[in->nbr_atoms++] = find_in_pool(p->token);
+	*src += n;
+	return 1;
+}
+
+// The flags a cell of each type can be written with, any others
+// only mean something to the process that set them...
+
+static uint_t qlf_flags(unsigned val_type)
+{
+	uint_t flags = FLAG_PASSTHRU|OP_FX|OP_FY|OP_XF|OP_YF|OP_YFX|OP_XFX|OP_XFY;
+
+	if (val_type == TYPE_INT)
+		flags |= FLAG_HEX|FLAG_OCTAL|FLAG_BINARY;
+	else if (val_type == TYPE_STRING)
+		flags |= FLAG_SMALL_STRING;
+	else if (val_type == TYPE_VAR)
+		flags |= FLAG_FIRST_USE;
+
+	return flags;
+}
+
+static int qlf_read_cell(const qlf_in *in, const char **src, const char *end, cell *c)
+{
+	uint8_t type[2];
+	uint_t flags, nbr_cells, v;
+
+	if (!qlf_read(src, end, type, sizeof(type)) ||
+		!qlf_read_uint(src, end, &flags) ||
+		!qlf_read_uint(src, end, &nbr_cells) ||
+		(flags & ~qlf_flags(type[0])))
+		return 0;
+
+	memset(c, 0, sizeof(cell));
+	c->val_type = type[0];
+	c->arity = type[1];
+	c->flags = flags;
+	c->nbr_cells = nbr_cells;
+
+	switch (c->val_type) {
+		case TYPE_LITERAL:
+			if (!qlf_read_uint(src, end, &v) || (v >= in->nbr_atoms))
+				return 0;
+
+			c->val_offset = in->atoms[v];
+			return 1;
+
+		case TYPE_VAR:
+			if (!qlf_read_uint(src, end, &v) || (v >= in->nbr_atoms))
+				return 0;
+
+			c->val_offset = in->atoms[v];
+
+			if (!qlf_read_uint(src, end, &v))
+				return 0;
+
+			c->slot_nbr = v;
+			return 1;
+
+		case TYPE_INT:
+			return qlf_read_int(src, end, &c->val_num) && qlf_read_int(src, end, &c->val_den);
+
+		case TYPE_FLOAT:
+			return qlf_read(src, end, &c->val_real, sizeof(c->val_real));
+
+		case TYPE_STRING:
+		{
+			size_t len;
+
+			if (!qlf_read_len(src, end, &len))
+				return 0;
+
+			if (is_smallstring(c)) {
+				if (len >= MAX_SMALL_STRING)
+					return 0;
+
+				memcpy(c->val_chars, *src, len);
+				c->val_chars[len] = '\0';
+			} else {
+				c->val_str = alloc_strbuf(*src, len);
+			}
+
+			*src += len;
+			return 1;
+		}
+
+		case TYPE_END:
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+
+int qlf_read_term(parser *p, const qlf_in *in, const char **src, const char *end)
+{
+	uint_t nbr_cells;
+	uint8_t hdr[3];
+
+	if (!qlf_read_uint(src, end, &nbr_cells) || !qlf_read(src, end, hdr, sizeof(hdr)))
+		return 0;
+
+	// Each cell takes at least four bytes...
+
+	if (!nbr_cells || ((uint_t)(end - *src) / 4 < nbr_cells))
+		return 0;
+
+	while (p->t->nbr_cells < nbr_cells) {
+		idx_t n = p->t->nbr_cells * 2;
+		p->t = realloc(p->t, sizeof(term)+(sizeof(cell)*n));
+		if (!p->t) abort();
+		p->t->nbr_cells = n;
+	}
+
+	term *t = p->t;
+	t->cidx = 0;
+
+	for (idx_t i = 0; i < nbr_cells; i++) {
+		cell *c = t->cells + i;
+		if (!qlf_read_cell(in, src, end, c))
+			return 0;
+
+		t->cidx++;
+
+		if (!c->nbr_cells || ((i + c->nbr_cells) > nbr_cells))
+			return 0;
+	}
+
+	if (!is_end(t->cells+nbr_cells-1))
+		return 0;
+
+	t->nbr_vars = hdr[0];
+	t->first_cut = hdr[1];
+	t->cut_only = hdr[2];
+	return 1;
+}
+
+static int qlf_replay(parser *p, const char *src, size_t len)
+{
+	const char *end = src + len;
+	qlf_in in = {0};
+	size_t n;
+
+	if (len < QLF_HEADER_SIZE + sizeof(qlf_stamp))
+		p->error = 1;
+	else
+		src += QLF_HEADER_SIZE + sizeof(qlf_stamp);
+
+	while (!p->error && (src < end)) {
+		int tag = *src++;
 
-		if (!p->quoted && (!strcmp(p->token, ")") || !strcmp(p->token, "]") || !strcmp(p->token, "}"))) {
-			parser_attach(p, begin_idx);
-			return arity;
-		}
+		if ((tag == 'a') && qlf_read_atom(p, &in, &src, end))
+			;
+		else if ((tag == 'd') && qlf_read_len(&src, end, &n) && ((size_t)(end-src) >= n+sizeof(qlf_stamp)))
+			src += n + sizeof(qlf_stamp);
+		else if ((tag == 't') && qlf_read_term(p, &in, &src, end)) {
+			directives(p, p->t);
 
-		if (p->is_var && (*p->srcptr == '(')) {
-			fprintf(stderr, "Error: syntax error, line %d: %s\n", p->line_nbr, p->srcptr);
-			p->error = 1;
-			break;
-		}
+			if (!p->skip)
+				assertz_to_db(p->m, p->t, 1);
 
-		unsigned optype = 0;
-		int userop = 0;
-		int precedence = get_op(p->m, p->token, &optype, &userop, last_op);
+			clear_term(p->t);
+		} else
+			p->error = 1;
+	}
 
-		if (p->quoted && !userop) {
-			optype = 0;
-			precedence = 0;
-		}
+	if (p->error) {
+		fprintf(stderr, "Error: corrupt precompiled file\n");
+		clear_term(p->t);
+	}
 
-		if (precedence && ((*p->srcptr == ',') || (*p->srcptr == ')'))) {
-			optype = 0;
-			precedence = 0;
-		}
+	free(in.atoms);
+	p->end_of_term = 1;
+	return !p->error;
+}
 
-		// Operators in canonical form..
+static module *module_load_lib(module *m, const library *lib)
+{
+	size_t len = lib->qlf_end - lib->qlf_start;
+
+	if (lib->qlf_start && qlf_valid((const char*)lib->qlf_start, len)) {
+		parser *p = create_parser(m);
+		p->consulting = 1;
+		qlf_replay(p, (const char*)lib->qlf_start, len);
+		module_load_done(p, &m);
+		return m;
+	}
 
-		if (last_op && precedence && (*p->srcptr == '(')) {
-			p->val_type = TYPE_LITERAL;
-			optype = 0;
-			precedence = 0;
-			p->quoted = 0;
-		}
+	char *src = strndup((const char*)lib->start, (lib->end-lib->start));
+	m = module_load_text(m, src);
+	free(src);
+	return m;
+}
 
-		last_op = strcmp(p->token, ")") && precedence;
-		int func = (p->val_type == TYPE_LITERAL) && !optype && (*p->srcptr == '(');
+static int module_load_mapped(module *m, FILE *fp)
+{
+#ifndef _WIN32
+	struct stat st;
 
-		if (func) {
-			is_func = 1;
-			p->is_op = 0;
-			save_idx = p->t->cidx;
-		}
+	if (fstat(fileno(fp), &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return module_load_fp(m, fp);
 
-#if 0
-		if (p->is_op && !precedence) {
-			fprintf(stderr, "Error: syntax error or operator expected, line %d: %s, %s\n", p->line_nbr, p->token, p->srcptr);
-			p->error = 1;
-			break;
-		}
-#endif
+	void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
 
-		p->start_term = 0;
-		cell *c = make_cell(p);
-		memset(c, 0, sizeof(cell));
-		c->nbr_cells = 1;
-		c->val_type = p->val_type;
-		c->flags = (uint16_t)optype;
-		c->precedence = precedence;
+	if (addr == MAP_FAILED)
+		return module_load_fp(m, fp);
 
-		if (p->dcg_passthru)
-			c->flags |= FLAG_PASSTHRU;
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+	int ok;
 
-		if (p->val_type == TYPE_INT) {
-			const char *src = p->token;
-			parse_number(p, &src, &c->val_num, &c->val_den);
+	if (qlf_valid(addr, st.st_size)) {
+		parser *p = create_parser(m);
+		p->consulting = 1;
+		qlf_replay(p, addr, st.st_size);
+		ok = module_load_done(p, NULL);
+	} else
+		ok = module_load_mem(m, addr, st.st_size);
 
-			if (strstr(p->token, "0o"))
-				c->flags |= FLAG_OCTAL;
-			else if (strstr(p->token, "0x"))
-				c->flags |= FLAG_HEX;
-			else if (strstr(p->token, "0b"))
-				c->flags |= FLAG_BINARY;
-		}
-		else if (p->val_type == TYPE_FLOAT)
-			c->val_real = atof(p->token);
-		else if (!p->quoted || func || p->is_op || p->is_var || check_builtin(p->m, p->token, 0)) {
-			if (func && !strcmp(p->token, "."))
-				c->precedence = 0;
+	munmap(addr, st.st_size);
+	return ok;
+#else
+	return module_load_fp(m, fp);
+#endif
+}
 
-			if (p->is_var)
-				c->val_type = TYPE_VAR;
+static FILE *open_source(const char *filename, char *path, size_t size)
+{
+	static const char *s_exts[] = {"", ".pro", ".pl", ".qlf", NULL};
 
-			c->val_offset = find_in_pool(p->token);
-		} else {
-			c->val_type = TYPE_STRING;
+	for (const char **ext = s_exts; *ext; ext++) {
+		snprintf(path, size, "%s%s", filename, *ext);
+		FILE *fp = fopen(path, "r");
 
-			if (strlen(p->token) < MAX_SMALL_STRING) {
-				c->flags |= FLAG_SMALL_STRING;
-				strcpy(c->val_chars, p->token);
-			} else
-				c->val_str = strdup(p->token);
-		}
+		if (fp)
+			return fp;
 	}
 
-	p->depth--;
-	return !p->error;
+	return NULL;
 }
 
-static void module_purge(module *m)
+// The files the source loads follow its stamp in the precompiled
+// file, each is checked to be as it was when compiled...
+
+static int qlf_deps_current(FILE *fp)
 {
-	if (!m->dirty)
-		return;
+	char path[1024];
+	int ch;
 
-	for (rule *h = m->head; h != NULL; h = h->next) {
-		clause *last = NULL;
+	while ((ch = getc(fp)) == 'd') {
+		uint_t len = 0;
 
-		for (clause *r = h->head; r != NULL;) {
-			if (!r->t.deleted) {
-				last = r;
-				r = r->next;
-				continue;
-			}
+		for (unsigned shift = 0; (ch = getc(fp)) != EOF; shift += 7) {
+			if (shift >= sizeof(uint_t)*8)
+				return 0;
 
-			if (h->head == r)
-				h->head = r->next;
+			len |= (uint_t)(ch & 0x7F) << shift;
 
-			if (h->tail == r)
-				h->tail = last;
+			if (!(ch & 0x80))
+				break;
+		}
 
-			if (last)
-				last->next = r->next;
+		if ((ch == EOF) || (len >= sizeof(path)) || (fread(path, 1, len, fp) != len))
+			return 0;
 
-			clause *next = r->next;
-			clear_term(&r->t);
-			free(r);
-			r = next;
-		}
-	}
+		qlf_stamp stamp, stamp1;
+		path[len] = '\0';
 
-	m->dirty = 0;
-}
+		if (fread(&stamp, sizeof(stamp), 1, fp) != 1)
+			return 0;
 
-static int parser_run(parser *p, const char *src, int dump)
-{
-	p->srcptr = (char*)src;
+		FILE *fp1 = fopen(path, "r");
 
-	if (!parser_tokenize(p, 0, 0))
-		return 0;
+		if (!fp1)
+			return 0;
 
-	if (p->skip) {
-		p->m->status = 1;
-		return 1;
+		int ok = qlf_stamp_file(fp1, &stamp1);
+		fclose(fp1);
+
+		if (!ok || memcmp(&stamp, &stamp1, sizeof(stamp)))
+			return 0;
 	}
 
-	if (!parser_attach(p, 0))
-		return 0;
+	return 1;
+}
 
-	if (p->command) {
-		parser_dcg_rewrite(p);
-		parser_assign_vars(p);
-	}
+// Use the precompiled file in place of its source if they and the
+// files it loads are unchanged since it was written by a compatible
+// build...
 
-	if (!parser_xref(p, p->t, NULL))
-		return 0;
+static FILE *open_precompiled(FILE *fp, const char *path)
+{
+	char qlfname[1024+8], hdr[QLF_HEADER_SIZE];
+	qlf_filename(qlfname, sizeof(qlfname), path);
 
-	query *q = create_query(p->m, 0);
-	query_execute(q, p->t);
+	if (!strcmp(qlfname, path))
+		return fp;
 
-	if (q->halt)
-		q->error = 0;
-	else if (dump)
-		dump_vars(q, p);
+	FILE *fp2 = fopen(qlfname, "r");
 
-	p->m->halt = q->halt;
-	p->m->halt_code = q->halt_code;
-	p->m->status = q->status;
+	if (!fp2)
+		return fp;
 
-	if (!p->m->quiet && !p->directive && dump && q->m->stats) {
-		fprintf(stderr,
-			"Goals %llu, Matches %llu, Max frames %u, Max choices %u, Max trails: %u, Heap: %u, Backtracks %llu, TCOs:%llu\n",
-			(unsigned long long)q->tot_goals, (unsigned long long)q->tot_matches,
-			q->max_frames, q->max_choices, q->max_trails, q->max_heaps,
-			(unsigned long long)q->tot_retries, (unsigned long long)q->tot_tcos);
+	qlf_stamp stamp1, stamp2;
+
+	if ((fread(hdr, 1, sizeof(hdr), fp2) != sizeof(hdr)) || !qlf_valid(hdr, sizeof(hdr))
+		|| (fread(&stamp2, sizeof(stamp2), 1, fp2) != 1) || !qlf_stamp_file(fp, &stamp1)
+		|| memcmp(&stamp1, &stamp2, sizeof(stamp1)) || !qlf_deps_current(fp2)) {
+		fclose(fp2);
+		return fp;
 	}
 
-	int ok = !q->error;
-	destroy_query(q);
-	module_purge(p->m);
-	return ok;
+	rewind(fp2);
+	fclose(fp);
+	return fp2;
 }
 
-static module *module_load_text(module *m, const char *src)
+int module_compile_file(module *m, const char *filename)
 {
-	parser *p = create_parser(m);
-	p->consulting = 1;
-	p->srcptr = (char*)src;
-	parser_tokenize(p, 0, 0);
+	char path[1024], qlfname[1024+8];
+	FILE *fp = open_source(filename, path, sizeof(path));
 
-	if (!p->error && !p->end_of_term && p->t->cidx) {
-		fprintf(stderr, "Error: incomplete statement\n");
-		p->error = 1;
+	if (!fp) {
+		fprintf(stderr, "Error: file '%s[.pro|.pl]' does not exist\n", filename);
+		return 0;
 	}
 
-	if (!p->error) {
-		parser_xref_db(p);
-		int save = p->m->quiet;
-		p->m->quiet = 1;
-		p->directive = 1;
+	qlf_filename(qlfname, sizeof(qlfname), path);
 
-		if (parser_run(p, "initialization(G), call(G)", 0))
-			p->m->halt = 1;
-		else
-			p->m->halt = 0;
+	if (!strcmp(qlfname, path)) {
+		fprintf(stderr, "Error: '%s' is already precompiled\n", path);
+		fclose(fp);
+		return 0;
+	}
 
-		p->directive = 0;
-		p->m->quiet = save;
+	// Directives are recorded rather than run, except those that
+	// change how the rest of the file is read, here or in the files
+	// it loads, so a scratch module is used for those...
+
+	parser *p = create_parser(create_module("$compile"));
+	p->qlf = fopen(qlfname, "wb");
+
+	if (!p->qlf) {
+		fprintf(stderr, "Error: can't create '%s'\n", qlfname);
+		destroy_module(p->m);
+		destroy_parser(p);
+		fclose(fp);
+		return 0;
 	}
 
-	m = p->m;
-	destroy_parser(p);
-	return m;
-}
+	qlf_stamp stamp;
 
-int module_load_fp(module *m, FILE *fp)
-{
-	parser *p = create_parser(m);
+	if (!qlf_stamp_file(fp, &stamp)) {
+		fprintf(stderr, "Error: can't read '%s'\n", path);
+		p->error = 1;
+	}
+
+	qlf_out deps = {0};
+	p->m->quiet = m->quiet;
 	p->consulting = 1;
+	p->deps = &deps;
 	p->fp = fp;
-	int ok;
 
 	do {
 		if (getline(&p->save_line, &p->n_line, p->fp) == -1)
 			break;
 
 		p->srcptr = p->save_line;
-		ok = parser_tokenize(p, 0, 0);
 	}
-	 while (ok);
-
-	free(p->save_line);
+	 while (parser_tokenize(p, 0, 0));
 
 	if (!p->error && !p->end_of_term && p->t->cidx) {
 		fprintf(stderr, "Error: incomplete statement\n");
 		p->error = 1;
 	}
 
-	if (!p->error) {
-		parser_xref_db(p);
-		int save = p->m->quiet;
-		p->m->quiet = 1;
-		p->directive = 1;
+	uint16_t version = QLF_VERSION, cell_size = sizeof(cell);
+	fwrite(QLF_MAGIC, 1, 4, p->qlf);
+	fwrite(&version, sizeof(version), 1, p->qlf);
+	fwrite(&cell_size, sizeof(cell_size), 1, p->qlf);
+	fwrite(&stamp, sizeof(stamp), 1, p->qlf);
+	fwrite(deps.buf, 1, deps.len, p->qlf);
+	fwrite(p->qlf_buf.buf, 1, p->qlf_buf.len, p->qlf);
 
-		if (parser_run(p, "initialization(G), call(G)", 0))
-			p->m->halt = 1;
-		else
-			p->m->halt = 0;
+	if (ferror(p->qlf))
+		p->error = 1;
 
-		p->directive = 0;
-		p->m->quiet = save;
-	}
+	if (fclose(p->qlf) || p->error)
+		remove(qlfname);
 
-	ok = !p->error;
-	int halt = p->m->halt;
+	int ok = !p->error;
+	free(p->save_line);
+	qlf_clear(&p->qlf_buf);
+	qlf_clear(&deps);
+	m = p->m;
 	destroy_parser(p);
-	return ok && !halt;
+	destroy_module(m);
+	fclose(fp);
+	return ok;
 }
 
 int module_load_file(module *m, const char *filename)
@@ -2479,31 +5133,17 @@ int module_load_file(module *m, const char *filename)
 	}
 
 	char tmpbuf[1024];
-	strncpy(tmpbuf, filename, sizeof(tmpbuf)); tmpbuf[sizeof(tmpbuf)-1] = '\0';
-
-	FILE *fp = fopen(tmpbuf, "r");
-
-	if (!fp) {
-		strncpy(tmpbuf, filename, sizeof(tmpbuf)); tmpbuf[sizeof(tmpbuf)-1] = '\0';
-		strcat(tmpbuf, ".pro");
-		fp = fopen(tmpbuf, "r");
-	}
-
-	if (!fp) {
-		strncpy(tmpbuf, filename, sizeof(tmpbuf)); tmpbuf[sizeof(tmpbuf)-1] = '\0';
-		strcat(tmpbuf, ".pl");
-		fp = fopen(tmpbuf, "r");
-	}
+	FILE *fp = open_source(filename, tmpbuf, sizeof(tmpbuf));
 
 	if (!fp) {
-		strncpy(tmpbuf, filename, sizeof(tmpbuf)); tmpbuf[sizeof(tmpbuf)-1] = '\0';
 		fprintf(stderr, "Error: file '%s[.pro|.pl]' does not exist\n", filename);
 		return 0;
 	}
 
+	fp = open_precompiled(fp, tmpbuf);
 	free(m->filename);
 	m->filename = strdup(filename);
-	int ok = module_load_fp(m, fp);
+	int ok = module_load_mapped(m, fp);
 	fclose(fp);
 
 	return ok;
@@ -2569,8 +5209,12 @@ module *create_module(const char *name)
 	m->flag.character_escapes = 1;
 	m->flag.rational_syntax_natural = 0;
 	m->flag.prefer_rationals = 0;
+	m->flag.persist_compact_size = 64 * 1024 * 1024;
+	m->flag.persist_compact_ratio = 50;
+	m->purge_at = PURGE_MIN;
 	m->user_ops = MAX_USER_OPS;
 	m->iso_only = 0;
+	m->opt = g_opt;
 
 	make_rule(m, "A -> B :- A, !, B.");
 	make_rule(m, "phrase(P,L) :- phrase(P,L,[]).");
@@ -2609,6 +5253,29 @@ module *create_module(const char *name)
 	make_rule(m, "succ(X,Y) :- integer(X), Y is X + 1, X >= 0, !.");
 	make_rule(m, "succ(X,Y) :- integer(Y), X is Y - 1, X >= 0.");
 
+	make_rule(m, "predsort(P,L,Sorted) :- length(L,N), '$predsort'(P,N,L,_,Sorted1), !, Sorted = Sorted1.");
+	make_rule(m, "'$predsort'(P,2,[X1,X2|L],L,R) :- !, call(P,Delta,X1,X2), '$predsort2'(Delta,X1,X2,R).");
+	make_rule(m, "'$predsort'(_,1,[X|L],L,[X]) :- !.");
+	make_rule(m, "'$predsort'(_,0,L,L,[]) :- !.");
+	make_rule(m, "'$predsort'(P,N,L1,L3,R) :- N1 is N // 2, N2 is N - N1, '$predsort'(P,N1,L1,L2,R1), '$predsort'(P,N2,L2,L3,R2), '$predmerge'(P,R1,R2,R).");
+	make_rule(m, "'$predsort2'(<,X1,X2,[X1,X2]).");
+	make_rule(m, "'$predsort2'(=,X1,_,[X1]).");
+	make_rule(m, "'$predsort2'(>,X1,X2,[X2,X1]).");
+	make_rule(m, "'$predmerge'(_,[],R,R) :- !.");
+	make_rule(m, "'$predmerge'(_,R,[],R) :- !.");
+	make_rule(m, "'$predmerge'(P,[H1|T1],[H2|T2],Result) :- call(P,Delta,H1,H2), !, '$predmerge_'(Delta,P,H1,H2,T1,T2,Result).");
+	make_rule(m, "'$predmerge_'(<,P,H1,H2,T1,T2,[H1|R]) :- '$predmerge'(P,T1,[H2|T2],R).");
+	make_rule(m, "'$predmerge_'(=,P,H1,_,T1,T2,[H1|R]) :- '$predmerge'(P,T1,T2,R).");
+	make_rule(m, "'$predmerge_'(>,P,H1,H2,T1,T2,[H2|R]) :- '$predmerge'(P,[H1|T1],T2,R).");
+
+	// Tabling
+
+	make_rule(m, "'$tbl_call'(G,Impl) :- '$tbl_variant'(G,T,Fresh), (Fresh == true -> '$tbl_start'(T), '$tbl_rounds'(T,G,Impl) ; true), '$tbl_answer'(T,G,_).");
+	// A round runs the clauses under \+ so that a cut in one of them
+	// stops at its barrier instead of skipping '$tbl_add' and '$tbl_done'...
+
+	make_rule(m, "'$tbl_rounds'(T,G,Impl) :- \\+ (call(Impl), '$tbl_add'(T,G), fail), ('$tbl_done'(T) -> true ; '$tbl_rounds'(T,G,Impl)).");
+
 	// Other
 
 	make_rule(m, "client(U,H,P,S) :- client(U,H,P,S,[]).");
@@ -2639,13 +5306,31 @@ void destroy_module(module *m)
 			r = save;
 		}
 
+		drop_arg_indexes(h);
+
 		if (h->index)
 			sl_destroy(h->index);
 
+		if (h->jit)
+			free_index(h->jit);
+
 		free(h);
 		h = save;
 	}
 
+	while (m->retired) {
+		cindex *save = m->retired;
+		m->retired = save->next;
+		free_index(save);
+	}
+
+	free_dead(m);
+	destroy_gvars(m);
+
+	for (struct op_table *ptr = m->ops; ptr->name; ptr++)
+		free((void*)ptr->name);
+
+	free(m->fn_hash);
 	module *last = NULL;
 
 	for (module *tmp = g_modules; tmp; tmp = tmp->next) {
@@ -2660,8 +5345,7 @@ void destroy_module(module *m)
 			last = tmp;
 	}
 
-	if (m->fp)
-		fclose(m->fp);
+	db_close(m);
 
 	free(m->filename);
 	destroy_parser(m->p);
@@ -2685,7 +5369,17 @@ void set_trace(prolog *pl) { pl->m->trace = 1; }
 void set_quiet(prolog *pl) { pl->m->quiet = 1; }
 void set_stats(prolog *pl) { pl->m->stats = 1; }
 void set_iso_only(prolog *pl) { pl->m->iso_only = 1; }
-void set_opt(prolog *pl, int level) { pl->m->opt = level; }
+void set_threads(prolog *pl, int nbr) { pl->m->threads = nbr; }
+
+// The library modules already exist by now so set them too...
+
+void set_opt(prolog *pl, int level)
+{
+	g_opt = level;
+
+	for (module *m = g_modules; m; m = m->next)
+		m->opt = level;
+}
 
 int pl_eval(prolog *pl, const char *src)
 {
@@ -2706,6 +5400,11 @@ int pl_consult(prolog *pl, const char *filename)
 	return module_load_file(pl->m, filename);
 }
 
+int pl_compile(prolog *pl, const char *filename)
+{
+	return module_compile_file(pl->m, filename);
+}
+
 prolog *pl_create()
 {
 	g_tpl_count++;
@@ -2731,6 +5430,7 @@ prolog *pl_create()
 	g_lt_s = find_in_pool("<");
 	g_gt_s = find_in_pool(">");
 	g_eq_s = find_in_pool("=");
+	load_builtins();
 
 	g_streams[0].fp = stdin;
 	g_streams[0].filename = strdup("stdin");
@@ -2753,9 +5453,7 @@ prolog *pl_create()
 	for (library *lib = g_libs; lib->name; lib++) {
 		if (!strcmp(lib->name, "apply") || !strcmp(lib->name, "dict") ||
 			!strcmp(lib->name, "http") || !strcmp(lib->name, "lists")) {
-			char *src = strndup((const char*)lib->start, (lib->end-lib->start));
-			module_load_text(pl->m, src);
-			free(src);
+			module_load_lib(pl->m, lib);
 		}
 	}
 
@@ -2796,6 +5494,11 @@ void pl_destroy(prolog *pl)
 
 		free(g_pool);
 		g_pool = NULL;
+		free(g_pool_hash);
+		g_pool_hash = NULL;
+		g_pool_hash_size = g_pool_count = 0;
+		destroy_tables();
+		destroy_builtins();
 	}
 }
 
@@ -76,115 +76,192 @@ static size_t sprint_int(char *dst, size_t size, int_t n, int base)
 	return dst - save_dst;
 }
 
-static size_t formatted(char *dst, size_t dstlen, const char *src)
+#define MAX_NESTING 9999
+
+static void sink_flush(sink *s)
 {
-	extern const char *g_escapes;
-	extern const char *g_anti_escapes;
-	size_t len = 0;
+	if (!s->fp || !s->len)
+		return;
 
-	while (*src) {
-		int ch = *src++;
-		const char *ptr = strchr(g_escapes, ch);
+	if (fwrite(s->buf, 1, s->len, s->fp) != s->len)
+		s->error = 1;
 
-		if (ptr) {
-			if (dstlen) {
-				*dst++ = '\\';
-				*dst++ = g_anti_escapes[ptr-g_escapes];
-			}
+	s->len = 0;
+}
+
+static void sink_put(sink *s, const char *src, size_t len)
+{
+	if ((s->len + len + 1) > s->size) {
+		if (s->fp) {
+			sink_flush(s);
+
+			if ((len + 1) > s->size) {
+				if (fwrite(src, 1, len, s->fp) != len)
+					s->error = 1;
 
-			len += 2;;
+				return;
+			}
 		} else {
-			if (dstlen)
-				*dst++ = ch;
+			size_t size = s->size ? s->size : 256;
+
+			while ((s->len + len + 1) > size)
+				size *= 2;
 
-			len++;
+			s->buf = realloc(s->buf, s->size = size);
 		}
 	}
 
-	return len;
+	memcpy(s->buf + s->len, src, len);
+	s->len += len;
+	s->buf[s->len] = '\0';
 }
 
-size_t write_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, int running, int dq, int depth)
+static void sink_puts(sink *s, const char *src)
 {
-	char *save_dst = dst;
+	sink_put(s, src, strlen(src));
+}
 
-	if (depth > 9999) {
-		fprintf(stderr, "Error: max depth exceeded\n");
-		q->error = 1;
-		return dst - save_dst;
+static void sink_int(sink *s, int_t n, int base)
+{
+	char tmpbuf[256];
+	size_t len = sprint_int(tmpbuf, sizeof(tmpbuf), n, base);
+	sink_put(s, tmpbuf, len);
+}
+
+// Closing brackets owed by arguments that are written in the same
+// frame rather than by recursing, emitted in reverse order on exit...
+
+static void sink_push_closer(sink *s, char ch)
+{
+	if (s->nbr_closers == s->max_closers)
+		s->closers = realloc(s->closers, s->max_closers = s->max_closers ? s->max_closers * 2 : 64);
+
+	s->closers[s->nbr_closers++] = ch;
+}
+
+static void sink_pop_closers(sink *s, size_t base)
+{
+	while (s->nbr_closers > base)
+		sink_put(s, &s->closers[--s->nbr_closers], 1);
+}
+
+static void formatted(sink *s, const char *src)
+{
+	extern const char *g_escapes;
+	extern const char *g_anti_escapes;
+
+	while (*src) {
+		const char *save_src = src;
+
+		while (*src && !strchr(g_escapes, *src))
+			src++;
+
+		sink_put(s, save_src, src - save_src);
+
+		if (!*src)
+			break;
+
+		const char *ptr = strchr(g_escapes, *src++);
+		char tmpbuf[2] = {'\\', g_anti_escapes[ptr-g_escapes]};
+		sink_put(s, tmpbuf, 2);
 	}
+}
 
+static int print_number(query *q, sink *s, cell *c, int running, int canonical)
+{
 	if (is_rational(c)) {
-		if (((c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY))) {
-			dst += snprintf(dst, dstlen, "%s0x", c->val_int<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_int, 16);
+		if (((c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY)) && (canonical || !running)) {
+			sink_puts(s, c->val_int<0?"-0x":"0x");
+			sink_int(s, c->val_int, 16);
 		} else if ((c->flags & FLAG_OCTAL) && !running) {
-			dst += snprintf(dst, dstlen, "%s0o", c->val_int<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_int, 8);
+			sink_puts(s, c->val_int<0?"-0o":"0o");
+			sink_int(s, c->val_int, 8);
 		} else if (c->val_den != 1) {
-			if (q->m->flag.rational_syntax_natural) {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "/");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
-			} else {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "r");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
-			}
+			sink_int(s, c->val_num, 10);
+			sink_puts(s, q->m->flag.rational_syntax_natural?"/":"r");
+			sink_int(s, c->val_den, 10);
 		} else
-			dst += sprint_int(dst, dstlen, c->val_int, 10);
+			sink_int(s, c->val_int, 10);
 
-		return dst - save_dst;
+		return 1;
 	}
 
-	if (is_real(c) && (c->val_real == M_PI)) {
-		dst += snprintf(dst, dstlen, "%s", "3.141592653589793");
-		return dst - save_dst;
+	if (!is_real(c))
+		return 0;
+
+	if (c->val_real == M_PI) {
+		sink_puts(s, "3.141592653589793");
+		return 1;
 	}
-	else if (is_real(c) && (c->val_real == M_E)) {
-		dst += snprintf(dst, dstlen, "%s", "2.718281828459045");
-		return dst - save_dst;
+
+	if (c->val_real == M_E) {
+		sink_puts(s, "2.718281828459045");
+		return 1;
 	}
-	else if (is_real(c)) {
-		char tmpbuf[256];
-		sprintf(tmpbuf, "%.*g", 16, c->val_real);
 
-		if (!strchr(tmpbuf, '.'))
-			strcat(tmpbuf, ".0");
+	char tmpbuf[256];
+	sprintf(tmpbuf, "%.*g", 16, c->val_real);
 
-		dst += snprintf(dst, dstlen, "%s", tmpbuf);
-		return dst - save_dst;
-	}
+	if (!strchr(tmpbuf, '.'))
+		strcat(tmpbuf, ".0");
 
-	if (is_var(c) && ((1ULL << c->slot_nbr) & q->nv_mask)) {
-		dst += snprintf(dst, dstlen, "'$VAR'(%u)", q->nv_start + count_bits(q->nv_mask, c->slot_nbr));
-		return dst - save_dst;
-	}
+	sink_puts(s, tmpbuf);
+	return 1;
+}
 
-	const char *src = GET_STR(c);
-	int quote = !is_var(c) && needs_quote(q->m, src);
-	dst += snprintf(dst, dstlen, "%s", quote?dq?"\"":"'":"");
-	dst += formatted(dst, dstlen, src);
-	dst += snprintf(dst, dstlen, "%s", quote?dq?"\"":"'":"");
+// The last argument of a compound is written by looping rather than
+// recursing, so long right-nested terms (conjunctions, f(..f(..)..))
+// only use C stack for their left-hand branches...
 
-	if (!is_structure(c))
-		return dst - save_dst;
+static void print_canonical(query *q, sink *s, cell *c, int running, int dq)
+{
+	if (s->nesting > MAX_NESTING) {
+		fprintf(stderr, "Error: max depth exceeded\n");
+		q->error = 1;
+		return;
+	}
 
 	idx_t save_ctx = q->latest_ctx;
-	idx_t arity = c->arity;
-	dst += snprintf(dst, dstlen, "(");
+	size_t base = s->nbr_closers;
+	s->nesting++;
+
+	for (;;) {
+		if (print_number(q, s, c, running, 1))
+			break;
+
+		if (is_var(c) && ((1ULL << c->slot_nbr) & q->nv_mask)) {
+			char tmpbuf[80];
+			snprintf(tmpbuf, sizeof(tmpbuf), "'$VAR'(%u)", q->nv_start + count_bits(q->nv_mask, c->slot_nbr));
+			sink_puts(s, tmpbuf);
+			break;
+		}
+
+		const char *src = GET_STR(c);
+		int quote = !is_var(c) && needs_quote(q->m, src);
+		if (quote) sink_puts(s, dq?"\"":"'");
+		formatted(s, src);
+		if (quote) sink_puts(s, dq?"\"":"'");
 
-	for (c++; arity--; c += c->nbr_cells) {
-		cell *p = running ? GET_VALUE(q, c, save_ctx) : c;
-		dst += write_canonical_to_buf(q, dst, dstlen, p, running, dq, depth+1);
+		if (!is_structure(c))
+			break;
 
-		if (arity)
-			dst += snprintf(dst, dstlen, ",");
+		idx_t ctx = q->latest_ctx;
+		idx_t arity = c->arity;
+		sink_puts(s, "(");
+
+		for (c++; arity > 1; arity--, c += c->nbr_cells) {
+			cell *p = running ? GET_VALUE(q, c, ctx) : c;
+			print_canonical(q, s, p, running, dq);
+			sink_puts(s, ",");
+		}
+
+		sink_push_closer(s, ')');
+		c = running ? GET_VALUE(q, c, ctx) : c;
 	}
 
-	dst += snprintf(dst, dstlen, ")");
+	sink_pop_closers(s, base);
+	s->nesting--;
 	q->latest_ctx = save_ctx;
-	return dst - save_dst;
 }
 
 static char *varformat(unsigned nbr)
@@ -196,247 +273,233 @@ static char *varformat(unsigned nbr)
 	return tmpbuf;
 }
 
-size_t write_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, int running, int dq, int cons, int max_depth, int depth)
+static void print_term(query *q, sink *s, cell *c, int running, int dq, int cons, int max_depth, int depth)
 {
-	char *save_dst = dst;
-
-	if (depth > 9999) {
+	if (s->nesting > MAX_NESTING) {
 		fprintf(stderr, "Error: max depth exceeded\n");
 		q->error = 1;
-		return dst - save_dst;
+		return;
 	}
 
-	if (is_rational(c)) {
-		if (((c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY)) && !running) {
-			dst += snprintf(dst, dstlen, "%s0x", c->val_int<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_int, 16);
-		} else if ((c->flags & FLAG_OCTAL) && !running) {
-			dst += snprintf(dst, dstlen, "%s0o", c->val_int<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_int, 8);
-		} else if (c->val_den != 1) {
-			if (q->m->flag.rational_syntax_natural) {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "/");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
-			} else {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "r");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
-			}
-		} else
-			dst += sprint_int(dst, dstlen, c->val_int, 10);
-
-		return dst - save_dst;
-	}
-
-	if (is_real(c) && (c->val_real == M_PI)) {
-		dst += snprintf(dst, dstlen, "%s", "3.141592653589793");
-		return dst - save_dst;
-	}
-	else if (is_real(c) && (c->val_real == M_E)) {
-		dst += snprintf(dst, dstlen, "%s", "2.718281828459045");
-		return dst - save_dst;
-	}
-	else if (is_real(c)) {
-		char tmpbuf[256];
-		sprintf(tmpbuf, "%.*g", 16, c->val_real);
-
-		if (!strchr(tmpbuf, '.'))
-			strcat(tmpbuf, ".0");
-
-		dst += snprintf(dst, dstlen, "%s", tmpbuf);
-		return dst - save_dst;
-	}
-
-	idx_t save_ctx = q->latest_ctx;
 	idx_t save2_ctx = q->latest_ctx;
-	const char *src = GET_STR(c);
-	int print_list = 0;
-
-	// FIXME make non-recursive
-
-	while (is_list(c)) {
-		if (max_depth && (depth >= max_depth)) {
-			dst += snprintf(dst, dstlen, " |...");
-			return dst - save_dst;
-		}
-
-		cell *head = c + 1;
-		cell *tail = head + head->nbr_cells;
-
-		if (!cons)
-			dst += snprintf(dst, dstlen, "%s", "[");
-
-		head = running ? GET_VALUE(q, head, save_ctx) : head;
-		dst += write_term_to_buf(q, dst, dstlen, head, running, dq, 0, max_depth, depth+1);
-		tail = running ? GET_VALUE(q, tail, save_ctx) : tail;
+	idx_t save_ctx = q->latest_ctx;
+	size_t base = s->nbr_closers;
+	s->nesting++;
+
+	for (;;) {
+		if (print_number(q, s, c, running, 0))
+			break;
+
+		const char *src = GET_STR(c);
+		cell *next = NULL;
+
+		if (is_list(c)) {
+			int print_list = 0;
+
+			while (is_list(c)) {
+				if (max_depth && (depth >= max_depth)) {
+					sink_puts(s, " |...");
+					break;
+				}
+
+				cell *head = c + 1;
+				cell *tail = head + head->nbr_cells;
+
+				if (!cons)
+					sink_puts(s, "[");
+
+				head = running ? GET_VALUE(q, head, save_ctx) : head;
+				print_term(q, s, head, running, dq, 0, max_depth, depth+1);
+				tail = running ? GET_VALUE(q, tail, save_ctx) : tail;
+
+				if (is_list(tail)) {
+					sink_puts(s, ",");
+					c = tail;
+					save_ctx = q->latest_ctx;
+					print_list++;
+					cons = 1;
+					continue;
+				}
+
+				int closing = !cons || print_list;
+
+				if (!is_literal(tail) || is_structure(tail) || strcmp(GET_STR(tail), "[]")) {
+					sink_puts(s, "|");
+					if (closing) sink_push_closer(s, ']');
+					next = tail;
+				} else if (closing)
+					sink_puts(s, "]");
+
+				break;
+			}
 
-		if (is_literal(tail) && !is_structure(tail)) {
-			src = GET_STR(tail);
+			if (!next)
+				break;
 
-			if (strcmp(src, "[]")) {
-				dst += snprintf(dst, dstlen, "%s", "|");
-				dst += write_term_to_buf(q, dst, dstlen, tail, running, dq, 1, max_depth, depth+1);
-			}
-		}
-		else if (is_list(tail)) {
-			dst += snprintf(dst, dstlen, "%s", ",");
-			c = tail;
+			c = next;
 			save_ctx = q->latest_ctx;
-			print_list++;
 			cons = 1;
+			depth++;
 			continue;
 		}
-		else {
-			dst += snprintf(dst, dstlen, "%s", "|");
-			dst += write_term_to_buf(q, dst, dstlen, tail, running, dq, 1, max_depth, depth+1);
-		}
 
-		if (!cons || print_list)
-			dst += snprintf(dst, dstlen, "%s", "]");
+		int optype = (c->flags & OP_FX) | (c->flags & OP_FY) | (c->flags & OP_XF) |
+			(c->flags & OP_YF) | (c->flags & OP_XFX) |
+			(c->flags & OP_YFX) | (c->flags & OP_XFY);
 
-		q->latest_ctx = save2_ctx;
-		return dst - save_dst;
-	}
+		if (q->ignore_ops || !optype || !c->arity) {
+			int quote = (running <= 0) && !is_var(c) && !is_structure(c);
+			quote += q->quoted && needs_quote(q->m, src);
+			if (is_var(c)) quote = 0;
+			if (quote) sink_puts(s, dq?"\"":"'");
+			int braces = 0;
+
+			if (running && is_var(c) && ((1ULL << c->slot_nbr) & q->nv_mask)) {
+				sink_puts(s, varformat(q->nv_start + count_bits(q->nv_mask, c->slot_nbr)));
+				break;
+			}
 
-	int optype = (c->flags & OP_FX) | (c->flags & OP_FY) | (c->flags & OP_XF) |
-		(c->flags & OP_YF) | (c->flags & OP_XFX) |
-		(c->flags & OP_YFX) | (c->flags & OP_XFY);
+			if (running && is_var(c)) {
+				char tmpbuf[80];
 
-	if (q->ignore_ops || !optype || !c->arity) {
-		int quote = (running <= 0) && !is_var(c) && !is_structure(c);
-		quote += q->quoted && needs_quote(q->m, src);
-		if (is_var(c)) quote = 0;
-		dst += snprintf(dst, dstlen, "%s", quote?dq?"\"":"'":"");
-		int braces = 0;
+				if (is_global_ctx(q->latest_ctx))
+					snprintf(tmpbuf, sizeof(tmpbuf), "_G%u_%u", q->latest_ctx & ~CTX_GLOBAL, c->slot_nbr);
+				else
+					snprintf(tmpbuf, sizeof(tmpbuf), "_%u_%u", q->latest_ctx, c->slot_nbr);
 
-		if (running && is_var(c) && ((1ULL << c->slot_nbr) & q->nv_mask)) {
-			dst += snprintf(dst, dstlen, "%s", varformat(q->nv_start + count_bits(q->nv_mask, c->slot_nbr)));
-			return dst - save_dst;
-		}
+				sink_puts(s, src);
+				sink_puts(s, tmpbuf);
+				break;
+			}
 
-		if (running && is_var(c)) {
-			dst += snprintf(dst, dstlen, "%s_%u_%u", src, q->latest_ctx, c->slot_nbr);
-			return dst - save_dst;
-		}
+			if (!strcmp(src, "{}") && c->arity)
+				braces = 1;
+			else if (quote)
+				formatted(s, src);
+			else
+				sink_puts(s, src);
 
-		if (!strcmp(src, "{}") && c->arity)
-			braces = 1;
-		else if (quote)
-			dst += formatted(dst, dstlen, src);
-		else
-			dst += snprintf(dst, dstlen, "%s", src);
+			if (quote) sink_puts(s, dq?"\"":"'");
 
-		dst += snprintf(dst, dstlen, "%s", quote?dq?"\"":"'":"");
+			if (!is_structure(c))
+				break;
 
-		if (is_structure(c)) {
 			idx_t arity = c->arity;
-			dst += snprintf(dst, dstlen, braces?"{":"(");
+			sink_puts(s, braces?"{":"(");
 
-			for (c++; arity--; c += c->nbr_cells) {
+			for (c++; arity > 1; arity--, c += c->nbr_cells) {
 				cell *tmp = running ? GET_VALUE(q, c, save_ctx) : c;
-				dst += write_term_to_buf(q, dst, dstlen, tmp, running, dq, 0, max_depth, depth+1);
-
-				if (arity)
-					dst += snprintf(dst, dstlen, ",");
+				print_term(q, s, tmp, running, dq, 0, max_depth, depth+1);
+				sink_puts(s, ",");
 			}
 
-			dst += snprintf(dst, dstlen, braces?"}":")");
+			sink_push_closer(s, braces?'}':')');
+			next = running ? GET_VALUE(q, c, save_ctx) : c;
 		}
-	}
-	else if ((c->flags & OP_XF) || (c->flags & OP_YF)) {
-		cell *lhs = c + 1;
-		lhs = running ? GET_VALUE(q, lhs, save_ctx) : lhs;
-		dst += write_term_to_buf(q, dst, dstlen, lhs, running, dq, 0, max_depth, depth+1);
-		dst += snprintf(dst, dstlen, "%s", src);
-	}
-	else if ((c->flags & OP_FX) || (c->flags & OP_FY)) {
-		cell *rhs = c + 1;
-		rhs = running ? GET_VALUE(q, rhs, save_ctx) : rhs;
-		int space = isalpha_utf8(peek_char_utf8(src)) || !strcmp(src, ":-") || !strcmp(src, "\\+");
-		int parens = is_structure(rhs) && !strcmp(GET_STR(rhs), ",");
-		dst += snprintf(dst, dstlen, "%s", src);
-		if (space && !parens) dst += snprintf(dst, dstlen, " ");
-		if (parens) dst += snprintf(dst, dstlen, "(");
-		dst += write_term_to_buf(q, dst, dstlen, rhs, running, dq, 0, max_depth, depth+1);
-		if (parens) dst += snprintf(dst, dstlen, ")");
-	}
-	else {
-		cell *lhs = c + 1;
-		cell *rhs = lhs + lhs->nbr_cells;
-		int my_prec = get_op(q->m, GET_STR(c), NULL, NULL, 0);
-		int lhs_prec1 = is_literal(lhs) ? get_op(q->m, GET_STR(lhs), NULL, NULL, 0) : 0;
-		int lhs_prec2 = is_literal(lhs) && !lhs->arity ? get_op(q->m, GET_STR(lhs), NULL, NULL, 0) : 0;
-		int rhs_prec1 = is_literal(rhs) ? get_op(q->m, GET_STR(rhs), NULL, NULL, 0) : 0;
-		int rhs_prec2 = is_literal(rhs) && !rhs->arity ? get_op(q->m, GET_STR(rhs), NULL, NULL, 0) : 0;
-		lhs = running ? GET_VALUE(q, lhs, save_ctx) : lhs;
-		int parens = 0;//depth && strcmp(src, ",") && strcmp(src, "is") && strcmp(src, "->");
-		int lhs_parens = lhs_prec1 > my_prec;
-		lhs_parens |= lhs_prec2;
-		if (parens || lhs_parens) dst += snprintf(dst, dstlen, "(");
-		dst += write_term_to_buf(q, dst, dstlen, lhs, running, dq, 0, max_depth, depth+1);
-		if (lhs_parens) dst += snprintf(dst, dstlen, ")");
-		rhs = running ? GET_VALUE(q, rhs, save_ctx) : rhs;
-		int space = isalpha_utf8(peek_char_utf8(src)) || !strcmp(src, ":-") || !strcmp(src, "-->") || !*src;
-		if (space && !parens) dst += snprintf(dst, dstlen, " ");
-		dst += snprintf(dst, dstlen, "%s", src);
-		if (!*src) space = 0;
-		if (space && !parens) dst += snprintf(dst, dstlen, " ");
-		int rhs_parens = rhs_prec1 > my_prec;
-		rhs_parens |= rhs_prec2;
-		if (rhs_parens) dst += snprintf(dst, dstlen, "(");
-		dst += write_term_to_buf(q, dst, dstlen, rhs, running, dq, 0, max_depth, depth+1);
-		if (parens || rhs_parens) dst += snprintf(dst, dstlen, ")");
+		else if ((c->flags & OP_XF) || (c->flags & OP_YF)) {
+			cell *lhs = c + 1;
+			lhs = running ? GET_VALUE(q, lhs, save_ctx) : lhs;
+			print_term(q, s, lhs, running, dq, 0, max_depth, depth+1);
+			sink_puts(s, src);
+			break;
+		}
+		else if ((c->flags & OP_FX) || (c->flags & OP_FY)) {
+			cell *rhs = c + 1;
+			rhs = running ? GET_VALUE(q, rhs, save_ctx) : rhs;
+			int space = isalpha_utf8(peek_char_utf8(src)) || !strcmp(src, ":-") || !strcmp(src, "\\+");
+			int parens = is_structure(rhs) && !strcmp(GET_STR(rhs), ",");
+			sink_puts(s, src);
+			if (space && !parens) sink_puts(s, " ");
+			if (parens) sink_puts(s, "(");
+			if (parens) sink_push_closer(s, ')');
+			next = rhs;
+		}
+		else {
+			cell *lhs = c + 1;
+			cell *rhs = lhs + lhs->nbr_cells;
+			int my_prec = get_op(q->m, GET_STR(c), NULL, NULL, 0);
+			int lhs_prec1 = is_literal(lhs) ? get_op(q->m, GET_STR(lhs), NULL, NULL, 0) : 0;
+			int lhs_prec2 = is_literal(lhs) && !lhs->arity ? get_op(q->m, GET_STR(lhs), NULL, NULL, 0) : 0;
+			int rhs_prec1 = is_literal(rhs) ? get_op(q->m, GET_STR(rhs), NULL, NULL, 0) : 0;
+			int rhs_prec2 = is_literal(rhs) && !rhs->arity ? get_op(q->m, GET_STR(rhs), NULL, NULL, 0) : 0;
+			lhs = running ? GET_VALUE(q, lhs, save_ctx) : lhs;
+			int parens = 0;//depth && strcmp(src, ",") && strcmp(src, "is") && strcmp(src, "->");
+			int lhs_parens = lhs_prec1 > my_prec;
+			lhs_parens |= lhs_prec2;
+			if (parens || lhs_parens) sink_puts(s, "(");
+			print_term(q, s, lhs, running, dq, 0, max_depth, depth+1);
+			if (lhs_parens) sink_puts(s, ")");
+			rhs = running ? GET_VALUE(q, rhs, save_ctx) : rhs;
+			int space = isalpha_utf8(peek_char_utf8(src)) || !strcmp(src, ":-") || !strcmp(src, "-->") || !*src;
+			if (space && !parens) sink_puts(s, " ");
+			sink_puts(s, src);
+			if (!*src) space = 0;
+			if (space && !parens) sink_puts(s, " ");
+			int rhs_parens = rhs_prec1 > my_prec;
+			rhs_parens |= rhs_prec2;
+			if (rhs_parens) sink_puts(s, "(");
+			if (parens || rhs_parens) sink_push_closer(s, ')');
+			next = rhs;
+		}
+
+		c = next;
+		save_ctx = q->latest_ctx;
+		cons = 0;
+		depth++;
 	}
 
-	q->latest_ctx = save_ctx;
-	return dst - save_dst;
+	sink_pop_closers(s, base);
+	s->nesting--;
+	q->latest_ctx = save2_ctx;
 }
 
-void write_canonical(query *q, FILE *fp, cell *c, int running, int dq, int depth)
-{
-	idx_t save_ctx = q->latest_ctx;
-	size_t len = write_canonical_to_buf(q, NULL, 0, c, running, dq, depth);
-	char *dst = malloc(len+1);
-	write_canonical_to_buf(q, dst, len+1, c, running, dq, depth);
-	const char *src = dst;
-
-	while (len) {
-		size_t nbytes = fwrite(src, 1, len, fp);
+// On return s->buf holds the NUL-terminated text (the caller frees it)
+// unless s->fp is set, in which case it has all been written out...
 
-		if (feof(fp)) {
-			q->error = 1;
-			return;
-		}
+void write_canonical_to_sink(query *q, sink *s, cell *c, int running, int dq, int depth)
+{
+	s->nesting = depth;
+	print_canonical(q, s, c, running, dq);
+	sink_put(s, "", 0);
+	sink_flush(s);
+	free(s->closers);
+	s->closers = NULL;
+	s->nbr_closers = s->max_closers = 0;
+}
 
-		len -= nbytes;
-		src += nbytes;
-	}
+void write_term_to_sink(query *q, sink *s, cell *c, int running, int dq, int cons, int max_depth, int depth)
+{
+	s->nesting = 0;
+	print_term(q, s, c, running, dq, cons, max_depth, depth);
+	sink_put(s, "", 0);
+	sink_flush(s);
+	free(s->closers);
+	s->closers = NULL;
+	s->nbr_closers = s->max_closers = 0;
+}
 
-	free(dst);
-	q->latest_ctx = save_ctx;
+void write_canonical(query *q, FILE *fp, cell *c, int running, int dq, int depth)
+{
+	char tmpbuf[1024*8];
+	sink s = {0};
+	s.buf = tmpbuf;
+	s.size = sizeof(tmpbuf);
+	s.fp = fp;
+	write_canonical_to_sink(q, &s, c, running, dq, depth);
+
+	if (s.error)
+		q->error = 1;
 }
 
 void write_term(query *q, FILE *fp, cell *c, int running, int dq, int cons, int max_depth, int depth)
 {
-	idx_t save_ctx = q->latest_ctx;
-	size_t len = write_term_to_buf(q, NULL, 0, c, running, dq, cons, max_depth, depth);
-	char *dst = malloc(len+1);
-	write_term_to_buf(q, dst, len+1, c, running, dq, cons, max_depth, depth);
-	const char *src = dst;
-
-	while (len) {
-		size_t nbytes = fwrite(src, 1, len, fp);
-
-		if (feof(fp)) {
-			q->error = 1;
-			return;
-		}
-
-		len -= nbytes;
-		src += nbytes;
-	}
-
-	free(dst);
-	q->latest_ctx = save_ctx;
+	char tmpbuf[1024*8];
+	sink s = {0};
+	s.buf = tmpbuf;
+	s.size = sizeof(tmpbuf);
+	s.fp = fp;
+	write_term_to_sink(q, &s, c, running, dq, cons, max_depth, depth);
+
+	if (s.error)
+		q->error = 1;
 }
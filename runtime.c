@@ -62,6 +62,7 @@ static void check_frame(query *q)
 		q->max_frames = q->st.fp;
 
 		if (q->st.fp >= q->nbr_frames) {
+			idx_t save_frames = q->nbr_frames;
 			q->nbr_frames += q->nbr_frames / 2;
 
 			if ((sizeof(frame)*q->nbr_frames) > (1024LL*1024*1024)) {
@@ -72,6 +73,7 @@ static void check_frame(query *q)
 			assert(q->nbr_frames);
 			q->frames = realloc(q->frames, sizeof(frame)*q->nbr_frames);
 			assert(q->frames);
+			memset(q->frames+save_frames, 0, sizeof(frame)*(q->nbr_frames-save_frames));
 		}
 	}
 }
@@ -100,30 +102,312 @@ static void check_slot(query *q)
 unsigned create_vars(query *q, unsigned nbr)
 {
 	frame *g = GET_FRAME(q->st.curr_frame);
+	unsigned slot_nbr = g->nbr_vars;
 
 	if ((g->env + g->nbr_slots) == q->st.sp) {
-		unsigned slot_nbr = g->nbr_vars;
 		g->nbr_slots += nbr;
-		g->nbr_vars += nbr;
-		q->st.sp += nbr;
-		return slot_nbr;
+	} else {
+		assert(!g->overflow);
+		g->overflow = q->st.sp;
 	}
 
-	assert(!g->overflow);
-	g->overflow = q->st.sp;
 	q->st.sp += nbr;
 	check_slot(q);
 
-	for (int i = 0; i < nbr; i++) {
-		slot *e = GET_SLOT(g, g->nbr_vars+i);
+	// Slots above sp may hold stale bindings that were never trailed
+
+	for (unsigned i = 0; i < nbr; i++) {
+		slot *e = GET_SLOT(g, slot_nbr+i);
 		e->c.val_type = TYPE_EMPTY;
 	}
 
-	unsigned slot_nbr = g->nbr_vars;
 	g->nbr_vars += nbr;
 	return slot_nbr;
 }
 
+static void check_gframe(query *q)
+{
+	if (q->st.gfp < q->nbr_gframes)
+		return;
+
+	q->nbr_gframes = q->nbr_gframes ? q->nbr_gframes + q->nbr_gframes / 2 : 256;
+
+	if ((sizeof(frame)*q->nbr_gframes) > (1024LL*1024*1024)) {
+		fprintf(stderr, "Out of frames\n");
+		abort();
+	}
+
+	q->gframes = realloc(q->gframes, sizeof(frame)*q->nbr_gframes);
+	assert(q->gframes);
+}
+
+static void check_gslot(query *q)
+{
+	if (q->st.gsp < q->nbr_gslots)
+		return;
+
+	q->nbr_gslots = q->nbr_gslots ? q->nbr_gslots + q->nbr_gslots / 2 : 1024;
+
+	if ((sizeof(slot)*q->nbr_gslots) > (1024LL*1024*1024)) {
+		fprintf(stderr, "Out of environment\n");
+		abort();
+	}
+
+	q->gslots = realloc(q->gslots, sizeof(slot)*q->nbr_gslots);
+	assert(q->gslots);
+
+	// Only the heap collector drops dead global frames, so ask for a
+	// collection before growing again...
+
+	q->gc = 1;
+}
+
+// Global frames are older than any frame on the stack...
+
+static int is_older(idx_t c1_ctx, idx_t c2_ctx)
+{
+	return (c1_ctx ^ CTX_GLOBAL) < (c2_ctx ^ CTX_GLOBAL);
+}
+
+// Whether a slot was made since the choice, so needs no trailing...
+
+static int is_newer_slot(const choice *ch, idx_t ctx)
+{
+	if (is_global_ctx(ctx))
+		return (ctx & ~CTX_GLOBAL) >= ch->st.gfp;
+
+	return ctx >= ch->st.fp;
+}
+
+static void make_var_ref(cell *tmp, unsigned slot_nbr, idx_t name)
+{
+	tmp->val_type = TYPE_VAR;
+	tmp->nbr_cells = 1;
+	tmp->arity = 0;
+	tmp->flags = 0;
+	tmp->slot_nbr = slot_nbr;
+	tmp->val_offset = name;
+}
+
+static void make_indirect(cell *tmp, cell *c)
+{
+	tmp->val_type = TYPE_INDIRECT;
+	tmp->nbr_cells = 1;
+	tmp->arity = 0;
+	tmp->val_cell = c;
+}
+
+static int any_vars(const cell *c)
+{
+	for (idx_t i = 0; i < c->nbr_cells; i++) {
+		if (is_var(c+i))
+			return 1;
+	}
+
+	return 0;
+}
+
+// A structure that an older slot is bound to, or that a last call
+// passes on when its frame is reused, has to outlive the frame it was
+// made in. It is copied to the heap with its variables moved to a
+// global frame, one that is only discarded on backtracking. Those
+// still unbound are bound to their global copy, so the frame goes on
+// seeing the same variable. Anything else the frame's variables are
+// bound to is copied along, except a structure of some other frame on
+// the stack, which is left referring to it and stops it being popped.
+//
+// When reusing a frame (see reuse_frame) a variable that its new
+// slots are bound to is moved to the first of them instead, unless a
+// structure needs it too.
+
+typedef struct {
+	idx_t f_ctx, g_ctx, new_frame;
+	unsigned nbr_vars, nbr_mapped;
+	int reuse, refs;
+	uint16_t map[MAX_ARITY+1], local[MAX_ARITY+1];
+} globalizer;
+
+static void init_globalizer(query *q, globalizer *gz, idx_t f_ctx, int reuse)
+{
+	frame *f = GET_FRAME(f_ctx);
+	gz->f_ctx = f_ctx;
+	gz->g_ctx = 0;
+	gz->new_frame = q->st.fp;
+	gz->nbr_vars = f->nbr_vars;
+	gz->nbr_mapped = 0;
+	gz->reuse = reuse;
+	gz->refs = 0;
+	memset(gz->map, 0, sizeof(uint16_t)*gz->nbr_vars);
+
+	if (reuse)
+		memset(gz->local, 0, sizeof(uint16_t)*gz->nbr_vars);
+}
+
+// The newest global frame is added to while it has room for all the
+// variables being copied, unless there has been a choice since it was
+// made, as backtracking would only drop its newer slots...
+
+static frame *global_frame(query *q, globalizer *gz)
+{
+	if (gz->g_ctx)
+		return GET_FRAME(gz->g_ctx);
+
+	const choice *ch = q->cp ? q->choices + q->cp - 1 : NULL;
+	frame *gg = q->st.gfp ? q->gframes + q->st.gfp - 1 : NULL;
+
+	if (!gg || (ch && (ch->st.gfp == q->st.gfp))
+		|| ((gg->nbr_vars + gz->nbr_vars) > MAX_ARITY)) {
+		check_gframe(q);
+		gg = q->gframes + q->st.gfp++;
+		gg->global = 1;
+		gg->env = q->st.gsp;
+		gg->nbr_vars = gg->nbr_slots = 0;
+		gg->any_refs = 0;
+	}
+
+	gz->g_ctx = (gg - q->gframes) | CTX_GLOBAL;
+	return gg;
+}
+
+static unsigned global_slot(query *q, globalizer *gz)
+{
+	frame *gg = global_frame(q, gz);
+	check_gslot(q);
+	unsigned n = gg->nbr_vars++;
+	gg->nbr_slots++;
+	q->st.gsp++;
+	slot *e = GET_SLOT(gg, n);
+	e->c.val_type = TYPE_EMPTY;
+	e->ctx = 0;
+	return n;
+}
+
+// Anything left referring to the stack has to keep its frame...
+
+static idx_t global_ref(query *q, globalizer *gz, idx_t ctx)
+{
+	if (gz->reuse && (ctx == gz->new_frame)) {
+		gz->refs = 1;
+		return gz->f_ctx;
+	}
+
+	frame *g = GET_FRAME(ctx);
+	g->any_refs = 1;
+	return ctx;
+}
+
+static unsigned global_var(query *q, globalizer *gz, unsigned slot_nbr, idx_t name);
+
+static cell *global_term(query *q, globalizer *gz, cell *c)
+{
+	cell *tmp = clone_term(q, 0, c, gz->f_ctx, 0);
+	idx_t nbr_cells = tmp->nbr_cells;
+
+	for (idx_t i = 0; i < nbr_cells; i++) {
+		if (!is_var(tmp+i))
+			continue;
+
+		tmp[i].slot_nbr = global_var(q, gz, tmp[i].slot_nbr, tmp[i].val_offset);
+		tmp[i].flags &= ~FLAG_FIRST_USE;
+	}
+
+	return tmp;
+}
+
+// Sets global slot n to the (dereferenced) value c...
+
+static void global_value(query *q, globalizer *gz, unsigned n, cell *c, idx_t c_ctx)
+{
+	cell tmp;
+	idx_t tmp_ctx = c_ctx;
+
+	if (is_var(c)) {
+		unsigned slot_nbr = c->slot_nbr;
+		idx_t name = c->val_offset;
+
+		if (c_ctx == gz->f_ctx) {
+			make_var_ref(&tmp, global_var(q, gz, slot_nbr, name), name);
+			tmp_ctx = gz->g_ctx;
+		} else if (is_global_ctx(c_ctx)) {
+			tmp = *c;
+		} else if ((global_frame(q, gz)->nbr_vars + gz->nbr_vars - gz->nbr_mapped) < MAX_ARITY) {
+			make_var_ref(&tmp, global_slot(q, gz), name);
+			tmp_ctx = gz->g_ctx;
+			cell v;
+			make_var_ref(&v, slot_nbr, name);
+			set_var(q, &v, c_ctx, &tmp, tmp_ctx);
+		} else {
+			tmp = *c;
+			tmp_ctx = global_ref(q, gz, c_ctx);
+		}
+	} else if (!c->arity) {
+		tmp = *c;
+	} else if (is_global_ctx(c_ctx) || !any_vars(c)) {
+		make_indirect(&tmp, c);
+	} else if (c_ctx == gz->f_ctx) {
+		make_indirect(&tmp, global_term(q, gz, c));
+		tmp_ctx = gz->g_ctx;
+	} else {
+		make_indirect(&tmp, c);
+		tmp_ctx = global_ref(q, gz, c_ctx);
+	}
+
+	frame *gg = GET_FRAME(gz->g_ctx);
+	slot *e = GET_SLOT(gg, n);
+	e->c = tmp;
+	e->ctx = tmp_ctx;
+}
+
+static unsigned global_var(query *q, globalizer *gz, unsigned slot_nbr, idx_t name)
+{
+	if (gz->map[slot_nbr])
+		return gz->map[slot_nbr] - 1;
+
+	unsigned n = global_slot(q, gz);
+	gz->map[slot_nbr] = n + 1;
+	gz->nbr_mapped++;
+	cell tmp;
+	make_var_ref(&tmp, n, name);
+
+	if (gz->reuse && gz->local[slot_nbr]) {
+		frame *new_g = GET_FRAME(gz->new_frame);
+		slot *e = GET_SLOT(new_g, gz->local[slot_nbr]-1);
+		e->c = tmp;
+		e->ctx = gz->g_ctx;
+		return n;
+	}
+
+	frame *f = GET_FRAME(gz->f_ctx);
+	slot *e = GET_SLOT(f, slot_nbr);
+	cell *c = &e->c;
+	idx_t c_ctx = e->ctx;
+
+	if (is_empty(c)) {
+		cell v;
+		make_var_ref(&v, slot_nbr, name);
+		set_var(q, &v, gz->f_ctx, &tmp, gz->g_ctx);
+		return n;
+	}
+
+	if (is_var(c)) {
+		c = deref_var(q, c, c_ctx);
+		c_ctx = q->latest_ctx;
+	} else if (is_indirect(c))
+		c = c->val_cell;
+
+	global_value(q, gz, n, c, c_ctx);
+	return n;
+}
+
+static cell *globalize(query *q, cell *v, idx_t *v_ctx)
+{
+	globalizer gz;
+	init_globalizer(q, &gz, *v_ctx, 0);
+	cell *tmp = global_term(q, &gz, v);
+	*v_ctx = gz.g_ctx;
+	return tmp;
+}
+
 static void trace_call(query *q, cell *c, int box)
 {
 	if (!c->fn)
@@ -152,17 +436,60 @@ static void unwind_trail(query *q, const choice *ch)
 	while (q->st.tp > ch->st.tp) {
 		trail *tr = q->trails + --q->st.tp;
 
+		if (tr->gvar) {
+			gvar_undo *u = q->undo + --q->nbr_undo;
+			free_gvar_value(u->v->val);
+			u->v->val = u->val;
+			continue;
+		}
+
 		if (ch->pins) {
 			if (ch->pins & (1 << tr->slot_nbr))
 				continue;
 		}
 
+		// Frames made since the choice are discarded anyway, and
+		// one that has since been popped may now be reused.
+
+		if (is_newer_slot(ch, tr->ctx))
+			continue;
+
 		frame *g = GET_FRAME(tr->ctx);
 		slot *e = GET_SLOT(g, tr->slot_nbr);
 		e->c.val_type = TYPE_EMPTY;
 	}
 }
 
+// Saves the value of v before a backtrackable assignment, only needed
+// while there is a choice to backtrack to...
+
+void trail_gvar(query *q, gvar *v)
+{
+	if (q->nbr_undo == q->max_undo) {
+		q->max_undo = q->max_undo ? q->max_undo * 2 : 256;
+		q->undo = realloc(q->undo, sizeof(gvar_undo)*q->max_undo);
+		assert(q->undo);
+	}
+
+	gvar_undo *u = q->undo + q->nbr_undo++;
+	u->v = v;
+	u->val = v->val;
+	check_trail(q);
+	trail *tr = q->trails + q->st.tp++;
+	tr->ctx = 0;
+	tr->slot_nbr = 0;
+	tr->gvar = 1;
+}
+
+// Once there is nothing left to backtrack to the saved values are
+// dropped with the trail...
+
+void forget_gvars(query *q)
+{
+	while (q->nbr_undo)
+		free_gvar_value(q->undo[--q->nbr_undo].val);
+}
+
 void undo_me(query *q)
 {
 	idx_t curr_choice = q->cp - 1;
@@ -174,6 +501,9 @@ void try_me(const query *q, unsigned vars)
 {
 	frame *g = GET_FRAME(q->st.fp);
 	g->nbr_slots = vars;
+	g->nbr_vars = vars;
+	g->overflow = 0;
+	g->any_refs = 0;
 	g->env = q->st.sp;
 	slot *e = GET_SLOT(g, 0);
 
@@ -214,28 +544,33 @@ int retry_choice(query *q)
 	if (ch->catchme == 2)
 		return retry_choice(q);
 
-	for (idx_t i = ch->st.hp; i < q->st.hp; i++) {
-		cell *c = &q->arenas->heap[i];
-
-		if (is_bigstring(c) && !is_const(c)) {
-			free(c->val_str);
-		} else if (is_integer(c) && ((c)->flags&FLAG_STREAM)) {
-			stream *str = &g_streams[c->val_int];
-
-			if (str->fp) {
-				fclose(str->fp);
-				free(str->filename);
-				free(str->mode);
-				free(str->data);
-				free(str->name);
-				memset(str, 0, sizeof(stream));
+	if (q->arenas)
+		q->arenas->hp = q->st.hp;
+
+	for (arena *a = q->arenas; a && (a->nbr >= ch->st.anbr);) {
+		idx_t from = a->nbr == ch->st.anbr ? ch->st.hp : 0;
+
+		for (idx_t i = from; i < a->hp; i++) {
+			cell *c = &a->heap[i];
+
+			if (is_bigstring(c) && !is_const(c)) {
+				release_string(c);
+			} else if (is_integer(c) && ((c)->flags&FLAG_STREAM)) {
+				stream *str = &g_streams[c->val_int];
+
+				if (str->fp) {
+					fclose(str->fp);
+					free(str->filename);
+					free(str->mode);
+					free(str->data);
+					free(str->name);
+					memset(str, 0, sizeof(stream));
+				}
 			}
-		}
 
-		c->val_type = TYPE_EMPTY;
-	}
+			c->val_type = TYPE_EMPTY;
+		}
 
-	for (arena *a = q->arenas; a;) {
 		if (a->nbr > ch->st.anbr) {
 			arena *save = a;
 			q->arenas = a = a->next;
@@ -244,10 +579,7 @@ int retry_choice(query *q)
 			continue;
 		}
 
-		if (a->nbr == ch->st.anbr)
-			break;
-
-		a = a->next;
+		break;
 	}
 
 	q->st = ch->st;
@@ -284,40 +616,84 @@ static void make_frame(query *q, unsigned nbr_vars, int last_match)
 	q->st.curr_frame = new_frame;
 }
 
-static void reuse_frame(query *q, unsigned nbr_vars)
+// The new frame's slots may be bound to variables or structures of the
+// frame being reused, so those are moved over or made global first.
+
+static void reuse_slot(query *q, globalizer *gz, unsigned i)
 {
-	frame *g = GET_FRAME(q->st.curr_frame);
-	g->any_choices = 0;
-	g->overflow = 0;
-	g->nbr_slots = nbr_vars;
-	g->nbr_vars = nbr_vars;
+	frame *new_g = GET_FRAME(gz->new_frame);
+	slot *e = GET_SLOT(new_g, i);
+	cell *c = &e->c;
+	idx_t c_ctx = e->ctx;
 
-	if (!q->no_tco && q->m->opt) {
-		frame *new_g = GET_FRAME(q->st.fp);
-		slot *from = GET_SLOT(new_g, 0);
-		slot *to = GET_SLOT(g, 0);
-		memcpy(to, from, sizeof(slot)*nbr_vars);
-		q->st.sp = g->env + nbr_vars;
-	} else {
-		g->env = q->st.sp;
-		q->st.sp += nbr_vars;
-	}
+	if (is_var(c)) {
+		if (c_ctx != gz->f_ctx) {
+			if (c_ctx == gz->new_frame)
+				e->ctx = gz->f_ctx;
 
-	q->tot_tcos++;
+			return;
+		}
+
+		c = deref_var(q, c, c_ctx);
+		c_ctx = q->latest_ctx;
+	} else if (is_indirect(c))
+		c = c->val_cell;
+	else
+		return;
+
+	cell tmp;
+	idx_t tmp_ctx = c_ctx == gz->new_frame ? gz->f_ctx : c_ctx;
+
+	if (is_var(c)) {
+		unsigned slot_nbr = c->slot_nbr;
+		tmp = *c;
+
+		if (c_ctx != gz->f_ctx)
+			;
+		else if (gz->map[slot_nbr]) {
+			make_var_ref(&tmp, gz->map[slot_nbr]-1, c->val_offset);
+			tmp_ctx = gz->g_ctx;
+		} else if (gz->local[slot_nbr]) {
+			make_var_ref(&tmp, gz->local[slot_nbr]-1, c->val_offset);
+		} else {
+			gz->local[slot_nbr] = i + 1;
+			tmp.val_type = TYPE_EMPTY;
+		}
+	} else if (!c->arity) {
+		tmp = *c;
+	} else if ((c_ctx == gz->f_ctx) && any_vars(c)) {
+		make_indirect(&tmp, global_term(q, gz, c));
+		tmp_ctx = gz->g_ctx;
+	} else
+		make_indirect(&tmp, c);
+
+	e = GET_SLOT(new_g, i);
+	e->c = tmp;
+	e->ctx = tmp_ctx;
 }
 
-static int check_slots(const query *q, frame *g, term *t)
+static int reuse_frame(query *q, unsigned nbr_vars)
 {
-	if (t && (g->nbr_vars != t->nbr_vars))
+	frame *g = GET_FRAME(q->st.curr_frame);
+	frame *new_g = GET_FRAME(q->st.fp);
+
+	if (new_g->any_refs)
 		return 0;
 
-	for (unsigned i = 0; i < g->nbr_vars; i++) {
-		slot *e = GET_SLOT(g, i);
+	globalizer gz;
+	init_globalizer(q, &gz, q->st.curr_frame, 1);
 
-		if (is_indirect(&e->c))
-			return 0;
-	}
+	for (unsigned i = 0; i < nbr_vars; i++)
+		reuse_slot(q, &gz, i);
 
+	memmove(q->slots+g->env, q->slots+new_g->env, sizeof(slot)*nbr_vars);
+	g->any_choices = 0;
+	g->any_refs = gz.refs;
+	g->overflow = 0;
+	g->nbr_slots = nbr_vars;
+	g->nbr_vars = nbr_vars;
+	q->st.sp = g->env + nbr_vars;
+	q->tot_tcos++;
 	return 1;
 }
 
@@ -326,20 +702,46 @@ static void commit_me(query *q, term *t)
 	frame *g = GET_FRAME(q->st.curr_frame);
 	g->m = q->m;
 	q->m = q->st.curr_clause->m;
-	int last_match = (!q->st.curr_clause->next && !q->st.iter) || t->first_cut;
-	int recursive = last_match && (q->st.curr_cell->flags&FLAG_TAILREC);
-	int tco = recursive && !g->any_choices && check_slots(q, g, t);
+	int last_match = t->first_cut;
+
+	if (q->st.bucket)
+		last_match |= q->st.bucket == q->st.bucket_end;
+	else if (q->st.iter)
+		last_match |= !sl_is_next_key(q->st.iter);
+	else
+		last_match |= !q->st.curr_clause->next;
+
+	// The last call of a recursive clause reuses the frame when nothing
+	// can refer to it any more: no choice was made for or since the
+	// call that made it, it is the newest frame and no older slot is
+	// bound into it.
+
+	int tco = last_match && (q->st.curr_cell->flags&FLAG_TAILREC)
+		&& !g->any_choices && !g->any_refs
+		&& (q->st.curr_frame == (q->st.fp-1)) && q->m->opt;
 
 	if (!last_match) {
 		idx_t curr_choice = q->cp - 1;
 		choice *ch = q->choices + curr_choice;
 		ch->st.curr_clause = q->st.curr_clause;
-	} else
+		ch->st.bucket = q->st.bucket;
+	} else {
+		if (q->st.iter)
+			sl_done(q->st.iter);
+
 		drop_choice(q);
+	}
 
-	if (tco)
-		reuse_frame(q, t->nbr_vars);
-	else
+	q->st.iter = NULL;
+
+	if (tco && q->cp) {
+		const choice *ch = q->choices + q->cp - 1;
+
+		if (ch->st.fp >= q->st.curr_frame)
+			tco = 0;
+	}
+
+	if (!tco || !reuse_frame(q, t->nbr_vars))
 		make_frame(q, t->nbr_vars, last_match);
 
 	if (t->cut_only)
@@ -357,6 +759,7 @@ void cut_me(query *q, int inner_cut)
 
 	if (!q->cp) {
 		q->st.tp = 0;
+		forget_gvars(q);
 		return;
 	}
 
@@ -367,8 +770,7 @@ void cut_me(query *q, int inner_cut)
 	while ((ch->st.fp >= q->st.curr_frame) && !cut) {
 		if (ch->qnbr) {
 			q->qnbr = ch->qnbr;
-			free(q->tmpq[q->qnbr]);
-			q->tmpq[q->qnbr] = NULL;
+			q->qs[q->qnbr].tmpq_nbr = 0;
 			q->qnbr--;
 		}
 
@@ -392,6 +794,7 @@ void cut_me(query *q, int inner_cut)
 
 	if (!q->cp) {
 		q->st.tp = 0;
+		forget_gvars(q);
 	}
 }
 
@@ -403,6 +806,25 @@ static void follow_me(query *q)
 		q->st.curr_cell = q->st.curr_cell->val_cell;
 }
 
+// A frame can be popped on exit when it is the newest, no choice point
+// was made inside it and no older slot has been bound into it.
+
+// A choice left by the call that made the frame keeps it, as a cut
+// goes back to the choices made since the frame's number...
+
+static void trim_frame(query *q, const frame *g)
+{
+	if (q->cp) {
+		const choice *ch = q->choices + q->cp - 1;
+
+		if (ch->st.fp >= q->st.curr_frame)
+			return;
+	}
+
+	q->st.sp = g->env;
+	q->st.fp--;
+}
+
 static int resume_frame(query *q)
 {
 	if (!q->st.curr_frame)
@@ -410,12 +832,8 @@ static int resume_frame(query *q)
 
 	frame *g = GET_FRAME(q->st.curr_frame);
 
-#if 0
-	int det = check_slots(q, g, NULL);
-
-	if (det && !g->any_choices && (q->st.curr_frame == (q->st.fp-1)) && q->m->opt)
-		q->st.fp--;
-#endif
+	if (!g->any_refs && (q->st.curr_frame == (q->st.fp-1)) && q->m->opt)
+		trim_frame(q, g);
 
 	cell *curr_cell = g->curr_cell;
 	g = GET_FRAME(q->st.curr_frame=g->prev_frame);
@@ -450,18 +868,35 @@ cell *deref_var(query *q, cell *c, idx_t c_ctx)
 	return &e->c;
 }
 
-static void make_indirect(cell *tmp, cell *c)
+// Binding an older slot to a structure in a newer frame would keep
+// that frame from being popped or reused, so the structure is made
+// global (see above). A variable in a newer frame, or a structure
+// bound while a choice has pinned variables, marks the frame as
+// referenced instead...
+
+static cell *ref_frame(query *q, idx_t c_ctx, cell *v, idx_t *v_ctx)
 {
-	tmp->val_type = TYPE_INDIRECT;
-	tmp->nbr_cells = 1;
-	tmp->arity = 0;
-	tmp->val_cell = c;
+	if (is_global_ctx(*v_ctx) || (*v_ctx > q->st.fp) || !is_older(c_ctx, *v_ctx))
+		return v;
+
+	if (!is_var(v) && (!v->arity || !any_vars(v)))
+		return v;
+
+	if (is_var(v) || (q->cp && q->choices[q->cp-1].pins)) {
+		frame *g = GET_FRAME(*v_ctx);
+		g->any_refs = 1;
+		return v;
+	}
+
+	return globalize(q, v, v_ctx);
 }
 
 void set_var(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 {
+	unsigned slot_nbr = c->slot_nbr;
+	v = ref_frame(q, c_ctx, v, &v_ctx);
 	frame *g = GET_FRAME(c_ctx);
-	slot *e = GET_SLOT(g, c->slot_nbr);
+	slot *e = GET_SLOT(g, slot_nbr);
 	e->ctx = v_ctx;
 
 	if (v->arity)
@@ -472,10 +907,16 @@ void set_var(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 	if (!q->cp)
 		return;
 
+	const choice *ch = q->choices + q->cp - 1;
+
+	if (is_newer_slot(ch, c_ctx))
+		return;
+
 	check_trail(q);
 	trail *tr = q->trails + q->st.tp++;
-	tr->slot_nbr = c->slot_nbr;
+	tr->slot_nbr = slot_nbr;
 	tr->ctx = c_ctx;
+	tr->gvar = 0;
 }
 
 void reset_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
@@ -490,6 +931,10 @@ void reset_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 		e = GET_SLOT(g, c->slot_nbr);
 	}
 
+	unsigned slot_nbr = c->slot_nbr;
+	v = ref_frame(q, c_ctx, v, &v_ctx);
+	g = GET_FRAME(c_ctx);
+	e = GET_SLOT(g, slot_nbr);
 	e->ctx = v_ctx;
 
 	if (v->arity)
@@ -498,14 +943,10 @@ void reset_value(query *q, cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 		e->c = *v;
 }
 
-static int unify_structure(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
-{
-	if (p1->arity != p2->arity)
-		return 0;
-
-	if (p1->val_offset != p2->val_offset)
-		return 0;
+// Unifies the arguments of two structures of the same arity...
 
+static int unify_args(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
+{
 	unsigned arity = p1->arity;
 	p1++; p2++;
 
@@ -525,6 +966,17 @@ static int unify_structure(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_
 	return 1;
 }
 
+static int unify_structure(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
+{
+	if (p1->arity != p2->arity)
+		return 0;
+
+	if (p1->val_offset != p2->val_offset)
+		return 0;
+
+	return unify_args(q, p1, p1_ctx, p2, p2_ctx);
+}
+
 static int unify_int(cell *p1, cell *p2)
 {
 	if (is_rational(p2))
@@ -541,26 +993,21 @@ static int unify_float(cell *p1, cell *p2)
 	return 0;
 }
 
-#define GET_STR2(c) ((c)->flags&FLAG_SMALL_STRING ? (c)->val_chars : (c)->val_str)
-
 static int unify_literal(cell *p1, cell *p2)
 {
 	if (is_literal(p2))
 		return p1->val_offset == p2->val_offset;
 
 	if (is_string(p2))
-		return !strcmp(g_pool+p1->val_offset, GET_STR2(p2));
+		return atom_eq(p1, p2);
 
 	return 0;
 }
 
 static int unify_string(cell *p1, cell *p2)
 {
-	if (is_literal(p2))
-		return !strcmp(GET_STR2(p1), g_pool+p2->val_offset);
-
-	if (is_string(p2))
-		return !strcmp(GET_STR2(p1), GET_STR2(p2));
+	if (is_literal(p2) || is_string(p2))
+		return atom_eq(p1, p2);
 
 	return 0;
 }
@@ -584,9 +1031,9 @@ static const struct dispatch g_disp[] =
 int unify(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
 {
 	if (is_var(p1) && is_var(p2)) {
-		if (p2_ctx > p1_ctx)
+		if (is_older(p1_ctx, p2_ctx))
 			set_var(q, p2, p2_ctx, p1, p1_ctx);
-		else if (p2_ctx < p1_ctx)
+		else if (is_older(p2_ctx, p1_ctx))
 			set_var(q, p1, p1_ctx, p2, p2_ctx);
 		else if (p1->slot_nbr != p2->slot_nbr)
 			set_var(q, p1, p1_ctx, p2, p2_ctx);
@@ -598,9 +1045,6 @@ int unify(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
 		if (is_empty(p2))
 			return 1;
 
-		if (is_structure(p2) && (p2_ctx >= q->st.curr_frame))
-			q->no_tco = 1;
-
 		set_var(q, p1, p1_ctx, p2, p2_ctx);
 		return 1;
 	}
@@ -609,9 +1053,6 @@ int unify(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
 		if (is_empty(p1))
 			return 1;
 
-		if (is_structure(p1) && (p1_ctx >= q->st.curr_frame))
-			q->no_tco = 1;
-
 		set_var(q, p2, p2_ctx, p1, p1_ctx);
 		return 1;
 	}
@@ -622,6 +1063,38 @@ int unify(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx)
 	return g_disp[p1->val_type].fn(p1, p2);
 }
 
+// Compare a stored key with an argument of the goal as it is bound
+// in the goal's frame, so no copy of the goal is needed.
+
+static int compkey_goal(const void *ptr1, const void *ptr2, const void *param)
+{
+	query *q = (query*)param;
+	cell *c = GET_VALUE(q, (cell*)ptr2, q->st.curr_frame);
+	return compkey(ptr1, c);
+}
+
+// Use the first bound argument that has, or can be given, an index.
+
+static skiplist *bound_arg_index(query *q, rule *h, cell **key)
+{
+	cell *c = q->st.curr_cell + 1;
+	c += c->nbr_cells;
+
+	for (unsigned n = 1; n < h->arity; n++, c += c->nbr_cells) {
+		if (is_var(GET_VALUE(q, c, q->st.curr_frame)))
+			continue;
+
+		skiplist *l = get_arg_index(h, n);
+
+		if (l) {
+			*key = c;
+			return l;
+		}
+	}
+
+	return NULL;
+}
+
 static void next_key(query *q)
 {
 	if (q->st.iter) {
@@ -629,14 +1102,34 @@ static void next_key(query *q)
 			q->st.curr_clause = NULL;
 			q->st.iter = NULL;
 		}
+	} else if (q->st.bucket) {
+		if (q->st.bucket < q->st.bucket_end)
+			q->st.curr_clause = *q->st.bucket++;
+		else
+			q->st.curr_clause = NULL;
 	} else
 		q->st.curr_clause = q->st.curr_clause->next;
 }
 
+// The clauses of a tabled predicate are those of its implementation,
+// stored under another name, so only the arguments of heads are
+// unified. Its wrapper clause is never seen...
+
+static rule *find_clauses(query *q, cell *head)
+{
+	rule *h = find_match(q->m, head);
+
+	if (h && (h->flags&FLAG_RULE_TABLED))
+		h = h->impl;
+
+	return h;
+}
+
 static int do_match2(query *q, cell *curr_cell)
 {
 	cell *head = get_head(curr_cell);
-	rule *h = find_match(q->m, head);
+	cell *body = head + head->nbr_cells;
+	rule *h = find_clauses(q, head);
 
 	if (!h)
 		q->st.curr_clause = NULL;
@@ -651,11 +1144,22 @@ static int do_match2(query *q, cell *curr_cell)
 
 		term *t = &q->st.curr_clause->t;
 		cell *c = t->cells;
+
+		if (!get_body(c))
+			continue;
+
 		try_me(q, t->nbr_vars);
 		q->tot_matches++;
 
-		if (unify_structure(q, curr_cell, q->st.curr_frame, c, q->st.fp))
-			return 1;
+		if (unify_args(q, head, q->st.curr_frame, get_head(c), q->st.fp)) {
+			cell *c1 = GET_VALUE(q, body, q->st.curr_frame);
+			idx_t c1_ctx = q->latest_ctx;
+			cell *c2 = GET_VALUE(q, get_body(c), q->st.fp);
+			idx_t c2_ctx = q->latest_ctx;
+
+			if (unify(q, c1, c1_ctx, c2, c2_ctx))
+				return 1;
+		}
 
 		undo_me(q);
 	}
@@ -672,7 +1176,7 @@ int do_match(query *q, cell *curr_cell)
 		if (!strcmp(GET_STR(curr_cell), ":-"))
 			return do_match2(q, curr_cell);
 
-		rule *h = find_match(q->m, curr_cell);
+		rule *h = find_clauses(q, curr_cell);
 
 		if (!h)
 			q->st.curr_clause = NULL;
@@ -691,7 +1195,7 @@ int do_match(query *q, cell *curr_cell)
 		try_me(q, t->nbr_vars);
 		q->tot_matches++;
 
-		if (unify_structure(q, curr_cell, q->st.curr_frame, head, q->st.fp))
+		if (unify_args(q, curr_cell, q->st.curr_frame, head, q->st.fp))
 			return 1;
 
 		undo_me(q);
@@ -721,35 +1225,44 @@ static int match(query *q)
 			}
 		}
 
-		if (h->index) {
-			cell *key = deep_clone_term_on_heap(q, q->st.curr_cell, q->st.curr_frame);
-			int all_vars = 1, arity = key->arity;
+		cell *arg1 = h->arity ? GET_VALUE(q, q->st.curr_cell+1, q->st.curr_frame) : NULL;
+		q->st.bucket = NULL;
+		q->st.iter = NULL;
 
-			for (cell *c = key + 1; arity--; c += c->nbr_cells) {
-				if (!is_var(c)) {
-					all_vars = 0;
-					break;
-				}
-			}
+		skiplist *l = NULL;
+		cell *key = NULL;
+
+		if (h->index && arg1 && !is_var(arg1) && !(h->flags&FLAG_RULE_VARKEY)) {
+			l = h->index;
+			key = q->st.curr_cell + 1;
+		} else if (h->index)
+			l = bound_arg_index(q, h, &key);
+
+		if (l) {
+			q->st.iter = sl_findkey_ex(l, key, compkey_goal, q);
 
-			if ((key->arity > 1)  && !all_vars) {
-				q->st.iter = sl_findkey(h->index, key);
+			if (q->st.iter)
 				next_key(q);
-			} else {
-				q->st.curr_clause = h->head;
-				q->st.iter = NULL;
-			}
-		} else {
+			else
+				q->st.curr_clause = NULL;
+		} else if (h->jit && arg1 && !is_var(arg1)) {
+			const cindex *idx = h->jit;
+			idx_t i = index_key(arg1) & (idx->nbr_buckets - 1);
+			q->st.bucket = idx->clauses + idx->start[i];
+			q->st.bucket_end = idx->clauses + idx->start[i+1];
+			next_key(q);
+		} else
 			q->st.curr_clause = h->head;
-			q->st.iter = NULL;
-		}
 	} else
 		next_key(q);
 
 	if (!q->st.curr_clause)
 		return 0;
 
+	// The choice owns the iterator but we carry on using it here...
+
 	make_choice(q);
+	q->st.iter = q->choices[q->cp-1].st.iter;
 
 	for (; q->st.curr_clause; next_key(q)) {
 		if (q->st.curr_clause->t.deleted)
@@ -759,7 +1272,6 @@ static int match(query *q)
 		cell *head = get_head(t->cells);
 		try_me(q, t->nbr_vars);
 		q->tot_matches++;
-		q->no_tco = 0;
 
 		if (unify_structure(q, q->st.curr_cell, q->st.curr_frame, head, q->st.fp)) {
 			trace(q, q->st.curr_cell, EXIT);
@@ -774,11 +1286,30 @@ static int match(query *q)
 	return 0;
 }
 
+// An error caught by catch/3 resumes at its recovery goal, whatever
+// the goal that raised it returned...
+
+static int resume_catch(query *q)
+{
+	if (!q->did_throw)
+		return 0;
+
+	q->did_throw = 0;
+	follow_me(q);
+	return 1;
+}
+
 void run_query(query *q)
 {
 	q->yielded = 0;
 
 	while (!g_tpl_abort && !q->error) {
+		if (q->gc && !q->retry)
+			gc_heap(q);
+
+		if (g_purge && !q->retry)
+			purge_retracted();
+
 		if (q->retry) {
 			if (!retry_choice(q))
 				break;
@@ -787,8 +1318,10 @@ void run_query(query *q)
 		if (is_var(q->st.curr_cell)) {
 			cell *c = GET_VALUE(q, q->st.curr_cell, q->st.curr_frame);
 
-			if (!call_me(q, c, q->latest_ctx))
+			if (!call_me(q, c, q->latest_ctx)) {
+				resume_catch(q);
 				continue;
+			}
 		}
 
 		q->tot_goals++;
@@ -798,10 +1331,17 @@ void run_query(query *q)
 		if (!(q->st.curr_cell->flags&FLAG_BUILTIN)) {
 			if (!is_literal(q->st.curr_cell)) {
 				throw_error(q, q->st.curr_cell, "type_error", "callable");
+
+				if (resume_catch(q))
+					continue;
+
 				break;
 			}
 
 			if (!match(q)) {
+				if (resume_catch(q))
+					continue;
+
 				q->retry = 1;
 				q->tot_retries++;
 				trace(q, q->st.curr_cell, FAIL);
@@ -815,7 +1355,12 @@ void run_query(query *q)
 				continue;
 			}
 
-			if (!q->st.curr_cell->fn(q)) {
+			int ok = q->st.curr_cell->fn(q);
+
+			if (resume_catch(q))
+				continue;
+
+			if (!ok) {
 				q->retry = 1;
 
 				if (q->yielded)
@@ -851,6 +1396,8 @@ void query_execute(query *q, term *t)
 	q->st.sp = t->nbr_vars;
 	q->st.curr_frame = 0;
 	q->st.fp = 1;
+	q->st.gfp = 0;
+	q->st.gsp = 0;
 
 	frame *g = q->frames + q->st.curr_frame;
 	g->nbr_vars = t->nbr_vars;
@@ -0,0 +1,58 @@
+% Tabling benchmarks:
+%
+%	tpl -l samples/tabling.pro -g "time(test1),halt"
+%	tpl -l samples/tabling.pro -g "time(test2),halt"
+%	tpl -l samples/tabling.pro -g "time(test3),halt"
+
+% Transitive closure over a 100k-edge graph: 50000 nodes in a ring,
+% each also linked to another node further on...
+
+:- dynamic(edge/2).
+
+make_graph(N) :-
+	between(1, N, I),
+	J is (I mod N) + 1,
+	K is ((I * 7919) mod N) + 1,
+	assertz(edge(I, J)),
+	assertz(edge(I, K)),
+	fail.
+make_graph(_).
+
+:- table path/2.
+
+path(X, Y) :- path(X, Z), edge(Z, Y).
+path(X, Y) :- edge(X, Y).
+
+test1 :-
+	make_graph(50000),
+	findall(Y, path(1, Y), L),
+	length(L, Len),
+	write('reachable='), write(Len), nl.
+
+% Fibonacci, modulo a prime as integers are 64-bit. Untabled this is
+% exponential, tabled it is linear...
+
+:- table fib/2.
+
+fib(0, 0).
+fib(1, 1).
+fib(N, F) :-
+	N > 1,
+	N1 is N - 1, N2 is N - 2,
+	fib(N1, F1), fib(N2, F2),
+	F is (F1 + F2) mod 1000000007.
+
+test2 :-
+	fib(1000, F),
+	F = 517691607,
+	write('fib(1000)='), write(F), write(' PASSED'), nl.
+
+% Answers are kept between queries, the second call is a lookup...
+
+test3 :-
+	abolish_all_tables,
+	fib(1000, _),
+	between(1, 100000, _),
+	fib(1000, _),
+	fail.
+test3.
@@ -0,0 +1,23 @@
+% Grouping benchmark: bagof/setof over 100k facts in 5000 groups.
+
+test1 :-
+	write('Load...'), nl,
+	between(1,100000,I),
+		K is I mod 5000,
+		assertz(sale(K,I)),
+		fail.
+test1.
+
+test2 :-
+	write('Bagof by key...'), nl,
+	findall(K-N, (bagof(V, sale(K,V), Vs), length(Vs,N)), L),
+	length(L, G),
+	write(G), write(' groups'), nl.
+
+test3 :-
+	write('Setof by key...'), nl,
+	findall(K, setof(V, sale(K,V), _), L),
+	length(L, G),
+	write(G), write(' groups'), nl.
+
+:- initialization((test1, test2, test3)).
@@ -0,0 +1,34 @@
+% Dynamic call benchmark over a large number of predicates.
+
+make_preds(N) :-
+	between(1,N,I),
+		atomic_concat(p_, I, F),
+		Head =.. [F,X,Y],
+		assertz((Head :- Y is X+1)),
+		fail.
+make_preds(_).
+
+test1 :-
+	write('Load...'), nl,
+	make_preds(5000),
+	write('Call/N over 5000 predicates...'), nl,
+	between(1,200,_),
+		between(1,5000,I),
+			atomic_concat(p_, I, F),
+			call(F, I, _),
+			fail.
+test1 :-
+	write('Done... '), write(1000000), write(' calls'), nl, true.
+
+test2 :-
+	write('Load...'), nl,
+	make_preds(5000),
+	write('Univ call over 5000 predicates...'), nl,
+	between(1,200,_),
+		between(1,5000,I),
+			atomic_concat(p_, I, F),
+			G =.. [F,I,_],
+			call(G),
+			fail.
+test2 :-
+	write('Done... '), write(1000000), write(' calls'), nl, true.
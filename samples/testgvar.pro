@@ -0,0 +1,50 @@
+% Counting with global variables versus the database...
+%
+%	tpl -l samples/testgvar.pro -g "time(test1),halt"
+
+:- dynamic(counter/1).
+
+% Non-backtrackable counter in a failure-driven loop
+
+test1 :-
+	nb_setval(counter, 0),
+	(	between(1, 10000000, _),
+		nb_getval(counter, C),
+		C1 is C + 1,
+		nb_setval(counter, C1),
+		fail
+	;	true
+	),
+	nb_getval(counter, N),
+	writeln(N).
+
+% Backtrackable counter in a recursive loop
+
+test2 :-
+	b_setval(counter, 0),
+	count(10000000),
+	b_getval(counter, N),
+	writeln(N).
+
+count(0) :- !.
+count(I) :-
+	b_getval(counter, C),
+	C1 is C + 1,
+	b_setval(counter, C1),
+	I1 is I - 1,
+	count(I1).
+
+% The same with assert & retract (fewer iterations)
+
+test3 :-
+	retractall(counter(_)),
+	assertz(counter(0)),
+	(	between(1, 100000, _),
+		once(retract(counter(C))),
+		C1 is C + 1,
+		assertz(counter(C1)),
+		fail
+	;	true
+	),
+	counter(N),
+	writeln(N).
@@ -0,0 +1,21 @@
+% Heap growth benchmark: builds lists of ten million cells.
+
+test1 :-
+	write('Build 10M-cell list with findall...'), nl,
+	findall(X, between(1,5000000,X), L),
+	length(L, N),
+	write(N), nl.
+
+test2 :-
+	write('Build 10M-cell list with copy_term...'), nl,
+	findall(X, between(1,5000000,X), L),
+	copy_term(f(L), f(L2)),
+	length(L2, N),
+	write(N), nl.
+
+test3 :-
+	write('Build 10M-cell list with msort...'), nl,
+	findall(X, (between(1,5000000,I), X is 5000000-I), L),
+	msort(L, L2),
+	L2 = [H|_],
+	write(H), nl.
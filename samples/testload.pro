@@ -0,0 +1,19 @@
+% Bulk load benchmark: write 1M ground facts to a file then consult it.
+
+gen(_, N, N) :- !.
+gen(S, I, N) :-
+	K is I mod 1000,
+	V is (I * 7919) mod 100003,
+	writeq(S, fact(I, K, 'Item number', V)), write(S, '.'), nl(S),
+	J is I + 1,
+	gen(S, J, N).
+
+test1 :-
+	write('Write 1M facts...'), nl,
+	open('/tmp/testload_facts.pro', write, S),
+	gen(S, 0, 1000000),
+	close(S),
+	write('Load...'), nl,
+	consult('/tmp/testload_facts.pro'),
+	fact(999999, K, _, V),
+	write(done(K,V)), nl.
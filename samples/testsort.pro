@@ -0,0 +1,29 @@
+% Sort benchmark: one million element lists.
+
+test1 :-
+	write('msort 1M pseudo-random integers...'), nl,
+	findall(X, (between(1,1000000,I), X is (I * 7919) mod 1000003), L),
+	msort(L, L2),
+	L2 = [H|_],
+	write(H), nl.
+
+test2 :-
+	write('sort 1M atoms with common prefixes...'), nl,
+	findall(X, (between(1,1000000,I), J is I mod 50000, number_codes(J, Cs), atom_codes(A, Cs), atom_concat(key_, A, X)), L),
+	sort(L, L2),
+	length(L2, N),
+	write(N), nl.
+
+test3 :-
+	write('keysort 1M pairs...'), nl,
+	findall(K-I, (between(1,1000000,I), K is I mod 1000), L),
+	keysort(L, L2),
+	L2 = [H|_],
+	write(H), nl.
+
+test4 :-
+	write('msort 1M already sorted integers...'), nl,
+	findall(X, between(1,1000000,X), L),
+	msort(L, L2),
+	L2 = [H|_],
+	write(H), nl.
@@ -0,0 +1,24 @@
+% Consult a 100k row static fact table and look it up by 1st-arg.
+
+gen(File, N) :-
+	open(File, write, S),
+	(	between(1, N, I),
+			J is I * 7,
+			write(S, row(I, J)), write(S, '.'), nl(S),
+			fail
+	;	true
+	),
+	close(S).
+
+test1 :-
+	File = '/tmp/teststatic_rows.pro',
+	write('Generate...'), nl,
+	gen(File, 100000),
+	write('Consult...'), nl,
+	consult(File),
+	write('Search using 1st-arg...'), nl,
+	between(1, 100000, I),
+		row(I, _),
+		fail.
+test1 :-
+	write('Done... '), write(100000), write(' items'), nl, true.
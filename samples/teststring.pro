@@ -0,0 +1,32 @@
+% String benchmark: copying and splitting 4K character lines.
+
+line(L) :-
+	findall(C, (between(1,4096,I), C is 0'a + (I mod 26)), Cs),
+	atom_codes(L, Cs).
+
+copy(0, _) :- !.
+copy(N, L) :-
+	copy_term(f(L,L,L), _),
+	findall(X, (X = L ; X = L), [_,_]),
+	M is N-1,
+	copy(M, L).
+
+split(0, _) :- !.
+split(N, L) :-
+	sub_atom(L, 103, _, 0, Rest),
+	atom_concat(abc, Tail, Rest),
+	atom_length(Tail, _),
+	M is N-1,
+	split(M, L).
+
+test1 :-
+	write('Copy a 4K line 100K times...'), nl,
+	line(L),
+	copy(100000, L),
+	write(done), nl.
+
+test2 :-
+	write('Split a 4K line 100K times...'), nl,
+	line(L),
+	split(100000, L),
+	write(done), nl.
@@ -0,0 +1,28 @@
+% Text benchmark: atom_length/2 and sub_atom/5 on a 100K character atom.
+
+text(T) :-
+	findall(C, (between(1,100000,I), C is 0'a + (I mod 26)), Cs),
+	atom_codes(T, Cs).
+
+loop(0, _) :- !.
+loop(N, T) :- atom_length(T, _), M is N-1, loop(M, T).
+
+test1 :-
+	write('atom_length 100K times...'), nl,
+	text(T),
+	loop(100000, T),
+	write(done), nl.
+
+test2 :-
+	write('Find all occurrences of a word...'), nl,
+	text(T),
+	findall(B, sub_atom(T, B, _, _, xyz), L),
+	length(L, N),
+	write(N), nl.
+
+test3 :-
+	write('Enumerate every character...'), nl,
+	text(T),
+	findall(C, sub_atom(T, _, 1, _, C), L),
+	length(L, N),
+	write(N), nl.
@@ -24,7 +24,8 @@ struct slnode_ {
 struct sliter_ {
 	skiplist *l;
 	slnode_t *p;
-	const void *key;
+	const void *key, *param;
+	int (*compkey)(const void*, const void*, const void*);
 	int idx, dynamic;
 };
 
@@ -77,6 +78,7 @@ void sl_destroy(skiplist *l)
 }
 
 size_t sl_count(const skiplist *l) { return l->count; }
+int sl_iterators(const skiplist *l) { return l->iter_cnt; }
 
 static int binary_search(const skiplist *l, const keyval_t n[], const void *key, int imin, int imax)
 {
@@ -162,7 +164,7 @@ int sl_set(skiplist *l, const void *key, const void *val)
 	}
 
 	if (p != l->header) {
-		int imid = binary_search2(l, p->bkt, key, 0, p->nbr - 1);
+		int imid = binary_search1(l, p->bkt, key, 0, p->nbr - 1);
 
 		if (p->nbr < BUCKET_SIZE) {
 			int j;
@@ -177,17 +179,12 @@ int sl_set(skiplist *l, const void *key, const void *val)
 			return 1;
 		}
 
-		// Don't drop this unless you are 100% sure:
-
-		while ((imid < p->nbr) && (l->compkey(p->bkt[imid].key, key) == 0))
-			imid++;
+		// Equal keys move to the new node, after this one...
 
-		if (imid <= BUCKET_SIZE) {
-			for (int j = imid; j < p->nbr; j++)
-				stash.bkt[stash.nbr++] = p->bkt[j];
+		for (int j = imid; j < p->nbr; j++)
+			stash.bkt[stash.nbr++] = p->bkt[j];
 
-			p->nbr = imid;
-		}
+		p->nbr = imid;
 	}
 
 	k = random_level(&l->seed);
@@ -423,25 +420,59 @@ void sl_find(const skiplist *l, const void *key, int (*f)(void*, const void*, co
 	}
 }
 
+static int binary_search3(const sliter *iter, const keyval_t n[], int imin, int imax)
+{
+	int imid = 0;
+
+	while (imax >= imin) {
+		imid = (imax + imin) / 2;
+
+		if (iter->compkey(n[imid].key, iter->key, iter->param) < 0)
+			imin = imid + 1;
+		else
+			imax = imid - 1;
+	}
+
+	if (iter->compkey(n[imid].key, iter->key, iter->param) < 0)
+		imid++;
+
+	return imid;
+}
+
+static int compkey_list(const void *ptr1, const void *ptr2, const void *param)
+{
+	const skiplist *l = (const skiplist*)param;
+	return l->compkey(ptr1, ptr2);
+}
+
 sliter *sl_findkey(skiplist *l, const void *key)
+{
+	return sl_findkey_ex(l, key, compkey_list, l);
+}
+
+// As sl_findkey but the search key is only ever passed as the second
+// argument of 'compkey' (with 'param'), so it need not be a stored key.
+
+sliter *sl_findkey_ex(skiplist *l, const void *key, int (*compkey)(const void*, const void*, const void*), const void *param)
 {
 	slnode_t *p, *q = 0;
 	p = l->header;
 
 	for (int k = l->level - 1; k >= 0; k--) {
-		while ((q = p->forward[k]) && (l->compkey(q->bkt[q->nbr - 1].key, key) < 0))
+		while ((q = p->forward[k]) && (compkey(q->bkt[q->nbr - 1].key, key, param) < 0))
 			p = q;
 	}
 
 	if (!(q = p->forward[0]))
 		return NULL;
 
-	int imid = binary_search1(l, q->bkt, key, 0, q->nbr - 1);
+	sliter tmp;
+	tmp.key = key;
+	tmp.param = param;
+	tmp.compkey = compkey;
+	int imid = binary_search3(&tmp, q->bkt, 0, q->nbr - 1);
 
-	if (imid < 0)
-		return NULL;
-
-	if (l->compkey(q->bkt[imid].key, key) != 0)
+	if ((imid >= q->nbr) || (compkey(q->bkt[imid].key, key, param) != 0))
 		return NULL;
 
 	sliter *iter;
@@ -456,6 +487,8 @@ sliter *sl_findkey(skiplist *l, const void *key)
 	}
 
 	iter->key = key;
+	iter->param = param;
+	iter->compkey = compkey;
 	iter->l = (skiplist*)l;
 	iter->p = q;
 	iter->idx = imid;
@@ -470,7 +503,7 @@ int sl_nextkey(sliter *iter, void **val)
 	}
 
 	if (iter->idx < iter->p->nbr) {
-		if (iter->l->compkey(iter->p->bkt[iter->idx].key, iter->key) != 0) {
+		if (iter->compkey(iter->p->bkt[iter->idx].key, iter->key, iter->param) != 0) {
 			sl_done(iter);
 			return 0;
 		}
@@ -489,6 +522,22 @@ int sl_nextkey(sliter *iter, void **val)
 	return 0;
 }
 
+int sl_is_next_key(sliter *iter)
+{
+	const slnode_t *p = iter->p;
+	int idx = iter->idx;
+
+	if (p && (idx >= p->nbr)) {
+		p = p->forward[0];
+		idx = 0;
+	}
+
+	if (!p || (idx >= p->nbr))
+		return 0;
+
+	return !iter->compkey(p->bkt[idx].key, iter->key, iter->param);
+}
+
 void sl_done(sliter *iter)
 {
 	iter->l->iter_cnt--;
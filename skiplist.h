@@ -13,8 +13,11 @@ int sl_del(skiplist *l, const void *k);
 void sl_iterate(const skiplist *l, int (*callback)(void *p, const void *k, const void *v), void *p);
 void sl_find(const skiplist *l, const void *k, int (*f)(void *p, const void *k, const void *v), void *p);
 sliter *sl_findkey(skiplist *l, const void *k);
+sliter *sl_findkey_ex(skiplist *l, const void *k, int (*compkey)(const void*, const void*, const void*), const void *p);
 int sl_nextkey(sliter *i, void **v);
+int sl_is_next_key(sliter *i);
 void sl_done(sliter *i);
 size_t sl_count(const skiplist *l);
+int sl_iterators(const skiplist *l);
 void sl_dump(const skiplist *l, const char *(*f)(void *p, const void* k), void *p);
 void sl_destroy(skiplist *l);
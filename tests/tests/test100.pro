@@ -0,0 +1,17 @@
+:-initialization(main).
+:-use_module(library(lists)).
+
+% Library predicates run in their own module, which must get the same
+% optimization level as user code, so this reverse/2 should not grow
+% the stack of frames either.
+
+mk(0, []) :- !.
+mk(N, [N|T]) :- N1 is N-1, mk(N1, T).
+
+main :-
+	mk(100000, L),
+	reverse(L, [F|_]),
+	write(F), nl,
+	statistics(max_frames, M),
+	(M < 100 -> write(bounded) ; write(M)), nl,
+	halt.
@@ -0,0 +1,23 @@
+:-initialization(main).
+
+% Every step binds a term with variables, so its frame is made global.
+% The term made half way is kept while the others are dropped, so the
+% collector slides its frame down over theirs and its variables must
+% still be found afterwards.
+
+walk(0, _, Keep, Keep) :- !.
+walk(N, _, Keep0, Keep) :-
+	Y = p(_, N, q(_)),
+	(N =:= 1000000 -> Keep1 = Y ; Keep1 = Keep0),
+	N1 is N-1,
+	walk(N1, Y, Keep1, Keep).
+
+main :-
+	walk(2000000, x, none, Keep),
+	Keep = p(A, N, q(B)),
+	(var(A), var(B) -> write(unbound) ; write(bound)), nl,
+	A = N, B = A,
+	write(Keep), nl,
+	statistics(gc_count, C),
+	(C > 0 -> write(collected) ; write(not_collected)), nl,
+	halt.
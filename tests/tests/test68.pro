@@ -0,0 +1,25 @@
+:-initialization(main).
+
+mk(0) :- !.
+mk(N) :-
+	number_codes(N, Cs),
+	atom_codes(A, [0'f,0'(,0'a|Cs]),
+	atom_concat(A, ')', S),
+	read_term_from_atom(S, _, []),
+	N1 is N-1,
+	mk(N1).
+
+main :-
+	statistics(atoms, A0),
+	mk(200),
+	statistics(atoms, A1),
+	D is A1 - A0,
+	write(D), nl,
+	mk(200),
+	statistics(atoms, A2),
+	D2 is A2 - A1,
+	write(D2), nl,
+	statistics(atom_lookups, L),
+	statistics(atom_probes, P),
+	(P < L * 2 -> write(ok) ; write(P/L)), nl,
+	halt.
@@ -0,0 +1,28 @@
+:-initialization(main).
+
+f(a, 1).
+f(b, 2).
+f(X, any(X)).
+f(1, int).
+f(1.0, float).
+f(-0.0, zero).
+f(g(x), g1).
+f(g(x,y), g2).
+f([], nil).
+f([_|_], list).
+f(b, 3).
+
+len([], 0).
+len([_|T], N) :- len(T, N0), N is N0 + 1.
+
+main :-
+	findall(K-V, f(K,V), L1), write(L1), nl,
+	findall(V, f(b,V), L2), write(L2), nl,
+	findall(V, f(1,V), L3), write(L3), nl,
+	findall(V, f(0.0,V), L4), write(L4), nl,
+	findall(V, f(g(_),V), L5), write(L5), nl,
+	findall(V, f([a],V), L6), write(L6), nl,
+	findall(V, f(zz,V), L7), write(L7), nl,
+	atom_codes(A, "a"), findall(V, f(A,V), L8), write(L8), nl,
+	len([a,b,c], N), write(N), nl,
+	halt.
@@ -0,0 +1,23 @@
+:-initialization(main).
+
+:- dynamic(g/2).
+:- dynamic(h/2).
+
+main :-
+	between(1, 100, I), J is I mod 7, assertz(g(I, J)), fail.
+main :-
+	findall(X, g(X,3), L1), write(L1), nl,
+	findall(Y, g(17,Y), L2), write(L2), nl,
+	assertz(h(b, 1)), assertz(h(1, int)), assertz(h(a, 2)),
+	asserta(h(b, 0)), assertz(h(f(x), f1)), assertz(h(1.0, float)),
+	assertz(h(b, 3)), asserta(h(f(y), f0)), assertz(h("b", str)),
+	findall(V, h(b,V), L3), write(L3), nl,
+	findall(V, h(f(_),V), L4), write(L4), nl,
+	findall(V, h(1,V), L5), write(L5), nl,
+	findall(V, h(zz,V), L6), write(L6), nl,
+	retract(h(b, 1)),
+	findall(V, h(b,V), L7), write(L7), nl,
+	assertz(h(_, any)),
+	findall(V, h(a,V), L8), write(L8), nl,
+	findall(K-V, h(K,V), L9), length(L9, N9), write(N9), nl,
+	halt.
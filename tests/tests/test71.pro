@@ -0,0 +1,27 @@
+:-initialization(main).
+
+:- dynamic(edge/2).
+:- dynamic(w/3).
+
+st(a, 1).
+st(b, 2).
+
+main :-
+	between(1, 50, I), J is I mod 5, K is I * 2,
+		assertz(edge(I, J)), assertz(w(I, J, K)), fail.
+main :-
+	findall(X, edge(X, 3), L1), write(L1), nl,
+	(predicate_property(edge(_,_), indexed(I1)) -> write(I1) ; write(none)), nl,
+	findall(X, w(X, _, 40), L2), write(L2), nl,
+	findall(X-Y, w(X, Y, 40), L3), write(L3), nl,
+	(predicate_property(w(_,_,_), indexed(I2)) -> write(I2) ; write(none)), nl,
+	asserta(edge(0, 3)), assertz(edge(99, 3)),
+	findall(X, edge(X, 3), L4), write(L4), nl,
+	retract(edge(13, 3)),
+	findall(X, edge(X, 3), L5), write(L5), nl,
+	assertz(edge(100, _)),
+	findall(X, edge(X, 3), L6), write(L6), nl,
+	(predicate_property(edge(_,_), indexed(I3)) -> write(I3) ; write(none)), nl,
+	(predicate_property(st(_,_), indexed(I4)) -> write(I4) ; write(none)), nl,
+	(predicate_property(edge(_,_), dynamic) -> write(yes) ; write(no)), nl,
+	halt.
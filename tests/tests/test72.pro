@@ -0,0 +1,33 @@
+:-initialization(main).
+
+:- dynamic(k/2).
+
+s(abcdefghijklmnopqrstuvwxyz, static).
+s(abcdefghijklmnopqrstuvwxyZ, other).
+s(short, small).
+
+mk(A, B, C) :- atom_concat(A, B, C).
+
+main :-
+	mk(abcdefghij, klmnopqrstuvwxyz, A1),
+	mk(abcdefghij, klmnopqrstuvwxyz, A2),
+	mk(abcdefghij, klmnopqrstuvwxyZ, A3),
+	mk(sh, ort, A4),
+	(A1 = abcdefghijklmnopqrstuvwxyz -> write(yes) ; write(no)), nl,
+	(A1 == A2 -> write(yes) ; write(no)), nl,
+	(A1 == A3 -> write(yes) ; write(no)), nl,
+	(A1 = abcdefghijklmnopqrstuvwxy -> write(yes) ; write(no)), nl,
+	(A4 == short -> write(yes) ; write(no)), nl,
+	compare(O1, A1, A3), write(O1), nl,
+	compare(O2, A1, A2), write(O2), nl,
+	msort([A3, A1, zzz, A4, A2, aaa], L1), write(L1), nl,
+	sort([A3, A1, zzz, A4, A2, aaa], L2), write(L2), nl,
+	findall(V, s(A1, V), L3), write(L3), nl,
+	findall(V, s(A3, V), L4), write(L4), nl,
+	findall(V, s(A4, V), L5), write(L5), nl,
+	assertz(k(A1, 1)), assertz(k(abcdefghijklmnopqrstuvwxyz, 2)),
+	assertz(k(A3, 3)), assertz(k(short, 4)),
+	findall(V, k(abcdefghijklmnopqrstuvwxyz, V), L6), write(L6), nl,
+	findall(V, k(A2, V), L7), write(L7), nl,
+	findall(V, k(A4, V), L8), write(L8), nl,
+	halt.
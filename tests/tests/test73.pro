@@ -0,0 +1,25 @@
+:-initialization(main).
+
+handle(N, L) :-
+	atomic_concat(request_number_with_a_long_prefix_, N, A),
+	atom_length(A, L),
+	findall(X, between(1,20,X), Xs),
+	length(Xs, 20).
+
+loop(0, _, Acc, Acc) :- !.
+loop(N, Keep, Acc0, Acc) :-
+	handle(N, L),
+	Acc1 is Acc0 + L,
+	N1 is N-1,
+	loop(N1, Keep, Acc1, Acc).
+
+main :-
+	atomic_concat(kept_across_collections_, 42, K),
+	findall(Y, between(1,5,Y), Ys),
+	loop(100000, f(K, Ys), 0, Sum),
+	write(Sum), nl,
+	write(K), nl,
+	write(Ys), nl,
+	statistics(gc_count, C),
+	(C > 0 -> write(collected) ; write(not_collected)), nl,
+	halt.
@@ -0,0 +1,23 @@
+:-initialization(main).
+
+sq(X,Y) :- Y is X*X.
+pair(X,p(X,Y)) :- Y is X+1.
+wrap(X,f(X,_)).
+pick(X) :- member(X,[a,b,c]).
+
+loop(0,S,S) :- !.
+loop(N,S0,S) :- sq(N,Q), S1 is S0+Q, N1 is N-1, loop(N1,S1,S).
+
+build(0,[]) :- !.
+build(N,[P|T]) :- pair(N,P), N1 is N-1, build(N1,T).
+
+sum([],0).
+sum([p(X,Y)|T],S) :- sum(T,S0), S is S0+X+Y.
+
+main :-
+	loop(100000,0,S1), write(S1), nl,
+	build(1000,L), sum(L,S2), write(S2), nl,
+	wrap(a,W), W = f(_,Z), Z = z, write(W), nl,
+	findall(X-Y, (pick(X), sq(3,Y)), Ps), write(Ps), nl,
+	findall(X, (pick(X), (X == b -> true ; sq(2,4))), Xs), write(Xs), nl,
+	halt.
@@ -0,0 +1,19 @@
+:-initialization(main).
+
+depth(0,0).
+depth(N,S) :- N > 0, N1 is N-1, findall(X, depth(N1,X), [S0]), S is S0+1.
+
+tree(0,leaf).
+tree(N,node(L,R)) :- N > 0, N1 is N-1, findall(T, tree(N1,T), [L]), findall(T, tree(N1,T), [R]).
+
+leaves(leaf,1).
+leaves(node(L,R),N) :- leaves(L,A), leaves(R,B), N is A+B.
+
+values(Vs) :- bagof(V, K^member(K-V,[a-1,b-2,a-3,c-4,b-5]), Vs).
+
+main :-
+	depth(500,D), write(D), nl,
+	tree(6,T), leaves(T,N), write(N), nl,
+	findall(Vs, values(Vs), G), write(G), nl,
+	findall(S, (member(X,[3,1,2]), setof(Y, between(1,X,Y), S)), Ss), write(Ss), nl,
+	halt.
@@ -0,0 +1,16 @@
+:-initialization(main).
+
+by_length(O,A,B) :- atom_length(A,LA), atom_length(B,LB), compare(O,LA,LB).
+
+main :-
+	sort([c,b,a,b,1,2.0,1.0,f(x),zebra_long_name,zebra_long_mame,''], L1), write(L1), nl,
+	msort([b,a,b,1,1.0,1], L2), write(L2), nl,
+	keysort([b-1,a-2,b-0,a-1,c-9], L3), write(L3), nl,
+	sort(0, @>=, [1,3,2,3], L4), write(L4), nl,
+	sort(1, @<, [f(2,a),f(1,b),f(2,c)], L5), write(L5), nl,
+	sort(1, @>=, [f(2,a),f(1,b),f(2,c)], L6), write(L6), nl,
+	sort(2, @=<, [f(2,b),f(1,a),f(3,b)], L7), write(L7), nl,
+	predsort(by_length, [abc,a,ab,xyz,b], L8), write(L8), nl,
+	sort([1r2,1r3,2r6,9223372036854775807r2,9223372036854775806r3], L9), write(L9), nl,
+	sort([[3,2,1],[1,2],[1,2,3]], L10), write(L10), nl,
+	halt.
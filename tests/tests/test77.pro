@@ -0,0 +1,20 @@
+:-initialization(main).
+main :-
+	findall(B-L-A-S, sub_atom(abc,B,L,A,S), L1), write(L1), nl,
+	findall(B-A, sub_atom(abcabc,B,_,A,bc), L2), write(L2), nl,
+	findall(B-A, sub_atom(abcabc,B,_,A,''), L3), write(L3), nl,
+	findall(S, sub_atom(abcde,1,_,_,S), L4), write(L4), nl,
+	findall(S, sub_atom(abcde,_,2,_,S), L5), write(L5), nl,
+	findall(S, sub_atom(abcde,_,_,1,S), L6), write(L6), nl,
+	findall(S, sub_atom(abcde,1,2,_,S), L7), write(L7), nl,
+	findall(S, sub_atom(abcde,_,2,1,S), L8), write(L8), nl,
+	findall(S, sub_atom(abcde,1,_,1,S), L9), write(L9), nl,
+	findall(B-S, sub_atom('héllo wörld',B,3,_,S), L10), write(L10), nl,
+	findall(B-A, sub_atom('héllo wörld',B,_,A,'ö'), L11), write(L11), nl,
+	findall(B-A, sub_atom('ééé',B,_,A,'é'), L12), write(L12), nl,
+	atom_length('héllo', N1), write(N1), nl,
+	atom_length(abc, N2), write(N2), nl,
+	findall(S, sub_atom(abc,_,5,_,S), L14), write(L14), nl,
+	findall(S, sub_atom(abc,4,_,_,S), L15), write(L15), nl,
+	findall(S, sub_atom(abc,_,_,3,S), L16), write(L16), nl,
+	halt.
@@ -0,0 +1,16 @@
+:-initialization(main).
+main :-
+	findall(A+B, atom_concat(A,B,abc), L1), write(L1), nl,
+	findall(A+B, atom_concat(A,B,'héé'), L2), write(L2), nl,
+	findall(A+B, atom_concat(A,B,''), L3), write(L3), nl,
+	atom_codes(Long, "the quick brown fox jumps over the lazy dog"),
+	findall(S, sub_atom(Long,_,_,0,S), L4), length(L4,N4), write(N4), nl,
+	sub_atom(Long, 4, _, 0, S5), write(S5), nl,
+	sub_atom(S5, 6, _, 0, S6), write(S6), nl, atom_length(S6, N6), write(N6), nl,
+	sub_atom(S6, 0, 5, _, S7), write(S7), nl,
+	atom_concat(S6, '!', S8), write(S8), nl,
+	(S6 == 'fox jumps over the lazy dog' -> write(eq) ; write(neq)), nl,
+	copy_term(f(S6), F), write(F), nl,
+	findall(X, (member(X,[S5,S6])), L9), write(L9), nl,
+	atom_concat(the, R, Long), write(R), nl,
+	halt.
@@ -0,0 +1,23 @@
+:-initialization(main).
+:-dynamic(d/2).
+f(a, b, 'C d', 12).
+f(-5, 0, 'x', 'a longer quoted atom here').
+f(true, 'true', '-', is).
+f(a , b, c, d).
+f(1.5, "s", [x], g(y)).
+/* comment */ f(0x1F, 0'a, 007, -0).
+g(X) :- f(X, _, _, _).
+d(1,2).   % trailing comment
+d(2,
+  3).
+f(é, 'é', 'ééééééééééééééééé', k123_Z).
+f(aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa, 123456789012345678, 'a', 'b').
+main :-
+	findall(f(A,B,C,D), f(A,B,C,D), L1), writeq(L1), nl,
+	findall(A, g(A), L2), writeq(L2), nl,
+	findall(A-B, d(A,B), L3), writeq(L3), nl,
+	f(A4, B4, 'C d', D4), writeq(A4/B4/D4), nl,
+	(atom('C d') -> write(yes) ; write(no)), nl,
+	(f(_, _, _, 'a longer quoted atom here') -> write(yes) ; write(no)), nl,
+	assertz(d(3,4)), findall(A-B, d(A,B), L5), writeq(L5), nl,
+	halt.
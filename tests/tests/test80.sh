@@ -0,0 +1,27 @@
+#!/bin/sh
+
+# Precompiled files: consult the .qlf directly and through its source name
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+cat >$DIR/prog.pro <<'PRO'
+:- initialization(main).
+:- dynamic(count/1).
+:- op(700, xfx, ===>).
+count(0).
+a ===> b.
+greeting("hello", 'Hello World, a longer quoted atom').
+digits --> [D], { code_type(D, digit) }.
+main :-
+	retract(count(N)), M is N+1, assertz(count(M)), count(C), write(C), nl,
+	X ===> Y, write(X-Y), nl,
+	greeting(S, A), atom_codes(T, S), write(T), nl, write(A), nl,
+	(phrase(digits, "7") -> write(yes) ; write(no)), nl,
+	member(Z, [x,y]), write(Z), nl,
+	halt.
+PRO
+
+$TPL -q --compile $DIR/prog.pro || echo compile failed
+$TPL -q -l $DIR/prog.qlf
+$TPL -q -l $DIR/prog
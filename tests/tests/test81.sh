@@ -0,0 +1,36 @@
+#!/bin/sh
+
+# Parallel consult: clause order, operators declared part way through
+# and statements the splitter has to be careful with
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+awk 'BEGIN { for (i = 0; i < 10000; i++) printf "n(%d, \"item %d. done\").\n", i, i }' >$DIR/prog.pro
+
+cat >>$DIR/prog.pro <<'PRO'
+:- initialization(main).
+:- op(700, xfx, ===>).
+a ===> b.	% comment after the full stop
+c ===> d.% and without a space
+e('quoted. atom', X) :- X =.. [f, 1].
+/* a block comment. */ g(1).
+h([1,
+   2]).
+PRO
+
+awk 'BEGIN { for (i = 10000; i < 20000; i++) printf "n(%d, \"item %d. done\").\n", i, i }' >>$DIR/prog.pro
+
+cat >>$DIR/prog.pro <<'PRO'
+main :-
+	findall(N, n(N, _), L), length(L, Len), write(Len), nl,
+	L = [First|_], append(_, [Last], L), write(First-Last), nl,
+	n(12345, S), atom_codes(A, S), write(A), nl,
+	findall(X-Y, X ===> Y, Ops), write(Ops), nl,
+	e(Q, T), write(Q/T), nl,
+	g(G), h(H), write(G/H), nl,
+	halt.
+PRO
+
+$TPL -q --threads=1 -l $DIR/prog.pro </dev/null
+$TPL -q --threads=4 -l $DIR/prog.pro </dev/null
@@ -0,0 +1,55 @@
+#!/bin/sh
+
+# Persistent predicates: the binary log survives restarts, a torn
+# record at the end is dropped and an old text log is converted
+
+case $TPL in /*) ;; *) TPL=$(pwd)/$TPL ;; esac
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+cd $DIR
+
+cat >add.pro <<'PRO'
+:- initialization(main).
+:- set_prolog_flag(persist_sync, 1).
+:- persist f/2.
+main :-
+	db_load,
+	assertz(f(1, 'an atom')), assertz(f(2, g(X, X, [a,b]))),
+	asserta(f(0, -3.5)), assertz(f(3, x), U), assertz(f(4, U)),
+	retract(f(2, _)),
+	halt.
+PRO
+
+cat >more.pro <<'PRO'
+:- initialization(main).
+:- persist f/2.
+main :- db_load, assertz(f(5, 123456789012)), halt.
+PRO
+
+cat >show.pro <<'PRO'
+:- initialization(main).
+:- persist f/2.
+main :-
+	db_load,
+	findall(K, f(K, _), L), write(L), nl,
+	f(1, A), f(0, R), write(A/R), nl,
+	f(4, U), atom_length(U, N), write(N), nl,
+	halt.
+PRO
+
+$TPL -q -l add.pro
+$TPL -q -l show.pro
+$TPL -q -l more.pro
+SIZE=$(wc -c <user.db)
+head -c $((SIZE - 3)) user.db >user.tmp && mv user.tmp user.db
+$TPL -q -l show.pro 2>/dev/null
+$TPL -q -l show.pro
+
+cat >user.db <<'LOG'
+z_(f(7,old),'00065E0230408398-0000-00006AD30168').
+z_(f(8,text),'00065E02304083BB-0000-00006AD30169').
+e_('00065E0230408398-0000-00006AD30168').
+LOG
+$TPL -q -l more.pro
+head -c 4 user.db; echo
+$TPL -q -l show.pro 2>/dev/null | head -1
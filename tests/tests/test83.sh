@@ -0,0 +1,54 @@
+#!/bin/sh
+
+# Persistent predicates: the log is compacted in the background, by
+# size and by the share of erased records, without losing updates
+
+case $TPL in /*) ;; *) TPL=$(pwd)/$TPL ;; esac
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+cd $DIR
+
+cat >churn.pro <<'PRO'
+:- initialization(main).
+:- persist s/2.
+main :- db_load, loop(0), halt.
+loop(6000) :- !.
+loop(I) :-
+	K is I mod 50,
+	ignore(retract(s(K, _))),
+	assertz(s(K, v(I, "payload", 'an atom'))),
+	I2 is I + 1, loop(I2).
+PRO
+
+cat >grow.pro <<'PRO'
+:- initialization(main).
+:- set_prolog_flag(persist_compact_size, 20000).
+:- set_prolog_flag(persist_compact_ratio, 0).
+:- set_prolog_flag(stack_limit, 1000000).
+:- persist g/1.
+main :- db_load, loop(0), halt.
+loop(3000) :- !.
+loop(I) :- assertz(g(I)), I2 is I + 1, loop(I2).
+PRO
+
+cat >show.pro <<'PRO'
+:- initialization(main).
+:- persist s/2.
+:- persist g/1.
+main :-
+	db_load,
+	findall(K-I, s(K, v(I, _, _)), L), length(L, N), write(N), nl,
+	L = [First|_], write(First), nl,
+	findall(G, g(G), Gs), length(Gs, Len), sum(Gs, 0, S), write(Len/S), nl,
+	halt.
+sum([], S, S).
+sum([X|Xs], S0, S) :- S1 is S0 + X, sum(Xs, S1, S).
+PRO
+
+$TPL -q -l churn.pro
+[ $(wc -c <user.db) -lt 100000 ] && echo compacted
+$TPL -q -l grow.pro
+$TPL -q -l grow.pro
+echo junk >user.TMP
+$TPL -q -l show.pro
+[ -f user.TMP ] || echo removed
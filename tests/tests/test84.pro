@@ -0,0 +1,19 @@
+:-initialization(main).
+nest(0, a) :- !.
+nest(N, f(x,T)) :- N1 is N-1, nest(N1, T).
+conj(0, true) :- !.
+conj(N, (x,T)) :- N1 is N-1, conj(N1, T).
+nums(N, N, [N]) :- !.
+nums(I, N, [I|T]) :- I1 is I+1, nums(I1, N, T).
+main :-
+	nest(3, T1), writeq(T1), nl, write_canonical(T1), nl,
+	term_to_atom(T1, A1), writeq(A1), nl,
+	conj(3, T2), writeq(T2), nl,
+	nums(1, 5, L1), write_canonical(L1), nl, term_to_atom(L1, A2), writeq(A2), nl,
+	writeq([a,b|c]), nl, writeq(f(- 1, -(-(1)), 'A b', "s")), nl,
+	format('~w ~q ~k~n', [g('A', [x|y]), 'A', [1,2]]),
+	nest(100000, T3), term_to_atom(T3, A3), atom_length(A3, N3), write(N3), nl,
+	conj(100000, T4), format(atom(A4), '~w', [T4]), atom_length(A4, N4), write(N4), nl,
+	nums(1, 100000, L2), with_output_to_length(L2, N5), write(N5), nl,
+	halt.
+with_output_to_length(T, N) :- term_to_atom(T, A), atom_length(A, N).
@@ -0,0 +1,26 @@
+:-initialization(main).
+same(A, B) :- (A == B -> write(same) ; write(diff)), nl.
+main :-
+	term_hash(foo(bar, 'A b'), H0), write(H0), nl,
+	term_hash(foo(bar, [1,2,3], "str", 1.5, 1 rdiv 3), H1),
+	T = foo(bar, [1,2,3], "str", 1.5, 1 rdiv 3), term_hash(T, H2), same(H1, H2),
+	term_hash(foo(X), H3), (var(H3) -> write(unbound) ; write(H3)), nl,
+	term_hash(abc, A1), term_hash("abc", A2), same(A1, A2),
+	term_hash(1, I1), term_hash(1.0, I2), same(I1, I2),
+	term_hash(f(a, g(X)), 2, 1000, R1), term_hash(f(a, g(b)), 2, 1000, R2), same(R1, R2),
+	(R1 >= 0, R1 < 1000 -> write(in_range) ; write(R1)), nl,
+	term_hash(f(a, b), 1, 1000, R3), term_hash(f(c, d), 1, 1000, R4), same(R3, R4),
+	term_hash(f(a, b), 1, 1000, R5), term_hash(g(a, b), 1, 1000, R6), same(R5, R6),
+	term_hash(f(a, b), 0, 1000, Z1), term_hash(g(X), 0, 1000, Z2), same(Z1, Z2),
+	term_hash(f(a, g(b)), -1, 1000, D1), term_hash(f(a, g(c)), -1, 1000, D2), same(D1, D2),
+	term_hash(f(a, g(b)), 2, 1000, D3), term_hash(f(a, g(c)), 2, 1000, D4), same(D3, D4),
+	term_hash(f(a, g(X)), -1, 1000, D5), (var(D5) -> write(unbound) ; write(D5)), nl,
+	catch(term_hash(f(a), -5, 1000, _), error(E, _), true), write(E), nl,
+	variant_hash(f(X, Y, X), V1), variant_hash(f(_A, _B, _A), V2), same(V1, V2),
+	variant_hash(f(_C, _D, _D), V3), same(V1, V3),
+	variant_hash(f(a), V4), term_hash(f(a), V5), same(V4, V5),
+	atom_codes(C, [0'a,0'b,0'c]), term_hash(abc, S1), term_hash('abc', S2), term_hash(C, S3),
+	same(S1, S2), same(S1, S3),
+	variant_hash(f(abc, _), W1), variant_hash(f('abc', _), W2), variant_hash(f(C, _), W3),
+	same(W1, W2), same(W1, W3),
+	halt.
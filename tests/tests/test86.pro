@@ -0,0 +1,55 @@
+:-initialization(main).
+
+:- table path/2.
+edge(a,b). edge(b,c). edge(c,a). edge(c,d).
+path(X,Y) :- path(X,Z), edge(Z,Y).
+path(X,Y) :- edge(X,Y).
+
+:- table fib/2.
+fib(0,0).
+fib(1,1).
+fib(N,F) :- N > 1, N1 is N-1, N2 is N-2, fib(N1,F1), fib(N2,F2), F is F1+F2.
+
+:- table even/1, odd/1.
+even(0).
+even(N) :- odd(M), M < 20, N is M+1.
+odd(N) :- even(M), M < 20, N is M+1.
+
+:- dynamic e/2 as incremental.
+:- table r/2 as incremental.
+e(1,2).
+r(X,Y) :- e(X,Y).
+r(X,Y) :- r(X,Z), e(Z,Y).
+
+:- table bad/1.
+bad(X) :- X > 0, throw(oops).
+bad(1).
+
+:- table name/1.
+name(abc).
+name('abc').
+name(X) :- atom_codes(X, [0'a,0'b,0'c]).
+
+:- table k/1.
+k(1) :- !.
+k(2).
+
+:- table fcut/1.
+fcut(X) :- member(X,[1,2,3]), !.
+
+main :-
+	findall(X-Y, path(X,Y), L1), msort(L1, S1), writeln(S1),
+	findall(Y, path(d,Y), L2), writeln(L2),
+	fib(30, F1), writeln(F1), fib(80, F2), writeln(F2),
+	findall(X, even(X), L3), msort(L3, S3), writeln(S3),
+	findall(Y, r(1,Y), R1), writeln(R1),
+	assertz(e(2,3)),
+	findall(Y, r(1,Y), R2), msort(R2, S2), writeln(S2),
+	(predicate_property(r(_,_), tabled) -> writeln(tabled) ; writeln(not_tabled)),
+	catch(bad(1), E, (writeln(caught(E)))),
+	findall(X, name(X), L5), writeln(L5),
+	k(K), writeln(K), findall(X, k(X), L6), writeln(L6),
+	findall(X, fcut(X), L7), writeln(L7),
+	abolish_all_tables,
+	findall(X-Y, path(X,Y), L4), length(L4, N4), writeln(N4),
+	halt.
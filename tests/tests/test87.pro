@@ -0,0 +1,14 @@
+:-initialization(main).
+p(a). p(b).
+main :-
+	nb_setval(k, f(X, X, 'a long atom well over the small atom limit', [1,2,3])),
+	nb_getval(k, f(A, B, S, L)), A = x, writeln(B), writeln(S), writeln(L),
+	nb_setval(n, 0), (between(1, 3, I), nb_setval(n, I), fail ; nb_getval(n, N), writeln(N)),
+	b_setval(v, 1), (b_setval(v, 2), b_getval(v, V2), writeln(V2), fail ; b_getval(v, V1), writeln(V1)),
+	b_setval(z, 1), (member(Y, [5,6]), b_getval(z, Z1), writeln(Z1), b_setval(z, Y), Y = 6 ; true), b_getval(z, Z2), writeln(Z2),
+	b_setval(y, s(1)), \+ \+ (b_setval(y, s(2)), b_getval(y, Y1), writeln(Y1)), b_getval(y, Y2), writeln(Y2),
+	b_setval(w, 0), p(W), b_setval(w, W), !, b_getval(w, W1), writeln(W1),
+	nb_setval(c, 0), (between(1, 1000, _), nb_getval(c, C), C1 is C+1, nb_setval(c, C1), fail ; nb_getval(c, C2), writeln(C2)),
+	(b_setval(undone, 1), fail ; true),
+	catch(nb_getval(undone, _), error(E, _), true), writeln(E),
+	halt.
@@ -0,0 +1,21 @@
+:-initialization(main).
+:- dynamic(f/2).
+:- dynamic(counter/1).
+
+churn(K, N) :- between(1, N, J), assertz(f(K, J)), once(retract(f(K, J))), fail.
+churn(_, _).
+
+main :-
+	forall(between(1, 3000, I), (format(atom(S), 'a_long_atom_well_over_the_small_limit_~w', [I]), assertz(f(I, g(I, S))))),
+	findall(X, (f(I, X), I mod 2 =:= 0, retract(f(I, _)), churn(w, 2)), L1), length(L1, N1), writeln(N1),
+	findall(I, f(I, _), L2), length(L2, N2), writeln(N2),
+	f(2999, G), retract(f(2999, _)), churn(x, 5000), writeln(G),
+	(f(A, B), integer(A), A > 2990, retract(f(A, B)), churn(y, 2000), writeln(A-B), fail ; true),
+	assertz(counter(0)),
+	(between(1, 10000, _), once(retract(counter(C))), C1 is C+1, assertz(counter(C1)), fail ; true),
+	counter(N), writeln(N),
+	module(lists),
+	assertz(tmp(a)), assertz(tmp(b)),
+	(tmp(T), retract(tmp(T)), (between(1, 3000, J), assertz(tmp(J)), once(retract(tmp(J))), fail ; true), writeln(T), fail ; true),
+	findall(T, tmp(T), L3), module(user), writeln(L3),
+	halt.
@@ -0,0 +1,20 @@
+:-initialization(main).
+
+p(1,c). p(2,a). p(1,b). p(3,a). p(2,d). p(1,c).
+q(X,Y,Z) :- member(X-Y-Z, [a-1-x, b-2-y, a-3-z, b-4-x]).
+
+main :-
+	findall(K-L, bagof(V, p(K,V), L), G1), writeln(G1),
+	findall(V-L, bagof(K, p(K,V), L), G2), writeln(G2),
+	findall(K-L, setof(V, p(K,V), L), G3), writeln(G3),
+	bagof(V1, p(K1,V1), L1), writeln(K1-L1),
+	(bagof(V2, p(K2,V2), L2), K2 == 2 -> writeln(L2) ; writeln(none)),
+	bagof(K-L, bagof(V, p(K,V), L), LL), writeln(LL),
+	bagof(V4, K4^p(K4,V4), L4), writeln(L4),
+	setof(V5, K5^p(K5,V5), L5), writeln(L5),
+	findall(X-L, bagof(Y, Z^q(X,Y,Z), L), G6), writeln(G6),
+	findall(Z-L, setof(X-Y, q(X,Y,Z), L), G7), writeln(G7),
+	findall(L, bagof(Y, X^Z^q(X,Y,Z), L), G8), writeln(G8),
+	(bagof(V9, p(9,V9), L9) -> writeln(L9) ; writeln(empty)),
+	setof(K10-V10, p(K10,V10), L10), writeln(L10),
+	halt.
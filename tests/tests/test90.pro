@@ -0,0 +1,28 @@
+:-initialization(main).
+
+% Keep big strings live across several arenas while collecting the
+% garbage between them, then backtrack to the older choice point.
+
+grow(0, Acc, Acc) :- !.
+grow(N, Acc0, Acc) :-
+	atomic_concat(a_string_long_enough_to_live_on_the_heap_, N, A),
+	findall(X, between(1,30,X), Xs),
+	length(Xs, 30),
+	(N mod 10 =:= 0 -> Acc1 = [A|Acc0] ; Acc1 = Acc0),
+	N1 is N-1,
+	grow(N1, Acc1, Acc).
+
+run(R) :-
+	atomic_concat(kept_, R, K),
+	grow(60000, [], L),
+	length(L, Len),
+	L = [First|_],
+	nth1(Len, L, Last),
+	write(K-Len-First-Last), nl,
+	fail.
+
+main :-
+	(member(R, [first,second,third]), run(R) ; true),
+	statistics(gc_count, C),
+	(C > 1 -> write(collected) ; write(not_collected)), nl,
+	halt.
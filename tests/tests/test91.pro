@@ -0,0 +1,28 @@
+:-initialization(main).
+
+% Errors raised by builtins are caught like those from throw/1, and
+% execution carries on after the catch.
+
+p(X) :- catch(atom_length(X, _), error(E, _), (write(caught(E)), nl)).
+
+q(N) :- catch(succ_or_fail(N), error(type_error(T, _), _), (write(type(T)), nl)).
+
+succ_or_fail(N) :- N > 0.
+
+main :-
+	p(1), p(abc), write(after), nl,
+	catch(atom_codes(_, _), error(E1, _), true), write(E1), nl,
+	catch(atom_length(f(x), _), error(E2, _), true), write(E2), nl,
+	q(a), q(1),
+	(catch(functor(_, _, _), _, fail) -> write(yes) ; write(no)), nl,
+	findall(E, (member(X, [1, a, 2]), catch(atom_length(X, _), error(E, _), true), nonvar(E)), L),
+	write(L), nl,
+	catch(call(1), error(E3, _), true), write(E3), nl,
+	G = foo(1), arg(1, G, N), catch(call(N), error(E4, _), true), write(E4), nl,
+	catch(X1 is foo+1, error(E5, _), true), write(X1-E5), nl,
+	catch(_ is 1+f(2)*3, error(E6, _), true), write(E6), nl,
+	catch(1 < foo, error(E7, _), true), write(E7), nl,
+	catch(atom_chars(_, [a|b]), error(E8, _), true), write(E8), nl,
+	catch(set_input(nosuch), error(E9, _), true), write(E9), nl,
+	write(done), nl,
+	halt.
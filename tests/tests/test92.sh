@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# Precompiled files: operators from loaded files, checking those files
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+case $TPL in /*) ;; *) TPL=$PWD/$TPL ;; esac
+cd $DIR
+
+cat >a.pro <<'PRO'
+:- op(700, xfx, ===>).
+r(1 ===> 2).
+PRO
+
+cat >b.pro <<'PRO'
+:- ensure_loaded(a).
+
+% unused
+s(X) :- r(X ===> Y), writeln(Y).
+t(Z) :- true.
+PRO
+
+$TPL -q --compile b || echo compile failed
+$TPL -q -l b -g "s(1),halt"
+sed 's/writeln(Y)/writeln(new(Y))/' b.pro >b.tmp && mv b.tmp b.pro
+touch -t 200001010000 a.pro b.pro
+$TPL -q -l b -g "s(1),halt"
+touch a.pro
+$TPL -q -l b -g "s(1),halt"
+$TPL --compile b 2>&1
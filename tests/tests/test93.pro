@@ -0,0 +1,28 @@
+:-initialization(main).
+
+:- dynamic p/1.
+:- table p/1.
+
+:- table q/1.
+:- dynamic q/1.
+q(1).
+q(X) :- X = 2.
+
+main :-
+	assertz(p(1)), assertz(p(2)),
+	findall(X, p(X), L1), writeln(L1),
+	findall(B, clause(p(_),B), L2), writeln(L2),
+	retract(p(1)),
+	findall(X, p(X), L3), writeln(L3),
+	abolish_all_tables, assertz(p(3)),
+	findall(X, p(X), L4), writeln(L4),
+	retractall(p(_)),
+	findall(X, p(X), L5), writeln(L5),
+	assertz(p(4)),
+	findall(X, p(X), L6), writeln(L6),
+	findall(X, q(X), L7), writeln(L7),
+	retract((q(Y) :- Y = 2)),
+	findall(X, q(X), L8), writeln(L8),
+	(retract((q(_) :- '$tbl_call'(_,_))) -> writeln(wrapper) ; writeln(no_wrapper)),
+	findall(X, q(X), L9), writeln(L9),
+	halt.
@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# Precompiled files: edits that keep the size and time of a source or
+# of a file it loads are noticed
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+case $TPL in /*) ;; *) TPL=$PWD/$TPL ;; esac
+cd $DIR
+
+cat >a.pro <<'PRO'
+:- op(700, xfy, ===>).
+PRO
+
+cat >b.pro <<'PRO'
+:- ensure_loaded(a).
+w(1 ===> 2 ===> 3).
+PRO
+
+$TPL -q --compile b || echo compile failed
+$TPL -q -l b -g "w(X),write_canonical(X),nl,halt"
+cp -p b.pro ref.pro
+sed 's/1 ===>/4 ===>/' b.pro >b.tmp && cat b.tmp >b.pro
+touch -r ref.pro b.pro
+$TPL -q -l b -g "w(X),write_canonical(X),nl,halt"
+$TPL -q --compile b || echo compile failed
+cp -p a.pro ref.pro
+sed 's/xfy/yfx/' a.pro >a.tmp && cat a.tmp >a.pro
+touch -r ref.pro a.pro
+$TPL -q -l b -g "w(X),write_canonical(X),nl,halt"
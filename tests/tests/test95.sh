@@ -0,0 +1,23 @@
+#!/bin/sh
+
+# Parallel consult: statements the tokenizer ends elsewhere than the
+# splitter, each once and then throughout, load in linear time
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+awk 'BEGIN { for (i = 0; i < 8000; i++) printf "m(%d, a.b).\nn(%d).\n", i, i }' >$DIR/prog.pro
+awk 'BEGIN { for (i = 8000; i < 16000; i++) printf "e(%d, a.b) :- true.\nn(%d).\n", i, i }' >>$DIR/prog.pro
+
+cat >>$DIR/prog.pro <<'PRO'
+main :-
+	findall(N, n(N), L), length(L, Len), write(Len), nl,
+	L = [First|_], append(_, [Last], L), write(First-Last), nl,
+	findall(x, b, Bs), length(Bs, Nb), write(Nb), nl,
+	halt.
+PRO
+
+for threads in 1 2; do
+	timeout 20 $TPL -q --threads=$threads -l $DIR/prog.pro -g main </dev/null 2>/dev/null
+	[ $? -eq 124 ] && echo "timed out with $threads threads"
+done
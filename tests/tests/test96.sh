@@ -0,0 +1,39 @@
+#!/bin/sh
+
+# Retracted clauses are only reclaimed once no query, running or
+# suspended, can still reach them: a task yields while on a clause of
+# another module that the caller then retracts, or retracts the clause
+# its caller is backtracking over
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+case $TPL in /*) ;; *) TPL=$PWD/$TPL ;; esac
+cd $DIR
+
+cat >store.pro <<'PRO'
+:- module(store, [fill/0, walk/0, scan/0, churn/1, rest/0]).
+:- dynamic(item/1).
+:- dynamic(junk/1).
+
+fill :- assertz(item(a)), assertz(item(b)), assertz(item(c)).
+
+walk :- item(T), yield, write(T), nl, fail.
+walk.
+
+scan :- item(T), spawn(churn(T)), wait, write(T), nl, fail.
+scan.
+
+churn(X) :-
+	once(retract(item(X))),
+	(between(1, 3000, J), assertz(junk(J)), once(retract(junk(J))), fail ; true).
+
+rest :- findall(T, item(T), L), write(L), nl.
+PRO
+
+cat >main.pro <<'PRO'
+:- use_module(store).
+PRO
+
+$TPL -q -l main.pro -g "fill, spawn(walk), await, churn(a), churn(b), wait, rest, halt"
+$TPL -q -l main.pro -g "fill, spawn(walk), await, churn(b), churn(a), wait, rest, halt"
+$TPL -q -l main.pro -g "fill, scan, rest, halt"
@@ -0,0 +1,27 @@
+:-initialization(main).
+
+% Last calls reuse their frame even when it binds compound terms, so
+% none of these deep recursions should grow the stack of frames.
+
+inc(X, Y) :- Y is X+1.
+
+range(N, N, [N]) :- !.
+range(I, N, [I|T]) :- I1 is I+1, range(I1, N, T).
+
+codes(0) :- !.
+codes(N) :- atom_codes(abc, _), N1 is N-1, codes(N1).
+
+acc(0, A, A) :- !.
+acc(N, A, R) :- N1 is N-1, acc(N1, f(N,A), R).
+
+bounded(Name, Goal) :-
+	call(Goal),
+	statistics(max_frames, F),
+	(F < 100 -> write(Name-bounded) ; write(Name-F)), nl.
+
+main :-
+	bounded(range, range(1, 100000, L)),
+	bounded(maplist, (maplist(inc, L, L2), length(L2, N), write(N), nl)),
+	bounded(codes, codes(100000)),
+	bounded(acc, (acc(100000, x, R), R = f(1,f(2,_)), write(ok), nl)),
+	halt.
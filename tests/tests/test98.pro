@@ -0,0 +1,15 @@
+:-initialization(main).
+
+% The terms are made in different frames, so their variables have the
+% same slot numbers, but the copy must keep them apart.
+
+mk1(f(_,_)).
+mk2(g(_,_)).
+
+main :-
+	mk1(X), mk2(Y),
+	copy_term(X-Y, f(P,Q)-g(R,S)),
+	P = 1, Q = 2,
+	(var(R), var(S) -> write(apart) ; write(shared)), nl,
+	copy_term(X-Y-X, A-_-B), A = B, write(ok), nl,
+	halt.
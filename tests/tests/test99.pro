@@ -0,0 +1,19 @@
+:-initialization(main).
+
+% A frame popped on exit while the call that made it still has other
+% clauses to try must not be reused: a cut in the next call would
+% take that call's choice with it.
+
+a(1).
+a(2).
+a(3).
+
+b :- !.
+
+t :- a(X), b, write(X), nl, fail.
+t.
+
+main :-
+	t,
+	findall(X-Y, (a(X), b, a(Y), b), L), length(L, N), write(N), nl,
+	halt.
@@ -145,7 +145,8 @@ int main(int ac, char *av[])
 	char histfile[1024];
 	snprintf(histfile, sizeof(histfile), "%s/%s", homedir, ".tpl_history");
 
-	int i, do_load = 0, do_goal = 0, version = 0, quiet = 0, daemon = 0;
+	int i, do_load = 0, do_goal = 0, do_compile = 0, version = 0, quiet = 0, daemon = 0;
+	int compiled = 0;
 	void *pl = pl_create();
 	set_opt(pl, 1);
 
@@ -175,6 +176,8 @@ int main(int ac, char *av[])
 			set_stats(pl);
 		else if (!strcmp(av[i], "--iso-only"))
 			set_iso_only(pl);
+		else if (!strncmp(av[i], "--threads=", 10))
+			set_threads(pl, atoi(av[i]+10));
 		else if (!strcmp(av[i], "-d") || !strcmp(av[i], "--daemon"))
 			daemon = 1;
 	}
@@ -199,8 +202,19 @@ int main(int ac, char *av[])
 			do_load = 1;
 		else if (!strcmp(av[i], "-g") || !strcmp(av[i], "--query-goal"))
 			do_goal = 1;
+		else if (!strcmp(av[i], "--compile"))
+			do_compile = 1;
 		else if (av[i][0] == '-')
 			continue;
+		else if (do_compile) {
+			do_compile = 0;
+			compiled = 1;
+
+			if (!pl_compile(pl, av[i])) {
+				pl_destroy(pl);
+				return 1;
+			}
+		}
 		else if (do_load) {
 			do_load = 0;
 
@@ -224,6 +238,11 @@ int main(int ac, char *av[])
 		}
 	}
 
+	if (compiled) {
+		pl_destroy(pl);
+		return 0;
+	}
+
 	if (!quiet)
 		printf("Trealla ProLog (c) Infradig 2020, %s\n", VERSION);
 
@@ -239,8 +258,10 @@ int main(int ac, char *av[])
 		fprintf(stderr, "  -d, --daemon\t\t- daemonize\n");
 		fprintf(stderr, "  -w, --watchdog\t\t- create watchdog\n");
 		fprintf(stderr, "  --consult\t- consult from STDIN\n");
+		fprintf(stderr, "  --compile file\t- write precompiled file.qlf and exit\n");
 		fprintf(stderr, "  --stats\t\t- print stats\n");
 		fprintf(stderr, "  --iso-only\t\t- ISO-only mode\n");
+		fprintf(stderr, "  --threads=n\t\t- threads used to consult files\n");
 	}
 
 	if (version && !quiet)
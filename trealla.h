@@ -8,6 +8,7 @@ void pl_destroy(prolog*);
 int pl_eval(prolog*, const char *expr);
 int pl_consult(prolog*, const char *filename);
 int pl_consult_fp(prolog*, FILE *fp);
+int pl_compile(prolog*, const char *filename);
 
 int get_halt_code(prolog*);
 int get_halt(prolog*);
@@ -17,6 +18,7 @@ void set_quiet(prolog*);
 void set_stats(prolog*);
 void set_iso_only(prolog*);
 void set_opt(prolog*, int onoff);
+void set_threads(prolog*, int nbr);
 
 extern int g_tpl_abort, g_ac, g_avc;
 extern char **g_av;